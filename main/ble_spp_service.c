@@ -1,9 +1,17 @@
 #include "esp32_spp_server.h"
+#include "str_buf.h"
+#include "spp_stats.h"
+#include "spp_trace.h"
+#include "spp_dlog.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
 
 #include "esp_gap_ble_api.h"
 #include "esp_gatt_defs.h"
 #include "esp_gatts_api.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #define SPP_SVC_INST_ID                     0
 
@@ -11,6 +19,10 @@
 #define ESP_GATT_UUID_SPP_DATA_NOTIFY       0xABF2
 #define ESP_GATT_UUID_SPP_COMMAND_RECEIVE   0xABF3
 #define ESP_GATT_UUID_SPP_COMMAND_NOTIFY    0xABF4
+#define ESP_GATT_UUID_SPP_DATA1_RECEIVE     0xABF5
+#define ESP_GATT_UUID_SPP_DATA1_NOTIFY      0xABF6
+#define ESP_GATT_UUID_SPP_DATA2_RECEIVE     0xABF7
+#define ESP_GATT_UUID_SPP_DATA2_NOTIFY      0xABF8
 
 #define CHAR_DECLARATION_SIZE               (sizeof(uint8_t))
 
@@ -30,6 +42,15 @@ static const uint16_t SPP_DATA_NOTIFY_UUID      = ESP_GATT_UUID_SPP_DATA_NOTIFY;
 static const uint8_t  SPP_DATA_NOTIFY_VAL[20]   = { 0x00 };
 static const uint8_t  SPP_DATA_NOTIFY_CCC[2]    = { 0x00, 0x00 };
 
+#if SPP_CHAN_NUM > 1
+static const uint16_t SPP_DATA1_RECV_UUID       = ESP_GATT_UUID_SPP_DATA1_RECEIVE;
+static const uint16_t SPP_DATA1_NOTIFY_UUID     = ESP_GATT_UUID_SPP_DATA1_NOTIFY;
+#endif
+#if SPP_CHAN_NUM > 2
+static const uint16_t SPP_DATA2_RECV_UUID       = ESP_GATT_UUID_SPP_DATA2_RECEIVE;
+static const uint16_t SPP_DATA2_NOTIFY_UUID     = ESP_GATT_UUID_SPP_DATA2_NOTIFY;
+#endif
+
 static const uint16_t SPP_COMMAND_UUID          = ESP_GATT_UUID_SPP_COMMAND_RECEIVE;
 static const uint8_t  SPP_COMMAND_VAL[10]       = {0x00};
 
@@ -56,8 +77,8 @@ static const uint8_t SPP_ADV_DATA[23] = {
 };
 
 static esp_ble_adv_params_t spp_adv_params = {
-    .adv_int_min        = 0x20,
-    .adv_int_max        = 0x40,
+    .adv_int_min        = SPP_ADV_FAST_INT_MIN,
+    .adv_int_max        = SPP_ADV_FAST_INT_MAX,
     .adv_type           = ADV_TYPE_IND,
     .own_addr_type      = BLE_ADDR_TYPE_PUBLIC,
     .channel_map        = ADV_CHNL_ALL,
@@ -66,128 +87,126 @@ static esp_ble_adv_params_t spp_adv_params = {
 
 uint16_t spp_handle_table[SPP_IDX_NB];
 
-const esp_gatts_attr_db_t SPP_GATT_DB[SPP_IDX_NB] =
-{
-    // Service Declaration
-    [SPP_IDX_SVC] = {
-        { ESP_GATT_AUTO_RSP },
-        {
-            ESP_UUID_LEN_16, (uint8_t *)&PRIM_SERVICE_UUID,
-            ESP_GATT_PERM_READ,
-            sizeof(SPP_SERVICE_UUID), sizeof(SPP_SERVICE_UUID),
-            (uint8_t *)&SPP_SERVICE_UUID
-        }
-    },
-
-    // Data Receive: characteristic declaration
-    [SPP_IDX_SPP_DATA_RECV_CHAR] = {
-        { ESP_GATT_AUTO_RSP },
-        {
-            ESP_UUID_LEN_16, (uint8_t *)&CHAR_DECL_UUID,
-            ESP_GATT_PERM_READ,
-            CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
-            (uint8_t *)&CHAR_PROP_READ_WRITE
-        }
-    },
-
-    // Data Receive: characteristic value
-    [SPP_IDX_SPP_DATA_RECV_VAL] = {
-        { ESP_GATT_AUTO_RSP },
-        {
-            ESP_UUID_LEN_16, (uint8_t *)&SPP_DATA_RECV_UUID,
-            ESP_GATT_PERM_WRITE,
-            SPP_DATA_MAX_LEN, sizeof(SPP_DATA_RECV_VAL),
-            (uint8_t *)SPP_DATA_RECV_VAL
-        }
-    },
-
-    // Data Notify: characteristic declaration
-    [SPP_IDX_SPP_DATA_NOTIFY_CHAR] = {
-        { ESP_GATT_AUTO_RSP },
-        {
-            ESP_UUID_LEN_16, (uint8_t *)&CHAR_DECL_UUID,
-            ESP_GATT_PERM_READ,
-            CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
-            (uint8_t *)&CHAR_PROP_READ_NOTIFY
-        }
-    },
-
-    // Data notify: characteristic value
-    [SPP_IDX_SPP_DATA_NOTIFY_VAL] = {
-        { ESP_GATT_AUTO_RSP },
-        {
-            ESP_UUID_LEN_16, (uint8_t *)&SPP_DATA_NOTIFY_UUID,
-            ESP_GATT_PERM_READ,
-            SPP_DATA_MAX_LEN, sizeof(SPP_DATA_NOTIFY_VAL),
-            (uint8_t *)SPP_DATA_NOTIFY_VAL
-        }
-    },
-
-    // Data notify: client characteristic configuration descriptor
-    [SPP_IDX_SPP_DATA_NOTIFY_CFG] = {
-        { ESP_GATT_AUTO_RSP },
-        {
-            ESP_UUID_LEN_16, (uint8_t *)&CHAR_CLIENT_CONFIG_UUID,
-            ESP_GATT_PERM_READ|ESP_GATT_PERM_WRITE,
-            sizeof(uint16_t), sizeof(SPP_DATA_NOTIFY_CCC),
-            (uint8_t *)SPP_DATA_NOTIFY_CCC
-        }
-    },
-
-    // Command: characteristic declaration
-    [SPP_IDX_SPP_COMMAND_CHAR] = {
-        { ESP_GATT_AUTO_RSP },
-        {
-            ESP_UUID_LEN_16, (uint8_t *)&CHAR_DECL_UUID,
-            ESP_GATT_PERM_READ,
-            CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
-            (uint8_t *)&CHAR_PROP_READ_WRITE
-        }
+// Attribute handle minus the service handle, to spp_index_t.
+static uint8_t spp_handle_index[SPP_IDX_NB];
+
+typedef void (*spp_attr_handler_t)(esp_gatt_if_t gatts_if,
+                                   esp_ble_gatts_cb_param_t *param,
+                                   uint32_t chan);
+
+typedef struct spp_attr_handlers {
+    spp_attr_handler_t read;
+    spp_attr_handler_t write;
+    uint32_t chan;
+} spp_attr_handlers_t;
+
+static void handle_data_recv_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param, uint32_t chan);
+static void handle_data_notify_cfg_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param, uint32_t chan);
+static void handle_command_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param, uint32_t chan);
+static void handle_status_read(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param, uint32_t chan);
+static void handle_status_cfg_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param, uint32_t chan);
+
+// The data characteristics of channel n, which use the UUIDs SPP_DATA<n>_*.
+#define SPP_CHAN_ATTR_TABLE(X, n, chan) \
+    /* Data Receive: characteristic declaration */ \
+    X(SPP_DATA##n##_RECV_CHAR, ESP_GATT_AUTO_RSP, CHAR_DECL_UUID, ESP_GATT_PERM_READ, \
+      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, &CHAR_PROP_READ_WRITE, \
+      NULL, NULL, chan) \
+    /* Data Receive: characteristic value */ \
+    X(SPP_DATA##n##_RECV_VAL, ESP_GATT_AUTO_RSP, SPP_DATA##n##_RECV_UUID, ESP_GATT_PERM_WRITE, \
+      SPP_DATA_MAX_LEN, sizeof(SPP_DATA_RECV_VAL), SPP_DATA_RECV_VAL, \
+      NULL, handle_data_recv_write, chan) \
+    /* Data Notify: characteristic declaration */ \
+    X(SPP_DATA##n##_NOTIFY_CHAR, ESP_GATT_AUTO_RSP, CHAR_DECL_UUID, ESP_GATT_PERM_READ, \
+      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, &CHAR_PROP_READ_NOTIFY, \
+      NULL, NULL, chan) \
+    /* Data notify: characteristic value */ \
+    X(SPP_DATA##n##_NOTIFY_VAL, ESP_GATT_AUTO_RSP, SPP_DATA##n##_NOTIFY_UUID, ESP_GATT_PERM_READ, \
+      SPP_DATA_MAX_LEN, sizeof(SPP_DATA_NOTIFY_VAL), SPP_DATA_NOTIFY_VAL, \
+      NULL, NULL, chan) \
+    /* Data notify: client characteristic configuration descriptor */ \
+    X(SPP_DATA##n##_NOTIFY_CFG, ESP_GATT_AUTO_RSP, CHAR_CLIENT_CONFIG_UUID, \
+      ESP_GATT_PERM_READ|ESP_GATT_PERM_WRITE, \
+      sizeof(uint16_t), sizeof(SPP_DATA_NOTIFY_CCC), SPP_DATA_NOTIFY_CCC, \
+      NULL, handle_data_notify_cfg_write, chan)
+
+#if SPP_CHAN_NUM > 1
+#define SPP_CHAN1_ATTR_TABLE(X) SPP_CHAN_ATTR_TABLE(X, 1, 1)
+#else
+#define SPP_CHAN1_ATTR_TABLE(X)
+#endif
+#if SPP_CHAN_NUM > 2
+#define SPP_CHAN2_ATTR_TABLE(X) SPP_CHAN_ATTR_TABLE(X, 2, 2)
+#else
+#define SPP_CHAN2_ATTR_TABLE(X)
+#endif
+
+// X(name, response, uuid, permission, max length, length, value, read handler, write handler, channel)
+//
+// Both the attribute database and the dispatch table are built from this
+// list, so an attribute and its handlers are added at one place. The order
+// must follow spp_index_t.
+#define SPP_ATTR_TABLE(X) \
+    /* Service Declaration */ \
+    X(SVC, ESP_GATT_AUTO_RSP, PRIM_SERVICE_UUID, ESP_GATT_PERM_READ, \
+      sizeof(SPP_SERVICE_UUID), sizeof(SPP_SERVICE_UUID), &SPP_SERVICE_UUID, \
+      NULL, NULL, 0) \
+    SPP_CHAN_ATTR_TABLE(X, , 0) \
+    /* Command: characteristic declaration */ \
+    X(SPP_COMMAND_CHAR, ESP_GATT_AUTO_RSP, CHAR_DECL_UUID, ESP_GATT_PERM_READ, \
+      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, &CHAR_PROP_READ_WRITE, \
+      NULL, NULL, 0) \
+    /* Command: characteristic value */ \
+    X(SPP_COMMAND_VAL, ESP_GATT_AUTO_RSP, SPP_COMMAND_UUID, \
+      ESP_GATT_PERM_READ|ESP_GATT_PERM_WRITE, \
+      SPP_CMD_MAX_LEN, sizeof(SPP_COMMAND_VAL), SPP_COMMAND_VAL, \
+      NULL, handle_command_write, 0) \
+    /* Status: characteristic declaration */ \
+    X(SPP_STATUS_CHAR, ESP_GATT_AUTO_RSP, CHAR_DECL_UUID, ESP_GATT_PERM_READ, \
+      CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, &CHAR_PROP_READ_NOTIFY, \
+      NULL, NULL, 0) \
+    /* Status: characteristic value */ \
+    X(SPP_STATUS_VAL, ESP_GATT_RSP_BY_APP, SPP_STATUS_UUID, ESP_GATT_PERM_READ, \
+      SPP_STATUS_MAX_LEN, sizeof(SPP_STATUS_VAL), SPP_STATUS_VAL, \
+      handle_status_read, NULL, 0) \
+    /* Status: client characteristic configuration descriptor */ \
+    X(SPP_STATUS_CFG, ESP_GATT_AUTO_RSP, CHAR_CLIENT_CONFIG_UUID, \
+      ESP_GATT_PERM_READ|ESP_GATT_PERM_WRITE, \
+      sizeof(uint16_t), sizeof(SPP_STATUS_CCC), SPP_STATUS_CCC, \
+      NULL, handle_status_cfg_write, 0) \
+    SPP_CHAN1_ATTR_TABLE(X) \
+    SPP_CHAN2_ATTR_TABLE(X)
+
+#define SPP_ATTR_DB(name, rsp, uuid, perm, max_len, len, value, read, write, chan) \
+    [SPP_IDX_##name] = { \
+        { rsp }, \
+        { ESP_UUID_LEN_16, (uint8_t *)&(uuid), perm, max_len, len, (uint8_t *)(value) } \
     },
 
-    // Command: characteristic value
-    [SPP_IDX_SPP_COMMAND_VAL] = {
-        { ESP_GATT_AUTO_RSP },
-        {
-            ESP_UUID_LEN_16, (uint8_t *)&SPP_COMMAND_UUID,
-            ESP_GATT_PERM_READ|ESP_GATT_PERM_WRITE,
-            SPP_CMD_MAX_LEN, sizeof(SPP_COMMAND_VAL),
-            (uint8_t *)SPP_COMMAND_VAL
-        }
-    },
+#define SPP_ATTR_HANDLERS(name, rsp, uuid, perm, max_len, len, value, read, write, chan) \
+    [SPP_IDX_##name] = { read, write, chan },
 
-    // Status: characteristic declaration
-    [SPP_IDX_SPP_STATUS_CHAR] = {
-        { ESP_GATT_AUTO_RSP },
-        {
-            ESP_UUID_LEN_16, (uint8_t *)&CHAR_DECL_UUID,
-            ESP_GATT_PERM_READ,
-            CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE,
-            (uint8_t *)&CHAR_PROP_READ_NOTIFY
-        }
-    },
+const esp_gatts_attr_db_t SPP_GATT_DB[] = {
+    SPP_ATTR_TABLE(SPP_ATTR_DB)
+};
 
-    // Status: characteristic value
-    [SPP_IDX_SPP_STATUS_VAL] = {
-        { ESP_GATT_AUTO_RSP },
-        {
-            ESP_UUID_LEN_16, (uint8_t *)&SPP_STATUS_UUID,
-            ESP_GATT_PERM_READ,
-            SPP_STATUS_MAX_LEN, sizeof(SPP_STATUS_VAL),
-            (uint8_t *)SPP_STATUS_VAL
-        }
-    },
+static const spp_attr_handlers_t SPP_ATTR_HANDLER[] = {
+    SPP_ATTR_TABLE(SPP_ATTR_HANDLERS)
+};
 
-    // Status: client characteristic configuration descriptor
-    [SPP_IDX_SPP_STATUS_CFG] = {
-        { ESP_GATT_AUTO_RSP },
-        {
-            ESP_UUID_LEN_16, (uint8_t *)&CHAR_CLIENT_CONFIG_UUID,
-            ESP_GATT_PERM_READ|ESP_GATT_PERM_WRITE,
-            sizeof(uint16_t), sizeof(SPP_STATUS_CCC),
-            (uint8_t *)SPP_STATUS_CCC
-        }
-    },
+_Static_assert(sizeof(SPP_GATT_DB) / sizeof(SPP_GATT_DB[0]) == SPP_IDX_NB,
+               "SPP_ATTR_TABLE does not match spp_index_t");
+_Static_assert(sizeof(SPP_ATTR_HANDLER) / sizeof(SPP_ATTR_HANDLER[0]) == SPP_IDX_NB,
+               "SPP_ATTR_TABLE does not match spp_index_t");
+
+static const uint8_t SPP_CHAN_NOTIFY_IDX[SPP_CHAN_NUM] = {
+    SPP_IDX_SPP_DATA_NOTIFY_VAL,
+#if SPP_CHAN_NUM > 1
+    SPP_IDX_SPP_DATA1_NOTIFY_VAL,
+#endif
+#if SPP_CHAN_NUM > 2
+    SPP_IDX_SPP_DATA2_NOTIFY_VAL,
+#endif
 };
 
 static void gatts_spp_status_event_handler(esp_gatts_cb_event_t event,
@@ -198,18 +217,222 @@ gatts_spp_status_t spp_status[SPP_PROFILE_NUM] = {
     [SPP_PROFILE_APP_IDX] = {
         .gatts_cb = gatts_spp_status_event_handler,
         .gatts_if = ESP_GATT_IF_NONE,
-        .mtu_size = 23,
     },
 };
 
+static spp_peer_t spp_peer[SPP_PEER_MAX];
+static TimerHandle_t conn_tune_timer = NULL;
+
 gatts_spp_status_t *gatts_spp_status()
 {
     return &(spp_status[SPP_PROFILE_APP_IDX]);
 }
 
+spp_peer_t *gatts_spp_peer(uint32_t index)
+{
+    return &(spp_peer[index]);
+}
+
+static spp_peer_t *find_peer(uint16_t conn_id)
+{
+    for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+        if (spp_peer[i].in_use && !spp_peer[i].is_closing &&
+            (spp_peer[i].connection_id == conn_id)) {
+            return &(spp_peer[i]);
+        }
+    }
+    return NULL;
+}
+
+static spp_peer_t *find_peer_by_bda(esp_bd_addr_t bda)
+{
+    for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+        if (spp_peer[i].in_use && !spp_peer[i].is_closing &&
+            (memcmp(spp_peer[i].remote_bda, bda, sizeof(esp_bd_addr_t)) == 0)) {
+            return &(spp_peer[i]);
+        }
+    }
+    return NULL;
+}
+
+spp_peer_t *gatts_spp_find_peer(uint16_t conn_id)
+{
+    return find_peer(conn_id);
+}
+
+// NOTE: A slot which is free is no longer touched by the sender task, so it
+// is set up here before in_use publishes it.
+static spp_peer_t *alloc_peer(uint16_t conn_id)
+{
+    for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+        if (!__atomic_load_n(&(spp_peer[i].in_use), __ATOMIC_ACQUIRE)) {
+            spp_peer[i].connection_id = conn_id;
+            spp_peer[i].mtu_size = 23;
+            spp_peer[i].is_status_enabled = false;
+            spp_peer[i].is_authenticated = false;
+            spp_peer[i].is_compressed = false;
+            spp_peer[i].is_framed = false;
+            spp_peer[i].rx_bytes = 0;
+            memset(spp_peer[i].chan, 0, sizeof(spp_peer[i].chan));
+            spp_peer[i].is_closing = false;
+            __atomic_store_n(&(spp_peer[i].in_use), true, __ATOMIC_RELEASE);
+            return &(spp_peer[i]);
+        }
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Advertising
+// After the boot and each disconnection the server advertises at the short
+// interval for CONFIG_SPP_ADV_FAST_MS, so that a central which scans for it
+// reconnects quickly, then backs off to the long interval.
+static TimerHandle_t adv_timer = NULL;
+static bool adv_is_fast = true;
+static int64_t disconnect_time = 0;
+
+// NOTE: The controller stops advertising at every connection, so it is
+// restarted as long as a slot for another central remains.
+static void start_advertising(void)
+{
+    bool is_fast = __atomic_load_n(&adv_is_fast, __ATOMIC_RELAXED);
+
+    if (gatts_spp_status()->is_advertising) {
+        return;
+    }
+    if (gatts_spp_status()->peer_count >= SPP_PEER_MAX) {
+        return;
+    }
+    spp_adv_params.adv_int_min = is_fast ? SPP_ADV_FAST_INT_MIN : SPP_ADV_SLOW_INT_MIN;
+    spp_adv_params.adv_int_max = is_fast ? SPP_ADV_FAST_INT_MAX : SPP_ADV_SLOW_INT_MAX;
+    esp_ble_gap_start_advertising(&spp_adv_params);
+}
+
+// The running advertising keeps the old interval until it stopped, then
+// ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT restarts it with the new one.
+static void set_adv_fast(bool is_fast)
+{
+    if (__atomic_exchange_n(&adv_is_fast, is_fast, __ATOMIC_RELAXED) == is_fast) {
+        return;
+    }
+    if (gatts_spp_status()->is_advertising) {
+        esp_ble_gap_stop_advertising();
+    }
+}
+
+static void end_adv_fast(TimerHandle_t timer)
+{
+    set_adv_fast(false);
+}
+
+static void start_adv_fast(void)
+{
+    if (adv_timer != NULL) {
+        xTimerReset(adv_timer, 0);
+    }
+    set_adv_fast(true);
+    start_advertising();
+}
+
+static void record_reconnect(void)
+{
+    uint32_t ms;
+
+    if (disconnect_time == 0) {
+        return;
+    }
+    ms = (esp_timer_get_time() - disconnect_time) / 1000;
+    disconnect_time = 0;
+    SPP_STATS_ADD(reconnect_count, 1);
+    __atomic_store_n(&(spp_stats.reconnect_ms), ms, __ATOMIC_RELAXED);
+    if (ms > spp_stats.reconnect_ms_max) {
+        __atomic_store_n(&(spp_stats.reconnect_ms_max), ms, __ATOMIC_RELAXED);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Connection tuning
+static void update_conn_params(spp_peer_t *peer, bool is_fast)
+{
+    esp_ble_conn_update_params_t params = {
+        .min_int = is_fast ? SPP_CONN_FAST_INT_MIN : SPP_CONN_SLOW_INT_MIN,
+        .max_int = is_fast ? SPP_CONN_FAST_INT_MAX : SPP_CONN_SLOW_INT_MAX,
+        .latency = is_fast ? SPP_CONN_FAST_LATENCY : SPP_CONN_SLOW_LATENCY,
+        .timeout = is_fast ? SPP_CONN_FAST_TIMEOUT : SPP_CONN_SLOW_TIMEOUT,
+    };
+
+    memcpy(params.bda, peer->remote_bda, sizeof(esp_bd_addr_t));
+    esp_ble_gap_update_conn_params(&params);
+    peer->is_fast = is_fast;
+    peer->idle_count = 0;
+}
+
+// Ask for large LL packets and a short interval right away, since a new
+// connection usually starts with the service discovery and the MTU exchange.
+static void tune_new_conn(spp_peer_t *peer)
+{
+    esp_ble_gap_set_pkt_data_len(peer->remote_bda, SPP_LE_DATA_LEN);
+    update_conn_params(peer, true);
+    peer->last_bytes = peer->tx_bytes + peer->rx_bytes;
+}
+
+// Switch each connection between the short interval for the bulk transfer
+// and the long one with the slave latency for the idle link.
+static void tune_conn(TimerHandle_t timer)
+{
+    for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+        spp_peer_t *peer = &(spp_peer[i]);
+        uint32_t bytes;
+
+        if (!peer->in_use) {
+            continue;
+        }
+        bytes = peer->tx_bytes + peer->rx_bytes;
+
+        if ((bytes - peer->last_bytes) >= SPP_CONN_BUSY_BYTES) {
+            if (!peer->is_fast) {
+                update_conn_params(peer, true);
+            }
+            peer->idle_count = 0;
+        } else if (peer->is_fast && (++peer->idle_count >= SPP_CONN_IDLE_PERIODS)) {
+            update_conn_params(peer, false);
+        }
+        peer->last_bytes = bytes;
+    }
+}
+
+// Move the idle connections to the short interval at the start of a burst,
+// rather than at the next tune period, see spp_pm.h. tune_conn moves them
+// back once they are idle again.
+void gatts_spp_conn_burst(void)
+{
+    for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+        spp_peer_t *peer = &(spp_peer[i]);
+
+        if (peer->in_use && !peer->is_fast) {
+            update_conn_params(peer, true);
+        }
+    }
+}
+
 uint16_t gatts_handle(spp_index_t index)
 {
-    return spp_handle_table[SPP_IDX_SPP_DATA_NOTIFY_VAL];
+    return spp_handle_table[index];
+}
+
+uint16_t gatts_chan_handle(uint32_t chan)
+{
+    return spp_handle_table[SPP_CHAN_NOTIFY_IDX[chan]];
+}
+
+static bool is_data_notify_handle(uint16_t handle)
+{
+    for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+        if (handle == gatts_chan_handle(i)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void gatts_event_handler(esp_gatts_cb_event_t event,
@@ -220,7 +443,7 @@ void gatts_event_handler(esp_gatts_cb_event_t event,
         if (param->reg.status == ESP_GATT_OK) {
             gatts_spp_status()->gatts_if = gatts_if;
         } else {
-            ESP_LOGE(TAG_SPP, "Failed to regist application.");
+            SPP_LOGE("Failed to regist application.");
             return;
         }
     }
@@ -235,48 +458,138 @@ void gatts_event_handler(esp_gatts_cb_event_t event,
     }
 }
 
-static uint8_t find_gatts_index(uint16_t handle)
+// NOTE: A service gets its handles in a row, so the offset from the
+// service handle is a direct index.
+static void build_handle_index(void)
 {
-    for (uint32_t i = 0; i < SPP_IDX_NB ; i++) {
-        if (handle == spp_handle_table[i]) {
-            return i;
+    memset(spp_handle_index, 0xFF, sizeof(spp_handle_index));
+
+    for (uint32_t i = 0; i < SPP_IDX_NB; i++) {
+        uint16_t offset = spp_handle_table[i] - spp_handle_table[SPP_IDX_SVC];
+
+        if (offset >= SPP_IDX_NB) {
+            SPP_LOGE("Attribute handles are not contiguous at %s.", __func__);
+            continue;
         }
+        spp_handle_index[offset] = i;
     }
-    return 0xFF;
 }
 
-void handle_gatts_write_event(uint8_t res, esp_ble_gatts_cb_param_t *param)
+static const spp_attr_handlers_t *find_gatts_handlers(uint16_t handle)
 {
-    switch (res) {
-    case SPP_IDX_SPP_COMMAND_VAL:
-        handle_command(param->write.value, param->write.len);
-        break;
-    case SPP_IDX_SPP_DATA_NOTIFY_CFG:
-        if (param->write.len != 2) {
-            break;
-        }
-        if ((param->write.value[0] == 0x01) && (param->write.value[1] == 0x00)){
-            gatts_spp_status()->is_notify_enabled = true;
-        } else if ((param->write.value[0] == 0x00) && (param->write.value[1] == 0x00)) {
-            gatts_spp_status()->is_notify_enabled = false;
-        }
-        break;
-    case SPP_IDX_SPP_DATA_RECV_VAL:
-        if (param->write.is_prep == true) {
-            handle_uart_remote_data_prep(param->write.value, param->write.len);
-        } else {
-            handle_uart_remote_data(param->write.value, param->write.len);
+    uint16_t offset = handle - spp_handle_table[SPP_IDX_SVC];
+
+    if ((offset >= SPP_IDX_NB) || (spp_handle_index[offset] == 0xFF)) {
+        return NULL;
+    }
+    return &(SPP_ATTR_HANDLER[spp_handle_index[offset]]);
+}
+
+static void handle_command_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param,
+                                 uint32_t chan)
+{
+    handle_command(param->write.conn_id, param->write.value, param->write.len);
+}
+
+static void handle_data_notify_cfg_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param,
+                                         uint32_t chan)
+{
+    spp_peer_t *peer = find_peer(param->write.conn_id);
+
+    if ((param->write.len != 2) || (peer == NULL)) {
+        return;
+    }
+    if ((param->write.value[0] == 0x01) && (param->write.value[1] == 0x00)){
+        peer->chan[chan].is_notify_enabled = true;
+        handle_data_subscribe();
+    } else if ((param->write.value[0] == 0x00) && (param->write.value[1] == 0x00)) {
+        peer->chan[chan].is_notify_enabled = false;
+    }
+}
+
+static void handle_status_cfg_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param,
+                                    uint32_t chan)
+{
+    spp_peer_t *peer = find_peer(param->write.conn_id);
+
+    if ((param->write.len != 2) || (peer == NULL)) {
+        return;
+    }
+    peer->is_status_enabled = (param->write.value[0] & 0x01) != 0;
+    if (peer->is_status_enabled) {
+        handle_status_subscribe();
+    }
+}
+
+static void handle_data_recv_write(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param,
+                                   uint32_t chan)
+{
+    spp_peer_t *peer = find_peer(param->write.conn_id);
+
+    // NOTE: The prepared writes are counted when they are executed. The
+    // image of an OTA update counts for the connection, not for the credits.
+    if ((peer != NULL) && !param->write.is_prep) {
+        peer->rx_bytes += param->write.len;
+    }
+    if (handle_ota_data(param->write.conn_id, chan, param->write.value, param->write.len,
+                        param->write.is_prep)) {
+        return;
+    }
+    if ((peer != NULL) && !param->write.is_prep) {
+        peer->chan[chan].rx_bytes += param->write.len;
+    }
+    if (param->write.is_prep == true) {
+        handle_uart_remote_data_prep(chan, param->write.offset,
+                                     param->write.value, param->write.len);
+    } else {
+        handle_uart_remote_data(chan, param->write.value, param->write.len);
+    }
+}
+
+// The status characteristic is answered by the application, so that a read
+// always returns fresh telemetry. A long read continues at param->read.offset.
+static void handle_status_read(esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param,
+                               uint32_t chan)
+{
+    static esp_gatt_rsp_t rsp;
+    spp_telemetry_t telemetry;
+    spp_peer_t *peer = find_peer(param->read.conn_id);
+    uint16_t mtu_size = (peer != NULL) ? peer->mtu_size : 23;
+    uint32_t len = make_telemetry(&telemetry, mtu_size);
+    esp_gatt_status_t status = ESP_GATT_OK;
+
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.attr_value.handle = param->read.handle;
+    rsp.attr_value.offset = param->read.offset;
+
+    if (param->read.offset > len) {
+        status = ESP_GATT_INVALID_OFFSET;
+    } else {
+        len -= param->read.offset;
+        if (len > (uint32_t)(mtu_size - 1)) {
+            len = mtu_size - 1;
         }
-        break;
-    default:
-        break;
+        memcpy(rsp.attr_value.value, (uint8_t *)&telemetry + param->read.offset, len);
+        rsp.attr_value.len = len;
     }
+    esp_ble_gatts_send_response(gatts_if, param->read.conn_id, param->read.trans_id,
+                                status, &rsp);
 }
 
 void handle_gatts_exec_write_event(esp_ble_gatts_cb_param_t *param)
 {
+    spp_peer_t *peer = find_peer(param->exec_write.conn_id);
+
     if (param->exec_write.exec_write_flag) {
-        handle_uart_remote_data_exec();
+        uint32_t chan;
+        uint32_t len = handle_uart_remote_data_exec(&chan);
+
+        if (peer != NULL) {
+            peer->rx_bytes += len;
+            peer->chan[chan].rx_bytes += len;
+        }
+    } else {
+        str_buf_clear();
     }
 }
 
@@ -284,44 +597,107 @@ void gatts_spp_status_event_handler(esp_gatts_cb_event_t event,
                                     esp_gatt_if_t gatts_if,
                                     esp_ble_gatts_cb_param_t *param)
 {
-    uint8_t res = find_gatts_index(param->read.handle);
+    const spp_attr_handlers_t *handlers;
+    spp_peer_t *peer;
 
     switch (event) {
     case ESP_GATTS_REG_EVT:
         esp_ble_gap_set_device_name(DEVICE_NAME);
         esp_ble_gap_config_adv_data_raw((uint8_t *)SPP_ADV_DATA, sizeof(SPP_ADV_DATA));
         esp_ble_gatts_create_attr_tab(SPP_GATT_DB, gatts_if, SPP_IDX_NB, SPP_SVC_INST_ID);
+
+        conn_tune_timer = xTimerCreate("conn_tune", SPP_CONN_TUNE_PERIOD_MS / portTICK_PERIOD_MS,
+                                       pdTRUE, NULL, tune_conn);
+        if (conn_tune_timer != NULL) {
+            xTimerStart(conn_tune_timer, 0);
+        }
+        adv_timer = xTimerCreate("adv_fast", CONFIG_SPP_ADV_FAST_MS / portTICK_PERIOD_MS,
+                                 pdFALSE, NULL, end_adv_fast);
         break;
     case ESP_GATTS_READ_EVT:
-        if (res == SPP_IDX_SPP_STATUS_VAL) {
-            // TODO: client read the status characteristic
+        handlers = find_gatts_handlers(param->read.handle);
+        if ((handlers != NULL) && (handlers->read != NULL)) {
+            handlers->read(gatts_if, param, handlers->chan);
         }
         break;
     case ESP_GATTS_WRITE_EVT:
-        handle_gatts_write_event(res, param);
+        handlers = find_gatts_handlers(param->write.handle);
+        if ((handlers != NULL) && (handlers->write != NULL)) {
+            SPP_TRACE_BEGIN(SPP_TRACE_GATTS_WRITE, handlers->chan);
+            handlers->write(gatts_if, param, handlers->chan);
+            SPP_TRACE_END(SPP_TRACE_GATTS_WRITE, handlers->chan, param->write.len);
+        }
         break;
     case ESP_GATTS_EXEC_WRITE_EVT:
         handle_gatts_exec_write_event(param);
         break;
+    case ESP_GATTS_CONF_EVT:
+        peer = find_peer(param->conf.conn_id);
+        if ((peer != NULL) && is_data_notify_handle(param->conf.handle)) {
+            spp_flow_release(&(peer->flow));
+        }
+        break;
+    case ESP_GATTS_CONGEST_EVT:
+        peer = find_peer(param->congest.conn_id);
+        if (peer != NULL) {
+            spp_flow_congest(&(peer->flow), param->congest.congested);
+        }
+        if (param->congest.congested) {
+            SPP_STATS_ADD(congest, 1);
+            SPP_TRACE_BEGIN(SPP_TRACE_CONGEST, 0);
+        } else {
+            SPP_TRACE_END(SPP_TRACE_CONGEST, 0, param->congest.conn_id);
+        }
+        break;
     case ESP_GATTS_MTU_EVT:
-        gatts_spp_status()->mtu_size = param->mtu.mtu;
+        peer = find_peer(param->mtu.conn_id);
+        if (peer != NULL) {
+            peer->mtu_size = param->mtu.mtu;
+        }
         break;
     case ESP_GATTS_CONNECT_EVT:
-        gatts_spp_status()->connection_id = param->connect.conn_id;
         gatts_spp_status()->gatts_if = gatts_if;
-        gatts_spp_status()->is_connected = true;
+        gatts_spp_status()->is_advertising = false;
+        peer = alloc_peer(param->connect.conn_id);
+        if (peer == NULL) {
+            SPP_LOGE("No slot for the connection.");
+            esp_ble_gap_disconnect(param->connect.remote_bda);
+            break;
+        }
+        memcpy(peer->remote_bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+        spp_flow_reset(&(peer->flow));
+        tune_new_conn(peer);
+        gatts_spp_status()->peer_count++;
+        record_reconnect();
+        // NOTE: Another central waits for the long interval.
+        if (adv_timer != NULL) {
+            xTimerStop(adv_timer, 0);
+        }
+        set_adv_fast(false);
+        start_advertising();
         break;
     case ESP_GATTS_DISCONNECT_EVT:
-        gatts_spp_status()->is_connected = false;
-        gatts_spp_status()->is_notify_enabled = false;
-        esp_ble_gap_start_advertising(&spp_adv_params);
+        handle_ota_disconnect(param->disconnect.conn_id);
+        peer = find_peer(param->disconnect.conn_id);
+        if (peer != NULL) {
+            for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+                peer->chan[i].is_notify_enabled = false;
+            }
+            peer->is_status_enabled = false;
+            __atomic_store_n(&(peer->is_closing), true, __ATOMIC_RELEASE);
+            gatts_spp_status()->peer_count--;
+            disconnect_time = esp_timer_get_time();
+            handle_peer_close();
+        }
+        start_adv_fast();
         break;
     case ESP_GATTS_CREAT_ATTR_TAB_EVT:
         if (param->add_attr_tab.status != ESP_GATT_OK){
-            ESP_LOGE(TAG_SPP, "Failed to create attribute table.");
+            SPP_LOGE("Failed to create attribute table.");
             break;
         }
         memcpy(spp_handle_table, param->add_attr_tab.handles, sizeof(spp_handle_table));
+        build_handle_index();
         esp_ble_gatts_start_service(spp_handle_table[SPP_IDX_SVC]);
         break;
     default:
@@ -331,13 +707,47 @@ void gatts_spp_status_event_handler(esp_gatts_cb_event_t event,
 
 void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
 {
+    spp_peer_t *peer;
+
     switch (event) {
     case ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT:
-        esp_ble_gap_start_advertising(&spp_adv_params);
+        start_adv_fast();
         break;
     case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
         if (param->adv_start_cmpl.status != ESP_BT_STATUS_SUCCESS) {
-            ESP_LOGE(TAG_SPP, "Failed to start advertising.");
+            SPP_LOGE("Failed to start advertising.");
+            break;
+        }
+        gatts_spp_status()->is_advertising = true;
+        if (spp_stats.boot_adv_ms == 0) {
+            __atomic_store_n(&(spp_stats.boot_adv_ms), esp_timer_get_time() / 1000,
+                             __ATOMIC_RELAXED);
+            SPP_LOGI("Advertising %u ms after boot.", spp_stats.boot_adv_ms);
+        }
+        break;
+    case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
+        gatts_spp_status()->is_advertising = false;
+        start_advertising();
+        break;
+    case ESP_GAP_BLE_SEC_REQ_EVT:
+#ifdef CONFIG_SPP_BLE_BOND
+        // A bonded central encrypts with the stored keys, without pairing.
+        esp_ble_gap_security_rsp(param->ble_security.ble_req.bd_addr, true);
+#else
+        esp_ble_gap_security_rsp(param->ble_security.ble_req.bd_addr, false);
+#endif
+        break;
+    case ESP_GAP_BLE_AUTH_CMPL_EVT:
+        if (!param->ble_security.auth_cmpl.success) {
+            SPP_LOGW("Pairing failed, reason 0x%x.", param->ble_security.auth_cmpl.fail_reason);
+            break;
+        }
+        // NOTE: Only the keys of a pairing with the passkey are authenticated,
+        // the keys of a Just Works pairing only encrypt.
+        peer = find_peer_by_bda(param->ble_security.auth_cmpl.bd_addr);
+        if (peer != NULL) {
+            peer->is_authenticated =
+                (param->ble_security.auth_cmpl.auth_mode & ESP_LE_AUTH_REQ_MITM) != 0;
         }
         break;
     default:
@@ -2,8 +2,12 @@
 #include "esp_gatts_api.h"
 
 gatts_spp_status_t *gatts_spp_status();
+spp_peer_t *gatts_spp_peer(uint32_t index);
+spp_peer_t *gatts_spp_find_peer(uint16_t conn_id);
 
 uint16_t gatts_handle(spp_index_t index);
+uint16_t gatts_chan_handle(uint32_t chan);
+void gatts_spp_conn_burst(void);
 
 void gatts_event_handler(esp_gatts_cb_event_t event,
                          esp_gatt_if_t gatts_if,
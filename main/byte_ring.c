@@ -0,0 +1,164 @@
+#include "byte_ring.h"
+
+#include <string.h>
+
+// head is written only by the producer and tail only by the consumer. Both
+// are free running counters, so (head - tail) is the number of stored bytes.
+// The acquire/release pairs make the data copy visible to the other core
+// before the counter which publishes it.
+
+static uint32_t ring_load(uint32_t *pos)
+{
+    return __atomic_load_n(pos, __ATOMIC_ACQUIRE);
+}
+
+static void ring_store(uint32_t *pos, uint32_t val)
+{
+    __atomic_store_n(pos, val, __ATOMIC_RELEASE);
+}
+
+static void ring_copy_in(byte_ring_t *ring, uint32_t pos, const uint8_t *str, uint32_t len)
+{
+    uint32_t offset = pos & (ring->size - 1);
+    uint32_t first = ring->size - offset;
+
+    if (first > len) {
+        first = len;
+    }
+    memcpy(ring->buf + offset, str, first);
+    memcpy(ring->buf, str + first, len - first);
+}
+
+static void ring_copy_out(byte_ring_t *ring, uint32_t pos, uint8_t *buf, uint32_t len)
+{
+    uint32_t offset = pos & (ring->size - 1);
+    uint32_t first = ring->size - offset;
+
+    if (first > len) {
+        first = len;
+    }
+    memcpy(buf, ring->buf + offset, first);
+    memcpy(buf + first, ring->buf, len - first);
+}
+
+uint32_t byte_ring_free(byte_ring_t *ring)
+{
+    return ring->size - (ring->head - ring_load(&ring->tail));
+}
+
+uint32_t byte_ring_used(byte_ring_t *ring)
+{
+    return ring_load(&ring->head) - ring->tail;
+}
+
+static void ring_update_high_water(byte_ring_t *ring, uint32_t head)
+{
+    uint32_t used = head - ring_load(&ring->tail);
+
+    if (used > ring->high_water) {
+        ring->high_water = used;
+    }
+}
+
+uint32_t byte_ring_write(byte_ring_t *ring, const uint8_t *str, uint32_t len)
+{
+    uint32_t head = ring->head;
+    uint32_t space = ring->size - (head - ring_load(&ring->tail));
+
+    if (len > space) {
+        ring->overflow += len - space;
+        len = space;
+    }
+    ring_copy_in(ring, head, str, len);
+    ring_store(&ring->head, head + len);
+    ring_update_high_water(ring, head + len);
+
+    return len;
+}
+
+// Return the contiguous free space at head, which the producer may fill
+// directly and then publish with byte_ring_commit().
+uint32_t byte_ring_reserve(byte_ring_t *ring, uint8_t **buf)
+{
+    uint32_t head = ring->head;
+    uint32_t space = ring->size - (head - ring_load(&ring->tail));
+    uint32_t offset = head & (ring->size - 1);
+
+    *buf = ring->buf + offset;
+    if (space > (ring->size - offset)) {
+        space = ring->size - offset;
+    }
+    return space;
+}
+
+void byte_ring_commit(byte_ring_t *ring, uint32_t len)
+{
+    uint32_t head = ring->head + len;
+
+    ring_store(&ring->head, head);
+    ring_update_high_water(ring, head);
+}
+
+uint32_t byte_ring_copy(byte_ring_t *ring, uint8_t *buf, uint32_t len)
+{
+    return byte_ring_copy_at(ring, ring->tail, buf, len);
+}
+
+uint32_t byte_ring_read(byte_ring_t *ring, uint8_t *buf, uint32_t len)
+{
+    len = byte_ring_copy(ring, buf, len);
+    byte_ring_consume(ring, len);
+
+    return len;
+}
+
+// Return the contiguous stored bytes at tail, which the consumer may use
+// in place and then release with byte_ring_consume().
+uint32_t byte_ring_peek(byte_ring_t *ring, uint8_t **str)
+{
+    return byte_ring_peek_at(ring, ring->tail, str);
+}
+
+void byte_ring_consume(byte_ring_t *ring, uint32_t len)
+{
+    ring_store(&ring->tail, ring->tail + len);
+}
+
+void byte_ring_discard(byte_ring_t *ring)
+{
+    ring_store(&ring->tail, ring_load(&ring->head));
+}
+
+uint32_t byte_ring_head(byte_ring_t *ring)
+{
+    return ring_load(&ring->head);
+}
+
+uint32_t byte_ring_tail(byte_ring_t *ring)
+{
+    return ring->tail;
+}
+
+uint32_t byte_ring_copy_at(byte_ring_t *ring, uint32_t pos, uint8_t *buf, uint32_t len)
+{
+    uint32_t used = ring_load(&ring->head) - pos;
+
+    if (len > used) {
+        len = used;
+    }
+    ring_copy_out(ring, pos, buf, len);
+
+    return len;
+}
+
+uint32_t byte_ring_peek_at(byte_ring_t *ring, uint32_t pos, uint8_t **str)
+{
+    uint32_t used = ring_load(&ring->head) - pos;
+    uint32_t offset = pos & (ring->size - 1);
+
+    *str = ring->buf + offset;
+    if (used > (ring->size - offset)) {
+        used = ring->size - offset;
+    }
+    return used;
+}
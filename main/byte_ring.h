@@ -0,0 +1,42 @@
+#include <stdint.h>
+
+// Single producer / single consumer byte ring.
+// NOTE: size must be a power of 2.
+typedef struct byte_ring {
+    uint8_t *buf;
+    uint32_t size;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t high_water;
+    uint32_t overflow;
+} byte_ring_t;
+
+#define BYTE_RING_INITIALIZER(buffer) { \
+    .buf        = (buffer),             \
+    .size       = sizeof(buffer),       \
+    .head       = 0,                    \
+    .tail       = 0,                    \
+    .high_water = 0,                    \
+    .overflow   = 0,                    \
+}
+
+// Producer side
+uint32_t byte_ring_write(byte_ring_t *ring, const uint8_t *str, uint32_t len);
+uint32_t byte_ring_reserve(byte_ring_t *ring, uint8_t **buf);
+void byte_ring_commit(byte_ring_t *ring, uint32_t len);
+uint32_t byte_ring_free(byte_ring_t *ring);
+
+// Consumer side
+uint32_t byte_ring_read(byte_ring_t *ring, uint8_t *buf, uint32_t len);
+uint32_t byte_ring_copy(byte_ring_t *ring, uint8_t *buf, uint32_t len);
+uint32_t byte_ring_peek(byte_ring_t *ring, uint8_t **str);
+void byte_ring_consume(byte_ring_t *ring, uint32_t len);
+uint32_t byte_ring_used(byte_ring_t *ring);
+void byte_ring_discard(byte_ring_t *ring);
+
+// Consumer side, addressed by the free running position. These allow
+// several readers, which all stay between tail and head, to share the ring.
+uint32_t byte_ring_head(byte_ring_t *ring);
+uint32_t byte_ring_tail(byte_ring_t *ring);
+uint32_t byte_ring_copy_at(byte_ring_t *ring, uint32_t pos, uint8_t *buf, uint32_t len);
+uint32_t byte_ring_peek_at(byte_ring_t *ring, uint32_t pos, uint8_t **str);
@@ -1,219 +1,2255 @@
 #include "esp32_spp_server.h"
 #include "ble_spp_service.h"
 #include "str_buf.h"
+#include "byte_ring.h"
+#include "spp_config.h"
+#include "spp_lz.h"
+#include "spp_frame.h"
+#include "spp_stats.h"
+#include "spp_log.h"
+#include "spp_trace.h"
+#include "spp_dlog.h"
+#include "spp_pm.h"
+#include "spp_ota.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "xtensa/hal.h"
 
 #include "driver/uart.h"
 
 #include "esp_bt.h"
 #include "esp_bt_main.h"
+#include "esp_gatt_common_api.h"
 
 #include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_sleep.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 
+#include "nvs.h"
 #include "nvs_flash.h"
 
 static xQueueHandle cmd_queue = NULL;
+static TaskHandle_t task_handle[SPP_TASK_NB];
+
+static spp_config_t spp_config;
+
+// NOTE: Posted to the UART event queue to reinstall the driver.
+#define SPP_UART_EVENT_REINSTALL    UART_EVENT_MAX
+
+// A channel bridges one UART to a pair of data characteristics.
+// ring is filled by uart_task and drained by ble_tx_task, rx_ring is filled
+// by the BTC task and drained by uart_write_task. Each channel runs its own
+// pair of UART tasks.
+typedef struct spp_chan {
+    uart_port_t uart_num;
+    int tx_pin;
+    int rx_pin;
+    int rts_pin;
+    int cts_pin;
+    uint32_t weight;
+
+    byte_ring_t ring;
+    uint32_t backlog;
+    // Set by ble_tx_task to the oldest position an active peer still needs
+    // from the ring, read by uart_task with the hardware flow control.
+    uint32_t hold_tail;
+    bool is_held;
+    uint32_t rx_full_thresh;
+    QueueHandle_t uart_queue;
+    // Held while uart_task reinstalls the driver, and by the tasks which use
+    // the driver or post to uart_queue meanwhile.
+    SemaphoreHandle_t driver_lock;
+    TaskHandle_t uart_task;
+    TickType_t pending_since;
+    bool is_pending;
+
+    byte_ring_t rx_ring;
+    TaskHandle_t write_task;
+
+    // Owned by ble_tx_task
+    spp_log_t log;
+    bool is_storing;
+} spp_chan_t;
+
+static uint8_t uart_ring_buf[SPP_CHAN_NUM][SPP_RING_SIZE];
+static uint8_t rx_ring_buf[SPP_CHAN_NUM][SPP_RX_RING_SIZE];
+
+#define SPP_CHAN_INITIALIZER(n, uart, tx, rx, rts, cts, w) { \
+    .uart_num   = (uart),                                    \
+    .tx_pin     = (tx),                                      \
+    .rx_pin     = (rx),                                      \
+    .rts_pin    = (rts),                                     \
+    .cts_pin    = (cts),                                     \
+    .weight     = (w),                                       \
+    .ring       = BYTE_RING_INITIALIZER(uart_ring_buf[n]),   \
+    .rx_ring    = BYTE_RING_INITIALIZER(rx_ring_buf[n]),     \
+}
+
+// NOTE: Channel 0 keeps the pins of the console.
+static spp_chan_t spp_chan[SPP_CHAN_NUM] = {
+    SPP_CHAN_INITIALIZER(0, UART_NUM_0,
+                         UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE,
+                         UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, SPP_CHAN0_WEIGHT),
+#if SPP_CHAN_NUM > 1
+    SPP_CHAN_INITIALIZER(1, UART_NUM_1,
+                         SPP_CHAN1_TX_PIN, SPP_CHAN1_RX_PIN,
+                         SPP_CHAN1_RTS_PIN, SPP_CHAN1_CTS_PIN, SPP_CHAN1_WEIGHT),
+#endif
+#if SPP_CHAN_NUM > 2
+    SPP_CHAN_INITIALIZER(2, UART_NUM_2,
+                         SPP_CHAN2_TX_PIN, SPP_CHAN2_RX_PIN,
+                         SPP_CHAN2_RTS_PIN, SPP_CHAN2_CTS_PIN, SPP_CHAN2_WEIGHT),
+#endif
+};
+
+static uint32_t chan_id(spp_chan_t *chan)
+{
+    return chan - spp_chan;
+}
+
+static spp_uart_config_t *chan_config(spp_chan_t *chan)
+{
+    return &(spp_config.uart[chan_id(chan)]);
+}
+
+// The stream of a channel is the log followed by the ring, so a position
+// before the ring tail is read from the log.
+static bool chan_is_stored(spp_chan_t *chan, uint32_t pos)
+{
+    return (int32_t)(pos - byte_ring_tail(&(chan->ring))) < 0;
+}
+
+static uint32_t chan_store_tail(spp_chan_t *chan)
+{
+    if (spp_log_used(&(chan->log)) != 0) {
+        return chan->log.tail;
+    }
+    return byte_ring_tail(&(chan->ring));
+}
+
+static uint32_t chan_copy_at(spp_chan_t *chan, uint32_t pos, uint8_t *buf, uint32_t len)
+{
+    uint32_t copied = 0;
+
+    while (chan_is_stored(chan, pos) && (len != 0)) {
+        uint32_t size = byte_ring_tail(&(chan->ring)) - pos;
+        uint32_t read_size = spp_log_read_at(&(chan->log), pos, buf,
+                                             (len < size) ? len : size);
+
+        if (read_size == 0) {
+            return copied;
+        }
+        pos += read_size;
+        buf += read_size;
+        len -= read_size;
+        copied += read_size;
+    }
+    if (len != 0) {
+        copied += byte_ring_copy_at(&(chan->ring), pos, buf, len);
+    }
+    return copied;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // UART function
-static void uart_write(uint8_t *str, uint32_t len)
+static void uart_write(spp_chan_t *chan, uint8_t *str, uint32_t len)
+{
+    xSemaphoreTake(chan->driver_lock, portMAX_DELAY);
+    uart_write_bytes(chan->uart_num, (char *)str, len);
+    xSemaphoreGive(chan->driver_lock);
+}
+
+// NOTE: Only the buffered data is read, so this never blocks.
+static uint32_t uart_read(spp_chan_t *chan, uint8_t *buf, uint32_t len)
+{
+    int read_size = uart_read_bytes(chan->uart_num, buf, len, 0);
+
+    return (read_size > 0) ? read_size : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// UART handler: Local to Remote
+// Read UART data and send it to remote via BLE.
+
+// Encode the bytes at pos into a payload of at most max_data_size bytes,
+// which starts with the SPP_LZ_HDR_* byte. The bytes which do not compress
+// are sent raw. consumed is set to the bytes taken.
+// NOTE: The encoder keeps no state between the calls, so the same arguments
+// give the same payload again.
+static uint32_t compress_data(spp_chan_t *chan, uint32_t pos, uint32_t in_len,
+                              uint32_t max_data_size, uint8_t *buf, uint32_t *consumed)
+{
+    static spp_lz_t lz;
+    static uint8_t block[SPP_LZ_BLOCK_MAX];
+    uint32_t len = chan_copy_at(chan, pos, block,
+                                (in_len < sizeof(block)) ? in_len : sizeof(block));
+    uint32_t data_size = spp_lz_encode(&lz, block, len, buf + 1, max_data_size - 1, consumed);
+
+    if (data_size >= *consumed) {
+        *consumed = (len < (max_data_size - 1)) ? len : (max_data_size - 1);
+        memcpy(buf + 1, block, *consumed);
+        buf[0] = SPP_LZ_HDR_RAW;
+        data_size = *consumed;
+    } else {
+        buf[0] = SPP_LZ_HDR_LZ;
+    }
+    return data_size + 1;
+}
+
+// Build the frame of a segment into frame. The segment only refers to the
+// stream, which is held until the frame is acknowledged, so a retransmission
+// builds the same frame again. consumed is set to the stream bytes it carries.
+static uint32_t make_frame(spp_chan_t *chan, spp_rtx_seg_t *seg, uint8_t *frame, uint32_t *consumed)
+{
+    uint8_t *payload = frame + SPP_FRAME_HDR_LEN;
+    uint32_t len;
+
+    if (seg->is_compressed) {
+        len = compress_data(chan, seg->pos, seg->in_len, seg->max_size,
+                            payload, consumed);
+    } else {
+        len = chan_copy_at(chan, seg->pos, payload, seg->in_len);
+        *consumed = len;
+    }
+    return spp_frame_seal(frame, seg->seq, len);
+}
+
+static bool send_packet(spp_peer_t *peer, spp_chan_t *chan, uint8_t *str, uint32_t len)
+{
+    esp_err_t err;
+
+    SPP_TRACE_BEGIN(SPP_TRACE_TX_INDICATE, chan_id(chan));
+    err = esp_ble_gatts_send_indicate(gatts_spp_status()->gatts_if,
+                                      peer->connection_id,
+                                      gatts_chan_handle(chan_id(chan)),
+                                      len, str, false);
+    SPP_TRACE_END(SPP_TRACE_TX_INDICATE, chan_id(chan), len);
+    if (err != ESP_OK) {
+        SPP_LOGE("Failed to send notification.");
+        spp_flow_release(&(peer->flow));
+        return false;
+    }
+    spp_pm_tx();
+    peer->tx_bytes += len;
+    peer->tx_packets++;
+    SPP_STATS_ADD(tx_bytes, len);
+    SPP_STATS_ADD(tx_packets, 1);
+
+    return true;
+}
+
+// Take the ACK and NAK of the client, which the BTC task left, and send
+// the frames it asked for again.
+// Return false if the credits ran out.
+static bool handle_peer_rtx(spp_peer_t *peer, spp_chan_t *chan, spp_peer_chan_t *peer_chan)
+{
+    static uint8_t frame[SPP_DATA_MAX_LEN];
+    uint16_t ack = __atomic_load_n(&(peer_chan->ack_seq), __ATOMIC_RELAXED);
+    uint16_t outstanding = peer_chan->tx_seq - peer_chan->tx_ack;
+    uint32_t nak;
+    uint32_t consumed;
+
+    if ((uint16_t)(ack - peer_chan->tx_ack) <= outstanding) {
+        peer_chan->tx_ack = ack;
+        outstanding = peer_chan->tx_seq - peer_chan->tx_ack;
+    }
+    nak = __atomic_exchange_n(&(peer_chan->nak_mask), 0, __ATOMIC_RELAXED);
+
+    for (uint32_t i = 0; nak != 0; i++, nak >>= 1) {
+        spp_rtx_seg_t *seg = &(peer_chan->rtx[i]);
+
+        if (((nak & 1) == 0) || ((uint16_t)(seg->seq - peer_chan->tx_ack) >= outstanding)) {
+            continue;
+        }
+        if (!spp_flow_acquire(&(peer->flow))) {
+            __atomic_fetch_or(&(peer_chan->nak_mask), nak << i, __ATOMIC_RELAXED);
+            return false;
+        }
+        if (send_packet(peer, chan, frame, make_frame(chan, seg, frame, &consumed))) {
+            SPP_STATS_ADD(tx_retransmit, 1);
+        }
+    }
+    return true;
+}
+
+// Send the pending bytes of a peer directly from the ring memory. Only a
+// segment which crosses the end of the ring is copied into the bounce buffer.
+// Unless flush is set, a tail shorter than the payload size is held back.
+// At most quota packets are sent, and blocked is set if the peer has data
+// waiting for a credit. Return the number of packets sent.
+// A compressed connection gets one block per packet, and holds the bytes
+// until a full block is ready. A framed connection keeps its last
+// SPP_RTX_WINDOW frames for the retransmission, and waits for an ACK when
+// all of them are outstanding.
+static uint32_t send_peer_data(spp_peer_t *peer, spp_chan_t *chan, uint32_t head,
+                               bool flush, uint32_t quota, bool *blocked)
+{
+    static uint8_t bounce[SPP_DATA_MAX_LEN];
+    spp_peer_chan_t *peer_chan = &(peer->chan[chan_id(chan)]);
+    uint32_t max_data_size = peer->mtu_size - 3;
+    uint32_t hold_size;
+    uint32_t sent = 0;
+
+    if (max_data_size > sizeof(bounce)) {
+        max_data_size = sizeof(bounce);
+    }
+    hold_size = peer->is_compressed ? SPP_LZ_BLOCK_MAX : max_data_size;
+
+    if (peer->is_framed && !handle_peer_rtx(peer, chan, peer_chan)) {
+        *blocked = true;
+        return sent;
+    }
+
+    while ((peer_chan->pos != head) && (sent < quota) &&
+           !__atomic_load_n(&(peer->is_closing), __ATOMIC_ACQUIRE)) {
+        uint8_t *str;
+        uint32_t pending = head - peer_chan->pos;
+        uint32_t data_size;
+        uint32_t consumed;
+
+        if (!flush && (pending < hold_size)) {
+            break;
+        }
+        if (peer->is_framed &&
+            ((uint16_t)(peer_chan->tx_seq - peer_chan->tx_ack) >= SPP_RTX_WINDOW)) {
+            *blocked = true;
+            break;
+        }
+        if (!spp_flow_acquire(&(peer->flow))) {
+            *blocked = true;
+            break;
+        }
+
+        if (peer->is_framed) {
+            spp_rtx_seg_t *seg = &(peer_chan->rtx[peer_chan->tx_seq % SPP_RTX_WINDOW]);
+            uint32_t in_len;
+
+            seg->seq = peer_chan->tx_seq;
+            seg->pos = peer_chan->pos;
+            seg->max_size = max_data_size - SPP_FRAME_OVERHEAD;
+            seg->is_compressed = peer->is_compressed;
+            in_len = seg->is_compressed ? SPP_LZ_BLOCK_MAX : seg->max_size;
+            seg->in_len = (pending < in_len) ? pending : in_len;
+
+            data_size = make_frame(chan, seg, bounce, &consumed);
+            str = bounce;
+        } else if (peer->is_compressed) {
+            data_size = compress_data(chan, peer_chan->pos, pending,
+                                      max_data_size, bounce, &consumed);
+            str = bounce;
+        } else if (chan_is_stored(chan, peer_chan->pos)) {
+            data_size = chan_copy_at(chan, peer_chan->pos, bounce,
+                                     (pending < max_data_size) ? pending : max_data_size);
+            consumed = data_size;
+            str = bounce;
+        } else {
+            data_size = byte_ring_peek_at(&(chan->ring), peer_chan->pos, &str);
+            if (data_size > pending) {
+                data_size = pending;
+            }
+            if (data_size >= max_data_size) {
+                data_size = max_data_size;
+            } else if (data_size < pending) {
+                data_size = byte_ring_copy_at(&(chan->ring), peer_chan->pos, bounce,
+                                              (pending < max_data_size) ? pending : max_data_size);
+                str = bounce;
+            }
+            consumed = data_size;
+        }
+
+        // NOTE: Only a failed read of the log leaves nothing to send.
+        if (consumed == 0) {
+            spp_flow_release(&(peer->flow));
+            break;
+        }
+        if (!send_packet(peer, chan, str, data_size)) {
+            break;
+        }
+        if (peer->is_framed) {
+            peer_chan->tx_seq++;
+        }
+        peer_chan->pos += consumed;
+        sent++;
+    }
+    return sent;
+}
+
+static void handle_peer_lag(spp_peer_t *peer, spp_peer_chan_t *peer_chan, uint32_t head)
+{
+    SPP_LOGW("Peer %d lags behind.", peer->connection_id);
+
+    if (SPP_PEER_POLICY == SPP_PEER_POLICY_DISCONNECT) {
+        esp_ble_gap_disconnect(peer->remote_bda);
+        peer_chan->is_notify_enabled = false;
+        peer_chan->is_active = false;
+    } else {
+        peer_chan->drop_bytes += head - peer_chan->pos;
+        peer_chan->pos = head;
+        peer_chan->tx_ack = peer_chan->tx_seq;
+    }
+}
+
+// Return the oldest position a peer still needs, which is the first frame
+// not acknowledged yet on a framed connection.
+static uint32_t peer_hold_pos(spp_peer_t *peer, spp_peer_chan_t *peer_chan)
+{
+    if (!peer->is_framed) {
+        peer_chan->tx_ack = peer_chan->tx_seq;
+    }
+    if (peer_chan->tx_ack == peer_chan->tx_seq) {
+        return peer_chan->pos;
+    }
+    return peer_chan->rtx[peer_chan->tx_ack % SPP_RTX_WINDOW].pos;
+}
+
+// Keep the data of a channel which nobody receives, or which a peer still
+// replays from the log. The part of the ring above SPP_STORE_SPILL_THRESH is
+// moved into the log, which drops its oldest sector when full. Without the
+// log partition the data is kept in the ring only.
+static void handle_uart_store(spp_chan_t *chan)
+{
+    uint8_t *str;
+    uint32_t len;
+
+    if (!spp_log_ready(&(chan->log))) {
+        return;
+    }
+    while (byte_ring_used(&(chan->ring)) > SPP_STORE_SPILL_THRESH) {
+        len = byte_ring_peek(&(chan->ring), &str);
+        if (len > SPP_STORE_SPILL_CHUNK) {
+            len = SPP_STORE_SPILL_CHUNK;
+        }
+        if (spp_log_append(&(chan->log), byte_ring_tail(&(chan->ring)), str, len) != len) {
+            SPP_LOGE("Failed to store data at %s.", __func__);
+            break;
+        }
+        byte_ring_consume(&(chan->ring), len);
+    }
+}
+
+// Fan the stream of a channel out to every subscribed peer, segmented
+// at the MTU of each peer and at most quota packets per peer. The ring is
+// released up to the slowest peer, and a peer which lags more than
+// SPP_PEER_BACKLOG_MAX is handled by SPP_PEER_POLICY, so a slow peer never
+// stalls the others. With the hardware flow control no peer is skipped, the
+// UART is held back instead, see uart_receive().
+// While no peer subscribes, the data is stored. The first peer which
+// subscribes then starts at the oldest byte stored, and replays it at the
+// pace of its credits, while the other channels go on by the round-robin.
+// blocked is set if any peer has data waiting for a credit.
+// Return the number of packets sent.
+static uint32_t handle_uart_local_data(spp_chan_t *chan, bool flush, uint32_t quota, bool *blocked)
+{
+    uint32_t head = byte_ring_head(&(chan->ring));
+    uint32_t tail = head;
+    uint32_t sent = 0;
+    bool is_active = false;
+
+    SPP_TRACE_BEGIN(SPP_TRACE_TX_DATA, chan_id(chan));
+    for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+        spp_peer_t *peer = gatts_spp_peer(i);
+        spp_peer_chan_t *peer_chan = &(peer->chan[chan_id(chan)]);
+        uint32_t hold;
+
+        if (!peer->in_use || __atomic_load_n(&(peer->is_closing), __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        if (!peer_chan->is_notify_enabled) {
+            peer_chan->is_active = false;
+            continue;
+        }
+        if (!peer_chan->is_active) {
+            peer_chan->pos = chan->is_storing ? chan_store_tail(chan) : head;
+            peer_chan->tx_ack = peer_chan->tx_seq;
+            peer_chan->is_active = true;
+        }
+        hold = peer_hold_pos(peer, peer_chan);
+        if ((int32_t)(hold - chan_store_tail(chan)) < 0) {
+            // NOTE: The log dropped the data of a slow replay.
+            peer_chan->drop_bytes += chan_store_tail(chan) - peer_chan->pos;
+            peer_chan->pos = chan_store_tail(chan);
+            peer_chan->tx_ack = peer_chan->tx_seq;
+        } else if (!chan_config(chan)->flow_ctrl && !chan_is_stored(chan, hold) &&
+                   ((head - hold) > SPP_PEER_BACKLOG_MAX)) {
+            handle_peer_lag(peer, peer_chan, head);
+        }
+        if (!peer_chan->is_active) {
+            continue;
+        }
+        is_active = true;
+
+        sent += send_peer_data(peer, chan, head, flush, quota, blocked);
+        hold = peer_hold_pos(peer, peer_chan);
+        if ((int32_t)(hold - tail) < 0) {
+            tail = hold;
+        }
+    }
+    chan->is_storing = !is_active;
+    if (is_active && !chan_is_stored(chan, tail)) {
+        __atomic_store_n(&(chan->hold_tail), tail, __ATOMIC_RELAXED);
+        __atomic_store_n(&(chan->is_held), true, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&(chan->is_held), false, __ATOMIC_RELEASE);
+    }
+    if (!is_active) {
+        handle_uart_store(chan);
+    } else if (chan_is_stored(chan, tail)) {
+        handle_uart_store(chan);
+        spp_log_release(&(chan->log), tail);
+    } else {
+        byte_ring_consume(&(chan->ring), tail - byte_ring_tail(&(chan->ring)));
+        spp_log_release(&(chan->log), tail);
+    }
+    SPP_TRACE_END(SPP_TRACE_TX_DATA, chan_id(chan), sent);
+
+    return sent;
+}
+
+// Return the bytes the ring may still take with the hardware flow control,
+// so the slowest active peer lags at most SPP_PEER_BACKLOG_MAX.
+static uint32_t uart_hold_room(spp_chan_t *chan)
+{
+    uint32_t used;
+
+    if (!__atomic_load_n(&(chan->is_held), __ATOMIC_ACQUIRE)) {
+        return UINT32_MAX;
+    }
+    used = byte_ring_head(&(chan->ring)) - __atomic_load_n(&(chan->hold_tail), __ATOMIC_RELAXED);
+    return (used < SPP_PEER_BACKLOG_MAX) ? (SPP_PEER_BACKLOG_MAX - used) : 0;
+}
+
+// Read all the data buffered in the driver straight into the free space of
+// the ring, in the largest contiguous chunks it has.
+// With the hardware flow control, the data which does not fit, or which
+// would put a peer more than SPP_PEER_BACKLOG_MAX behind, is left in the
+// driver, so RTS holds the sender back. Otherwise it is read out and dropped.
+// NOTE: The events queued for the data already read find nothing to read.
+static void uart_receive(spp_chan_t *chan)
+{
+    static uint8_t scrap[SPP_CHAN_NUM][64];
+    uint32_t total = 0;
+    uint32_t room = chan_config(chan)->flow_ctrl ? uart_hold_room(chan) : UINT32_MAX;
+    size_t len;
+
+    SPP_STATS_ADD(uart_wakeups, 1);
+    if (uart_get_buffered_data_len(chan->uart_num, &len) != ESP_OK) {
+        return;
+    }
+    SPP_TRACE_BEGIN(SPP_TRACE_UART_READ, chan_id(chan));
+    while (len != 0) {
+        uint8_t *buf;
+        uint32_t read_size = byte_ring_reserve(&(chan->ring), &buf);
+
+        if (read_size > (room - total)) {
+            read_size = room - total;
+            if (read_size == 0) {
+                break;
+            }
+        }
+        if (read_size == 0) {
+            if (chan_config(chan)->flow_ctrl) {
+                break;
+            }
+            read_size = (len < sizeof(scrap[0])) ? len : sizeof(scrap[0]);
+            read_size = uart_read(chan, scrap[chan_id(chan)], read_size);
+            if (read_size == 0) {
+                break;
+            }
+            chan->ring.overflow += read_size;
+            len -= read_size;
+            continue;
+        }
+        if (read_size > len) {
+            read_size = len;
+        }
+        read_size = uart_read(chan, buf, read_size);
+        if (read_size == 0) {
+            break;
+        }
+        byte_ring_commit(&(chan->ring), read_size);
+        total += read_size;
+        len -= read_size;
+    }
+    SPP_STATS_ADD(uart_rx_bytes, total);
+    SPP_TRACE_END(SPP_TRACE_UART_READ, chan_id(chan), total);
+    chan->backlog = len;
+}
+
+// Tune the RX interrupts to the baud rate.
+// The FIFO full threshold leaves room for the bytes which arrive during the
+// ISR latency. The RX timeout detects the idle line of the throughput mode,
+// after spp_config.idle_chars characters. It is kept above
+// SPP_UART_RX_TOUT_MIN_US, so at the high baud rates a burst is not split
+// into many small events.
+static void uart_tune_intr(spp_chan_t *chan)
+{
+    uint32_t baud_rate = chan_config(chan)->baud_rate;
+    // NOTE: A character is 10 bit times with 8N1.
+    uint32_t headroom = (baud_rate / 10) * SPP_UART_ISR_LATENCY_US / 1000000 + 1;
+    uint32_t tout = (baud_rate / 10) * SPP_UART_RX_TOUT_MIN_US / 1000000 + 1;
+    uart_intr_config_t intr_config = {
+        .intr_enable_mask = UART_RXFIFO_FULL_INT_ENA_M
+                          | UART_RXFIFO_TOUT_INT_ENA_M
+                          | UART_FRM_ERR_INT_ENA_M
+                          | UART_RXFIFO_OVF_INT_ENA_M
+                          | UART_BRK_DET_INT_ENA_M
+                          | UART_PARITY_ERR_INT_ENA_M,
+    };
+
+    headroom = (headroom < SPP_UART_FIFO_LEN - SPP_UART_RX_FULL_MAX) ?
+        SPP_UART_FIFO_LEN - SPP_UART_RX_FULL_MAX : headroom;
+    chan->rx_full_thresh = (headroom > SPP_UART_FIFO_LEN - SPP_UART_RX_FULL_MIN) ?
+        SPP_UART_RX_FULL_MIN : SPP_UART_FIFO_LEN - headroom;
+    intr_config.rxfifo_full_thresh = chan->rx_full_thresh;
+    tout = (tout < spp_config.idle_chars) ? spp_config.idle_chars : tout;
+    intr_config.rx_timeout_thresh = (tout > SPP_UART_RX_TOUT_MAX) ? SPP_UART_RX_TOUT_MAX : tout;
+
+    if (uart_intr_config(chan->uart_num, &intr_config) != ESP_OK) {
+        SPP_LOGE("Failed to config UART%d interrupt at %s.", chan->uart_num, __func__);
+    }
+}
+
+// Flush at each delimiter, so that the notifications end at record boundaries.
+static bool uart_set_delim(spp_chan_t *chan, bool enable, uint8_t delim)
+{
+    if (!enable) {
+        return uart_disable_pattern_det_intr(chan->uart_num) == ESP_OK;
+    }
+    return uart_enable_pattern_det_intr(chan->uart_num, delim, 1,
+                                        SPP_UART_DELIM_IDLE, SPP_UART_DELIM_IDLE,
+                                        SPP_UART_DELIM_IDLE) == ESP_OK;
+}
+
+static void uart_setup(spp_chan_t *chan)
+{
+    uart_config_t uart_config = {
+        .baud_rate = chan_config(chan)->baud_rate,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = chan_config(chan)->flow_ctrl ? UART_HW_FLOWCTRL_CTS_RTS : UART_HW_FLOWCTRL_DISABLE,
+        .rx_flow_ctrl_thresh = SPP_UART_RTS_THRESH,
+    };
+
+    uart_param_config(chan->uart_num, &uart_config);
+    uart_set_pin(chan->uart_num,
+                 chan->tx_pin, chan->rx_pin,
+                 chan->rts_pin, chan->cts_pin);
+#ifdef CONFIG_SPP_PM_LIGHT_SLEEP
+    // NOTE: Only UART0 and UART1 can wake the CPU up.
+    if (chan->uart_num != UART_NUM_2) {
+        uart_set_wakeup_threshold(chan->uart_num, SPP_PM_UART_WAKE_EDGES);
+        esp_sleep_enable_uart_wakeup(chan->uart_num);
+    }
+#endif
+}
+
+static void uart_install(spp_chan_t *chan)
+{
+    uart_driver_install(chan->uart_num, chan_config(chan)->rx_buf_size,
+                        chan_config(chan)->tx_buf_size, 10, &(chan->uart_queue), 0);
+    uart_tune_intr(chan);
+    uart_set_delim(chan, chan_config(chan)->delim_enable, chan_config(chan)->delim);
+}
+
+// NOTE: uart_driver_delete() frees uart_queue and uart_driver_install()
+// creates a new one, so nobody posts to it in between.
+static void uart_reinstall(spp_chan_t *chan)
+{
+    xSemaphoreTake(chan->driver_lock, portMAX_DELAY);
+    uart_driver_delete(chan->uart_num);
+    chan->backlog = 0;
+    uart_setup(chan);
+    uart_install(chan);
+    xSemaphoreGive(chan->driver_lock);
+}
+
+// Drop the events of the input which was flushed. Return true if the queue
+// held an SPP_UART_EVENT_REINSTALL, which the caller still has to run.
+static bool uart_drop_events(spp_chan_t *chan)
+{
+    uart_event_t event;
+    bool reinstall = false;
+
+    while (xQueueReceive(chan->uart_queue, (void * )&event, 0) == pdTRUE) {
+        if (event.type == SPP_UART_EVENT_REINSTALL) {
+            reinstall = true;
+        }
+    }
+    return reinstall;
+}
+
+void uart_task(void * arg)
+{
+    spp_chan_t *chan = (spp_chan_t *)arg;
+    uint32_t flush = SPP_TX_NOTIFY_DATA|SPP_TX_NOTIFY_FLUSH_CHAN(chan_id(chan));
+    uart_event_t event;
+
+    uart_install(chan);
+
+    while (1) {
+        // NOTE: While the data is left in the driver, poll for room in the ring.
+        TickType_t wait = (chan->backlog != 0) ? 1 : portMAX_DELAY;
+
+        if (xQueueReceive(chan->uart_queue, (void * )&event, wait) == pdFALSE) {
+            spp_pm_activity(true);
+            uart_receive(chan);
+            xTaskNotify(task_handle[SPP_TASK_BLE_TX], SPP_TX_NOTIFY_DATA, eSetBits);
+            continue;
+        }
+
+        switch (event.type) {
+        case UART_DATA:
+            spp_pm_activity(true);
+            // NOTE: An event smaller than the FIFO full threshold is caused
+            // by the RX timeout, so the line went idle.
+            uart_receive(chan);
+            xTaskNotify(task_handle[SPP_TASK_BLE_TX],
+                        (event.size < chan->rx_full_thresh) ? flush : SPP_TX_NOTIFY_DATA,
+                        eSetBits);
+            break;
+        case UART_PATTERN_DET:
+            spp_pm_activity(true);
+            uart_receive(chan);
+            xTaskNotify(task_handle[SPP_TASK_BLE_TX], flush, eSetBits);
+            break;
+        case UART_BUFFER_FULL:
+            // NOTE: With the hardware flow control the FIFO holds the rest,
+            // RTS holds the sender back, and the data is read as it fits.
+            if (chan_config(chan)->flow_ctrl) {
+                spp_pm_activity(true);
+                uart_receive(chan);
+                xTaskNotify(task_handle[SPP_TASK_BLE_TX], SPP_TX_NOTIFY_DATA, eSetBits);
+                break;
+            }
+            // fall through
+        case UART_FIFO_OVF:
+            SPP_LOGW("UART%d RX overflow.", chan->uart_num);
+            SPP_STATS_ADD(uart_overflow, 1);
+            chan->backlog = 0;
+            uart_flush_input(chan->uart_num);
+            if (uart_drop_events(chan)) {
+                uart_reinstall(chan);
+            }
+            break;
+        case SPP_UART_EVENT_REINSTALL:
+            uart_reinstall(chan);
+            break;
+        default:
+            break;
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+// Give the slots of the closed connections back to alloc_peer(). The slots
+// are set up again by alloc_peer(), the sender only stops using them.
+static void release_peers(void)
+{
+    for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+        spp_peer_t *peer = gatts_spp_peer(i);
+
+        if (peer->in_use && __atomic_load_n(&(peer->is_closing), __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&(peer->in_use), false, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static TickType_t tx_idle_ticks(spp_chan_t *chan)
+{
+    uint32_t baud_rate = chan_config(chan)->baud_rate;
+    uint32_t idle_ms = (spp_config.idle_chars * 10 * 1000 + baud_rate - 1) / baud_rate;
+    TickType_t ticks = (idle_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+
+    return (ticks == 0) ? 1 : ticks;
+}
+
+// Drain the UART rings and send them to remote.
+// In the throughput mode, the bytes of a channel are held until a full
+// payload is ready or its line has been idle, but never longer than the idle
+// timeout since the oldest pending byte arrived.
+// NOTE: The idle line is found by the UART RX timeout, which wakes this task
+// with SPP_TX_NOTIFY_FLUSH_CHAN, see uart_task. The timeout since the oldest
+// byte is counted in ticks, so it takes at least one tick (10 ms at
+// CONFIG_FREERTOS_HZ=100). It only catches a line which trickles without an
+// idle gap.
+//
+// The channels share the credits of a peer by the weighted round-robin. In
+// each round a channel sends up to its weight in packets per peer, and the
+// channel which goes first rotates, so a busy channel never starves the
+// others.
+void ble_tx_task(void * arg)
+{
+    TickType_t wait = portMAX_DELAY;
+    uint32_t next = 0;
+
+    while (1) {
+        uint32_t notify = 0;
+        bool flush[SPP_CHAN_NUM];
+        bool blocked = false;
+        uint32_t sent;
+        uint32_t start;
+
+        xTaskNotifyWait(0, UINT32_MAX, &notify, wait);
+
+        if ((notify & SPP_TX_NOTIFY_CLOSE) != 0) {
+            release_peers();
+        }
+        if (gatts_spp_status()->peer_count == 0) {
+            SPP_LOGI("BLE is NOT connected, storing.");
+            for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+                spp_chan[i].is_storing = true;
+                spp_chan[i].is_pending = false;
+                __atomic_store_n(&(spp_chan[i].is_held), false, __ATOMIC_RELEASE);
+                handle_uart_store(&(spp_chan[i]));
+            }
+            wait = portMAX_DELAY;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+            spp_chan_t *chan = &(spp_chan[i]);
+
+            if (!chan->is_pending && (byte_ring_used(&(chan->ring)) != 0)) {
+                chan->pending_since = xTaskGetTickCount();
+                chan->is_pending = true;
+            }
+            flush[i] = (spp_config.tx_mode == SPP_TX_MODE_LATENCY) ||
+                       ((notify & (SPP_TX_NOTIFY_FLUSH|SPP_TX_NOTIFY_FLUSH_CHAN(i))) != 0) ||
+                       ((xTaskGetTickCount() - chan->pending_since) >= tx_idle_ticks(chan));
+        }
+
+        start = xthal_get_ccount();
+        do {
+            sent = 0;
+            for (uint32_t n = 0; n < SPP_CHAN_NUM; n++) {
+                uint32_t i = (next + n) % SPP_CHAN_NUM;
+
+                sent += handle_uart_local_data(&(spp_chan[i]), flush[i],
+                                               spp_chan[i].weight, &blocked);
+            }
+            next = (next + 1) % SPP_CHAN_NUM;
+        } while (sent != 0);
+        spp_stats_cycles(xthal_get_ccount() - start);
+
+        wait = portMAX_DELAY;
+        for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+            spp_chan_t *chan = &(spp_chan[i]);
+            TickType_t remain;
+
+            if (byte_ring_used(&(chan->ring)) == 0) {
+                chan->is_pending = false;
+                continue;
+            }
+            if (flush[i]) {
+                // NOTE: Only the data waiting for a credit is left. A returning
+                // credit wakes this task up, the timeout only detects the
+                // credits which are never confirmed.
+                remain = blocked ? SPP_FLOW_WAIT_TICKS : portMAX_DELAY;
+            } else {
+                remain = tx_idle_ticks(chan) - (xTaskGetTickCount() - chan->pending_since);
+                if ((int32_t)remain <= 0) {
+                    remain = 1;
+                }
+            }
+            if (remain < wait) {
+                wait = remain;
+            }
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+static void set_tx_mode(spp_tx_mode_t mode, uint32_t idle_chars)
+{
+    spp_config.tx_mode = mode;
+    if (idle_chars != 0) {
+        spp_config.idle_chars = idle_chars;
+        for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+            xSemaphoreTake(spp_chan[i].driver_lock, portMAX_DELAY);
+            uart_tune_intr(&(spp_chan[i]));
+            xSemaphoreGive(spp_chan[i].driver_lock);
+        }
+    }
+    xTaskNotify(task_handle[SPP_TASK_BLE_TX], SPP_TX_NOTIFY_FLUSH, eSetBits);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// UART configuration
+// The driver calls hold driver_lock, like uart_reinstall(), and the config
+// only takes a setting which the driver accepted, so a reinstall sets up the
+// same UART.
+static bool set_uart_baud(spp_chan_t *chan, uint32_t baud_rate)
+{
+    bool is_set;
+
+    if ((baud_rate < SPP_UART_BAUD_MIN) || (baud_rate > SPP_UART_BAUD_MAX)) {
+        return false;
+    }
+    xSemaphoreTake(chan->driver_lock, portMAX_DELAY);
+    is_set = (uart_set_baudrate(chan->uart_num, baud_rate) == ESP_OK);
+    if (is_set) {
+        chan_config(chan)->baud_rate = baud_rate;
+        uart_tune_intr(chan);
+    }
+    xSemaphoreGive(chan->driver_lock);
+
+    return is_set;
+}
+
+static bool set_uart_flow(spp_chan_t *chan, bool rts_cts)
+{
+    bool is_set;
+
+    xSemaphoreTake(chan->driver_lock, portMAX_DELAY);
+    is_set = (uart_set_hw_flow_ctrl(chan->uart_num,
+                                    rts_cts ? UART_HW_FLOWCTRL_CTS_RTS : UART_HW_FLOWCTRL_DISABLE,
+                                    SPP_UART_RTS_THRESH) == ESP_OK);
+    if (is_set) {
+        chan_config(chan)->flow_ctrl = rts_cts;
+    }
+    xSemaphoreGive(chan->driver_lock);
+
+    return is_set;
+}
+
+static bool set_uart_delim(spp_chan_t *chan, bool enable, uint8_t delim)
+{
+    bool is_set;
+
+    xSemaphoreTake(chan->driver_lock, portMAX_DELAY);
+    is_set = uart_set_delim(chan, enable, delim);
+    if (is_set) {
+        chan_config(chan)->delim_enable = enable;
+        chan_config(chan)->delim = delim;
+    }
+    xSemaphoreGive(chan->driver_lock);
+
+    return is_set;
+}
+
+// NOTE: The driver is owned by uart_task, so it is reinstalled there. The
+// event is posted under driver_lock, but without waiting for room in the
+// queue, since uart_task may be waiting for driver_lock itself.
+static bool set_uart_buf(spp_chan_t *chan, uint32_t rx_buf_size, uint32_t tx_buf_size)
+{
+    uart_event_t event = {
+        .type = SPP_UART_EVENT_REINSTALL,
+    };
+    BaseType_t posted;
+
+    if ((rx_buf_size < SPP_UART_BUF_SIZE_MIN) || (rx_buf_size > SPP_UART_BUF_SIZE_MAX)) {
+        return false;
+    }
+    if ((tx_buf_size != 0) &&
+        ((tx_buf_size < SPP_UART_BUF_SIZE_MIN) || (tx_buf_size > SPP_UART_BUF_SIZE_MAX))) {
+        return false;
+    }
+    chan_config(chan)->rx_buf_size = rx_buf_size;
+    chan_config(chan)->tx_buf_size = tx_buf_size;
+
+    while (1) {
+        xSemaphoreTake(chan->driver_lock, portMAX_DELAY);
+        posted = xQueueSendToFront(chan->uart_queue, &event, 0);
+        xSemaphoreGive(chan->driver_lock);
+        if (posted == pdTRUE) {
+            return true;
+        }
+        vTaskDelay(1);
+    }
+}
+
+static uint32_t get_le32(const uint8_t *str)
+{
+    return str[0] | (str[1] << 8) | (str[2] << 16) | ((uint32_t)str[3] << 24);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// UART handler: Remote to Local
+// Receive UART data via BLE and write data.
+//
+// The GATT callback only copies the payload into the RX ring of the channel,
+// and uart_write_task does the blocking uart_write_bytes(), so a full UART TX
+// ring never stalls the Bluetooth stack.
+//
+// The ring space is handed out as credits on the status characteristic.
+// A peer which enabled the status notification gets SPP_STATUS_CREDIT
+// records, each carrying the total number of bytes it may have written to
+// the channel so far. Only the space released after the UART driver accepted
+// the bytes is granted, so a client which keeps to its credits is never
+// dropped.
+
+// NOTE: The prepared writes of one queue all go to the same characteristic.
+static uint32_t prep_chan = 0;
+
+// A write is stored whole or dropped whole, so the UART never gets a part of
+// it. A client which keeps to its credits always finds the room.
+static void rx_enqueue(spp_chan_t *chan, uint8_t *str, uint32_t len)
+{
+    spp_pm_activity(false);
+    if (byte_ring_free(&(chan->rx_ring)) < len) {
+        SPP_LOGW("Write of %u bytes beyond the credits of channel %u.", len, chan_id(chan));
+        SPP_STATS_ADD(rx_drop, len);
+        return;
+    }
+    byte_ring_write(&(chan->rx_ring), str, len);
+    if (chan->write_task != NULL) {
+        xTaskNotifyGive(chan->write_task);
+    }
+}
+
+static uint32_t rx_credit_outstanding(spp_peer_chan_t *peer_chan)
+{
+    int32_t outstanding = peer_chan->rx_granted - peer_chan->rx_bytes;
+
+    return (outstanding > 0) ? outstanding : 0;
+}
+
+// Share the ring space which is neither used nor granted yet among the
+// peers using the credits. A small grant is held back to save airtime,
+// unless the peer has no credit left at all.
+static void grant_rx_credit(spp_chan_t *chan)
+{
+    spp_credit_t credit = {
+        .type = SPP_STATUS_CREDIT,
+        .channel = chan_id(chan),
+    };
+    uint32_t avail = chan->rx_ring.size - byte_ring_used(&(chan->rx_ring));
+    uint32_t peer_num = 0;
+
+    for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+        spp_peer_t *peer = gatts_spp_peer(i);
+        uint32_t outstanding;
+
+        if (!peer->in_use || !peer->is_status_enabled) {
+            continue;
+        }
+        outstanding = rx_credit_outstanding(&(peer->chan[chan_id(chan)]));
+        avail = (avail > outstanding) ? (avail - outstanding) : 0;
+        peer_num++;
+    }
+    if ((peer_num == 0) || (avail == 0)) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+        spp_peer_t *peer = gatts_spp_peer(i);
+        spp_peer_chan_t *peer_chan = &(peer->chan[chan_id(chan)]);
+        uint32_t grant = avail / peer_num;
+
+        if (!peer->in_use || !peer->is_status_enabled) {
+            continue;
+        }
+        if ((grant < SPP_RX_CREDIT_STEP) && (rx_credit_outstanding(peer_chan) != 0)) {
+            continue;
+        }
+        if (grant == 0) {
+            continue;
+        }
+        peer_chan->rx_granted = peer_chan->rx_bytes + rx_credit_outstanding(peer_chan) + grant;
+        credit.granted = peer_chan->rx_granted;
+
+        esp_ble_gatts_send_indicate(gatts_spp_status()->gatts_if,
+                                    peer->connection_id,
+                                    gatts_handle(SPP_IDX_SPP_STATUS_VAL),
+                                    sizeof(credit), (uint8_t *)&credit, false);
+    }
+}
+
+void uart_write_task(void * arg)
+{
+    spp_chan_t *chan = (spp_chan_t *)arg;
+
+    while (1) {
+        uint8_t *str;
+        uint32_t len;
+
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while ((len = byte_ring_peek(&(chan->rx_ring), &str)) != 0) {
+            uart_write(chan, str, len);
+            byte_ring_consume(&(chan->rx_ring), len);
+            SPP_STATS_ADD(rx_bytes, len);
+
+            grant_rx_credit(chan);
+        }
+        grant_rx_credit(chan);
+    }
+    vTaskDelete(NULL);
+}
+
+// Called when a connection closed, so that the sender task releases its slot.
+void handle_peer_close(void)
+{
+    xTaskNotify(task_handle[SPP_TASK_BLE_TX], SPP_TX_NOTIFY_CLOSE, eSetBits);
+}
+
+// Called when a peer enables a data notification, so that the sender task
+// starts the replay of the stored data rather than waiting for the UART.
+void handle_data_subscribe(void)
+{
+    xTaskNotify(task_handle[SPP_TASK_BLE_TX], SPP_TX_NOTIFY_FLUSH, eSetBits);
+}
+
+// Called when a peer enables the status notification, to hand out its
+// first credits.
+void handle_status_subscribe(void)
+{
+    for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+        if (spp_chan[i].write_task != NULL) {
+            xTaskNotifyGive(spp_chan[i].write_task);
+        }
+    }
+}
+
+void handle_uart_remote_data(uint32_t chan, uint8_t *str, uint32_t len)
+{
+    SPP_STATS_ADD(rx_packets, 1);
+    rx_enqueue(&(spp_chan[chan]), str, len);
+}
+
+void handle_uart_remote_data_prep(uint32_t chan, uint32_t offset, uint8_t *str, uint32_t len)
+{
+    SPP_STATS_ADD(rx_packets, 1);
+    prep_chan = chan;
+    if (!str_buf_store(offset, str, len)) {
+        SPP_LOGE("Prepared write overflows at %s.", __func__);
+    }
+}
+
+// Return the bytes the peer wrote, which count against its credits also
+// when the queue overflowed and was dropped.
+uint32_t handle_uart_remote_data_exec(uint32_t *chan)
+{
+    uint8_t *str;
+    uint32_t len = str_buf_get(&str);
+    uint32_t dropped = str_buf_dropped();
+
+    SPP_TRACE_BEGIN(SPP_TRACE_RX_EXEC, prep_chan);
+    *chan = prep_chan;
+    if (dropped != 0) {
+        SPP_LOGW("Prepared write of %u bytes dropped.", dropped);
+        SPP_STATS_ADD(rx_drop, dropped);
+        len = dropped;
+    } else if (len != 0) {
+        rx_enqueue(&(spp_chan[prep_chan]), str, len);
+    }
+    str_buf_clear();
+    SPP_TRACE_END(SPP_TRACE_RX_EXEC, prep_chan, len);
+
+    return len;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// OTA update
+// SPP_CMD_OTA_BEGIN turns the channel 0 data characteristic of the connection
+// sending it into the image stream of spp_ota.h, and ota_task writes the
+// blocks into the next OTA partition. Each block written is reported with an
+// SPP_STATUS_OTA record, which grants the sender the next block.
+// SPP_CMD_OTA_END checks the image and makes it boot.
+//
+// The offset written is kept in NVS every SPP_OTA_SAVE_SIZE and whenever the
+// transfer stops, so SPP_CMD_OTA_BEGIN of the same image continues there,
+// also after a reboot.
+// NOTE: The GATT callback only copies the data. ota_lock keeps the commands
+// and ota_task apart, the callback never takes it.
+#ifdef CONFIG_SPP_OTA
+#define SPP_OTA_NAMESPACE           "spp_ota"
+#define SPP_OTA_KEY                 "resume"
+
+typedef struct spp_ota_resume {
+    uint32_t addr;
+    uint32_t size;
+    uint8_t id[SPP_OTA_ID_LEN];
+    uint32_t offset;
+} spp_ota_resume_t;
+
+static spp_ota_t spp_ota;
+static SemaphoreHandle_t ota_lock = NULL;
+static const esp_partition_t *ota_partition = NULL;
+static spp_ota_resume_t ota_resume;
+static uint16_t ota_conn_id;
+static uint8_t ota_state = SPP_OTA_STATE_IDLE;
+
+static bool ota_flash_read(void *ctx, uint32_t addr, void *buf, uint32_t len)
+{
+    return esp_partition_read(ctx, addr, buf, len) == ESP_OK;
+}
+
+static bool ota_flash_write(void *ctx, uint32_t addr, const void *buf, uint32_t len)
+{
+    return esp_partition_write(ctx, addr, buf, len) == ESP_OK;
+}
+
+static bool ota_flash_erase(void *ctx, uint32_t addr, uint32_t len)
+{
+    return esp_partition_erase_range(ctx, addr, len) == ESP_OK;
+}
+
+static const spp_ota_flash_t SPP_OTA_FLASH = {
+    .read   = ota_flash_read,
+    .write  = ota_flash_write,
+    .erase  = ota_flash_erase,
+};
+
+static void ota_resume_load(void)
+{
+    nvs_handle handle;
+    size_t size = sizeof(spp_ota_resume_t);
+
+    memset(&ota_resume, 0, sizeof(spp_ota_resume_t));
+    if (nvs_open(SPP_OTA_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    if ((nvs_get_blob(handle, SPP_OTA_KEY, &ota_resume, &size) != ESP_OK) ||
+        (size != sizeof(spp_ota_resume_t))) {
+        memset(&ota_resume, 0, sizeof(spp_ota_resume_t));
+    }
+    nvs_close(handle);
+}
+
+static void ota_resume_save(void)
+{
+    nvs_handle handle;
+
+    if (nvs_open(SPP_OTA_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        SPP_LOGE("Failed to open NVS for OTA.");
+        return;
+    }
+    if ((nvs_set_blob(handle, SPP_OTA_KEY, &ota_resume, sizeof(spp_ota_resume_t)) != ESP_OK) ||
+        (nvs_commit(handle) != ESP_OK)) {
+        SPP_LOGE("Failed to save OTA offset.");
+    }
+    nvs_close(handle);
+}
+
+static void send_ota_status(void)
+{
+    spp_peer_t *peer = gatts_spp_find_peer(ota_conn_id);
+    uint8_t state = __atomic_load_n(&ota_state, __ATOMIC_RELAXED);
+    spp_ota_status_t status = {
+        .type = SPP_STATUS_OTA,
+        .state = state,
+        .offset = spp_ota_written(&spp_ota),
+        .granted = (state == SPP_OTA_STATE_RECEIVING) ?
+                   spp_ota_granted(&spp_ota) : spp_ota_written(&spp_ota),
+    };
+
+    if ((peer == NULL) || !peer->is_status_enabled) {
+        return;
+    }
+    esp_ble_gatts_send_indicate(gatts_spp_status()->gatts_if, ota_conn_id,
+                                gatts_handle(SPP_IDX_SPP_STATUS_VAL),
+                                sizeof(status), (uint8_t *)&status, false);
+}
+
+// Keep the offset written for the next SPP_CMD_OTA_BEGIN. Called with
+// ota_lock held.
+static void ota_stop(spp_ota_state_t state)
+{
+    __atomic_store_n(&ota_state, state, __ATOMIC_RELEASE);
+    if (ota_resume.offset != spp_ota_written(&spp_ota)) {
+        ota_resume.offset = spp_ota_written(&spp_ota);
+        ota_resume_save();
+    }
+    send_ota_status();
+}
+
+// Drop the image and its offset. Called with ota_lock held.
+static void ota_drop(spp_ota_state_t state)
+{
+    __atomic_store_n(&ota_state, state, __ATOMIC_RELEASE);
+    memset(&ota_resume, 0, sizeof(spp_ota_resume_t));
+    ota_resume_save();
+}
+
+bool handle_ota_data(uint16_t conn_id, uint32_t chan, uint8_t *str, uint32_t len, bool is_prep)
+{
+    uint8_t state = __atomic_load_n(&ota_state, __ATOMIC_ACQUIRE);
+
+    if ((chan != 0) || (conn_id != ota_conn_id) ||
+        ((state != SPP_OTA_STATE_RECEIVING) && (state != SPP_OTA_STATE_ERROR))) {
+        return false;
+    }
+    // NOTE: After an error the rest of the image is dropped here, so that it
+    // never reaches the UART.
+    if (state == SPP_OTA_STATE_ERROR) {
+        return true;
+    }
+    // NOTE: A prepared write has no place in the stream until it is
+    // executed, and the execute carries no data here. The image stops, and
+    // SPP_CMD_OTA_BEGIN resumes it from the last block written.
+    if (is_prep) {
+        SPP_LOGW("OTA data in a prepared write.");
+        spp_ota_fail(&spp_ota);
+        xTaskNotify(task_handle[SPP_TASK_OTA], SPP_OTA_NOTIFY_DATA, eSetBits);
+        return true;
+    }
+    spp_pm_activity(false);
+    if (spp_ota_receive(&spp_ota, str, len) != len) {
+        SPP_LOGW("OTA data beyond the grant.");
+        xTaskNotify(task_handle[SPP_TASK_OTA], SPP_OTA_NOTIFY_DATA, eSetBits);
+    } else if (spp_ota_pending(&spp_ota)) {
+        xTaskNotify(task_handle[SPP_TASK_OTA], SPP_OTA_NOTIFY_DATA, eSetBits);
+    }
+    return true;
+}
+
+void handle_ota_disconnect(uint16_t conn_id)
+{
+    uint8_t state = __atomic_load_n(&ota_state, __ATOMIC_RELAXED);
+
+    if ((conn_id == ota_conn_id) &&
+        ((state == SPP_OTA_STATE_RECEIVING) || (state == SPP_OTA_STATE_ERROR))) {
+        xTaskNotify(task_handle[SPP_TASK_OTA], SPP_OTA_NOTIFY_STOP, eSetBits);
+    }
+}
+
+// Write the full blocks into the flash, off the GATT callback.
+void ota_task(void * arg)
+{
+    while (1) {
+        uint32_t notify = 0;
+
+        xTaskNotifyWait(0, UINT32_MAX, &notify, portMAX_DELAY);
+
+        if ((notify & SPP_OTA_NOTIFY_RESTART) != 0) {
+            vTaskDelay(SPP_OTA_RESTART_DELAY_MS / portTICK_PERIOD_MS);
+            esp_restart();
+        }
+        xSemaphoreTake(ota_lock, portMAX_DELAY);
+        if (__atomic_load_n(&ota_state, __ATOMIC_RELAXED) == SPP_OTA_STATE_RECEIVING) {
+            uint32_t last = spp_ota_written(&spp_ota);
+
+            if (!spp_ota_process(&spp_ota)) {
+                SPP_LOGE("OTA stopped at %u.", spp_ota_written(&spp_ota));
+                ota_stop(SPP_OTA_STATE_ERROR);
+            } else if (spp_ota_written(&spp_ota) != last) {
+                if ((spp_ota_written(&spp_ota) / SPP_OTA_SAVE_SIZE) != (last / SPP_OTA_SAVE_SIZE)) {
+                    ota_resume.offset = spp_ota_written(&spp_ota);
+                    ota_resume_save();
+                }
+                send_ota_status();
+            }
+        }
+        if ((notify & SPP_OTA_NOTIFY_STOP) != 0) {
+            uint8_t state = __atomic_load_n(&ota_state, __ATOMIC_RELAXED);
+
+            if ((state == SPP_OTA_STATE_RECEIVING) || (state == SPP_OTA_STATE_ERROR)) {
+                ota_stop(SPP_OTA_STATE_IDLE);
+            }
+        }
+        xSemaphoreGive(ota_lock);
+    }
+    vTaskDelete(NULL);
+}
+
+static void ota_init(void)
+{
+    ota_lock = xSemaphoreCreateMutex();
+    if (ota_lock == NULL) {
+        SPP_LOGE("Failed to create OTA lock.");
+    }
+    spp_ota_init(&spp_ota, &SPP_OTA_FLASH);
+    ota_resume_load();
+}
+#else
+bool handle_ota_data(uint16_t conn_id, uint32_t chan, uint8_t *str, uint32_t len, bool is_prep)
 {
-    uart_write_bytes(UART_NUM, (char *)str, len);
+    return false;
 }
 
-static void uart_read(uint8_t *buf, uint32_t len)
+void handle_ota_disconnect(uint16_t conn_id)
 {
-    uart_read_bytes(UART_NUM, buf, len, portMAX_DELAY);
 }
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
-// UART handler: Local to Remote
-// Read UART data and send it to remote via BLE.
-void handle_uart_local_data(uint8_t *str, uint32_t len)
+// Command handler
+// The GATT callback copies a command into a slot of cmd_queue, and
+// command_task runs the handler registered for its id. Every command is
+// answered with an SPP_STATUS_RESPONSE record on the status characteristic,
+// if the connection enabled the status notification.
+
+typedef struct spp_cmd_entry {
+    uint8_t id;
+    uint8_t arg_len;
+    spp_cmd_result_t (*handler)(spp_cmd_slot_t *cmd);
+} spp_cmd_entry_t;
+
+// NOTE: The channel which the UART commands apply to, see SPP_CMD_CHANNEL.
+static spp_chan_t *cmd_chan = &(spp_chan[0]);
+
+static uint16_t get_le16(const uint8_t *str)
 {
-    uint8_t *buf;
-    uint32_t mtu_size = gatts_spp_status()->mtu_size;
+    return str[0] | (str[1] << 8);
+}
 
-    if (len <= (mtu_size - 3)) {
-        esp_ble_gatts_send_indicate(gatts_spp_status()->gatts_if,
-                                    gatts_spp_status()->connection_id,
-                                    gatts_handle(SPP_IDX_SPP_DATA_NOTIFY_VAL),
-                                    len,
-                                    str,
-                                    false);
-    } else {
-        uint32_t current_num = 0;
-        uint32_t max_data_size = mtu_size - 3;
-        uint32_t total_num = (len - 1) / max_data_size + 1;
+static void send_cmd_response(uint16_t conn_id, uint8_t id, spp_cmd_result_t result)
+{
+    spp_peer_t *peer = gatts_spp_find_peer(conn_id);
+    spp_response_t response = {
+        .type = SPP_STATUS_RESPONSE,
+        .id = id,
+        .result = result,
+    };
 
-        buf = (uint8_t *)malloc(max_data_size*sizeof(uint8_t));
-        if (buf == NULL) {
-            ESP_LOGE(TAG_SPP, "Failed to malloc at %s.", __func__);
-            return;
-        }
+    if ((peer == NULL) || !peer->is_status_enabled) {
+        return;
+    }
+    esp_ble_gatts_send_indicate(gatts_spp_status()->gatts_if, conn_id,
+                                gatts_handle(SPP_IDX_SPP_STATUS_VAL),
+                                sizeof(response), (uint8_t *)&response, false);
+}
 
-        while (current_num < total_num) {
-            uint32_t data_size;
+static spp_cmd_result_t cmd_tx_mode(spp_cmd_slot_t *cmd)
+{
+    set_tx_mode((cmd->arg[0] == SPP_TX_MODE_THROUGHPUT) ?
+                SPP_TX_MODE_THROUGHPUT : SPP_TX_MODE_LATENCY,
+                cmd->arg[1]);
+    spp_config_save(&spp_config);
 
-            if (current_num == (total_num - 1)) {
-                data_size = len % max_data_size;
-            } else {
-                data_size = max_data_size;
-            }
-            memcpy(buf, str, data_size);
+    return SPP_CMD_OK;
+}
 
-            esp_ble_gatts_send_indicate(gatts_spp_status()->gatts_if,
-                                        gatts_spp_status()->connection_id,
-                                        gatts_handle(SPP_IDX_SPP_DATA_NOTIFY_VAL),
-                                        data_size,
-                                        buf, false);
+static spp_cmd_result_t cmd_uart_baud(spp_cmd_slot_t *cmd)
+{
+    if (!set_uart_baud(cmd_chan, get_le32(cmd->arg))) {
+        SPP_LOGE("Failed to set baud rate.");
+        return SPP_CMD_ERR_ARG;
+    }
+    spp_config_save(&spp_config);
+
+    return SPP_CMD_OK;
+}
+
+static spp_cmd_result_t cmd_uart_flow(spp_cmd_slot_t *cmd)
+{
+    if (!set_uart_flow(cmd_chan, cmd->arg[0] != 0)) {
+        SPP_LOGE("Failed to set flow control.");
+        return SPP_CMD_ERR_FAIL;
+    }
+    spp_config_save(&spp_config);
+
+    return SPP_CMD_OK;
+}
+
+static spp_cmd_result_t cmd_uart_buf(spp_cmd_slot_t *cmd)
+{
+    if (!set_uart_buf(cmd_chan, get_le32(cmd->arg), get_le32(cmd->arg + 4))) {
+        SPP_LOGE("Failed to set buffer size.");
+        return SPP_CMD_ERR_ARG;
+    }
+    spp_config_save(&spp_config);
+
+    return SPP_CMD_OK;
+}
+
+static spp_cmd_result_t cmd_status_period(spp_cmd_slot_t *cmd)
+{
+    spp_config.status_period = get_le16(cmd->arg);
+    xTaskNotifyGive(task_handle[SPP_TASK_STATUS]);
+    spp_config_save(&spp_config);
+
+    return SPP_CMD_OK;
+}
+
+static spp_cmd_result_t cmd_channel(spp_cmd_slot_t *cmd)
+{
+    if (cmd->arg[0] >= SPP_CHAN_NUM) {
+        SPP_LOGE("Failed to select channel.");
+        return SPP_CMD_ERR_ARG;
+    }
+    cmd_chan = &(spp_chan[cmd->arg[0]]);
+
+    return SPP_CMD_OK;
+}
+
+static spp_cmd_result_t cmd_compress(spp_cmd_slot_t *cmd)
+{
+    spp_peer_t *peer = gatts_spp_find_peer(cmd->conn_id);
+
+    if (peer == NULL) {
+        return SPP_CMD_ERR_FAIL;
+    }
+    peer->is_compressed = (cmd->arg[0] != 0);
+
+    return SPP_CMD_OK;
+}
+
+static spp_cmd_result_t cmd_framing(spp_cmd_slot_t *cmd)
+{
+    spp_peer_t *peer = gatts_spp_find_peer(cmd->conn_id);
+
+    if (peer == NULL) {
+        return SPP_CMD_ERR_FAIL;
+    }
+    peer->is_framed = (cmd->arg[0] != 0);
+
+    return SPP_CMD_OK;
+}
+
+static spp_cmd_result_t cmd_uart_delim(spp_cmd_slot_t *cmd)
+{
+    if (!set_uart_delim(cmd_chan, cmd->arg[0] != 0, cmd->arg[1])) {
+        SPP_LOGE("Failed to set delimiter.");
+        return SPP_CMD_ERR_FAIL;
+    }
+    spp_config_save(&spp_config);
 
-            vTaskDelay(20 / portTICK_PERIOD_MS);
-            current_num++;
-            str += max_data_size;
+    return SPP_CMD_OK;
+}
+
+#ifdef CONFIG_SPP_TRACE
+// Dump the trace, oldest event first. The trace points are stopped meanwhile.
+static spp_cmd_result_t cmd_trace(spp_cmd_slot_t *cmd)
+{
+    spp_peer_t *peer = gatts_spp_find_peer(cmd->conn_id);
+    uint8_t record[SPP_STATUS_MAX_LEN];
+    spp_trace_dump_t *dump = (spp_trace_dump_t *)record;
+    spp_trace_event_t *events = (spp_trace_event_t *)(record + sizeof(spp_trace_dump_t));
+    uint32_t first;
+    uint32_t count;
+    uint32_t record_events;
+
+    if (cmd->arg[0] != SPP_TRACE_SINK_STATUS) {
+        return SPP_CMD_ERR_ARG;
+    }
+    if ((peer == NULL) || !peer->is_status_enabled) {
+        return SPP_CMD_ERR_FAIL;
+    }
+    spp_trace_freeze(true);
+    count = spp_trace_snapshot(&first);
+
+    record_events = (((uint32_t)(peer->mtu_size - 3) < SPP_STATUS_MAX_LEN) ?
+                     (uint32_t)(peer->mtu_size - 3) : SPP_STATUS_MAX_LEN);
+    record_events = (record_events - sizeof(spp_trace_dump_t)) / sizeof(spp_trace_event_t);
+    dump->type = SPP_STATUS_TRACE;
+    dump->seq = 0;
+    do {
+        dump->count = (count < record_events) ? count : record_events;
+        for (uint32_t i = 0; i < dump->count; i++) {
+            spp_trace_get(first++, &(events[i]));
         }
-        free(buf);
+        count -= dump->count;
+        esp_ble_gatts_send_indicate(gatts_spp_status()->gatts_if, cmd->conn_id,
+                                    gatts_handle(SPP_IDX_SPP_STATUS_VAL),
+                                    sizeof(spp_trace_dump_t) + dump->count * sizeof(spp_trace_event_t),
+                                    record, false);
+        dump->seq++;
+        vTaskDelay(SPP_TRACE_DUMP_DELAY_MS / portTICK_PERIOD_MS);
+    } while (dump->count != 0);
+    spp_trace_freeze(false);
+
+    return SPP_CMD_OK;
+}
+#endif
+
+#ifdef CONFIG_SPP_OTA
+// Start the image into the next OTA partition, or continue the same image
+// where it stopped. The first SPP_STATUS_OTA record tells the offset to send
+// from.
+// NOTE: Only a link paired with the passkey may write the firmware. On any
+// other link the server asks the central to pair with it, and the central
+// sends the command again once the pairing completed.
+static spp_cmd_result_t cmd_ota_begin(spp_cmd_slot_t *cmd)
+{
+    spp_peer_t *peer = gatts_spp_find_peer(cmd->conn_id);
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    uint32_t size = get_le32(cmd->arg);
+    uint32_t offset = 0;
+
+    // NOTE: The grants go out on the status characteristic.
+    if ((peer == NULL) || !peer->is_status_enabled || (partition == NULL)) {
+        return SPP_CMD_ERR_FAIL;
+    }
+    if (!peer->is_authenticated) {
+        esp_ble_set_encryption(peer->remote_bda, ESP_BLE_SEC_ENCRYPT_MITM);
+        return SPP_CMD_ERR_AUTH;
+    }
+    if ((size == 0) || (size > partition->size)) {
+        return SPP_CMD_ERR_ARG;
+    }
+    // NOTE: After SPP_CMD_OTA_END the partition holds the image to boot, so
+    // a new image waits for the restart or SPP_CMD_OTA_ABORT.
+    xSemaphoreTake(ota_lock, portMAX_DELAY);
+    if ((__atomic_load_n(&ota_state, __ATOMIC_RELAXED) == SPP_OTA_STATE_RECEIVING) ||
+        (__atomic_load_n(&ota_state, __ATOMIC_RELAXED) == SPP_OTA_STATE_DONE)) {
+        xSemaphoreGive(ota_lock);
+        return SPP_CMD_ERR_BUSY;
+    }
+    if ((ota_resume.addr == partition->address) && (ota_resume.size == size) &&
+        (memcmp(ota_resume.id, cmd->arg + 4, SPP_OTA_ID_LEN) == 0)) {
+        offset = ota_resume.offset;
     }
+    if (!spp_ota_start(&spp_ota, (void *)partition, partition->size, size, offset)) {
+        SPP_LOGE("Failed to start OTA at %u.", offset);
+        ota_drop(SPP_OTA_STATE_IDLE);
+        xSemaphoreGive(ota_lock);
+        return SPP_CMD_ERR_FAIL;
+    }
+    ota_partition = partition;
+    ota_resume.addr = partition->address;
+    ota_resume.size = size;
+    memcpy(ota_resume.id, cmd->arg + 4, SPP_OTA_ID_LEN);
+    ota_resume.offset = offset;
+    ota_resume_save();
+    ota_conn_id = cmd->conn_id;
+    __atomic_store_n(&ota_state, SPP_OTA_STATE_RECEIVING, __ATOMIC_RELEASE);
+    send_ota_status();
+    xSemaphoreGive(ota_lock);
+    SPP_LOGI("OTA of %u bytes from %u.", size, offset);
+
+    return SPP_CMD_OK;
 }
 
-void uart_task(void * arg)
+// The image must be complete and match its id. esp_ota_set_boot_partition()
+// then checks the image itself before it is selected.
+static spp_cmd_result_t cmd_ota_end(spp_cmd_slot_t *cmd)
 {
-    static QueueHandle_t uart_queue = NULL;
-    uart_event_t event;
+    uint8_t digest[SPP_OTA_DIGEST_LEN];
+    spp_cmd_result_t result = SPP_CMD_OK;
 
-    uart_driver_install(UART_NUM, 4096, 8192, 10,&uart_queue,0);
+    xSemaphoreTake(ota_lock, portMAX_DELAY);
+    if ((__atomic_load_n(&ota_state, __ATOMIC_RELAXED) != SPP_OTA_STATE_RECEIVING) ||
+        (cmd->conn_id != ota_conn_id)) {
+        result = SPP_CMD_ERR_FAIL;
+    } else if (!spp_ota_process(&spp_ota)) {
+        ota_stop(SPP_OTA_STATE_ERROR);
+        result = SPP_CMD_ERR_FAIL;
+    } else if (!spp_ota_finish(&spp_ota, digest)) {
+        SPP_LOGE("OTA image is incomplete.");
+        result = SPP_CMD_ERR_LEN;
+    } else if (memcmp(digest, ota_resume.id, SPP_OTA_ID_LEN) != 0) {
+        SPP_LOGE("OTA image does not match its id.");
+        ota_drop(SPP_OTA_STATE_IDLE);
+        result = SPP_CMD_ERR_ARG;
+    } else if (esp_ota_set_boot_partition(ota_partition) != ESP_OK) {
+        SPP_LOGE("OTA image is not valid.");
+        ota_drop(SPP_OTA_STATE_IDLE);
+        result = SPP_CMD_ERR_FAIL;
+    } else {
+        ota_drop(SPP_OTA_STATE_DONE);
+    }
+    send_ota_status();
+    xSemaphoreGive(ota_lock);
 
-    while (1) {
-        uint8_t *buf;
-        uint32_t len;
+    if ((result == SPP_CMD_OK) && (cmd->arg[0] != 0)) {
+        xTaskNotify(task_handle[SPP_TASK_OTA], SPP_OTA_NOTIFY_RESTART, eSetBits);
+    }
+    return result;
+}
+
+// NOTE: After SPP_CMD_OTA_END, the running firmware is selected again.
+static spp_cmd_result_t cmd_ota_abort(spp_cmd_slot_t *cmd)
+{
+    spp_peer_t *peer = gatts_spp_find_peer(cmd->conn_id);
+    spp_cmd_result_t result = SPP_CMD_OK;
+
+    if ((peer == NULL) || !peer->is_authenticated) {
+        return SPP_CMD_ERR_AUTH;
+    }
+    xSemaphoreTake(ota_lock, portMAX_DELAY);
+    if ((__atomic_load_n(&ota_state, __ATOMIC_RELAXED) == SPP_OTA_STATE_DONE) &&
+        (esp_ota_set_boot_partition(esp_ota_get_running_partition()) != ESP_OK)) {
+        result = SPP_CMD_ERR_FAIL;
+    }
+    ota_drop(SPP_OTA_STATE_IDLE);
+    send_ota_status();
+    xSemaphoreGive(ota_lock);
 
-        if (xQueueReceive(uart_queue, (void * )&event, (portTickType)portMAX_DELAY) == pdFALSE) {
+    return result;
+}
+#endif
+
+// arg_len is the least number of argument bytes after the id.
+static const spp_cmd_entry_t SPP_CMD_TABLE[] = {
+    { SPP_CMD_TX_MODE,          2,  cmd_tx_mode },
+    { SPP_CMD_UART_BAUD,        4,  cmd_uart_baud },
+    { SPP_CMD_UART_FLOW,        1,  cmd_uart_flow },
+    { SPP_CMD_UART_BUF,         8,  cmd_uart_buf },
+    { SPP_CMD_STATUS_PERIOD,    2,  cmd_status_period },
+    { SPP_CMD_CHANNEL,          1,  cmd_channel },
+    { SPP_CMD_COMPRESS,         1,  cmd_compress },
+    { SPP_CMD_FRAMING,          1,  cmd_framing },
+    { SPP_CMD_UART_DELIM,       2,  cmd_uart_delim },
+#ifdef CONFIG_SPP_TRACE
+    { SPP_CMD_TRACE,            1,  cmd_trace },
+#endif
+#ifdef CONFIG_SPP_OTA
+    { SPP_CMD_OTA_BEGIN,        12, cmd_ota_begin },
+    { SPP_CMD_OTA_END,          1,  cmd_ota_end },
+    { SPP_CMD_OTA_ABORT,        0,  cmd_ota_abort },
+#endif
+};
+
+static spp_cmd_result_t run_command(spp_cmd_slot_t *cmd)
+{
+    for (uint32_t i = 0; i < (sizeof(SPP_CMD_TABLE) / sizeof(SPP_CMD_TABLE[0])); i++) {
+        const spp_cmd_entry_t *entry = &(SPP_CMD_TABLE[i]);
+
+        if (entry->id != cmd->id) {
             continue;
         }
-        if ((event.type != UART_DATA) || (event.size == 0)) {
-            continue;
+        if (cmd->arg_len < entry->arg_len) {
+            return SPP_CMD_ERR_LEN;
         }
+        return entry->handler(cmd);
+    }
+    SPP_LOGW("Unknown command 0x%02x.", cmd->id);
+    return SPP_CMD_ERR_UNKNOWN;
+}
 
-        len = event.size;
-        buf = (uint8_t *)malloc(sizeof(uint8_t)*len);
-        if (buf == NULL) {
-            ESP_LOGE(TAG_SPP, "Failed to malloc at %s.", __func__);
-            break;
-        }
-        memset(buf, 0x00, len);
-        uart_read(buf, len);
+// Leave the ACK or NAK of a frame to the sender task, which owns the window.
+// NOTE: This runs in the BTC task, so that the window moves on without
+// waiting for the command task.
+static void handle_frame_ack(uint16_t conn_id, uint8_t *str, uint32_t len)
+{
+    spp_peer_t *peer = gatts_spp_find_peer(conn_id);
+    spp_peer_chan_t *peer_chan;
+    uint16_t seq;
 
-        do {
-            if (!gatts_spp_status()->is_connected) {
-                ESP_LOGI(TAG_SPP, "BLE is NOT connected.");
-                break;
-            }
-            if (!gatts_spp_status()->is_notify_enabled) {
-                ESP_LOGI(TAG_SPP, "Data Notify is NOT enabled.");
-                break;
-            }
-            handle_uart_local_data(buf, len);
-        } while (0);
-        free(buf);
+    if ((len < 4) || (peer == NULL) || (str[1] >= SPP_CHAN_NUM)) {
+        return;
+    }
+    peer_chan = &(peer->chan[str[1]]);
+    seq = get_le16(str + 2);
+
+    if (str[0] == SPP_CMD_ACK) {
+        __atomic_store_n(&(peer_chan->ack_seq), (uint16_t)(seq + 1), __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_or(&(peer_chan->nak_mask), 1 << (seq % SPP_RTX_WINDOW), __ATOMIC_RELAXED);
+    }
+    xTaskNotify(task_handle[SPP_TASK_BLE_TX], SPP_TX_NOTIFY_FLOW, eSetBits);
+}
+
+// NOTE: The BTC task never waits here, a command which finds no free slot
+// is answered with SPP_CMD_ERR_BUSY.
+void handle_command(uint16_t conn_id, uint8_t *str, uint32_t len)
+{
+    spp_cmd_slot_t cmd;
+
+    if (len == 0) {
+        return;
+    }
+    if ((str[0] == SPP_CMD_ACK) || (str[0] == SPP_CMD_NAK)) {
+        handle_frame_ack(conn_id, str, len);
+        return;
+    }
+    if (len > (sizeof(cmd.arg) + 1)) {
+        send_cmd_response(conn_id, str[0], SPP_CMD_ERR_LEN);
+        return;
+    }
+    cmd.conn_id = conn_id;
+    cmd.id = str[0];
+    cmd.arg_len = len - 1;
+    memcpy(cmd.arg, str + 1, cmd.arg_len);
+
+    if (xQueueSend(cmd_queue, &cmd, 0) != pdTRUE) {
+        send_cmd_response(conn_id, cmd.id, SPP_CMD_ERR_BUSY);
+    }
+}
+
+void command_task(void * arg)
+{
+    spp_cmd_slot_t cmd;
+
+    while (1) {
+        if (xQueueReceive(cmd_queue, &cmd, portMAX_DELAY) == pdFALSE) {
+            continue;
+        }
+        send_cmd_response(cmd.conn_id, cmd.id, run_command(&cmd));
     }
     vTaskDelete(NULL);
 }
 
+// NOTE: The queue exists before the BLE stack starts, so the first write
+// never finds it missing.
+static void command_init(void)
+{
+    cmd_queue = xQueueCreate(SPP_CMD_QUEUE_DEPTH, sizeof(spp_cmd_slot_t));
+    if (cmd_queue == NULL) {
+        SPP_LOGE("Failed to create command queue.");
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
-// UART handler: Remote to Local
-// Receive UART data via BLE and write data.
-void handle_uart_remote_data(uint8_t *str, uint32_t len)
+// Store and forward
+// The log partition is split evenly between the channels, see spp_log.h.
+static bool log_flash_read(void *ctx, uint32_t addr, void *buf, uint32_t len)
 {
-    uart_write(str, len);
+    return esp_partition_read(ctx, addr, buf, len) == ESP_OK;
 }
 
-void handle_uart_remote_data_prep(uint8_t *str, uint32_t len)
+static bool log_flash_write(void *ctx, uint32_t addr, const void *buf, uint32_t len)
 {
-    str_buf_store(str, len);
+    return esp_partition_write(ctx, addr, buf, len) == ESP_OK;
 }
 
-void handle_uart_remote_data_exec()
+static bool log_flash_erase(void *ctx, uint32_t addr)
 {
-    str_buf_iter(uart_write);
-    str_buf_clear();
+    return esp_partition_erase_range(ctx, addr, SPP_LOG_SECTOR_SIZE) == ESP_OK;
+}
+
+static const spp_log_flash_t SPP_LOG_FLASH = {
+    .read   = log_flash_read,
+    .write  = log_flash_write,
+    .erase  = log_flash_erase,
+};
+
+static void store_init(void)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                ESP_PARTITION_SUBTYPE_ANY,
+                                                                SPP_STORE_PARTITION);
+    uint32_t size;
 
+    if (partition == NULL) {
+        SPP_LOGW("No log partition, storing in RAM only.");
+        return;
+    }
+    size = (partition->size / SPP_CHAN_NUM) & ~(SPP_LOG_SECTOR_SIZE - 1);
+    for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+        if (!spp_log_init(&(spp_chan[i].log), &SPP_LOG_FLASH, (void *)partition,
+                          i * size, size)) {
+            SPP_LOGE("Failed to init log of channel %d.", i);
+        }
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Command handler
-void handle_command(uint8_t *str, uint32_t len)
-{
-    uint8_t *spp_cmd_buff;
+// Status
+_Static_assert(sizeof(spp_telemetry_t) <= SPP_STATUS_MAX_LEN,
+               "spp_telemetry_t does not fit SPP_STATUS_MAX_LEN");
+_Static_assert((sizeof(spp_response_t) <= SPP_STATUS_MAX_LEN) &&
+               (sizeof(spp_ota_status_t) <= SPP_STATUS_MAX_LEN) &&
+               (sizeof(spp_credit_t) <= SPP_STATUS_MAX_LEN),
+               "a status record does not fit SPP_STATUS_MAX_LEN");
 
-    spp_cmd_buff = (uint8_t *)malloc(sizeof(uint8_t)*(len));
+uint32_t make_telemetry(spp_telemetry_t *telemetry, uint16_t mtu_size)
+{
+    telemetry->type = SPP_STATUS_TELEMETRY;
+    telemetry->tx_bytes = SPP_STATS_GET(tx_bytes);
+    telemetry->tx_packets = SPP_STATS_GET(tx_packets);
+    telemetry->rx_bytes = SPP_STATS_GET(rx_bytes);
+    telemetry->rx_packets = SPP_STATS_GET(rx_packets);
+    telemetry->uart_overflow = SPP_STATS_GET(uart_overflow);
+    telemetry->ring_overflow = 0;
+    telemetry->congest = SPP_STATS_GET(congest);
+    telemetry->mtu_size = mtu_size;
+    telemetry->ring_high_water = 0;
+    telemetry->heap_free = esp_get_free_heap_size();
+    telemetry->heap_min_free = esp_get_minimum_free_heap_size();
+    telemetry->rx_drop = SPP_STATS_GET(rx_drop);
+    telemetry->tx_retransmit = SPP_STATS_GET(tx_retransmit);
+    telemetry->tx_rounds = SPP_STATS_GET(tx_rounds);
+    telemetry->tx_cycles = SPP_STATS_GET(tx_cycles);
+    telemetry->tx_cycles_max = SPP_STATS_GET(tx_cycles_max);
+    telemetry->uart_wakeups = SPP_STATS_GET(uart_wakeups);
+    telemetry->uart_rx_bytes = SPP_STATS_GET(uart_rx_bytes);
+    telemetry->uptime_ms = esp_timer_get_time() / 1000;
+    telemetry->pm_bursts = SPP_STATS_GET(pm_bursts);
+    telemetry->pm_active_ms = SPP_STATS_GET(pm_active_ms);
+    telemetry->pm_first_tx_us = spp_pm_first_tx_us();
+    telemetry->pm_first_tx_us_max = SPP_STATS_GET(pm_first_tx_us_max);
+    telemetry->boot_adv_ms = SPP_STATS_GET(boot_adv_ms);
+    telemetry->reconnect_count = SPP_STATS_GET(reconnect_count);
+    telemetry->reconnect_ms = SPP_STATS_GET(reconnect_ms);
+    telemetry->reconnect_ms_max = SPP_STATS_GET(reconnect_ms_max);
+    telemetry->store_bytes = 0;
+    telemetry->store_drop = 0;
+#ifdef CONFIG_SPP_DLOG
+    telemetry->log_drop = spp_dlog_dropped();
+#else
+    telemetry->log_drop = 0;
+#endif
+    telemetry->rx_queue_used = 0;
 
-    if(spp_cmd_buff == NULL){
-        ESP_LOGE(TAG_SPP, "Failed to malloc at %s.", __func__);
-        return;
+    // NOTE: The rings of all the channels are summed up, except the high
+    // water mark which is the highest one.
+    for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+        telemetry->ring_overflow += spp_chan[i].ring.overflow;
+        if (spp_chan[i].ring.high_water > telemetry->ring_high_water) {
+            telemetry->ring_high_water = spp_chan[i].ring.high_water;
+        }
+        telemetry->rx_queue_used += byte_ring_used(&(spp_chan[i].rx_ring));
+        telemetry->store_drop += spp_chan[i].log.dropped;
+        telemetry->store_bytes += spp_log_used(&(spp_chan[i].log));
+        if (spp_chan[i].is_storing) {
+            telemetry->store_bytes += byte_ring_used(&(spp_chan[i].ring));
+        }
     }
-    memcpy(spp_cmd_buff, str, len);
-    spp_cmd_buff[len-1] = '\0'; // NOTE: a measures if there is a bug on client
 
-    xQueueSend(cmd_queue, &spp_cmd_buff, 10/portTICK_PERIOD_MS);
+    for (uint32_t i = 0; i < SPP_TASK_NB; i++) {
+        telemetry->stack_free[i] = (task_handle[i] != NULL) ?
+            uxTaskGetStackHighWaterMark(task_handle[i]) : 0;
+    }
+    return sizeof(spp_telemetry_t);
 }
 
-void command_task(void * arg)
+// Push the telemetry to the peers which enabled the status notification.
+// NOTE: A notification is cut to the MTU of the peer, a peer with the
+// default MTU gets the rest by reading the characteristic.
+void status_task(void * arg)
 {
-    uint8_t * cmd_id;
-    cmd_queue = xQueueCreate(10, sizeof(uint32_t));
+    spp_telemetry_t telemetry;
 
     while (1) {
-        vTaskDelay(50 / portTICK_PERIOD_MS);
-        if (xQueueReceive(cmd_queue, &cmd_id, portMAX_DELAY) == pdFALSE) {
+        if (spp_config.status_period == 0) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
             continue;
         }
-        esp_log_buffer_char(TAG_SPP,(char *)(cmd_id),strlen((char *)cmd_id));
-        free(cmd_id);
+        if (ulTaskNotifyTake(pdTRUE, (spp_config.status_period + portTICK_PERIOD_MS - 1) /
+                             portTICK_PERIOD_MS) != 0) {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+            spp_peer_t *peer = gatts_spp_peer(i);
+            uint32_t len;
+
+            if (!peer->in_use || !peer->is_status_enabled) {
+                continue;
+            }
+            len = make_telemetry(&telemetry, peer->mtu_size);
+            if (len > (uint32_t)(peer->mtu_size - 3)) {
+                len = peer->mtu_size - 3;
+            }
+            esp_ble_gatts_send_indicate(gatts_spp_status()->gatts_if,
+                                        peer->connection_id,
+                                        gatts_handle(SPP_IDX_SPP_STATUS_VAL),
+                                        len, (uint8_t *)&telemetry, false);
+        }
     }
     vTaskDelete(NULL);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Initializer
-static void uart_init(void)
+// Deferred log
+// dlog_task drains the entries of spp_dlog.h every SPP_DLOG_DRAIN_MS into
+// the sink, so the data UART never carries a log line of the forwarding path.
+#ifdef CONFIG_SPP_DLOG
+#if defined(CONFIG_SPP_DLOG_SINK_UART) || defined(CONFIG_SPP_DLOG_SINK_HOST)
+#if CONFIG_SPP_DLOG_UART_NUM < SPP_CHAN_NUM
+#error "CONFIG_SPP_DLOG_UART_NUM is bridged as a channel, lower CONFIG_SPP_CHAN_NUM."
+#endif
+
+static void dlog_sink_init(void)
 {
     uart_config_t uart_config = {
-        .baud_rate = 115200,
+        .baud_rate = CONFIG_SPP_DLOG_UART_BAUD,
         .data_bits = UART_DATA_8_BITS,
         .parity = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
     };
 
-    uart_param_config(UART_NUM, &uart_config);
-    uart_set_pin(UART_NUM,
-                 UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE,
-                 UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    uart_param_config(CONFIG_SPP_DLOG_UART_NUM, &uart_config);
+    uart_set_pin(CONFIG_SPP_DLOG_UART_NUM, CONFIG_SPP_DLOG_UART_TX_PIN,
+                 UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    uart_driver_install(CONFIG_SPP_DLOG_UART_NUM, SPP_UART_BUF_SIZE_MIN,
+                        SPP_UART_BUF_SIZE_MIN, 0, NULL, 0);
+}
+#else
+static void dlog_sink_init(void)
+{
+}
+#endif
+
+#if defined(CONFIG_SPP_DLOG_SINK_UART)
+// Format the entries like ESP_LOGx does.
+// NOTE: The arguments are passed as they were stored, see spp_dlog.h.
+static void dlog_drain(void)
+{
+    static const char LEVEL_CHAR[] = "NEWIDV";
+    char line[SPP_DLOG_LINE_MAX];
+    spp_dlog_entry_t entry;
+    uint32_t len;
+
+    while (spp_dlog_read(&entry)) {
+        len = snprintf(line, sizeof(line), "%c (%u) %s: ",
+                       LEVEL_CHAR[entry.level % (sizeof(LEVEL_CHAR) - 1)],
+                       entry.ticks * portTICK_PERIOD_MS, TAG_SPP);
+        len += snprintf(line + len, sizeof(line) - len, (const char *)(uintptr_t)entry.fmt,
+                        entry.arg[0], entry.arg[1], entry.arg[2]);
+        if ((entry.suppressed != 0) && (len < sizeof(line))) {
+            len += snprintf(line + len, sizeof(line) - len, " (%d muted)", entry.suppressed);
+        }
+        if (len > (sizeof(line) - 2)) {
+            len = sizeof(line) - 2;
+        }
+        line[len++] = '\n';
+        uart_write_bytes(CONFIG_SPP_DLOG_UART_NUM, line, len);
+    }
+}
+#elif defined(CONFIG_SPP_DLOG_SINK_HOST)
+// Send the raw entries after a sync word, for tools/spp_dlog.py.
+static void dlog_drain(void)
+{
+    static const char SYNC[] = { 0x55, 0xAA };
+    spp_dlog_entry_t entry;
+
+    while (spp_dlog_read(&entry)) {
+        uart_write_bytes(CONFIG_SPP_DLOG_UART_NUM, SYNC, sizeof(SYNC));
+        uart_write_bytes(CONFIG_SPP_DLOG_UART_NUM, (const char *)&entry, sizeof(entry));
+    }
+}
+#else
+// Send the raw entries in SPP_STATUS_LOG records, for tools/spp_dlog.py.
+// The entries wait in the ring until a peer enables the status notification.
+// NOTE: A peer whose MTU does not fit one entry gets no log.
+static void dlog_drain(void)
+{
+    uint8_t record[SPP_STATUS_MAX_LEN];
+    spp_log_record_t *header = (spp_log_record_t *)record;
+    spp_dlog_entry_t *entries = (spp_dlog_entry_t *)(record + sizeof(spp_log_record_t));
+    uint32_t min_size = sizeof(spp_log_record_t) + sizeof(spp_dlog_entry_t);
+    uint32_t record_size = sizeof(record);
+    uint32_t record_entries;
+
+    for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+        spp_peer_t *peer = gatts_spp_peer(i);
+
+        if (peer->in_use && peer->is_status_enabled &&
+            ((uint32_t)(peer->mtu_size - 3) >= min_size) &&
+            ((uint32_t)(peer->mtu_size - 3) < record_size)) {
+            record_size = peer->mtu_size - 3;
+        }
+    }
+    record_entries = (record_size - sizeof(spp_log_record_t)) / sizeof(spp_dlog_entry_t);
+    header->type = SPP_STATUS_LOG;
+
+    do {
+        bool is_sent = false;
+
+        for (uint32_t i = 0; i < SPP_PEER_MAX; i++) {
+            spp_peer_t *peer = gatts_spp_peer(i);
+
+            if (!peer->in_use || !peer->is_status_enabled ||
+                ((uint32_t)(peer->mtu_size - 3) < min_size)) {
+                continue;
+            }
+            if (!is_sent) {
+                for (header->count = 0; header->count < record_entries; header->count++) {
+                    if (!spp_dlog_read(&(entries[header->count]))) {
+                        break;
+                    }
+                }
+                if (header->count == 0) {
+                    return;
+                }
+                is_sent = true;
+            }
+            esp_ble_gatts_send_indicate(gatts_spp_status()->gatts_if, peer->connection_id,
+                                        gatts_handle(SPP_IDX_SPP_STATUS_VAL),
+                                        sizeof(spp_log_record_t) +
+                                        header->count * sizeof(spp_dlog_entry_t),
+                                        record, false);
+        }
+        if (!is_sent) {
+            return;
+        }
+    } while (header->count == record_entries);
+}
+#endif
+
+void dlog_task(void * arg)
+{
+    dlog_sink_init();
+
+    while (1) {
+        vTaskDelay(SPP_DLOG_DRAIN_MS / portTICK_PERIOD_MS);
+        dlog_drain();
+    }
+    vTaskDelete(NULL);
 }
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 // Command
+typedef struct spp_task_config {
+    const char *name;
+    uint32_t stack_size;
+    UBaseType_t priority;
+    int32_t core;
+} spp_task_config_t;
+
+// Task layout from Kconfig. By default the forwarding tasks run on core 1,
+// away from the BT controller and Bluedroid on core 0.
+#define SPP_TASK_CONFIG(func, key) { \
+    .name       = #func, \
+    .stack_size = CONFIG_SPP_##key##_TASK_STACK_SIZE, \
+    .priority   = CONFIG_SPP_##key##_TASK_PRIORITY, \
+    .core       = CONFIG_SPP_##key##_TASK_CORE, \
+}
+
+static const spp_task_config_t spp_task_config[SPP_TASK_NB] = {
+    [SPP_TASK_UART]         = SPP_TASK_CONFIG(uart_task, UART),
+    [SPP_TASK_BLE_TX]       = SPP_TASK_CONFIG(ble_tx_task, BLE_TX),
+    [SPP_TASK_COMMAND]      = SPP_TASK_CONFIG(command_task, COMMAND),
+    [SPP_TASK_STATUS]       = SPP_TASK_CONFIG(status_task, STATUS),
+    [SPP_TASK_UART_WRITE]   = SPP_TASK_CONFIG(uart_write_task, UART_WRITE),
+#ifdef CONFIG_SPP_DLOG
+    [SPP_TASK_DLOG]         = SPP_TASK_CONFIG(dlog_task, DLOG),
+#endif
+#ifdef CONFIG_SPP_OTA
+    [SPP_TASK_OTA]          = SPP_TASK_CONFIG(ota_task, OTA),
+#endif
+};
+
+static void spp_task_create(TaskFunction_t func, spp_task_index_t index,
+                            void *arg, TaskHandle_t *handle)
+{
+    const spp_task_config_t *config = &(spp_task_config[index]);
+    BaseType_t core = (config->core < 0) ? tskNO_AFFINITY : config->core;
+
+#if CONFIG_FREERTOS_UNICORE
+    core = 0;
+#endif
+    if (xTaskCreatePinnedToCore(func, config->name, config->stack_size, arg,
+                                config->priority, handle, core) != pdPASS) {
+        SPP_LOGE("Failed to create %s.", config->name);
+    }
+}
+
+// Return the free stack of a task, and warn if it is below the margin.
+static uint32_t spp_task_check_stack(spp_task_index_t index, TaskHandle_t handle)
+{
+    const spp_task_config_t *config = &(spp_task_config[index]);
+    uint32_t stack_free;
+
+    if (handle == NULL) {
+        return UINT32_MAX;
+    }
+    stack_free = uxTaskGetStackHighWaterMark(handle);
+    if (stack_free < CONFIG_SPP_TASK_STACK_MARGIN) {
+        SPP_LOGW("%s: %d of %d bytes stack free.", config->name,
+                 stack_free, config->stack_size);
+    }
+    return stack_free;
+}
+
+// Check the stack high water mark of every task once they have started.
+// Only the tasks below the margin are logged one by one, the rest in one
+// line, since the deferred log mutes a call site beyond SPP_DLOG_RATE_BURST.
+// NOTE: This only covers the startup, the telemetry keeps reporting the
+// marks of the running tasks.
+static void spp_task_check(void)
+{
+    uint32_t stack_min = UINT32_MAX;
+    uint32_t stack_free;
+
+    vTaskDelay(SPP_TASK_CHECK_DELAY_MS / portTICK_PERIOD_MS);
+
+    for (uint32_t i = 0; i < SPP_TASK_NB; i++) {
+        if ((i == SPP_TASK_UART) || (i == SPP_TASK_UART_WRITE)) {
+            continue;
+        }
+        stack_free = spp_task_check_stack(i, task_handle[i]);
+        stack_min = (stack_free < stack_min) ? stack_free : stack_min;
+    }
+    for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+        stack_free = spp_task_check_stack(SPP_TASK_UART, spp_chan[i].uart_task);
+        stack_min = (stack_free < stack_min) ? stack_free : stack_min;
+        stack_free = spp_task_check_stack(SPP_TASK_UART_WRITE, spp_chan[i].write_task);
+        stack_min = (stack_free < stack_min) ? stack_free : stack_min;
+    }
+    SPP_LOGI("Stacks checked, %d bytes free at least.", stack_min);
+}
+
 static void spp_task_init(void)
 {
-    xTaskCreate(uart_task, "uart_task", 2048, NULL, 8, NULL);
-    xTaskCreate(command_task, "command_task", 2048, NULL, 10, NULL);
+    spp_task_create(ble_tx_task, SPP_TASK_BLE_TX, NULL, &task_handle[SPP_TASK_BLE_TX]);
+    spp_flow_init(task_handle[SPP_TASK_BLE_TX], SPP_TX_NOTIFY_FLOW);
+    spp_task_create(command_task, SPP_TASK_COMMAND, NULL, &task_handle[SPP_TASK_COMMAND]);
+
+    for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+        spp_task_create(uart_task, SPP_TASK_UART, &(spp_chan[i]), &(spp_chan[i].uart_task));
+        spp_task_create(uart_write_task, SPP_TASK_UART_WRITE, &(spp_chan[i]),
+                        &(spp_chan[i].write_task));
+    }
+    // NOTE: The telemetry reports the stack of the channel 0 tasks.
+    task_handle[SPP_TASK_UART] = spp_chan[0].uart_task;
+    task_handle[SPP_TASK_UART_WRITE] = spp_chan[0].write_task;
+    spp_task_create(status_task, SPP_TASK_STATUS, NULL, &task_handle[SPP_TASK_STATUS]);
+#ifdef CONFIG_SPP_DLOG
+    spp_task_create(dlog_task, SPP_TASK_DLOG, NULL, &task_handle[SPP_TASK_DLOG]);
+#endif
+#ifdef CONFIG_SPP_OTA
+    spp_task_create(ota_task, SPP_TASK_OTA, NULL, &task_handle[SPP_TASK_OTA]);
+#endif
+}
+
+#ifdef CONFIG_SPP_BLE_BOND
+// Bond with a central which pairs, so that it reconnects with the stored keys
+// and its cached attribute handles, without pairing or service discovery.
+// With SPP_OTA the pairing takes CONFIG_SPP_BLE_PASSKEY, which the central
+// enters, as the server has no display of its own.
+// NOTE: The server only asks for the encryption at SPP_CMD_OTA_BEGIN, a
+// central which does not pair works as before.
+static void ble_security_init(void)
+{
+#ifdef CONFIG_SPP_OTA
+    esp_ble_auth_req_t auth_req = ESP_LE_AUTH_REQ_SC_MITM_BOND;
+    esp_ble_io_cap_t iocap = ESP_IO_CAP_OUT;
+    uint32_t passkey = CONFIG_SPP_BLE_PASSKEY;
+#else
+    esp_ble_auth_req_t auth_req = ESP_LE_AUTH_BOND;
+    esp_ble_io_cap_t iocap = ESP_IO_CAP_NONE;
+#endif
+    uint8_t key_size = 16;
+    uint8_t key = ESP_BLE_ENC_KEY_MASK|ESP_BLE_ID_KEY_MASK;
+
+#ifdef CONFIG_SPP_OTA
+    esp_ble_gap_set_security_param(ESP_BLE_SM_SET_STATIC_PASSKEY, &passkey, sizeof(passkey));
+#endif
+    esp_ble_gap_set_security_param(ESP_BLE_SM_AUTHEN_REQ_MODE, &auth_req, sizeof(auth_req));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_IOCAP_MODE, &iocap, sizeof(iocap));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_MAX_KEY_SIZE, &key_size, sizeof(key_size));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_SET_INIT_KEY, &key, sizeof(key));
+    esp_ble_gap_set_security_param(ESP_BLE_SM_SET_RSP_KEY, &key, sizeof(key));
 }
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
+// NOTE: The UART channels start before the BLE stack, which takes most of the
+// boot. Until a central subscribes, the bytes go to the store and are
+// replayed, see handle_uart_store.
 void app_main()
 {
     esp_err_t ret;
     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
 
+#ifdef CONFIG_SPP_DLOG
+    spp_dlog_init();
+#endif
     ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES) {
         ESP_ERROR_CHECK(nvs_flash_erase());
         ESP_ERROR_CHECK(nvs_flash_init());
     }
+    spp_config_load(&spp_config);
+    command_init();
+    store_init();
+#ifdef CONFIG_SPP_OTA
+    ota_init();
+#endif
+    spp_pm_init();
+
+    for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+        spp_chan[i].driver_lock = xSemaphoreCreateMutex();
+        uart_setup(&(spp_chan[i]));
+    }
+    spp_task_init();
+
+    SPP_LOGI("Task is started.");
+
     ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
 
     ESP_ERROR_CHECK(esp_bt_controller_init(&bt_cfg));
@@ -224,13 +2260,14 @@ void app_main()
     ESP_ERROR_CHECK(esp_ble_gatts_register_callback(gatts_event_handler));
     ESP_ERROR_CHECK(esp_ble_gap_register_callback(gap_event_handler));
     ESP_ERROR_CHECK(esp_ble_gatts_app_register(ESP_SPP_APP_ID));
+    ESP_ERROR_CHECK(esp_ble_gatt_set_local_mtu(ESP_GATT_MAX_MTU_SIZE));
+#ifdef CONFIG_SPP_BLE_BOND
+    ble_security_init();
+#endif
 
-    ESP_LOGI(TAG_SPP, "BLE intialization is done.");
-
-    uart_init();
-    spp_task_init();
+    SPP_LOGI("BLE intialization is done.");
 
-    ESP_LOGI(TAG_SPP, "Task is started.");
+    spp_task_check();
 
     return;
 }
@@ -3,23 +3,139 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "sdkconfig.h"
+
 #include "esp_gatts_api.h"
 
-#define UART_NUM UART_NUM_0
+#include "spp_flow.h"
 
 #define SPP_DATA_MAX_LEN           (512)
 #define SPP_CMD_MAX_LEN            (20)
-#define SPP_STATUS_MAX_LEN         (20)
+#define SPP_CMD_QUEUE_DEPTH        (8)
+
+#define SPP_PREP_QUEUE_DEPTH       (4)
+
+#define SPP_RING_SIZE              (8192)
+#define SPP_RX_RING_SIZE           (4096)
+// Credits smaller than this are not granted while the peer has some left.
+#define SPP_RX_CREDIT_STEP         (512)
+
+#define SPP_UART_BAUD_RATE         (115200)
+#define SPP_UART_BAUD_MIN          (1200)
+#define SPP_UART_BAUD_MAX          (5000000)
+#define SPP_UART_RX_BUF_SIZE       (4096)
+#define SPP_UART_TX_BUF_SIZE       (8192)
+// NOTE: The driver needs the buffers larger than the hardware FIFO.
+#define SPP_UART_BUF_SIZE_MIN      (256)
+#define SPP_UART_BUF_SIZE_MAX      (32768)
+#define SPP_UART_RTS_THRESH        (100)
+// The RX FIFO full interrupt leaves room in the 128 byte hardware FIFO for
+// the bytes which arrive while the ISR is pending, so faster baud rates get a
+// lower threshold. The RX timeout, in characters, is the idle time of the
+// throughput mode, and is stretched so that the line is idle this long at
+// least.
+#define SPP_UART_FIFO_LEN          (128)
+#define SPP_UART_ISR_LATENCY_US    (200)
+#define SPP_UART_RX_FULL_MIN       (16)
+#define SPP_UART_RX_FULL_MAX       (120)
+#define SPP_UART_RX_TOUT_MIN_US    (100)
+#define SPP_UART_RX_TOUT_MAX       (126)
+// NOTE: The idle gaps around the delimiter are not checked, so it is found
+// anywhere in the stream.
+#define SPP_UART_DELIM_IDLE        (0)
+#define SPP_COALESCE_IDLE_CHARS    (4)
+
+// Channels bridged over one connection, each with its own UART and pair of
+// data characteristics. Channel 0 is the console UART with the original UUIDs.
+// The count and the pins of UART1 and UART2 come from the Kconfig.
+#define SPP_CHAN_NUM               CONFIG_SPP_CHAN_NUM
+#define SPP_CHAN0_WEIGHT           (1)
+#if SPP_CHAN_NUM > 1
+#define SPP_CHAN1_TX_PIN           CONFIG_SPP_CHAN1_TX_PIN
+#define SPP_CHAN1_RX_PIN           CONFIG_SPP_CHAN1_RX_PIN
+#define SPP_CHAN1_RTS_PIN          CONFIG_SPP_CHAN1_RTS_PIN
+#define SPP_CHAN1_CTS_PIN          CONFIG_SPP_CHAN1_CTS_PIN
+#define SPP_CHAN1_WEIGHT           (1)
+#endif
+#if SPP_CHAN_NUM > 2
+#define SPP_CHAN2_TX_PIN           CONFIG_SPP_CHAN2_TX_PIN
+#define SPP_CHAN2_RX_PIN           CONFIG_SPP_CHAN2_RX_PIN
+#define SPP_CHAN2_RTS_PIN          CONFIG_SPP_CHAN2_RTS_PIN
+#define SPP_CHAN2_CTS_PIN          CONFIG_SPP_CHAN2_CTS_PIN
+#define SPP_CHAN2_WEIGHT           (1)
+#endif
+
+#define SPP_PEER_MAX               CONFIG_BT_ACL_CONNECTIONS
+// Bytes a peer may lag behind the UART stream before the policy applies.
+// With the hardware flow control the UART is no longer read instead.
+#define SPP_PEER_BACKLOG_MAX       (4096)
+#define SPP_PEER_POLICY            SPP_PEER_POLICY_DROP
+
+// Store and forward. The data of a channel with no subscriber stays in its
+// ring, and the part above the threshold is spilled into the channel's share
+// of the log partition, in chunks of at most SPP_STORE_SPILL_CHUNK.
+#define SPP_STORE_PARTITION        "spp_log"
+#define SPP_STORE_SPILL_THRESH     (SPP_RING_SIZE / 2)
+#define SPP_STORE_SPILL_CHUNK      (1024)
+
+#define SPP_STATUS_PERIOD_MS       (1000)
+
+// OTA update, see spp_ota.h. An image is identified by the first bytes of
+// its SHA-256, and the offset written is kept in NVS every SPP_OTA_SAVE_SIZE.
+#define SPP_OTA_ID_LEN             (8)
+#define SPP_OTA_SAVE_SIZE          (65536)
+#define SPP_OTA_RESTART_DELAY_MS   (500)
+#define SPP_OTA_NOTIFY_DATA        (1 << 0)
+#define SPP_OTA_NOTIFY_STOP        (1 << 1)
+#define SPP_OTA_NOTIFY_RESTART     (1 << 2)
+
+// Power management, see spp_pm.h. A UART which wakes the CPU from light
+// sleep needs this many RX edges, and the bytes carrying them are lost.
+#define SPP_PM_UART_WAKE_EDGES     (3)
+
+// Frames of a framed connection which may wait for an ACK, a power of 2.
+#define SPP_RTX_WINDOW             (8)
+
+// Connection tuning. Intervals are in 1.25 ms, timeouts in 10 ms units.
+#define SPP_LE_DATA_LEN            (251)
+#define SPP_CONN_FAST_INT_MIN      (6)
+#define SPP_CONN_FAST_INT_MAX      (12)
+#define SPP_CONN_FAST_LATENCY      (0)
+#define SPP_CONN_FAST_TIMEOUT      (400)
+#define SPP_CONN_SLOW_INT_MIN      (80)
+#define SPP_CONN_SLOW_INT_MAX      (160)
+#define SPP_CONN_SLOW_LATENCY      (4)
+#define SPP_CONN_SLOW_TIMEOUT      (600)
+#define SPP_CONN_TUNE_PERIOD_MS    (1000)
+
+// Advertising intervals in 0.625 ms. The short one is used for
+// CONFIG_SPP_ADV_FAST_MS after the boot and each disconnection.
+#define SPP_ADV_FAST_INT_MIN       (0x20)
+#define SPP_ADV_FAST_INT_MAX       (0x30)
+#define SPP_ADV_SLOW_INT_MIN       (0x640)
+#define SPP_ADV_SLOW_INT_MAX       (0x800)
+// A peer moving fewer bytes than this per period counts as idle.
+#define SPP_CONN_BUSY_BYTES        (256)
+#define SPP_CONN_IDLE_PERIODS      (5)
+
+#define SPP_TX_NOTIFY_DATA         (1 << 0)
+#define SPP_TX_NOTIFY_FLUSH        (1 << 1)
+#define SPP_TX_NOTIFY_FLOW         (1 << 2)
+#define SPP_TX_NOTIFY_CLOSE        (1 << 3)
+#define SPP_TX_NOTIFY_FLUSH_CHAN(n) (1 << (8 + (n)))
+
+// Data attributes of a channel, in the order of the attribute table.
+#define SPP_CHAN_INDEX(n) \
+    SPP_IDX_SPP_DATA##n##_RECV_CHAR, \
+    SPP_IDX_SPP_DATA##n##_RECV_VAL, \
+    SPP_IDX_SPP_DATA##n##_NOTIFY_CHAR, \
+    SPP_IDX_SPP_DATA##n##_NOTIFY_VAL, \
+    SPP_IDX_SPP_DATA##n##_NOTIFY_CFG,
 
 typedef enum {
     SPP_IDX_SVC,
 
-    SPP_IDX_SPP_DATA_RECV_CHAR,
-    SPP_IDX_SPP_DATA_RECV_VAL,
-
-    SPP_IDX_SPP_DATA_NOTIFY_CHAR,
-    SPP_IDX_SPP_DATA_NOTIFY_VAL,
-    SPP_IDX_SPP_DATA_NOTIFY_CFG,
+    SPP_CHAN_INDEX()
 
     SPP_IDX_SPP_COMMAND_CHAR,
     SPP_IDX_SPP_COMMAND_VAL,
@@ -28,23 +144,250 @@ typedef enum {
     SPP_IDX_SPP_STATUS_VAL,
     SPP_IDX_SPP_STATUS_CFG,
 
+#if SPP_CHAN_NUM > 1
+    SPP_CHAN_INDEX(1)
+#endif
+#if SPP_CHAN_NUM > 2
+    SPP_CHAN_INDEX(2)
+#endif
+
     SPP_IDX_NB,
 } spp_index_t;
 
+typedef enum {
+    SPP_CMD_TX_MODE             = 0x01, // mode(1) idle_chars(1)
+    SPP_CMD_UART_BAUD           = 0x02, // baud_rate(4)
+    SPP_CMD_UART_FLOW           = 0x03, // rts_cts(1)
+    SPP_CMD_UART_BUF            = 0x04, // rx_buf_size(4) tx_buf_size(4)
+    SPP_CMD_STATUS_PERIOD       = 0x05, // period_ms(2), 0 stops the notification
+    SPP_CMD_CHANNEL             = 0x06, // channel(1), the UART of the commands above
+    SPP_CMD_COMPRESS            = 0x07, // enable(1), for the connection sending it
+    SPP_CMD_FRAMING             = 0x08, // enable(1), for the connection sending it
+    SPP_CMD_ACK                 = 0x09, // channel(1) seq(2), the frames up to seq
+    SPP_CMD_NAK                 = 0x0A, // channel(1) seq(2), the frame to send again
+    SPP_CMD_UART_DELIM          = 0x0B, // enable(1) delim(1), flush at each record end
+    SPP_CMD_TRACE               = 0x0C, // sink(1), dump the latency trace
+    SPP_CMD_OTA_BEGIN           = 0x0D, // size(4) id(8), start or resume an image
+    SPP_CMD_OTA_END             = 0x0E, // restart(1), check and boot the image
+    SPP_CMD_OTA_ABORT           = 0x0F, // drop the image
+} spp_cmd_t;
+
+// NOTE: Multi-byte command arguments are little endian.
+
+// The first byte of the status characteristic tells the record type.
+typedef enum {
+    SPP_STATUS_TELEMETRY        = 0x01,
+    SPP_STATUS_CREDIT           = 0x02,
+    SPP_STATUS_RESPONSE         = 0x03,
+    SPP_STATUS_TRACE            = 0x04,
+    SPP_STATUS_LOG              = 0x05,
+    SPP_STATUS_OTA              = 0x06,
+} spp_status_type_t;
+
+// Where SPP_CMD_TRACE dumps the trace.
+// NOTE: There is no console sink. The console is UART0, which carries the
+// data of channel 0.
+typedef enum {
+    SPP_TRACE_SINK_STATUS       = 0x00, // SPP_STATUS_TRACE records
+} spp_trace_sink_t;
+
+typedef enum {
+    SPP_OTA_STATE_IDLE          = 0x00,
+    SPP_OTA_STATE_RECEIVING     = 0x01, // the data of channel 0 is the image
+    SPP_OTA_STATE_DONE          = 0x02, // the image boots at the next restart
+    SPP_OTA_STATE_ERROR         = 0x03, // stopped, SPP_CMD_OTA_BEGIN resumes
+} spp_ota_state_t;
+
+// The trace records are paced, so that the dump leaves room for the data.
+#define SPP_TRACE_DUMP_DELAY_MS    (10)
+
+typedef enum {
+    SPP_CMD_OK                  = 0x00,
+    SPP_CMD_ERR_UNKNOWN         = 0x01,
+    SPP_CMD_ERR_LEN             = 0x02,
+    SPP_CMD_ERR_ARG             = 0x03,
+    SPP_CMD_ERR_FAIL            = 0x04,
+    SPP_CMD_ERR_BUSY            = 0x05,
+    SPP_CMD_ERR_AUTH            = 0x06, // the link must be paired with the passkey first
+} spp_cmd_result_t;
+
+// A command waiting for command_task, copied by value through the queue.
+typedef struct spp_cmd_slot {
+    uint16_t conn_id;
+    uint8_t id;
+    uint8_t arg_len;
+    uint8_t arg[SPP_CMD_MAX_LEN - 1];
+} spp_cmd_slot_t;
+
+typedef enum {
+    SPP_TASK_UART,
+    SPP_TASK_BLE_TX,
+    SPP_TASK_COMMAND,
+    SPP_TASK_STATUS,
+    SPP_TASK_UART_WRITE,
+    SPP_TASK_DLOG,
+    SPP_TASK_OTA,
+
+    SPP_TASK_NB,
+} spp_task_index_t;
+
+// The startup self-check reads the stack marks after this delay.
+#define SPP_TASK_CHECK_DELAY_MS    (500)
+
+typedef struct __attribute__((packed)) spp_telemetry {
+    uint8_t type;
+    uint32_t tx_bytes;
+    uint32_t tx_packets;
+    uint32_t rx_bytes;
+    uint32_t rx_packets;
+    uint32_t uart_overflow;
+    uint32_t ring_overflow;
+    uint32_t congest;
+    uint16_t mtu_size;
+    uint16_t ring_high_water;
+    uint32_t heap_free;
+    uint32_t heap_min_free;
+    uint16_t stack_free[SPP_TASK_NB];
+    uint32_t rx_drop;
+    uint16_t rx_queue_used;
+    uint32_t tx_retransmit;
+    uint32_t tx_rounds;
+    uint32_t tx_cycles;
+    uint32_t tx_cycles_max;
+    uint32_t uart_wakeups;
+    uint32_t uart_rx_bytes;
+    uint32_t store_bytes;
+    uint32_t store_drop;
+    uint32_t log_drop;
+    uint32_t uptime_ms;
+    uint32_t pm_bursts;
+    uint32_t pm_active_ms;
+    uint32_t pm_first_tx_us;
+    uint32_t pm_first_tx_us_max;
+    uint32_t boot_adv_ms;
+    uint32_t reconnect_count;
+    uint32_t reconnect_ms;
+    uint32_t reconnect_ms_max;
+} spp_telemetry_t;
+
+typedef struct __attribute__((packed)) spp_response {
+    uint8_t type;
+    uint8_t id;
+    uint8_t result;
+} spp_response_t;
+
+// Followed by count spp_trace_event_t. A record with count 0 ends the dump.
+typedef struct __attribute__((packed)) spp_trace_dump {
+    uint8_t type;
+    uint16_t seq;
+    uint8_t count;
+} spp_trace_dump_t;
+
+// Followed by count spp_dlog_entry_t, see spp_dlog.h.
+typedef struct __attribute__((packed)) spp_log_record {
+    uint8_t type;
+    uint8_t count;
+} spp_log_record_t;
+
+// The image up to offset is in the flash, and the sender may send it up to
+// granted.
+typedef struct __attribute__((packed)) spp_ota_status {
+    uint8_t type;
+    uint8_t state;
+    uint32_t offset;
+    uint32_t granted;
+} spp_ota_status_t;
+
+typedef struct __attribute__((packed)) spp_credit {
+    uint8_t type;
+    uint8_t channel;
+    uint32_t granted;
+} spp_credit_t;
+
+// The telemetry record is the largest fixed one. The trace and log records
+// are filled up to this length.
+#define SPP_STATUS_MAX_LEN         (sizeof(spp_telemetry_t))
+
+typedef enum {
+    SPP_TX_MODE_LATENCY,
+    SPP_TX_MODE_THROUGHPUT,
+} spp_tx_mode_t;
+
+typedef enum {
+    SPP_PEER_POLICY_DROP,
+    SPP_PEER_POLICY_DISCONNECT,
+} spp_peer_policy_t;
+
 #define ESP_SPP_APP_ID              0x56
 #define SPP_PROFILE_NUM             1
 #define SPP_PROFILE_APP_IDX         0
 
 #define TAG_SPP  "ESP32_BLE_SPP"
 
+// A frame sent on a framed connection, kept until it is acknowledged.
+typedef struct spp_rtx_seg {
+    uint32_t pos;
+    uint16_t seq;
+    uint16_t in_len;
+    uint16_t max_size;
+    uint16_t is_compressed;
+} spp_rtx_seg_t;
+
+// Per channel state of a connection.
+// is_notify_enabled, rx_bytes, ack_seq and nak_mask are written by the BTC
+// task, rx_granted by the UART write task of the channel, the rest belongs
+// to the sender task.
+typedef struct spp_peer_chan {
+    uint16_t is_notify_enabled;
+    uint16_t is_active;
+    uint32_t pos;
+    uint32_t drop_bytes;
+    uint32_t rx_bytes;
+    uint32_t rx_granted;
+
+    uint16_t tx_seq;
+    uint16_t tx_ack;
+    uint16_t ack_seq;
+    uint32_t nak_mask;
+    spp_rtx_seg_t rtx[SPP_RTX_WINDOW];
+} spp_peer_chan_t;
+
+// Per connection state.
+// in_use, connection_id, remote_bda, mtu_size, is_status_enabled,
+// is_authenticated and rx_bytes are written by the BTC task, is_compressed and
+// is_framed by the command task,
+// the rest belongs to the sender task.
+// NOTE: At the disconnection the BTC task only sets is_closing. The sender
+// task stops using the slot and clears in_use, and only then alloc_peer()
+// hands the slot to a new connection.
+typedef struct spp_peer {
+    uint16_t in_use;
+    uint16_t is_closing;
+    uint16_t connection_id;
+    esp_bd_addr_t remote_bda;
+    uint16_t mtu_size;
+    uint16_t is_status_enabled;
+    uint16_t is_authenticated;
+    uint16_t is_compressed;
+    uint16_t is_framed;
+    uint32_t rx_bytes;
+    spp_flow_t flow;
+
+    uint16_t is_fast;
+    uint16_t idle_count;
+    uint32_t last_bytes;
+
+    uint32_t tx_bytes;
+    uint32_t tx_packets;
+    spp_peer_chan_t chan[SPP_CHAN_NUM];
+} spp_peer_t;
+
 typedef struct gatts_spp_status {
     esp_gatts_cb_t gatts_cb;
     uint16_t gatts_if;
     uint16_t app_id;
-    uint16_t connection_id;
-    uint16_t is_connected;
-    uint16_t is_notify_enabled;
-    uint16_t mtu_size;
+    uint16_t peer_count;
+    uint16_t is_advertising;
     uint16_t service_handle;
     esp_gatt_srvc_id_t service_id;
     uint16_t char_handle;
@@ -55,8 +398,14 @@ typedef struct gatts_spp_status {
     esp_bt_uuid_t descr_uuid;
 } gatts_spp_status_t;
 
-void handle_uart_remote_data(uint8_t *str, uint32_t len);
-void handle_uart_remote_data_prep(uint8_t *str, uint32_t len);
-void handle_uart_remote_data_exec();
-void handle_command(uint8_t *str, uint32_t len);
+void handle_uart_remote_data(uint32_t chan, uint8_t *str, uint32_t len);
+void handle_uart_remote_data_prep(uint32_t chan, uint32_t offset, uint8_t *str, uint32_t len);
+uint32_t handle_uart_remote_data_exec(uint32_t *chan);
+void handle_data_subscribe(void);
+void handle_status_subscribe(void);
+void handle_peer_close(void);
+bool handle_ota_data(uint16_t conn_id, uint32_t chan, uint8_t *str, uint32_t len, bool is_prep);
+void handle_ota_disconnect(uint16_t conn_id);
+void handle_command(uint16_t conn_id, uint8_t *str, uint32_t len);
+uint32_t make_telemetry(spp_telemetry_t *telemetry, uint16_t mtu_size);
 
@@ -0,0 +1,59 @@
+#include "esp32_spp_server.h"
+#include "spp_config.h"
+#include "spp_dlog.h"
+
+#include "nvs.h"
+
+#define SPP_CONFIG_NAMESPACE        "spp"
+#define SPP_CONFIG_KEY              "config"
+
+static const spp_config_t SPP_CONFIG_DEFAULT = {
+    .version        = SPP_CONFIG_VERSION,
+    .uart = {
+        [0 ... SPP_CHAN_NUM - 1] = {
+            .baud_rate      = SPP_UART_BAUD_RATE,
+            .rx_buf_size    = SPP_UART_RX_BUF_SIZE,
+            .tx_buf_size    = SPP_UART_TX_BUF_SIZE,
+            .flow_ctrl      = false,
+            .delim_enable   = false,
+            .delim          = '\n',
+        },
+    },
+    .status_period  = SPP_STATUS_PERIOD_MS,
+    .tx_mode        = SPP_TX_MODE_LATENCY,
+    .idle_chars     = SPP_COALESCE_IDLE_CHARS,
+};
+
+// NOTE: A blob of another version or size is stored by another firmware
+// version, so the defaults are used instead.
+void spp_config_load(spp_config_t *config)
+{
+    nvs_handle handle;
+    size_t size = sizeof(spp_config_t);
+
+    *config = SPP_CONFIG_DEFAULT;
+
+    if (nvs_open(SPP_CONFIG_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    if ((nvs_get_blob(handle, SPP_CONFIG_KEY, config, &size) != ESP_OK) ||
+        (size != sizeof(spp_config_t)) || (config->version != SPP_CONFIG_VERSION)) {
+        *config = SPP_CONFIG_DEFAULT;
+    }
+    nvs_close(handle);
+}
+
+void spp_config_save(const spp_config_t *config)
+{
+    nvs_handle handle;
+
+    if (nvs_open(SPP_CONFIG_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        SPP_LOGE("Failed to open NVS at %s.", __func__);
+        return;
+    }
+    if ((nvs_set_blob(handle, SPP_CONFIG_KEY, config, sizeof(spp_config_t)) != ESP_OK) ||
+        (nvs_commit(handle) != ESP_OK)) {
+        SPP_LOGE("Failed to save config at %s.", __func__);
+    }
+    nvs_close(handle);
+}
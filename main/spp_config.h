@@ -0,0 +1,26 @@
+#include <stdint.h>
+
+typedef struct spp_uart_config {
+    uint32_t baud_rate;
+    uint32_t rx_buf_size;
+    uint32_t tx_buf_size;
+    uint8_t flow_ctrl;
+    uint8_t delim_enable;
+    uint8_t delim;
+} spp_uart_config_t;
+
+// Raise at each change of spp_config_t, since a change which keeps the size
+// would otherwise load the old blob into the new layout.
+#define SPP_CONFIG_VERSION          (1)
+
+// Settings which persist in NVS.
+typedef struct spp_config {
+    uint16_t version;
+    spp_uart_config_t uart[SPP_CHAN_NUM];
+    uint16_t status_period;
+    uint8_t tx_mode;
+    uint8_t idle_chars;
+} spp_config_t;
+
+void spp_config_load(spp_config_t *config);
+void spp_config_save(const spp_config_t *config);
@@ -0,0 +1,97 @@
+#include "spp_dlog.h"
+
+#ifdef CONFIG_SPP_DLOG
+
+#include "freertos/task.h"
+
+_Static_assert((SPP_DLOG_LEN & (SPP_DLOG_LEN - 1)) == 0,
+               "CONFIG_SPP_DLOG_LEN must be a power of 2");
+
+// Bounded ring of many writers and one reader. A slot is free for the writer
+// at pos when its seq is pos, and holds an entry for the reader at pos when
+// its seq is pos + 1. A writer claims pos by the compare and swap of head,
+// so neither side ever takes a lock.
+typedef struct spp_dlog_slot {
+    uint32_t seq;
+    spp_dlog_entry_t entry;
+} spp_dlog_slot_t;
+
+typedef struct spp_dlog {
+    spp_dlog_slot_t slots[SPP_DLOG_LEN];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t dropped;
+} spp_dlog_t;
+
+static spp_dlog_t spp_dlog;
+
+void spp_dlog_init(void)
+{
+    for (uint32_t i = 0; i < SPP_DLOG_LEN; i++) {
+        spp_dlog.slots[i].seq = i;
+    }
+}
+
+// NOTE: The rate limit of a call site is not atomic, so two cores logging
+// from the same site at once may let an extra entry through.
+void spp_dlog_write(spp_dlog_site_t *site, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+{
+    TickType_t now = xTaskGetTickCount();
+    spp_dlog_slot_t *slot;
+    uint32_t pos;
+
+    if ((now - site->window) >= (SPP_DLOG_RATE_MS / portTICK_PERIOD_MS)) {
+        site->window = now;
+        site->count = 0;
+    }
+    if (site->count >= SPP_DLOG_RATE_BURST) {
+        if (site->suppressed != UINT16_MAX) {
+            site->suppressed++;
+        }
+        return;
+    }
+    site->count++;
+
+    pos = __atomic_load_n(&(spp_dlog.head), __ATOMIC_RELAXED);
+    do {
+        slot = &(spp_dlog.slots[pos & (SPP_DLOG_LEN - 1)]);
+        if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != pos) {
+            __atomic_fetch_add(&(spp_dlog.dropped), 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&(spp_dlog.head), &pos, pos + 1, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    slot->entry.ticks = now;
+    slot->entry.fmt = (uint32_t)(uintptr_t)site->fmt;
+    slot->entry.arg[0] = arg0;
+    slot->entry.arg[1] = arg1;
+    slot->entry.arg[2] = arg2;
+    slot->entry.suppressed = site->suppressed;
+    slot->entry.level = site->level;
+    slot->entry.core = xPortGetCoreID();
+    site->suppressed = 0;
+    __atomic_store_n(&(slot->seq), pos + 1, __ATOMIC_RELEASE);
+}
+
+// Take the oldest entry. Only dlog_task reads.
+bool spp_dlog_read(spp_dlog_entry_t *entry)
+{
+    spp_dlog_slot_t *slot = &(spp_dlog.slots[spp_dlog.tail & (SPP_DLOG_LEN - 1)]);
+
+    if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != (spp_dlog.tail + 1)) {
+        return false;
+    }
+    *entry = slot->entry;
+    __atomic_store_n(&(slot->seq), spp_dlog.tail + SPP_DLOG_LEN, __ATOMIC_RELEASE);
+    spp_dlog.tail++;
+
+    return true;
+}
+
+uint32_t spp_dlog_dropped(void)
+{
+    return __atomic_load_n(&(spp_dlog.dropped), __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,87 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+
+// Deferred logging off the data UART.
+// SPP_LOGE/W/I store the address of the format string and up to
+// SPP_DLOG_ARG_MAX integer arguments into a lock-free ring, which costs a few
+// tens of cycles and never touches a UART. dlog_task formats the entries
+// later and hands them to the sink chosen in Kconfig.
+// A call site which logs more than SPP_DLOG_RATE_BURST times within
+// SPP_DLOG_RATE_MS is muted for the rest of the window, and its next entry
+// carries the number of the entries muted.
+// NOTE: A %s argument must point to a string which stays, such as __func__,
+// since it is formatted much later.
+// NOTE: Without CONFIG_SPP_DLOG the calls go to ESP_LOGx as before.
+
+#define SPP_DLOG_ARG_MAX        (3)
+#define SPP_DLOG_RATE_MS        (1000)
+#define SPP_DLOG_RATE_BURST     (4)
+#define SPP_DLOG_DRAIN_MS       (100)
+#define SPP_DLOG_LINE_MAX       (128)
+
+// The entry of the sinks, also in the SPP_STATUS_LOG records.
+// fmt is the address of the format string in the firmware ELF.
+typedef struct __attribute__((packed)) spp_dlog_entry {
+    uint32_t ticks;
+    uint32_t fmt;
+    uint32_t arg[SPP_DLOG_ARG_MAX];
+    uint16_t suppressed;
+    uint8_t level;
+    uint8_t core;
+} spp_dlog_entry_t;
+
+#ifdef CONFIG_SPP_DLOG
+
+#define SPP_DLOG_LEN            (CONFIG_SPP_DLOG_LEN)
+
+typedef struct spp_dlog_site {
+    const char *fmt;
+    uint8_t level;
+    uint8_t count;
+    uint16_t suppressed;
+    TickType_t window;
+} spp_dlog_site_t;
+
+// Count the arguments, and pad them to SPP_DLOG_ARG_MAX.
+#define SPP_DLOG_NARG(...)          SPP_DLOG_NARG_(0, ##__VA_ARGS__, 3, 2, 1, 0)
+#define SPP_DLOG_NARG_(_0, _1, _2, _3, n, ...) n
+#define SPP_DLOG_CAT(a, b)          SPP_DLOG_CAT_(a, b)
+#define SPP_DLOG_CAT_(a, b)         a##b
+#define SPP_DLOG_ARG(x)             ((uint32_t)(uintptr_t)(x))
+#define SPP_DLOG_ARGS_0()           0, 0, 0
+#define SPP_DLOG_ARGS_1(a)          SPP_DLOG_ARG(a), 0, 0
+#define SPP_DLOG_ARGS_2(a, b)       SPP_DLOG_ARG(a), SPP_DLOG_ARG(b), 0
+#define SPP_DLOG_ARGS_3(a, b, c)    SPP_DLOG_ARG(a), SPP_DLOG_ARG(b), SPP_DLOG_ARG(c)
+#define SPP_DLOG_ARGS(...) \
+    SPP_DLOG_CAT(SPP_DLOG_ARGS_, SPP_DLOG_NARG(__VA_ARGS__))(__VA_ARGS__)
+
+#define SPP_DLOG(lvl, format, ...) do {                                 \
+        static spp_dlog_site_t dlog_site = {                            \
+            .fmt = (format),                                            \
+            .level = (lvl),                                             \
+        };                                                              \
+        spp_dlog_write(&dlog_site, SPP_DLOG_ARGS(__VA_ARGS__));         \
+    } while (0)
+
+#define SPP_LOGE(format, ...)   SPP_DLOG(ESP_LOG_ERROR, format, ##__VA_ARGS__)
+#define SPP_LOGW(format, ...)   SPP_DLOG(ESP_LOG_WARN, format, ##__VA_ARGS__)
+#define SPP_LOGI(format, ...)   SPP_DLOG(ESP_LOG_INFO, format, ##__VA_ARGS__)
+
+void spp_dlog_init(void);
+void spp_dlog_write(spp_dlog_site_t *site, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+bool spp_dlog_read(spp_dlog_entry_t *entry);
+uint32_t spp_dlog_dropped(void);
+
+#else
+
+#define SPP_LOGE(format, ...)   ESP_LOGE(TAG_SPP, format, ##__VA_ARGS__)
+#define SPP_LOGW(format, ...)   ESP_LOGW(TAG_SPP, format, ##__VA_ARGS__)
+#define SPP_LOGI(format, ...)   ESP_LOGI(TAG_SPP, format, ##__VA_ARGS__)
+
+#endif
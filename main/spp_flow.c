@@ -0,0 +1,92 @@
+#include "esp32_spp_server.h"
+#include "spp_dlog.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+
+// Credit based pacing of the notifications.
+//
+// Every notification handed to esp_ble_gatts_send_indicate() consumes one
+// credit and ESP_GATTS_CONF_EVT gives it back, so the number of packets
+// queued in the stack is bounded by SPP_FLOW_CREDIT_MAX per connection.
+// While the stack reports ESP_GATTS_CONGEST_EVT, no credit is handed out.
+//
+// The credits are given back in the BTC task and taken in the sender task,
+// which is woken up through the task notification whenever a credit returns.
+
+static TaskHandle_t flow_waiter = NULL;
+static uint32_t flow_notify_bit = 0;
+
+static void flow_wakeup(void)
+{
+    if (flow_waiter != NULL) {
+        xTaskNotify(flow_waiter, flow_notify_bit, eSetBits);
+    }
+}
+
+void spp_flow_init(TaskHandle_t waiter, uint32_t notify_bit)
+{
+    flow_notify_bit = notify_bit;
+    flow_waiter = waiter;
+}
+
+// NOTE: The stack never confirms the notifications which are pending at
+// disconnection, so all the credits are given back here.
+void spp_flow_reset(spp_flow_t *flow)
+{
+    __atomic_store_n(&flow->credit, SPP_FLOW_CREDIT_MAX, __ATOMIC_RELEASE);
+    __atomic_store_n(&flow->congested, false, __ATOMIC_RELEASE);
+    flow->last_release = xTaskGetTickCount();
+    flow_wakeup();
+}
+
+bool spp_flow_acquire(spp_flow_t *flow)
+{
+    uint32_t credit;
+
+    if (__atomic_load_n(&flow->congested, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    credit = __atomic_load_n(&flow->credit, __ATOMIC_ACQUIRE);
+    while (credit != 0) {
+        if (__atomic_compare_exchange_n(&flow->credit, &credit, credit - 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (credit == SPP_FLOW_CREDIT_MAX) {
+                // NOTE: Nothing was in flight, so the stall timer starts now.
+                flow->last_release = xTaskGetTickCount();
+            }
+            return true;
+        }
+    }
+
+    if ((xTaskGetTickCount() - flow->last_release) > SPP_FLOW_WAIT_TICKS) {
+        SPP_LOGW("Notification is not confirmed in time.");
+        spp_flow_reset(flow);
+    }
+    return false;
+}
+
+void spp_flow_release(spp_flow_t *flow)
+{
+    uint32_t credit = __atomic_load_n(&flow->credit, __ATOMIC_ACQUIRE);
+
+    while (credit < SPP_FLOW_CREDIT_MAX) {
+        if (__atomic_compare_exchange_n(&flow->credit, &credit, credit + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+    flow->last_release = xTaskGetTickCount();
+    flow_wakeup();
+}
+
+void spp_flow_congest(spp_flow_t *flow, bool congested)
+{
+    __atomic_store_n(&flow->congested, congested, __ATOMIC_RELEASE);
+    if (!congested) {
+        flow_wakeup();
+    }
+}
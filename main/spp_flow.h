@@ -0,0 +1,21 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Maximum number of notifications handed to the stack without ESP_GATTS_CONF_EVT.
+#define SPP_FLOW_CREDIT_MAX         (8)
+#define SPP_FLOW_WAIT_TICKS         (1000 / portTICK_PERIOD_MS)
+
+typedef struct spp_flow {
+    uint32_t credit;
+    uint32_t congested;
+    TickType_t last_release;
+} spp_flow_t;
+
+void spp_flow_init(TaskHandle_t waiter, uint32_t notify_bit);
+void spp_flow_reset(spp_flow_t *flow);
+bool spp_flow_acquire(spp_flow_t *flow);
+void spp_flow_release(spp_flow_t *flow);
+void spp_flow_congest(spp_flow_t *flow, bool congested);
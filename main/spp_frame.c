@@ -0,0 +1,50 @@
+#include "spp_frame.h"
+
+uint16_t spp_crc16(const uint8_t *str, uint32_t len)
+{
+    uint16_t crc = 0xFFFF;
+
+    while (len-- != 0) {
+        crc ^= (uint16_t)(*str++) << 8;
+        for (uint32_t i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+// Fill in seq and crc around the payload, which is already at
+// frame + SPP_FRAME_HDR_LEN. Return the frame size.
+uint32_t spp_frame_seal(uint8_t *frame, uint16_t seq, uint32_t payload_len)
+{
+    uint32_t len = SPP_FRAME_HDR_LEN + payload_len;
+    uint16_t crc;
+
+    frame[0] = seq & 0xFF;
+    frame[1] = seq >> 8;
+    crc = spp_crc16(frame, len);
+    frame[len] = crc & 0xFF;
+    frame[len + 1] = crc >> 8;
+
+    return len + SPP_FRAME_CRC_LEN;
+}
+
+// Check a received frame.
+// Return the payload size, which starts at frame + SPP_FRAME_HDR_LEN, or -1
+// if the frame is broken.
+int32_t spp_frame_check(const uint8_t *frame, uint32_t len, uint16_t *seq)
+{
+    uint16_t crc;
+
+    if (len < SPP_FRAME_OVERHEAD) {
+        return -1;
+    }
+    len -= SPP_FRAME_CRC_LEN;
+    crc = frame[len] | (frame[len + 1] << 8);
+    if (spp_crc16(frame, len) != crc) {
+        return -1;
+    }
+    *seq = frame[0] | (frame[1] << 8);
+
+    return len - SPP_FRAME_HDR_LEN;
+}
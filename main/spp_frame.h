@@ -0,0 +1,20 @@
+#include <stdint.h>
+
+// Framing of the data notifications for the framed transport.
+// NOTE: This file and spp_frame.c are plain C99 without ESP-IDF, so clients
+// build the same spp_frame_check().
+//
+//   seq(2)       little endian, counts the frames of a channel
+//   payload      the raw bytes, or SPP_LZ_HDR_* and the block if compressed
+//   crc(2)       little endian CRC-16/CCITT-FALSE over seq and payload
+//
+// The client acknowledges with SPP_CMD_ACK and asks for a lost or broken
+// frame with SPP_CMD_NAK. A retransmitted frame keeps its seq.
+
+#define SPP_FRAME_HDR_LEN       (2)
+#define SPP_FRAME_CRC_LEN       (2)
+#define SPP_FRAME_OVERHEAD      (SPP_FRAME_HDR_LEN + SPP_FRAME_CRC_LEN)
+
+uint16_t spp_crc16(const uint8_t *str, uint32_t len);
+uint32_t spp_frame_seal(uint8_t *frame, uint16_t seq, uint32_t payload_len);
+int32_t spp_frame_check(const uint8_t *frame, uint32_t len, uint16_t *seq);
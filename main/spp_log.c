@@ -0,0 +1,181 @@
+#include "spp_log.h"
+
+#include <stddef.h>
+
+static uint32_t sector_addr(spp_log_t *log, uint32_t index)
+{
+    return log->base + (index % log->sectors) * SPP_LOG_SECTOR_SIZE;
+}
+
+static uint32_t last_sector(spp_log_t *log)
+{
+    return (log->first + log->count - 1) % log->sectors;
+}
+
+// Find the newest sector of the earlier laps, and continue after it.
+bool spp_log_init(spp_log_t *log, const spp_log_flash_t *flash, void *ctx,
+                  uint32_t base, uint32_t size)
+{
+    spp_log_sector_t sector;
+    bool is_found = false;
+
+    log->flash = flash;
+    log->ctx = ctx;
+    log->base = base;
+    log->sectors = size / SPP_LOG_SECTOR_SIZE;
+    if (log->sectors > SPP_LOG_SECTOR_MAX) {
+        log->sectors = SPP_LOG_SECTOR_MAX;
+    }
+    log->seq = 0;
+    log->first = 0;
+    log->count = 0;
+    log->head = 0;
+    log->tail = 0;
+    log->dropped = 0;
+
+    if (log->sectors < 2) {
+        log->flash = NULL;
+        return false;
+    }
+    for (uint32_t i = 0; i < log->sectors; i++) {
+        if (!flash->read(ctx, sector_addr(log, i), &sector, sizeof(sector)) ||
+            (sector.magic != SPP_LOG_MAGIC)) {
+            continue;
+        }
+        if (!is_found || ((int32_t)(sector.seq - log->seq) >= 0)) {
+            log->seq = sector.seq + 1;
+            log->first = (i + 1) % log->sectors;
+            is_found = true;
+        }
+    }
+    return true;
+}
+
+bool spp_log_ready(const spp_log_t *log)
+{
+    return log->flash != NULL;
+}
+
+// Erase the next sector and start it at head. The oldest sector is dropped
+// if the region is full.
+static bool start_sector(spp_log_t *log)
+{
+    spp_log_sector_t sector = {
+        .magic = SPP_LOG_MAGIC,
+        .seq = log->seq,
+        .pos = log->head,
+    };
+    uint32_t index;
+
+    if (log->count == log->sectors) {
+        log->first = (log->first + 1) % log->sectors;
+        log->count--;
+        log->dropped += log->sector_pos[log->first] - log->tail;
+        log->tail = log->sector_pos[log->first];
+    }
+    index = (log->first + log->count) % log->sectors;
+    if (!log->flash->erase(log->ctx, sector_addr(log, index)) ||
+        !log->flash->write(log->ctx, sector_addr(log, index), &sector, sizeof(sector))) {
+        return false;
+    }
+    log->sector_pos[index] = log->head;
+    log->seq++;
+    log->count++;
+
+    return true;
+}
+
+// Store the stream bytes at pos. A pos other than head starts the log over.
+// Return the number of bytes stored, which is less than len on a flash error.
+uint32_t spp_log_append(spp_log_t *log, uint32_t pos, const uint8_t *str, uint32_t len)
+{
+    uint32_t stored = 0;
+
+    if ((log->count == 0) || (pos != log->head)) {
+        log->first = (log->first + log->count) % log->sectors;
+        log->count = 0;
+        log->head = pos;
+        log->tail = pos;
+    }
+    while (len != 0) {
+        uint32_t offset;
+        uint32_t size;
+
+        if ((log->count == 0) ||
+            ((log->head - log->sector_pos[last_sector(log)]) == SPP_LOG_DATA_SIZE)) {
+            if (!start_sector(log)) {
+                break;
+            }
+        }
+        offset = log->head - log->sector_pos[last_sector(log)];
+        size = SPP_LOG_DATA_SIZE - offset;
+        if (size > len) {
+            size = len;
+        }
+        if (!log->flash->write(log->ctx, sector_addr(log, last_sector(log)) +
+                               sizeof(spp_log_sector_t) + offset, str, size)) {
+            break;
+        }
+        log->head += size;
+        stored += size;
+        str += size;
+        len -= size;
+    }
+    return stored;
+}
+
+// Read the stored bytes from pos on, at most up to the end of its sector.
+// Return the number of bytes read, 0 if pos is not in the log.
+uint32_t spp_log_read_at(spp_log_t *log, uint32_t pos, uint8_t *buf, uint32_t len)
+{
+    uint32_t i;
+    uint32_t index = 0;
+    uint32_t end = log->head;
+
+    if ((log->count == 0) ||
+        ((int32_t)(pos - log->tail) < 0) || ((int32_t)(log->head - pos) <= 0)) {
+        return 0;
+    }
+    for (i = log->count; i-- != 0; ) {
+        index = (log->first + i) % log->sectors;
+        if ((int32_t)(pos - log->sector_pos[index]) >= 0) {
+            break;
+        }
+        end = log->sector_pos[index];
+    }
+    if (len > (end - pos)) {
+        len = end - pos;
+    }
+    if (!log->flash->read(log->ctx, sector_addr(log, index) + sizeof(spp_log_sector_t) +
+                          (pos - log->sector_pos[index]), buf, len)) {
+        return 0;
+    }
+    return len;
+}
+
+// Release the bytes before pos, freeing the sectors which hold only those.
+void spp_log_release(spp_log_t *log, uint32_t pos)
+{
+    if (log->count == 0) {
+        return;
+    }
+    if ((int32_t)(pos - log->head) >= 0) {
+        log->first = (log->first + log->count) % log->sectors;
+        log->count = 0;
+        log->tail = log->head;
+        return;
+    }
+    while ((log->count > 1) &&
+           ((int32_t)(pos - log->sector_pos[(log->first + 1) % log->sectors]) >= 0)) {
+        log->first = (log->first + 1) % log->sectors;
+        log->count--;
+    }
+    if ((int32_t)(pos - log->tail) > 0) {
+        log->tail = pos;
+    }
+}
+
+uint32_t spp_log_used(const spp_log_t *log)
+{
+    return log->head - log->tail;
+}
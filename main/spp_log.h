@@ -0,0 +1,56 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+// Append-only log of a byte stream in a flash region, for the data which
+// waits for a central.
+// NOTE: This file and spp_log.c are plain C99 without ESP-IDF. The flash is
+// reached through spp_log_flash_t, so the log also runs on a file.
+//
+// The region is used as a ring of sectors, written sequentially and erased
+// one sector ahead, so every sector is erased once per lap. Each sector
+// starts with spp_log_sector_t, followed by the stream bytes from pos on.
+// A stream position is the free running position of the byte ring, so the
+// log continues the ring at its tail. When the region is full the oldest
+// sector is dropped. The log starts empty at boot, after the newest sector
+// found, so the laps carry on over the reboots.
+
+#define SPP_LOG_SECTOR_SIZE     (4096)
+#define SPP_LOG_SECTOR_MAX      (64)
+#define SPP_LOG_MAGIC           (0x474C5053)    // "SPLG"
+
+typedef struct spp_log_sector {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t pos;
+} spp_log_sector_t;
+
+#define SPP_LOG_DATA_SIZE       (SPP_LOG_SECTOR_SIZE - sizeof(spp_log_sector_t))
+
+// addr is the offset in the flash, erase takes one whole sector.
+typedef struct spp_log_flash {
+    bool (*read)(void *ctx, uint32_t addr, void *buf, uint32_t len);
+    bool (*write)(void *ctx, uint32_t addr, const void *buf, uint32_t len);
+    bool (*erase)(void *ctx, uint32_t addr);
+} spp_log_flash_t;
+
+typedef struct spp_log {
+    const spp_log_flash_t *flash;
+    void *ctx;
+    uint32_t base;
+    uint32_t sectors;
+    uint32_t seq;
+    uint32_t first;     // oldest sector in use, or the next one to write
+    uint32_t count;     // sectors in use
+    uint32_t head;      // stream position after the last byte stored
+    uint32_t tail;      // stream position of the oldest byte kept
+    uint32_t dropped;   // bytes lost with the dropped sectors
+    uint32_t sector_pos[SPP_LOG_SECTOR_MAX];
+} spp_log_t;
+
+bool spp_log_init(spp_log_t *log, const spp_log_flash_t *flash, void *ctx,
+                  uint32_t base, uint32_t size);
+bool spp_log_ready(const spp_log_t *log);
+uint32_t spp_log_append(spp_log_t *log, uint32_t pos, const uint8_t *str, uint32_t len);
+uint32_t spp_log_read_at(spp_log_t *log, uint32_t pos, uint8_t *buf, uint32_t len);
+void spp_log_release(spp_log_t *log, uint32_t pos);
+uint32_t spp_log_used(const spp_log_t *log);
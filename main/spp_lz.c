@@ -0,0 +1,181 @@
+#include "spp_lz.h"
+
+#include <string.h>
+
+#define SPP_LZ_EMPTY            (0xFFFF)
+#define SPP_LZ_NIBBLE_MAX       (15)
+
+static uint32_t lz_read32(const uint8_t *str)
+{
+    uint32_t val;
+
+    memcpy(&val, str, sizeof(val));
+    return val;
+}
+
+static uint32_t lz_hash(const uint8_t *str)
+{
+    return (lz_read32(str) * 2654435761U) >> (32 - SPP_LZ_HASH_BITS);
+}
+
+// Size of the extra length bytes of a nibble.
+static uint32_t lz_ext_size(uint32_t len)
+{
+    return (len < SPP_LZ_NIBBLE_MAX) ? 0 : (1 + (len - SPP_LZ_NIBBLE_MAX) / 255);
+}
+
+static uint8_t *lz_put_ext(uint8_t *op, uint32_t len)
+{
+    if (len < SPP_LZ_NIBBLE_MAX) {
+        return op;
+    }
+    len -= SPP_LZ_NIBBLE_MAX;
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+
+    return op;
+}
+
+static uint8_t *lz_put_literals(uint8_t *op, const uint8_t *str, uint32_t len, uint32_t match_len)
+{
+    uint32_t lit = (len < SPP_LZ_NIBBLE_MAX) ? len : SPP_LZ_NIBBLE_MAX;
+    uint32_t match = (match_len < SPP_LZ_NIBBLE_MAX) ? match_len : SPP_LZ_NIBBLE_MAX;
+
+    *op++ = (lit << 4) | match;
+    op = lz_put_ext(op, len);
+    memcpy(op, str, len);
+
+    return op + len;
+}
+
+// Compress src into a block of at most dst_size bytes. As much of src is
+// taken as the block can hold, the number of bytes taken is set to consumed.
+// Return the size of the block.
+// NOTE: src_len must not exceed SPP_LZ_BLOCK_MAX.
+uint32_t spp_lz_encode(spp_lz_t *lz, const uint8_t *src, uint32_t src_len,
+                       uint8_t *dst, uint32_t dst_size, uint32_t *consumed)
+{
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_size;
+    uint32_t anchor = 0;
+    uint32_t ip = 0;
+    uint32_t avail;
+    uint32_t lit;
+
+    memset(lz->hash, 0xFF, sizeof(lz->hash));
+
+    while ((ip + SPP_LZ_MIN_MATCH) <= src_len) {
+        uint32_t h = lz_hash(src + ip);
+        uint32_t ref = lz->hash[h];
+        uint32_t len = SPP_LZ_MIN_MATCH;
+
+        lz->hash[h] = ip;
+        if ((ref == SPP_LZ_EMPTY) || (lz_read32(src + ref) != lz_read32(src + ip))) {
+            ip++;
+            continue;
+        }
+        while (((ip + len) < src_len) && (src[ref + len] == src[ip + len])) {
+            len++;
+        }
+
+        lit = ip - anchor;
+        if ((uint32_t)(op_end - op) <
+            (1 + lz_ext_size(lit) + lit + 2 + lz_ext_size(len - SPP_LZ_MIN_MATCH))) {
+            break;
+        }
+        op = lz_put_literals(op, src + anchor, lit, len - SPP_LZ_MIN_MATCH);
+        *op++ = (ip - ref) & 0xFF;
+        *op++ = (ip - ref) >> 8;
+        op = lz_put_ext(op, len - SPP_LZ_MIN_MATCH);
+
+        ip += len;
+        anchor = ip;
+    }
+
+    // The rest goes out as literals, as far as they fit.
+    avail = op_end - op;
+    lit = src_len - anchor;
+    if (avail <= 1) {
+        lit = 0;
+    } else if (lit > (avail - 1)) {
+        lit = avail - 1;
+    }
+    while ((lit != 0) && ((1 + lz_ext_size(lit) + lit) > avail)) {
+        lit--;
+    }
+    if (lit != 0) {
+        op = lz_put_literals(op, src + anchor, lit, 0);
+    }
+    *consumed = anchor + lit;
+
+    return op - dst;
+}
+
+static int32_t lz_get_ext(const uint8_t **ip, const uint8_t *ip_end, uint32_t *len)
+{
+    uint8_t val;
+
+    if (*len < SPP_LZ_NIBBLE_MAX) {
+        return 0;
+    }
+    do {
+        if (*ip >= ip_end) {
+            return -1;
+        }
+        val = *(*ip)++;
+        *len += val;
+    } while (val == 255);
+
+    return 0;
+}
+
+// Decode a block into dst.
+// Return the decoded size, or -1 if the block is broken or dst is too small.
+int32_t spp_lz_decode(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_size)
+{
+    const uint8_t *ip = src;
+    const uint8_t *ip_end = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_size;
+
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+        uint32_t lit = token >> 4;
+        uint32_t len = token & 0x0F;
+        uint32_t offset;
+
+        if ((lz_get_ext(&ip, ip_end, &lit) != 0) ||
+            ((uint32_t)(ip_end - ip) < lit) || ((uint32_t)(op_end - op) < lit)) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+
+        if (ip == ip_end) {
+            break;
+        }
+        if ((ip_end - ip) < 2) {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((lz_get_ext(&ip, ip_end, &len) != 0) ||
+            (offset == 0) || (offset > (uint32_t)(op - dst))) {
+            return -1;
+        }
+        len += SPP_LZ_MIN_MATCH;
+        if ((uint32_t)(op_end - op) < len) {
+            return -1;
+        }
+        // NOTE: The match may overlap its own output, so copy byte by byte.
+        while (len-- != 0) {
+            *op = *(op - offset);
+            op++;
+        }
+    }
+    return op - dst;
+}
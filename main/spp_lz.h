@@ -0,0 +1,34 @@
+#include <stdint.h>
+
+// LZ77 block codec for the compressed transport.
+// NOTE: This file and spp_lz.c are plain C99 without ESP-IDF, so clients
+// build the same spp_lz_decode() as the reference decoder.
+//
+// Every notification of a compressed connection starts with a header byte.
+// SPP_LZ_HDR_RAW is followed by the bytes as is, SPP_LZ_HDR_LZ by one block,
+// which decodes on its own without the earlier notifications.
+//
+// A block is a series of sequences:
+//   token(1)         literal length in the high nibble, match length - 4 in
+//                    the low nibble. 15 continues with the bytes below.
+//   [length(n)]      255 each until the last one, added to the literal length
+//   literals
+//   offset(2)        little endian distance back to the match, 1..65535
+//   [length(n)]      same as above, added to the match length
+// The block may end right after the literals of a sequence.
+
+#define SPP_LZ_HDR_RAW          (0x00)
+#define SPP_LZ_HDR_LZ           (0x01)
+
+#define SPP_LZ_MIN_MATCH        (4)
+#define SPP_LZ_HASH_BITS        (10)
+// The input of one block, which also bounds the match distance.
+#define SPP_LZ_BLOCK_MAX        (2048)
+
+typedef struct spp_lz {
+    uint16_t hash[1 << SPP_LZ_HASH_BITS];
+} spp_lz_t;
+
+uint32_t spp_lz_encode(spp_lz_t *lz, const uint8_t *src, uint32_t src_len,
+                       uint8_t *dst, uint32_t dst_size, uint32_t *consumed);
+int32_t spp_lz_decode(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_size);
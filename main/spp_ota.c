@@ -0,0 +1,161 @@
+#include "spp_ota.h"
+
+#include <string.h>
+
+#define SPP_OTA_SECTOR_SIZE     (4096)
+
+static uint32_t min_u32(uint32_t a, uint32_t b)
+{
+    return (a < b) ? a : b;
+}
+
+// Erase up to end, rounded up to the sector. Each step ends at a multiple of
+// SPP_OTA_ERASE_SIZE, or at the end of the image.
+static bool erase_ahead(spp_ota_t *ota, uint32_t end)
+{
+    while (ota->erased < end) {
+        uint32_t next = (ota->erased + SPP_OTA_ERASE_SIZE) & ~(SPP_OTA_ERASE_SIZE - 1);
+
+        next = min_u32(next, ota->erase_end);
+        if (!ota->flash->erase(ota->ctx, ota->erased, next - ota->erased)) {
+            return false;
+        }
+        ota->erased = next;
+    }
+    return true;
+}
+
+void spp_ota_init(spp_ota_t *ota, const spp_ota_flash_t *flash)
+{
+    memset(ota, 0, sizeof(spp_ota_t));
+    ota->flash = flash;
+    mbedtls_sha256_init(&(ota->sha));
+}
+
+// Start an image of size bytes into a partition of capacity bytes, at
+// offset, which is 0 or a block boundary already written.
+// NOTE: Nothing may call spp_ota_receive() or spp_ota_process() meanwhile.
+bool spp_ota_start(spp_ota_t *ota, void *ctx, uint32_t capacity,
+                   uint32_t size, uint32_t offset)
+{
+    if ((size == 0) || (size > capacity) || (offset > size) ||
+        (((offset % SPP_OTA_BLOCK_SIZE) != 0) && (offset != size))) {
+        return false;
+    }
+    ota->ctx = ctx;
+    ota->size = size;
+    ota->erase_end = min_u32((size + SPP_OTA_SECTOR_SIZE - 1) & ~(SPP_OTA_SECTOR_SIZE - 1),
+                             capacity);
+    ota->received = offset;
+    ota->fill_len = 0;
+    ota->filled = 0;
+    ota->flushed = 0;
+    ota->written = offset;
+    ota->erased = (offset + SPP_OTA_SECTOR_SIZE - 1) & ~(SPP_OTA_SECTOR_SIZE - 1);
+    ota->is_error = false;
+
+    mbedtls_sha256_free(&(ota->sha));
+    mbedtls_sha256_init(&(ota->sha));
+    mbedtls_sha256_starts_ret(&(ota->sha), 0);
+    for (uint32_t pos = 0; pos < offset; pos += SPP_OTA_BLOCK_SIZE) {
+        uint32_t len = min_u32(offset - pos, SPP_OTA_BLOCK_SIZE);
+
+        if (!ota->flash->read(ctx, pos, ota->block[0].data, len)) {
+            return false;
+        }
+        mbedtls_sha256_update_ret(&(ota->sha), ota->block[0].data, len);
+    }
+    return true;
+}
+
+// Copy the stream into the blocks, and return the bytes taken. Fewer than
+// len means that the sender overran its grant or the image, and the rest of
+// the transfer is refused.
+uint32_t spp_ota_receive(spp_ota_t *ota, const uint8_t *str, uint32_t len)
+{
+    uint32_t done = 0;
+
+    if (__atomic_load_n(&(ota->is_error), __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    while (done < len) {
+        spp_ota_block_t *block = &(ota->block[ota->filled % SPP_OTA_BLOCK_NUM]);
+        uint32_t n;
+
+        if ((ota->received == ota->size) ||
+            ((ota->filled - __atomic_load_n(&(ota->flushed), __ATOMIC_ACQUIRE)) >=
+             SPP_OTA_BLOCK_NUM)) {
+            __atomic_store_n(&(ota->is_error), true, __ATOMIC_RELAXED);
+            break;
+        }
+        if (ota->fill_len == 0) {
+            block->offset = ota->received;
+        }
+        n = min_u32(len - done, SPP_OTA_BLOCK_SIZE - ota->fill_len);
+        n = min_u32(n, ota->size - ota->received);
+        memcpy(block->data + ota->fill_len, str + done, n);
+        ota->fill_len += n;
+        ota->received += n;
+        done += n;
+
+        if ((ota->fill_len == SPP_OTA_BLOCK_SIZE) || (ota->received == ota->size)) {
+            block->len = ota->fill_len;
+            ota->fill_len = 0;
+            __atomic_store_n(&(ota->filled), ota->filled + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return done;
+}
+
+// Refuse the rest of the transfer, as after an overrun.
+void spp_ota_fail(spp_ota_t *ota)
+{
+    __atomic_store_n(&(ota->is_error), true, __ATOMIC_RELAXED);
+}
+
+// True if a full block waits for the writer.
+bool spp_ota_pending(const spp_ota_t *ota)
+{
+    return __atomic_load_n(&(ota->filled), __ATOMIC_ACQUIRE) !=
+           __atomic_load_n(&(ota->flushed), __ATOMIC_RELAXED);
+}
+
+// Write the full blocks. Returns false on a flash error, or once the sender
+// overran, after the blocks before the overrun are written.
+bool spp_ota_process(spp_ota_t *ota)
+{
+    while (ota->flushed != __atomic_load_n(&(ota->filled), __ATOMIC_ACQUIRE)) {
+        spp_ota_block_t *block = &(ota->block[ota->flushed % SPP_OTA_BLOCK_NUM]);
+        uint32_t end = block->offset + block->len;
+
+        if (!erase_ahead(ota, end) ||
+            !ota->flash->write(ota->ctx, block->offset, block->data, block->len)) {
+            return false;
+        }
+        mbedtls_sha256_update_ret(&(ota->sha), block->data, block->len);
+        __atomic_store_n(&(ota->written), end, __ATOMIC_RELAXED);
+        __atomic_store_n(&(ota->flushed), ota->flushed + 1, __ATOMIC_RELEASE);
+    }
+    return !__atomic_load_n(&(ota->is_error), __ATOMIC_RELAXED);
+}
+
+// Write what is left, and give the SHA-256 of the image once it is complete.
+bool spp_ota_finish(spp_ota_t *ota, uint8_t *digest)
+{
+    if (!spp_ota_process(ota) || (ota->written != ota->size)) {
+        return false;
+    }
+    mbedtls_sha256_finish_ret(&(ota->sha), digest);
+    return true;
+}
+
+uint32_t spp_ota_written(const spp_ota_t *ota)
+{
+    return __atomic_load_n(&(ota->written), __ATOMIC_RELAXED);
+}
+
+// The sender may send the image up to this offset.
+uint32_t spp_ota_granted(const spp_ota_t *ota)
+{
+    return min_u32(spp_ota_written(ota) + SPP_OTA_BLOCK_NUM * SPP_OTA_BLOCK_SIZE, ota->size);
+}
@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mbedtls/sha256.h"
+
+// Receiver of a firmware image streamed over BLE into an app partition.
+// NOTE: This file and spp_ota.c are plain C99 with mbedtls, without ESP-IDF.
+// The flash is reached through spp_ota_flash_t, so the receiver also runs on
+// an emulated partition.
+//
+// The GATT callback copies the stream into one of SPP_OTA_BLOCK_NUM sector
+// sized blocks, and hands a block over once it is full. The writer task
+// erases ahead, writes the block and adds it to the SHA-256 of the image,
+// while the next block fills. The sender may run up to SPP_OTA_BLOCK_NUM
+// blocks ahead of the bytes written, see spp_ota_granted(). A byte beyond
+// that finds no free block, and the transfer stops with is_error.
+//
+// An image is resumed at a block boundary which is already in the flash.
+// The part before it is hashed again from the flash, so the digest always
+// covers what the partition holds.
+
+#define SPP_OTA_BLOCK_SIZE      (4096)
+#define SPP_OTA_BLOCK_NUM       (2)
+// The flash is erased up to a multiple of this, so the aligned ranges take
+// the block erase, which is several times faster than the sector erase.
+#define SPP_OTA_ERASE_SIZE      (65536)
+#define SPP_OTA_DIGEST_LEN      (32)
+
+// addr is the offset in the partition. erase takes whole sectors.
+typedef struct spp_ota_flash {
+    bool (*read)(void *ctx, uint32_t addr, void *buf, uint32_t len);
+    bool (*write)(void *ctx, uint32_t addr, const void *buf, uint32_t len);
+    bool (*erase)(void *ctx, uint32_t addr, uint32_t len);
+} spp_ota_flash_t;
+
+typedef struct spp_ota_block {
+    uint32_t offset;
+    uint32_t len;
+    uint8_t data[SPP_OTA_BLOCK_SIZE];
+} spp_ota_block_t;
+
+// received, fill_len and filled belong to the GATT callback, written,
+// erased, flushed and sha to the writer task.
+typedef struct spp_ota {
+    const spp_ota_flash_t *flash;
+    void *ctx;
+    uint32_t size;
+    uint32_t erase_end;
+    uint32_t received;  // image offset after the last byte received
+    uint32_t fill_len;  // bytes in the block being filled
+    uint32_t filled;    // blocks handed to the writer, free running
+    uint32_t flushed;   // blocks written, free running
+    uint32_t written;   // image offset after the last block written
+    uint32_t erased;    // image offset after the last sector erased
+    bool is_error;
+    mbedtls_sha256_context sha;
+    spp_ota_block_t block[SPP_OTA_BLOCK_NUM];
+} spp_ota_t;
+
+void spp_ota_init(spp_ota_t *ota, const spp_ota_flash_t *flash);
+bool spp_ota_start(spp_ota_t *ota, void *ctx, uint32_t capacity,
+                   uint32_t size, uint32_t offset);
+uint32_t spp_ota_receive(spp_ota_t *ota, const uint8_t *str, uint32_t len);
+void spp_ota_fail(spp_ota_t *ota);
+bool spp_ota_pending(const spp_ota_t *ota);
+bool spp_ota_process(spp_ota_t *ota);
+bool spp_ota_finish(spp_ota_t *ota, uint8_t *digest);
+uint32_t spp_ota_written(const spp_ota_t *ota);
+uint32_t spp_ota_granted(const spp_ota_t *ota);
@@ -0,0 +1,197 @@
+#include "esp32_spp_server.h"
+#include "ble_spp_service.h"
+#include "spp_dlog.h"
+#include "spp_pm.h"
+#include "spp_stats.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+
+#include "esp_timer.h"
+
+#ifdef CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#include "esp32/pm.h"
+#endif
+
+#define SPP_PM_IDLE_TICKS   ((CONFIG_SPP_PM_IDLE_MS + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS)
+
+// NOTE: esp_pm_config_esp32_t of this IDF takes rtc_cpu_freq_t, not MHz.
+#ifdef CONFIG_PM_ENABLE
+#if defined(CONFIG_ESP32_DEFAULT_CPU_FREQ_240)
+#define SPP_PM_MAX_FREQ     RTC_CPU_FREQ_240M
+#elif defined(CONFIG_ESP32_DEFAULT_CPU_FREQ_160)
+#define SPP_PM_MAX_FREQ     RTC_CPU_FREQ_160M
+#else
+#define SPP_PM_MAX_FREQ     RTC_CPU_FREQ_80M
+#endif
+
+#ifdef CONFIG_SPP_PM_MIN_FREQ_160M
+#define SPP_PM_MIN_FREQ     RTC_CPU_FREQ_160M
+#else
+#define SPP_PM_MIN_FREQ     RTC_CPU_FREQ_80M
+#endif
+#endif
+
+typedef struct spp_pm {
+    TimerHandle_t idle_timer;
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_lock_handle_t cpu_lock;
+    esp_pm_lock_handle_t sleep_lock;
+#ifdef CONFIG_SPP_TRACE
+    esp_pm_lock_handle_t trace_lock;
+#endif
+#endif
+    bool is_first_tx;
+    int64_t burst_start;
+    // NOTE: lock keeps is_burst, last_activity and the PM locks consistent,
+    // see pm_idle(). It also keeps first_tx_us and its count consistent for
+    // the reader. The sum takes 64 bits, a 32-bit sum of microseconds
+    // overflows after about 70 minutes of latency.
+    portMUX_TYPE lock;
+    bool is_burst;
+    TickType_t last_activity;
+    uint64_t first_tx_us;
+    uint32_t first_tx_count;
+} spp_pm_t;
+
+static spp_pm_t spp_pm = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static void pm_lock(bool is_acquire)
+{
+#ifdef CONFIG_PM_ENABLE
+    if (is_acquire) {
+        esp_pm_lock_acquire(spp_pm.cpu_lock);
+        esp_pm_lock_acquire(spp_pm.sleep_lock);
+    } else {
+        esp_pm_lock_release(spp_pm.sleep_lock);
+        esp_pm_lock_release(spp_pm.cpu_lock);
+    }
+#endif
+}
+
+// End the burst once the pipeline has been idle long enough, otherwise wait
+// for the rest of the idle period.
+// NOTE: This runs in the timer task. The idle check, the end of the burst and
+// the release of the locks happen in one critical section with the activity
+// check of spp_pm_activity(). So an activity either comes first and keeps the
+// burst going, or comes after and starts a new burst with the locks held.
+static void pm_idle(TimerHandle_t timer)
+{
+    TickType_t idle;
+    int64_t burst_start;
+
+    portENTER_CRITICAL(&(spp_pm.lock));
+    idle = xTaskGetTickCount() - spp_pm.last_activity;
+    if (idle < SPP_PM_IDLE_TICKS) {
+        portEXIT_CRITICAL(&(spp_pm.lock));
+        xTimerChangePeriod(timer, SPP_PM_IDLE_TICKS - idle, 0);
+        return;
+    }
+    burst_start = spp_pm.burst_start;
+    __atomic_store_n(&(spp_pm.is_first_tx), false, __ATOMIC_RELAXED);
+    spp_pm.is_burst = false;
+    pm_lock(false);
+    portEXIT_CRITICAL(&(spp_pm.lock));
+
+    SPP_STATS_ADD(pm_active_ms, (esp_timer_get_time() - burst_start) / 1000);
+}
+
+void spp_pm_init(void)
+{
+#ifdef CONFIG_PM_ENABLE
+    esp_pm_config_esp32_t pm_config = {
+        .max_cpu_freq = SPP_PM_MAX_FREQ,
+        .min_cpu_freq = SPP_PM_MIN_FREQ,
+#ifdef CONFIG_SPP_PM_LIGHT_SLEEP
+        .light_sleep_enable = true,
+#endif
+    };
+
+    if (esp_pm_configure(&pm_config) != ESP_OK) {
+        SPP_LOGE("Failed to configure power management at %s.", __func__);
+    }
+    esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "spp_cpu", &(spp_pm.cpu_lock));
+    esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "spp_sleep", &(spp_pm.sleep_lock));
+#ifdef CONFIG_SPP_TRACE
+    // NOTE: The trace events carry cycle counts, which tools/spp_trace.py
+    // turns into time at one fixed frequency. So the CPU stays at the
+    // maximum frequency as long as the trace records.
+    esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "spp_trace", &(spp_pm.trace_lock));
+    esp_pm_lock_acquire(spp_pm.trace_lock);
+#endif
+#endif
+    spp_pm.idle_timer = xTimerCreate("spp_pm", SPP_PM_IDLE_TICKS, pdFALSE, NULL, pm_idle);
+    if (spp_pm.idle_timer == NULL) {
+        SPP_LOGE("Failed to create PM timer at %s.", __func__);
+    }
+}
+
+// Mark the pipeline busy. This only stores the tick, unless a burst starts.
+// NOTE: esp_pm_lock_acquire() and esp_pm_lock_release() may run in a
+// critical section, as they may in an ISR.
+void spp_pm_activity(bool is_uart_rx)
+{
+    bool is_start;
+
+    portENTER_CRITICAL(&(spp_pm.lock));
+    spp_pm.last_activity = xTaskGetTickCount();
+    is_start = !spp_pm.is_burst;
+    if (is_start) {
+        spp_pm.is_burst = true;
+        pm_lock(true);
+        spp_pm.burst_start = esp_timer_get_time();
+        __atomic_store_n(&(spp_pm.is_first_tx), is_uart_rx, __ATOMIC_RELEASE);
+    }
+    portEXIT_CRITICAL(&(spp_pm.lock));
+
+    if (!is_start) {
+        return;
+    }
+    SPP_STATS_ADD(pm_bursts, 1);
+#ifdef CONFIG_SPP_PM_FAST_ON_BURST
+    gatts_spp_conn_burst();
+#endif
+    if (spp_pm.idle_timer != NULL) {
+        xTimerChangePeriod(spp_pm.idle_timer, SPP_PM_IDLE_TICKS, 0);
+    }
+}
+
+// A notification went out. The first one of a burst started by UART RX
+// closes the latency measurement.
+void spp_pm_tx(void)
+{
+    uint32_t latency;
+
+    spp_pm_activity(false);
+    if (!__atomic_load_n(&(spp_pm.is_first_tx), __ATOMIC_RELAXED) ||
+        !__atomic_exchange_n(&(spp_pm.is_first_tx), false, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    latency = esp_timer_get_time() - spp_pm.burst_start;
+    portENTER_CRITICAL(&(spp_pm.lock));
+    spp_pm.first_tx_us += latency;
+    spp_pm.first_tx_count++;
+    portEXIT_CRITICAL(&(spp_pm.lock));
+    if (latency > spp_stats.pm_first_tx_us_max) {
+        __atomic_store_n(&(spp_stats.pm_first_tx_us_max), latency, __ATOMIC_RELAXED);
+    }
+}
+
+// Average time from the start of a burst by UART RX to its first
+// notification, 0 before the first one.
+uint32_t spp_pm_first_tx_us(void)
+{
+    uint64_t sum;
+    uint32_t count;
+
+    portENTER_CRITICAL(&(spp_pm.lock));
+    sum = spp_pm.first_tx_us;
+    count = spp_pm.first_tx_count;
+    portEXIT_CRITICAL(&(spp_pm.lock));
+
+    return (count != 0) ? (uint32_t)(sum / count) : 0;
+}
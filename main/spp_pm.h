@@ -0,0 +1,18 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+
+// Power management of the forwarding pipeline.
+// The first activity after an idle period starts a burst, which holds the
+// CPU frequency and no light sleep locks until the pipeline has been idle for
+// CONFIG_SPP_PM_IDLE_MS. In between, the CPU may scale down, or sleep with
+// CONFIG_SPP_PM_LIGHT_SLEEP. A burst started by UART RX measures the time to
+// its first notification, which is the latency the idle state costs.
+// NOTE: Without CONFIG_PM_ENABLE no lock is taken, but the bursts are still
+// counted, so the residency can be compared with and without it.
+
+void spp_pm_init(void);
+void spp_pm_activity(bool is_uart_rx);
+void spp_pm_tx(void);
+uint32_t spp_pm_first_tx_us(void);
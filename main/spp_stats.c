@@ -0,0 +1,18 @@
+#include "spp_stats.h"
+
+spp_stats_t spp_stats;
+
+// Account one round of ble_tx_task, which took cycles CPU cycles.
+// NOTE: The rounds run within a burst, which the UART data starts and the
+// notifications sent keep alive, see spp_pm.h. So with CONFIG_PM_ENABLE the
+// CPU is at the maximum frequency, and the cycles stand for the same time
+// as without it.
+// NOTE: Only ble_tx_task calls this, so the maximum needs no atomic update.
+void spp_stats_cycles(uint32_t cycles)
+{
+    SPP_STATS_ADD(tx_rounds, 1);
+    SPP_STATS_ADD(tx_cycles, cycles);
+    if (cycles > spp_stats.tx_cycles_max) {
+        __atomic_store_n(&(spp_stats.tx_cycles_max), cycles, __ATOMIC_RELAXED);
+    }
+}
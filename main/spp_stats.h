@@ -0,0 +1,37 @@
+#include <stdint.h>
+
+// Counters which are updated on the forwarding path.
+// NOTE: The counters are only ever incremented with relaxed atomics, so they
+// cost a few cycles and never take a lock.
+typedef struct spp_stats {
+    uint32_t tx_bytes;
+    uint32_t tx_packets;
+    uint32_t tx_retransmit;
+    uint32_t rx_bytes;
+    uint32_t rx_packets;
+    uint32_t rx_drop;
+    uint32_t uart_overflow;
+    uint32_t uart_wakeups;
+    uint32_t uart_rx_bytes;
+    uint32_t congest;
+    uint32_t tx_rounds;
+    uint32_t tx_cycles;
+    uint32_t tx_cycles_max;
+    uint32_t pm_bursts;
+    uint32_t pm_active_ms;
+    uint32_t pm_first_tx_us_max;
+    uint32_t boot_adv_ms;
+    uint32_t reconnect_count;
+    uint32_t reconnect_ms;
+    uint32_t reconnect_ms_max;
+} spp_stats_t;
+
+extern spp_stats_t spp_stats;
+
+#define SPP_STATS_ADD(field, val) \
+    __atomic_fetch_add(&(spp_stats.field), (val), __ATOMIC_RELAXED)
+
+#define SPP_STATS_GET(field) \
+    __atomic_load_n(&(spp_stats.field), __ATOMIC_RELAXED)
+
+void spp_stats_cycles(uint32_t cycles);
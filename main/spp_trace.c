@@ -0,0 +1,58 @@
+#include "spp_trace.h"
+
+#ifdef CONFIG_SPP_TRACE
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "xtensa/hal.h"
+
+_Static_assert((SPP_TRACE_LEN & (SPP_TRACE_LEN - 1)) == 0,
+               "CONFIG_SPP_TRACE_LEN must be a power of 2");
+
+typedef struct spp_trace {
+    spp_trace_event_t events[SPP_TRACE_LEN];
+    uint32_t head;
+    bool is_frozen;
+} spp_trace_t;
+
+static spp_trace_t spp_trace;
+
+// NOTE: The trace points run on both cores, so a slot is claimed by an
+// atomic increment of head and never locked.
+void spp_trace_record(uint8_t stage, uint8_t flags, uint32_t arg)
+{
+    spp_trace_event_t *event;
+
+    if (__atomic_load_n(&(spp_trace.is_frozen), __ATOMIC_RELAXED)) {
+        return;
+    }
+    event = &(spp_trace.events[__atomic_fetch_add(&(spp_trace.head), 1, __ATOMIC_RELAXED) &
+                               (SPP_TRACE_LEN - 1)]);
+    event->ccount = xthal_get_ccount();
+    event->arg = (arg > UINT16_MAX) ? UINT16_MAX : arg;
+    event->stage = stage;
+    event->flags = flags | ((xPortGetCoreID() != 0) ? SPP_TRACE_FLAG_CORE1 : 0);
+}
+
+// Stop the trace points while the ring is dumped, so that it stays consistent.
+void spp_trace_freeze(bool is_frozen)
+{
+    __atomic_store_n(&(spp_trace.is_frozen), is_frozen, __ATOMIC_SEQ_CST);
+}
+
+// Return the number of the events in the ring, from index first onwards.
+uint32_t spp_trace_snapshot(uint32_t *first)
+{
+    uint32_t head = __atomic_load_n(&(spp_trace.head), __ATOMIC_SEQ_CST);
+    uint32_t count = (head < SPP_TRACE_LEN) ? head : SPP_TRACE_LEN;
+
+    *first = head - count;
+    return count;
+}
+
+void spp_trace_get(uint32_t index, spp_trace_event_t *event)
+{
+    *event = spp_trace.events[index & (SPP_TRACE_LEN - 1)];
+}
+
+#endif
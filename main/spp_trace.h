@@ -0,0 +1,55 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+
+// Latency trace of the forwarding stages.
+// A trace point writes one spp_trace_event_t with the CPU cycle count into a
+// fixed ring in RAM, overwriting the oldest event. SPP_CMD_TRACE dumps the
+// ring, and tools/spp_trace.py turns it into latency histograms and a Chrome
+// trace timeline.
+// NOTE: Without CONFIG_SPP_TRACE the trace points compile to nothing.
+
+typedef enum {
+    SPP_TRACE_UART_READ         = 0x01, // uart_receive, arg is the bytes read
+    SPP_TRACE_TX_DATA           = 0x02, // handle_uart_local_data, arg is the packets sent
+    SPP_TRACE_TX_INDICATE       = 0x03, // esp_ble_gatts_send_indicate, arg is the length
+    SPP_TRACE_CONGEST           = 0x04, // ESP_GATTS_CONGEST_EVT, arg is the conn_id
+    SPP_TRACE_GATTS_WRITE       = 0x05, // ESP_GATTS_WRITE_EVT, arg is the length
+    SPP_TRACE_RX_EXEC           = 0x06, // handle_uart_remote_data_exec, arg is the length
+} spp_trace_stage_t;
+
+// flags of spp_trace_event_t
+#define SPP_TRACE_FLAG_END      (0x80)
+#define SPP_TRACE_FLAG_CORE1    (0x40)
+#define SPP_TRACE_FLAG_CHAN_MASK    (0x0F)
+
+// NOTE: ccount is the cycle counter of the core which wrote the event, the
+// two cores are not synchronized.
+typedef struct __attribute__((packed)) spp_trace_event {
+    uint32_t ccount;
+    uint16_t arg;
+    uint8_t stage;
+    uint8_t flags;
+} spp_trace_event_t;
+
+#ifdef CONFIG_SPP_TRACE
+
+#define SPP_TRACE_LEN           (CONFIG_SPP_TRACE_LEN)
+
+#define SPP_TRACE_BEGIN(stage, chan) \
+    spp_trace_record((stage), (chan), 0)
+#define SPP_TRACE_END(stage, chan, arg) \
+    spp_trace_record((stage), SPP_TRACE_FLAG_END | (chan), (arg))
+
+void spp_trace_record(uint8_t stage, uint8_t flags, uint32_t arg);
+void spp_trace_freeze(bool is_frozen);
+uint32_t spp_trace_snapshot(uint32_t *first);
+void spp_trace_get(uint32_t index, spp_trace_event_t *event);
+
+#else
+
+#define SPP_TRACE_BEGIN(stage, chan)        do { } while (0)
+#define SPP_TRACE_END(stage, chan, arg)     do { } while (0)
+
+#endif
@@ -1,89 +1,73 @@
 #include "esp32_spp_server.h"
+#include "str_buf.h"
 
 #include <stdlib.h>
 #include <stdint.h>
 
-#include "esp_log.h"
-
-typedef struct str_buf_node {
-    uint32_t len;
-    uint8_t *str;
-    struct str_buf_node *next;
-} str_buf_node_t;
+// Reassembly buffer for the prepared writes.
+//
+// Each fragment is placed at its attribute offset, so the whole queue ends
+// up as one contiguous span. A fragment with offset 0 starts the next long
+// write behind the current one.
+// The first fragment which does not fit spoils the whole queue, which is
+// then dropped at the execute, so the UART never gets a span with holes.
 
 typedef struct str_buf {
-    uint32_t node_count;
+    uint32_t base;
     uint32_t buff_size;
-    str_buf_node_t *first_node;
-    str_buf_node_t *last_node;
+    uint32_t write_size;
+    bool is_overflow;
+    uint8_t arena[SPP_DATA_MAX_LEN * SPP_PREP_QUEUE_DEPTH];
 } str_buf_t;
 
 static str_buf_t str_buf = {
-    .node_count = 0,
+    .base       = 0,
     .buff_size  = 0,
-    .first_node = NULL,
-    .last_node  = NULL,
 };
 
-static str_buf_node_t *str_buf_make_node(uint8_t *str, uint32_t len)
+bool str_buf_store(uint32_t offset, uint8_t *str, uint32_t len)
 {
-    str_buf_node_t *node = (str_buf_node_t *)malloc(sizeof(str_buf_node_t));
+    uint32_t pos;
 
-    if (node == NULL) {
-        ESP_LOGE(TAG_SPP, "Failed to malloc at %s.", __func__);
-        return NULL;
+    str_buf.write_size += len;
+    if (str_buf.is_overflow) {
+        return false;
     }
-
-    node->len = len;
-    node->str = (uint8_t *)malloc(len);
-    if (node->str == NULL) {
-        ESP_LOGE(TAG_SPP, "Failed to malloc at %s.", __func__);
-        free(node);
-        return NULL;
+    if ((offset == 0) && (str_buf.buff_size != 0)) {
+        str_buf.base = str_buf.buff_size;
     }
-    memcpy(node->str, str, len);
-    node->next = NULL;
-
-    return node;
-}
-
-void str_buf_store(uint8_t *str, uint32_t len)
-{
-    str_buf_node_t *node = str_buf_make_node(str, len);
 
-    str_buf.buff_size += node->len;
-    if (str_buf.last_node != NULL) {
-        str_buf.last_node->next = node;
+    pos = str_buf.base + offset;
+    if ((offset + len > SPP_DATA_MAX_LEN) || (pos + len > sizeof(str_buf.arena))) {
+        str_buf.is_overflow = true;
+        return false;
     }
-    str_buf.last_node = node;
+    memcpy(str_buf.arena + pos, str, len);
 
-    if (str_buf.node_count == 0) {
-        str_buf.first_node = node;
+    if (pos + len > str_buf.buff_size) {
+        str_buf.buff_size = pos + len;
     }
-    str_buf.node_count++;
+    return true;
 }
 
 void str_buf_clear(void)
 {
-    str_buf_node_t *node = str_buf.first_node;
-
-    while (node != NULL) {
-        free(node->str);
-        free(node);
-        node = node->next;
-    }
-    str_buf.node_count = 0;
+    str_buf.base = 0;
     str_buf.buff_size = 0;
-    str_buf.first_node = NULL;
-    str_buf.last_node = NULL;
+    str_buf.write_size = 0;
+    str_buf.is_overflow = false;
 }
 
-void str_buf_iter(void (*func)(uint8_t *, uint32_t))
+// Return the size of the span, or 0 if the queue overflowed.
+uint32_t str_buf_get(uint8_t **str)
 {
-    str_buf_node_t *node = str_buf.first_node;
+    *str = str_buf.arena;
 
-    while (node != NULL) {
-        func(node->str, node->len);
-        node = node->next;
-    }
+    return str_buf.is_overflow ? 0 : str_buf.buff_size;
+}
+
+// Return the bytes of all the fragments of a queue which overflowed, or 0.
+uint32_t str_buf_dropped(void)
+{
+    return str_buf.is_overflow ? str_buf.write_size : 0;
 }
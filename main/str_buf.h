@@ -1,5 +1,7 @@
 #include <stdint.h>
+#include <stdbool.h>
 
-void str_buf_store(uint8_t *str, uint32_t len);
+bool str_buf_store(uint32_t offset, uint8_t *str, uint32_t len);
 void str_buf_clear(void);
-void str_buf_iter(void (*func)(uint8_t *, uint32_t));
+uint32_t str_buf_get(uint8_t **str);
+uint32_t str_buf_dropped(void);
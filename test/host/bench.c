@@ -0,0 +1,318 @@
+#include "client.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Throughput and latency of the bridge in both directions, for each MTU and
+// traffic shape, on the simulated link, see sim.h.
+//
+// Downlink is the serial device to the central, uplink the central to the
+// serial device. The latency of a notification or of a UART chunk is the
+// time from its last byte leaving the sender, the serial line or the write
+// call of the central, to its arrival. BENCH_MS in the environment sets the
+// time each run sends for, 1000 ms by default.
+//
+// lost counts the bytes which never arrived, uart those of them the UART
+// driver dropped, corrupt the bytes which differ from the stream, which
+// follows from a loss. cong counts the congestion of the connection so far.
+// With RTS/CTS nothing may be lost in either direction, a run which loses
+// or corrupts any byte fails the bench.
+//
+// The round trip of a command is the time from its write to its response
+// on the status characteristic.
+
+#define BENCH_BAUD_RATE     (921600)
+#define BENCH_DRAIN_US      (500000)
+#define BENCH_COMMANDS      (50)
+
+static const uint16_t BENCH_MTU[] = { 23, 64, 128, 185, 247, 517 };
+
+typedef struct bench_shape {
+    const char *name;
+    uint32_t size;          // bytes per send
+    uint32_t period_us;     // between the sends, 0 back to back
+} bench_shape_t;
+
+static const bench_shape_t BENCH_SHAPE[] = {
+    { "bulk",   256,    0 },
+    { "burst",  1024,   50000 },
+    { "lines",  40,     10000 },
+};
+
+#define BENCH_MTU_NUM       (sizeof(BENCH_MTU) / sizeof(BENCH_MTU[0]))
+#define BENCH_SHAPE_NUM     (sizeof(BENCH_SHAPE) / sizeof(BENCH_SHAPE[0]))
+
+// A send, the bytes of the stream from offset on.
+typedef struct bench_chunk {
+    uint64_t offset;
+    uint32_t len;
+    int64_t start_us;
+    uint32_t byte_us;       // per byte on the serial line, 0 for a write
+} bench_chunk_t;
+
+typedef struct bench_run {
+    pthread_mutex_t lock;
+    bench_chunk_t *chunks;
+    uint32_t chunk_num;
+    uint32_t chunk_size;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t corrupt;
+    int64_t *samples;
+    uint32_t sample_num;
+    uint32_t sample_size;
+    int64_t first_us;
+    int64_t last_us;
+} bench_run_t;
+
+static bench_run_t run = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint8_t stream_byte(uint64_t offset)
+{
+    return (uint8_t)(offset ^ (offset >> 8) ^ (offset >> 16));
+}
+
+static void run_reset(void)
+{
+    pthread_mutex_lock(&(run.lock));
+    run.chunk_num = 0;
+    run.sent = 0;
+    run.received = 0;
+    run.corrupt = 0;
+    run.sample_num = 0;
+    run.first_us = 0;
+    run.last_us = 0;
+    pthread_mutex_unlock(&(run.lock));
+}
+
+static void run_add_chunk(uint32_t len, int64_t start_us, uint32_t byte_us)
+{
+    pthread_mutex_lock(&(run.lock));
+    if (run.chunk_num == run.chunk_size) {
+        run.chunk_size = (run.chunk_size != 0) ? (run.chunk_size * 2) : 1024;
+        run.chunks = realloc(run.chunks, run.chunk_size * sizeof(bench_chunk_t));
+    }
+    run.chunks[run.chunk_num].offset = run.sent;
+    run.chunks[run.chunk_num].len = len;
+    run.chunks[run.chunk_num].start_us = start_us;
+    run.chunks[run.chunk_num].byte_us = byte_us;
+    run.chunk_num++;
+    run.sent += len;
+    if (run.first_us == 0) {
+        run.first_us = start_us;
+    }
+    pthread_mutex_unlock(&(run.lock));
+}
+
+// Called with the lock held. When the byte at offset left the sender.
+static int64_t run_sent_us(uint64_t offset)
+{
+    uint32_t low = 0;
+    uint32_t high = run.chunk_num;
+
+    while ((high - low) > 1) {
+        uint32_t mid = (low + high) / 2;
+
+        if (run.chunks[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    if (run.chunk_num == 0) {
+        return 0;
+    }
+    if (run.chunks[low].byte_us == 0) {
+        return run.chunks[low].start_us;
+    }
+    return run.chunks[low].start_us + (offset - run.chunks[low].offset + 1) * run.chunks[low].byte_us;
+}
+
+static void run_receive(const uint8_t *data, uint32_t len, int64_t time_us)
+{
+    pthread_mutex_lock(&(run.lock));
+    for (uint32_t i = 0; i < len; i++) {
+        if (data[i] != stream_byte(run.received + i)) {
+            run.corrupt++;
+        }
+    }
+    run.received += len;
+    run.last_us = time_us;
+    if (run.sample_num == run.sample_size) {
+        run.sample_size = (run.sample_size != 0) ? (run.sample_size * 2) : 4096;
+        run.samples = realloc(run.samples, run.sample_size * sizeof(int64_t));
+    }
+    run.samples[run.sample_num++] = time_us - run_sent_us(run.received - 1);
+    pthread_mutex_unlock(&(run.lock));
+}
+
+static void handle_data(client_t *client, uint32_t chan, const uint8_t *value, uint32_t len,
+                        int64_t time_us, void *arg)
+{
+    if (chan == 0) {
+        run_receive(value, len, time_us);
+    }
+}
+
+static void handle_uart(uart_port_t port, const uint8_t *data, uint32_t len,
+                        int64_t time_us, void *arg)
+{
+    run_receive(data, len, time_us);
+}
+
+// Wait until the receiver got everything, or stopped getting anything.
+static void run_drain(void)
+{
+    uint64_t received = UINT64_MAX;
+
+    while (1) {
+        pthread_mutex_lock(&(run.lock));
+        if ((run.received >= run.sent) || (run.received == received)) {
+            pthread_mutex_unlock(&(run.lock));
+            return;
+        }
+        received = run.received;
+        pthread_mutex_unlock(&(run.lock));
+        sim_sleep_us(BENCH_DRAIN_US);
+    }
+}
+
+static void run_send(client_t *client, bool is_uplink, const bench_shape_t *shape,
+                     int64_t duration_us)
+{
+    uint8_t buf[1024];
+    uint32_t byte_us = 10 * 1000000 / sim_uart_baud(CLIENT_CHAN0_UART);
+    int64_t start = sim_time_us();
+    int64_t next = start;
+
+    while (sim_time_us() < (start + duration_us)) {
+        int64_t now;
+
+        for (uint32_t i = 0; i < shape->size; i++) {
+            buf[i] = stream_byte(run.sent + i);
+        }
+        if (shape->period_us != 0) {
+            sim_sleep_us(next - sim_time_us());
+            next += shape->period_us;
+        }
+        now = sim_time_us();
+        if (is_uplink) {
+            if (!client_send(client, 0, buf, shape->size)) {
+                printf("bench: no credits for the uplink\n");
+                break;
+            }
+            run_add_chunk(shape->size, now, 0);
+        } else {
+            run_add_chunk(shape->size, now, byte_us);
+            sim_uart_send(CLIENT_CHAN0_UART, buf, shape->size);
+        }
+    }
+    run_drain();
+}
+
+// Return false if the run lost or corrupted any byte.
+static bool run_report(const char *dir, const bench_shape_t *shape, uint16_t mtu,
+                       const sim_link_stats_t *stats, uint32_t uart_dropped)
+{
+    int64_t span;
+    double rate;
+    bool is_intact;
+
+    pthread_mutex_lock(&(run.lock));
+    sort_samples(run.samples, run.sample_num);
+    span = run.last_us - run.first_us;
+    rate = (span > 0) ? (run.received * 1000000.0 / span) : 0;
+    printf("%-8s %-6s %4u %10.0f %8.2f %8.2f %8llu %8u %8llu %7u %6u\n",
+           dir, shape->name, mtu, rate,
+           percentile(run.samples, run.sample_num, 50) / 1000.0,
+           percentile(run.samples, run.sample_num, 99) / 1000.0,
+           (unsigned long long)(run.sent - run.received), uart_dropped,
+           (unsigned long long)run.corrupt, stats->interval_us / 1000, stats->congest);
+    is_intact = (run.received == run.sent) && (run.corrupt == 0) && (uart_dropped == 0);
+    pthread_mutex_unlock(&(run.lock));
+    return is_intact;
+}
+
+static void bench_commands(client_t *client)
+{
+    static int64_t samples[BENCH_COMMANDS];
+    uint8_t arg[2] = { 0, 0 };
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < BENCH_COMMANDS; i++) {
+        int64_t sent = sim_time_us();
+
+        if (client_command(client, SPP_CMD_STATUS_PERIOD, arg, sizeof(arg)) == SPP_CMD_OK) {
+            pthread_mutex_lock(&(client->lock));
+            samples[count++] = client->response_us - sent;
+            pthread_mutex_unlock(&(client->lock));
+        }
+    }
+    sort_samples(samples, count);
+    printf("%u commands, round trip p50 %.2f ms, p99 %.2f ms\n", count,
+           percentile(samples, count, 50) / 1000.0, percentile(samples, count, 99) / 1000.0);
+}
+
+int main(void)
+{
+    const char *env = getenv("BENCH_MS");
+    int64_t duration_us = ((env != NULL) ? atoi(env) : 1000) * 1000LL;
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    uint8_t arg[4];
+    client_t client;
+    uint32_t failures = 0;
+
+    sim_boot();
+    sim_uart_set_sink(CLIENT_CHAN0_UART, handle_uart, NULL);
+
+    if (!client_connect(&client, &config, handle_data, NULL)) {
+        printf("bench: no connection\n");
+        return 1;
+    }
+    put_le32(arg, BENCH_BAUD_RATE);
+    if (client_command(&client, SPP_CMD_UART_BAUD, arg, 4) != SPP_CMD_OK) {
+        printf("bench: failed to set the baud rate\n");
+        return 1;
+    }
+    arg[0] = 1;
+    if (client_command(&client, SPP_CMD_UART_FLOW, arg, 1) != SPP_CMD_OK) {
+        printf("bench: failed to set the flow control\n");
+        return 1;
+    }
+    bench_commands(&client);
+    client_disconnect(&client);
+
+    printf("UART %u baud with RTS/CTS, %lld ms per run\n",
+           BENCH_BAUD_RATE, (long long)(duration_us / 1000));
+    printf("%-8s %-6s %4s %10s %8s %8s %8s %8s %8s %7s %6s\n", "dir", "shape", "mtu",
+           "bytes/s", "p50 ms", "p99 ms", "lost", "uart", "corrupt", "int ms", "cong");
+    for (uint32_t m = 0; m < BENCH_MTU_NUM; m++) {
+        config.mtu = BENCH_MTU[m];
+        if (!client_connect(&client, &config, handle_data, NULL)) {
+            printf("bench: no connection at MTU %u\n", BENCH_MTU[m]);
+            return 1;
+        }
+        for (uint32_t s = 0; s < BENCH_SHAPE_NUM; s++) {
+            for (uint32_t d = 0; d < 2; d++) {
+                uint32_t dropped = sim_uart_dropped(CLIENT_CHAN0_UART);
+                sim_link_stats_t stats;
+
+                run_reset();
+                run_send(&client, d == 1, &(BENCH_SHAPE[s]), duration_us);
+                sim_central_stats(client.central, &stats);
+                if (!run_report((d == 1) ? "uplink" : "downlink", &(BENCH_SHAPE[s]),
+                                BENCH_MTU[m], &stats,
+                                sim_uart_dropped(CLIENT_CHAN0_UART) - dropped)) {
+                    failures++;
+                }
+            }
+        }
+        client_disconnect(&client);
+    }
+    printf("%s: %u runs lost data\n", (failures == 0) ? "PASS" : "FAIL", failures);
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,259 @@
+#include "client.h"
+#include "sim_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint32_t check_failures = 0;
+
+static const uint8_t CHAN_NOTIFY_IDX[SPP_CHAN_NUM] = {
+    SPP_IDX_SPP_DATA_NOTIFY_VAL,
+#if SPP_CHAN_NUM > 1
+    SPP_IDX_SPP_DATA1_NOTIFY_VAL,
+#endif
+#if SPP_CHAN_NUM > 2
+    SPP_IDX_SPP_DATA2_NOTIFY_VAL,
+#endif
+};
+
+static const uint8_t CHAN_RECV_IDX[SPP_CHAN_NUM] = {
+    SPP_IDX_SPP_DATA_RECV_VAL,
+#if SPP_CHAN_NUM > 1
+    SPP_IDX_SPP_DATA1_RECV_VAL,
+#endif
+#if SPP_CHAN_NUM > 2
+    SPP_IDX_SPP_DATA2_RECV_VAL,
+#endif
+};
+
+static const uint8_t CHAN_CFG_IDX[SPP_CHAN_NUM] = {
+    SPP_IDX_SPP_DATA_NOTIFY_CFG,
+#if SPP_CHAN_NUM > 1
+    SPP_IDX_SPP_DATA1_NOTIFY_CFG,
+#endif
+#if SPP_CHAN_NUM > 2
+    SPP_IDX_SPP_DATA2_NOTIFY_CFG,
+#endif
+};
+
+void put_le16(uint8_t *buf, uint16_t value)
+{
+    buf[0] = value;
+    buf[1] = value >> 8;
+}
+
+void put_le32(uint8_t *buf, uint32_t value)
+{
+    put_le16(buf, value);
+    put_le16(buf + 2, value >> 16);
+}
+
+static void handle_status(client_t *client, const uint8_t *value, uint32_t len, int64_t time_us)
+{
+    pthread_mutex_lock(&(client->lock));
+    client->status_records++;
+    switch (value[0]) {
+    case SPP_STATUS_CREDIT: {
+        spp_credit_t credit;
+
+        if ((len >= sizeof(credit)) && (value[1] < SPP_CHAN_NUM)) {
+            memcpy(&credit, value, sizeof(credit));
+            client->granted[credit.channel] = credit.granted;
+            client->credit_records++;
+        }
+        break;
+    }
+    case SPP_STATUS_TELEMETRY:
+        client->telemetry_count++;
+        break;
+    case SPP_STATUS_RESPONSE:
+        if (len >= sizeof(spp_response_t)) {
+            memcpy(&(client->response), value, sizeof(spp_response_t));
+            client->response_count++;
+            client->response_us = time_us;
+        }
+        break;
+    case SPP_STATUS_OTA:
+        if (len >= sizeof(spp_ota_status_t)) {
+            memcpy(&(client->ota), value, sizeof(spp_ota_status_t));
+            client->ota_count++;
+        }
+        break;
+    default:
+        break;
+    }
+    pthread_cond_broadcast(&(client->cond));
+    pthread_mutex_unlock(&(client->lock));
+}
+
+static void handle_notify(sim_central_t *central, uint16_t handle, const uint8_t *value,
+                          uint32_t len, int64_t time_us, void *arg)
+{
+    client_t *client = arg;
+
+    if ((handle == CLIENT_HANDLE(SPP_IDX_SPP_STATUS_VAL)) && (len != 0)) {
+        handle_status(client, value, len, time_us);
+        return;
+    }
+    for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+        if ((handle == CLIENT_HANDLE(CHAN_NOTIFY_IDX[i])) && (client->data_cb != NULL)) {
+            client->data_cb(client, i, value, len, time_us, client->arg);
+        }
+    }
+}
+
+bool client_wait(client_t *client, bool (*cond)(client_t *client, void *arg), void *arg,
+                 int64_t timeout_us)
+{
+    int64_t deadline = sim_time_us() + timeout_us;
+    bool is_done;
+
+    pthread_mutex_lock(&(client->lock));
+    while (!(is_done = cond(client, arg)) &&
+           sim_cond_wait(&(client->cond), &(client->lock), deadline)) {
+    }
+    pthread_mutex_unlock(&(client->lock));
+
+    return is_done;
+}
+
+static bool has_credits(client_t *client, void *arg)
+{
+    for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+        if (client->granted[i] == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool client_connect(client_t *client, const sim_link_config_t *config,
+                    client_data_cb_t data_cb, void *arg)
+{
+    static const uint8_t ENABLE[2] = { 0x01, 0x00 };
+
+    memset(client, 0, sizeof(client_t));
+    pthread_mutex_init(&(client->lock), NULL);
+    sim_cond_init(&(client->cond));
+    client->data_cb = data_cb;
+    client->arg = arg;
+
+    client->central = sim_central_connect(config, handle_notify, client);
+    if (client->central == NULL) {
+        return false;
+    }
+    for (uint32_t i = 0; i < SPP_CHAN_NUM; i++) {
+        sim_central_write_req(client->central, CLIENT_HANDLE(CHAN_CFG_IDX[i]),
+                              ENABLE, sizeof(ENABLE));
+    }
+    sim_central_write_req(client->central, CLIENT_HANDLE(SPP_IDX_SPP_STATUS_CFG),
+                          ENABLE, sizeof(ENABLE));
+
+    return client_wait(client, has_credits, NULL, CLIENT_WAIT_US);
+}
+
+void client_disconnect(client_t *client)
+{
+    sim_central_disconnect(client->central);
+    client->central = NULL;
+}
+
+typedef struct response_wait {
+    uint32_t count;
+    uint8_t id;
+} response_wait_t;
+
+static bool has_response(client_t *client, void *arg)
+{
+    response_wait_t *wait = arg;
+
+    return (client->response_count != wait->count) && (client->response.id == wait->id);
+}
+
+int32_t client_command(client_t *client, uint8_t id, const void *arg, uint32_t len)
+{
+    uint8_t cmd[SPP_CMD_MAX_LEN];
+    response_wait_t wait = {
+        .id = id,
+    };
+
+    if (len > (sizeof(cmd) - 1)) {
+        return -1;
+    }
+    cmd[0] = id;
+    if (len != 0) {
+        memcpy(cmd + 1, arg, len);
+    }
+    pthread_mutex_lock(&(client->lock));
+    wait.count = client->response_count;
+    pthread_mutex_unlock(&(client->lock));
+
+    if (!sim_central_write_req(client->central, CLIENT_HANDLE(SPP_IDX_SPP_COMMAND_VAL),
+                               cmd, len + 1) ||
+        !client_wait(client, has_response, &wait, CLIENT_WAIT_US)) {
+        return -1;
+    }
+    return client->response.result;
+}
+
+typedef struct credit_wait {
+    uint32_t chan;
+} credit_wait_t;
+
+static bool has_credit(client_t *client, void *arg)
+{
+    credit_wait_t *wait = arg;
+
+    return (int32_t)(client->granted[wait->chan] - client->sent[wait->chan]) > 0;
+}
+
+bool client_send(client_t *client, uint32_t chan, const uint8_t *data, uint32_t len)
+{
+    uint32_t size = sim_central_mtu(client->central) - 3;
+    credit_wait_t wait = {
+        .chan = chan,
+    };
+
+    while (len != 0) {
+        uint32_t part = (len < size) ? len : size;
+        uint32_t avail;
+
+        if (!client_wait(client, has_credit, &wait, CLIENT_WAIT_US)) {
+            return false;
+        }
+        pthread_mutex_lock(&(client->lock));
+        avail = client->granted[chan] - client->sent[chan];
+        part = (part < avail) ? part : avail;
+        client->sent[chan] += part;
+        pthread_mutex_unlock(&(client->lock));
+
+        if (!sim_central_write(client->central, CLIENT_HANDLE(CHAN_RECV_IDX[chan]), data, part)) {
+            return false;
+        }
+        data += part;
+        len -= part;
+    }
+    return true;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+void sort_samples(int64_t *samples, uint32_t count)
+{
+    qsort(samples, count, sizeof(int64_t), compare_samples);
+}
+
+int64_t percentile(const int64_t *sorted, uint32_t count, uint32_t p)
+{
+    if (count == 0) {
+        return 0;
+    }
+    return sorted[((uint64_t)(count - 1) * p) / 100];
+}
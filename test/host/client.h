@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "sim.h"
+#include "esp32_spp_server.h"
+
+// An SPP client on a simulated central, for the tests and the benchmark.
+//
+// It enables the data and status notifications, keeps the credits of the
+// SPP_STATUS_CREDIT records, and waits for the SPP_STATUS_RESPONSE of a
+// command. The data notifications go to the callback given at the connection.
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+// The fake Bluedroid hands out the handles in a row from this one, see
+// fake/bt.c.
+#define CLIENT_HANDLE_BASE      (40)
+#define CLIENT_HANDLE(idx)      (CLIENT_HANDLE_BASE + (idx))
+
+// The UART of channel 0, see spp_chan in esp32_spp_server.c.
+#define CLIENT_CHAN0_UART       UART_NUM_0
+
+#define CLIENT_WAIT_US          (2000000)
+
+typedef struct client client_t;
+
+typedef void (*client_data_cb_t)(client_t *client, uint32_t chan, const uint8_t *value,
+                                 uint32_t len, int64_t time_us, void *arg);
+
+struct client {
+    sim_central_t *central;
+    client_data_cb_t data_cb;
+    void *arg;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t granted[SPP_CHAN_NUM];
+    uint32_t sent[SPP_CHAN_NUM];
+    uint32_t credit_records;
+    spp_response_t response;
+    uint32_t response_count;
+    int64_t response_us;
+    spp_ota_status_t ota;
+    uint32_t ota_count;
+    uint32_t telemetry_count;
+    uint32_t status_records;
+};
+
+bool client_connect(client_t *client, const sim_link_config_t *config,
+                    client_data_cb_t data_cb, void *arg);
+void client_disconnect(client_t *client);
+
+// Send a command and wait for its response. Return the spp_cmd_result_t,
+// or -1 if none came.
+int32_t client_command(client_t *client, uint8_t id, const void *arg, uint32_t len);
+
+// Write the data to the channel in writes of up to the MTU, each once the
+// credits allow it. Return false if the credits did not come in time.
+bool client_send(client_t *client, uint32_t chan, const uint8_t *data, uint32_t len);
+
+// Wait until cond() holds or timeout_us passed. Return cond().
+bool client_wait(client_t *client, bool (*cond)(client_t *client, void *arg), void *arg,
+                 int64_t timeout_us);
+
+void put_le16(uint8_t *buf, uint16_t value);
+void put_le32(uint8_t *buf, uint32_t value);
+
+// Percentile p of count sorted values.
+int64_t percentile(const int64_t *sorted, uint32_t count, uint32_t p);
+void sort_samples(int64_t *samples, uint32_t count);
+
+// Print the test result and count the failures, see CHECK().
+extern uint32_t check_failures;
+
+#define CHECK(cond, ...) do {                                               \
+        if (!(cond)) {                                                      \
+            printf("FAIL %s:%d: %s: ", __FILE__, __LINE__, #cond);          \
+            printf(__VA_ARGS__);                                            \
+            printf("\n");                                                   \
+            check_failures++;                                               \
+        }                                                                   \
+    } while (0)
+
+#endif
@@ -0,0 +1,1201 @@
+#include "sim_internal.h"
+#include "sim.h"
+
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_gap_ble_api.h"
+#include "esp_gatt_common_api.h"
+#include "esp_gatts_api.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bluedroid and the link layer.
+//
+// The BTC task is one thread which runs the messages posted by the API calls
+// and the link, in order, and calls the GATTS and GAP callbacks from there.
+// Each connection has a link thread, which runs one connection event per
+// interval, see sim.h. bt_lock keeps all the state below.
+
+#define SIM_GATTS_IF                (3)
+#define SIM_ATTR_HANDLE_BASE        (40)
+#define SIM_ATTR_MAX                (64)
+#define SIM_CONN_MAX                (8)
+// The first interval a central picks, before the server asks for another.
+#define SIM_CONN_INITIAL_US         (30000)
+// Time of an event which is kept free for the radio to switch and schedule.
+#define SIM_EVENT_GAP_US            (1250)
+// LE 1M PHY: 1 us per bit, 10 bytes of preamble, access address, header
+// and CRC per PDU, and 150 us between the PDUs.
+#define SIM_PDU_OVERHEAD            (10)
+#define SIM_IFS_US                  (150)
+#define SIM_LL_LEN_MIN              (27)
+#define SIM_LL_LEN_MAX              (251)
+#define SIM_L2CAP_HDR_LEN           (4)
+#define SIM_CONNECT_WAIT_US         (3000000)
+
+typedef enum {
+    SIM_ATT_NOTIFY,
+    SIM_ATT_WRITE_CMD,
+    SIM_ATT_WRITE_REQ,
+    SIM_ATT_PREP_WRITE,
+    SIM_ATT_EXEC_WRITE,
+} sim_att_op_t;
+
+// An L2CAP SDU, one ATT PDU.
+typedef struct sim_sdu {
+    struct sim_sdu *next;
+    sim_att_op_t op;
+    uint16_t handle;
+    uint16_t offset;
+    uint32_t size;          // on the air, with the ATT and L2CAP headers
+    uint32_t sent;
+    uint64_t *done_seq;     // set to the BTC message of a request
+    uint32_t len;
+    uint8_t value[];
+} sim_sdu_t;
+
+typedef struct sim_sdu_queue {
+    sim_sdu_t *head;
+    sim_sdu_t *tail;
+    uint32_t count;
+} sim_sdu_queue_t;
+
+struct sim_central {
+    sim_link_config_t config;
+    sim_notify_cb_t cb;
+    void *arg;
+
+    uint16_t conn_id;
+    esp_bd_addr_t bda;
+    bool is_connected;
+    bool is_encrypted;
+    uint16_t mtu;
+    uint16_t ll_len;
+    uint32_t interval_us;
+    uint32_t next_interval_us;
+    pthread_t link_thread;
+
+    sim_sdu_queue_t up;
+    sim_sdu_queue_t down;
+    bool is_congested;
+
+    uint32_t read_trans_id;
+    bool is_read_done;
+    int32_t read_len;
+    uint8_t read_value[ESP_GATT_MAX_ATTR_LEN];
+
+    sim_link_stats_t stats;
+};
+
+typedef struct btc_msg btc_msg_t;
+typedef void (*btc_handler_t)(btc_msg_t *msg);
+
+struct btc_msg {
+    btc_msg_t *next;
+    btc_handler_t handler;
+    uint64_t seq;
+    uint32_t event;
+    uint16_t conn_id;
+    esp_bd_addr_t bda;
+    union {
+        esp_ble_gatts_cb_param_t gatts;
+        esp_ble_gap_cb_param_t gap;
+    } param;
+    uint32_t len;
+    uint8_t data[];
+};
+
+typedef struct sim_attr {
+    bool is_auto_rsp;
+    uint16_t len;
+    uint8_t value[ESP_GATT_MAX_ATTR_LEN];
+} sim_attr_t;
+
+static pthread_mutex_t bt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bt_cond;
+static bool is_bt_started;
+
+static esp_gatts_cb_t gatts_cb = NULL;
+static esp_gap_ble_cb_t gap_cb = NULL;
+static uint16_t local_mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+static bool is_registered;
+static bool is_advertising;
+
+// The security parameters of the server.
+static esp_ble_auth_req_t sm_auth_req = ESP_LE_AUTH_NO_BOND;
+static esp_ble_io_cap_t sm_iocap = ESP_IO_CAP_NONE;
+static uint32_t sm_passkey;
+static bool has_passkey;
+
+static sim_attr_t attr_table[SIM_ATTR_MAX];
+static uint16_t attr_handles[SIM_ATTR_MAX];
+static uint32_t attr_num;
+
+static btc_msg_t *btc_head = NULL;
+static btc_msg_t *btc_tail = NULL;
+static uint64_t btc_posted;
+static uint64_t btc_done;
+
+static sim_central_t *conn_table[SIM_CONN_MAX];
+static uint16_t next_conn_id;
+static uint32_t next_trans_id = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+// BTC task
+static btc_msg_t *btc_new(btc_handler_t handler, uint32_t event, const void *data, uint32_t len)
+{
+    btc_msg_t *msg = calloc(1, sizeof(btc_msg_t) + len);
+
+    msg->handler = handler;
+    msg->event = event;
+    msg->len = len;
+    if (len != 0) {
+        memcpy(msg->data, data, len);
+    }
+    return msg;
+}
+
+// Called with bt_lock held. Return the sequence number, see btc_wait_locked().
+static uint64_t btc_post_locked(btc_msg_t *msg)
+{
+    msg->seq = ++btc_posted;
+    if (btc_tail == NULL) {
+        btc_head = msg;
+    } else {
+        btc_tail->next = msg;
+    }
+    btc_tail = msg;
+    pthread_cond_broadcast(&bt_cond);
+
+    return msg->seq;
+}
+
+static uint64_t btc_post(btc_msg_t *msg)
+{
+    uint64_t seq;
+
+    pthread_mutex_lock(&bt_lock);
+    seq = btc_post_locked(msg);
+    pthread_mutex_unlock(&bt_lock);
+
+    return seq;
+}
+
+// Wait until the BTC task has run the message seq.
+static void btc_wait_locked(uint64_t seq)
+{
+    while (btc_done < seq) {
+        sim_cond_wait(&bt_cond, &bt_lock, SIM_FOREVER);
+    }
+}
+
+static void *btc_task(void *arg)
+{
+    pthread_mutex_lock(&bt_lock);
+    while (1) {
+        btc_msg_t *msg = btc_head;
+
+        if (msg == NULL) {
+            sim_cond_wait(&bt_cond, &bt_lock, SIM_FOREVER);
+            continue;
+        }
+        btc_head = msg->next;
+        if (btc_head == NULL) {
+            btc_tail = NULL;
+        }
+        pthread_mutex_unlock(&bt_lock);
+
+        msg->handler(msg);
+
+        pthread_mutex_lock(&bt_lock);
+        btc_done = msg->seq;
+        pthread_cond_broadcast(&bt_cond);
+        free(msg);
+    }
+    return NULL;
+}
+
+static void btc_gatts_event(btc_msg_t *msg)
+{
+    if (gatts_cb != NULL) {
+        gatts_cb(msg->event, SIM_GATTS_IF, &(msg->param.gatts));
+    }
+}
+
+static void btc_gap_event(btc_msg_t *msg)
+{
+    if (gap_cb != NULL) {
+        gap_cb(msg->event, &(msg->param.gap));
+    }
+}
+
+static void post_gatts_locked(esp_gatts_cb_event_t event, esp_ble_gatts_cb_param_t *param)
+{
+    btc_msg_t *msg = btc_new(btc_gatts_event, event, NULL, 0);
+
+    msg->param.gatts = *param;
+    btc_post_locked(msg);
+}
+
+static void post_gap_locked(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param)
+{
+    btc_msg_t *msg = btc_new(btc_gap_event, event, NULL, 0);
+
+    msg->param.gap = *param;
+    btc_post_locked(msg);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Connections
+static sim_central_t *find_conn(uint16_t conn_id)
+{
+    for (uint32_t i = 0; i < SIM_CONN_MAX; i++) {
+        if ((conn_table[i] != NULL) && (conn_table[i]->conn_id == conn_id)) {
+            return conn_table[i];
+        }
+    }
+    return NULL;
+}
+
+static sim_central_t *find_conn_by_bda(const esp_bd_addr_t bda)
+{
+    for (uint32_t i = 0; i < SIM_CONN_MAX; i++) {
+        if ((conn_table[i] != NULL) &&
+            (memcmp(conn_table[i]->bda, bda, sizeof(esp_bd_addr_t)) == 0)) {
+            return conn_table[i];
+        }
+    }
+    return NULL;
+}
+
+static void sdu_push(sim_sdu_queue_t *queue, sim_sdu_t *sdu)
+{
+    sdu->next = NULL;
+    if (queue->tail == NULL) {
+        queue->head = sdu;
+    } else {
+        queue->tail->next = sdu;
+    }
+    queue->tail = sdu;
+    queue->count++;
+}
+
+static sim_sdu_t *sdu_pop(sim_sdu_queue_t *queue)
+{
+    sim_sdu_t *sdu = queue->head;
+
+    if (sdu != NULL) {
+        queue->head = sdu->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        queue->count--;
+    }
+    return sdu;
+}
+
+static void sdu_clear(sim_sdu_queue_t *queue)
+{
+    sim_sdu_t *sdu;
+
+    while ((sdu = sdu_pop(queue)) != NULL) {
+        free(sdu);
+    }
+}
+
+static sim_sdu_t *sdu_new(sim_att_op_t op, uint16_t handle, uint16_t offset,
+                          const uint8_t *value, uint32_t len)
+{
+    static const uint32_t ATT_HDR_LEN[] = {
+        [SIM_ATT_NOTIFY]        = 3,
+        [SIM_ATT_WRITE_CMD]     = 3,
+        [SIM_ATT_WRITE_REQ]     = 3,
+        [SIM_ATT_PREP_WRITE]    = 5,
+        [SIM_ATT_EXEC_WRITE]    = 2,
+    };
+    sim_sdu_t *sdu = calloc(1, sizeof(sim_sdu_t) + len);
+
+    sdu->op = op;
+    sdu->handle = handle;
+    sdu->offset = offset;
+    sdu->size = SIM_L2CAP_HDR_LEN + ATT_HDR_LEN[op] + len;
+    sdu->len = len;
+    if (len != 0) {
+        memcpy(sdu->value, value, len);
+    }
+    return sdu;
+}
+
+// Called with bt_lock held. The link thread stops at its next event.
+static void conn_close_locked(sim_central_t *central, int reason)
+{
+    esp_ble_gatts_cb_param_t param = {
+        .disconnect = {
+            .conn_id = central->conn_id,
+            .reason = reason,
+        },
+    };
+
+    if (!central->is_connected) {
+        return;
+    }
+    central->is_connected = false;
+    for (uint32_t i = 0; i < SIM_CONN_MAX; i++) {
+        if (conn_table[i] == central) {
+            conn_table[i] = NULL;
+        }
+    }
+    memcpy(param.disconnect.remote_bda, central->bda, sizeof(esp_bd_addr_t));
+    post_gatts_locked(ESP_GATTS_DISCONNECT_EVT, &param);
+    pthread_cond_broadcast(&bt_cond);
+}
+
+// A write of the central reached the server.
+static void btc_write(btc_msg_t *msg)
+{
+    msg->param.gatts.write.value = msg->data;
+    btc_gatts_event(msg);
+}
+
+static uint64_t post_write_locked(sim_central_t *central, sim_sdu_t *sdu)
+{
+    btc_msg_t *msg;
+
+    if (sdu->op == SIM_ATT_EXEC_WRITE) {
+        msg = btc_new(btc_gatts_event, ESP_GATTS_EXEC_WRITE_EVT, NULL, 0);
+        msg->param.gatts.exec_write.conn_id = central->conn_id;
+        msg->param.gatts.exec_write.trans_id = next_trans_id++;
+        msg->param.gatts.exec_write.exec_write_flag = sdu->value[0];
+        memcpy(msg->param.gatts.exec_write.bda, central->bda, sizeof(esp_bd_addr_t));
+        return btc_post_locked(msg);
+    }
+    msg = btc_new(btc_write, ESP_GATTS_WRITE_EVT, sdu->value, sdu->len);
+    msg->param.gatts.write.conn_id = central->conn_id;
+    msg->param.gatts.write.trans_id = next_trans_id++;
+    msg->param.gatts.write.handle = sdu->handle;
+    msg->param.gatts.write.offset = sdu->offset;
+    msg->param.gatts.write.need_rsp = (sdu->op != SIM_ATT_WRITE_CMD);
+    msg->param.gatts.write.is_prep = (sdu->op == SIM_ATT_PREP_WRITE);
+    msg->param.gatts.write.len = sdu->len;
+    memcpy(msg->param.gatts.write.bda, central->bda, sizeof(esp_bd_addr_t));
+    return btc_post_locked(msg);
+}
+
+// What an event delivers, once its last PDU is over the air.
+typedef struct sim_delivery {
+    int64_t time_us;
+    bool is_down;
+    sim_sdu_t *sdu;
+} sim_delivery_t;
+
+#define SIM_EVENT_DELIVERY_MAX      (64)
+
+// Run one connection event. Called with bt_lock held.
+static uint32_t run_event(sim_central_t *central, int64_t start, sim_delivery_t *delivery)
+{
+    int64_t budget = central->interval_us - SIM_EVENT_GAP_US;
+    int64_t used = 0;
+    uint32_t exchanges = 0;
+    uint32_t count = 0;
+
+    central->stats.events++;
+    while (count < (SIM_EVENT_DELIVERY_MAX - 1)) {
+        sim_sdu_t *up = central->up.head;
+        sim_sdu_t *down = central->down.head;
+        uint32_t m = (up != NULL) ? up->size - up->sent : 0;
+        uint32_t s = (down != NULL) ? down->size - down->sent : 0;
+        int64_t cost;
+
+        m = (m < central->ll_len) ? m : central->ll_len;
+        s = (s < central->ll_len) ? s : central->ll_len;
+        if ((exchanges != 0) && (m == 0) && (s == 0)) {
+            break;
+        }
+        if ((central->config.event_pdus != 0) && (exchanges >= central->config.event_pdus)) {
+            break;
+        }
+        cost = (m + SIM_PDU_OVERHEAD) * 8 + SIM_IFS_US + (s + SIM_PDU_OVERHEAD) * 8 + SIM_IFS_US;
+        if ((exchanges != 0) && ((used + cost) > budget)) {
+            break;
+        }
+        used += cost;
+        exchanges++;
+
+        if (m != 0) {
+            central->stats.up_pdus++;
+            up->sent += m;
+            if (up->sent == up->size) {
+                delivery[count].time_us = start + used - cost / 2;
+                delivery[count].is_down = false;
+                delivery[count++].sdu = sdu_pop(&(central->up));
+                pthread_cond_broadcast(&bt_cond);
+            }
+        }
+        if (s != 0) {
+            central->stats.down_pdus++;
+            down->sent += s;
+            if (down->sent == down->size) {
+                delivery[count].time_us = start + used;
+                delivery[count].is_down = true;
+                delivery[count++].sdu = sdu_pop(&(central->down));
+                if (central->is_congested &&
+                    (central->down.count <= (central->config.l2cap_quota / 2))) {
+                    esp_ble_gatts_cb_param_t param = {
+                        .congest = {
+                            .conn_id = central->conn_id,
+                            .congested = false,
+                        },
+                    };
+
+                    central->is_congested = false;
+                    post_gatts_locked(ESP_GATTS_CONGEST_EVT, &param);
+                }
+            }
+        }
+        if ((m == 0) && (s == 0)) {
+            break;
+        }
+    }
+    return count;
+}
+
+static void *link_thread(void *arg)
+{
+    sim_central_t *central = arg;
+    sim_delivery_t delivery[SIM_EVENT_DELIVERY_MAX];
+    int64_t next;
+
+    pthread_mutex_lock(&bt_lock);
+    next = sim_time_us() + central->interval_us;
+    while (central->is_connected) {
+        uint32_t count;
+
+        if (sim_cond_wait(&bt_cond, &bt_lock, next)) {
+            continue;
+        }
+        if (central->next_interval_us != 0) {
+            central->interval_us = central->next_interval_us;
+            central->next_interval_us = 0;
+        }
+        count = run_event(central, next, delivery);
+        next += central->interval_us;
+        // NOTE: A host which falls behind skips the events it missed.
+        if (next < sim_time_us()) {
+            next = sim_time_us() + central->interval_us;
+        }
+        pthread_mutex_unlock(&bt_lock);
+
+        for (uint32_t i = 0; i < count; i++) {
+            sim_sdu_t *sdu = delivery[i].sdu;
+
+            sim_sleep_until(delivery[i].time_us);
+            if (delivery[i].is_down) {
+                if (central->cb != NULL) {
+                    central->cb(central, sdu->handle, sdu->value, sdu->len,
+                                delivery[i].time_us, central->arg);
+                }
+            } else {
+                uint64_t seq;
+
+                pthread_mutex_lock(&bt_lock);
+                if (central->is_connected) {
+                    seq = post_write_locked(central, sdu);
+                    if (sdu->done_seq != NULL) {
+                        *(sdu->done_seq) = seq;
+                        pthread_cond_broadcast(&bt_cond);
+                    }
+                }
+                pthread_mutex_unlock(&bt_lock);
+            }
+            free(sdu);
+        }
+        pthread_mutex_lock(&bt_lock);
+    }
+    pthread_mutex_unlock(&bt_lock);
+
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Controller and Bluedroid
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t *cfg)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode)
+{
+    return (mode == ESP_BT_MODE_BLE) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_bluedroid_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_bluedroid_enable(void)
+{
+    pthread_mutex_lock(&bt_lock);
+    if (!is_bt_started) {
+        is_bt_started = true;
+        sim_cond_init(&bt_cond);
+        sim_thread_start(btc_task, NULL);
+    }
+    pthread_mutex_unlock(&bt_lock);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t mtu)
+{
+    if ((mtu < ESP_GATT_DEF_BLE_MTU_SIZE) || (mtu > ESP_GATT_MAX_MTU_SIZE)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&bt_lock);
+    local_mtu = mtu;
+    pthread_mutex_unlock(&bt_lock);
+
+    return ESP_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// GATTS
+esp_err_t esp_ble_gatts_register_callback(esp_gatts_cb_t callback)
+{
+    gatts_cb = callback;
+    return ESP_OK;
+}
+
+static void btc_app_register(btc_msg_t *msg)
+{
+    pthread_mutex_lock(&bt_lock);
+    is_registered = true;
+    pthread_mutex_unlock(&bt_lock);
+    btc_gatts_event(msg);
+}
+
+esp_err_t esp_ble_gatts_app_register(uint16_t app_id)
+{
+    btc_msg_t *msg = btc_new(btc_app_register, ESP_GATTS_REG_EVT, NULL, 0);
+
+    msg->param.gatts.reg.status = ESP_GATT_OK;
+    msg->param.gatts.reg.app_id = app_id;
+    btc_post(msg);
+
+    return ESP_OK;
+}
+
+// NOTE: The handles of a service are consecutive, as in Bluedroid.
+esp_err_t esp_ble_gatts_create_attr_tab(const esp_gatts_attr_db_t *gatts_attr_db,
+                                        esp_gatt_if_t gatts_if, uint8_t max_nb_attr,
+                                        uint8_t srvc_inst_id)
+{
+    btc_msg_t *msg;
+
+    if ((gatts_if != SIM_GATTS_IF) || (max_nb_attr > SIM_ATTR_MAX)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&bt_lock);
+    attr_num = max_nb_attr;
+    for (uint32_t i = 0; i < attr_num; i++) {
+        const esp_attr_desc_t *desc = &(gatts_attr_db[i].att_desc);
+        sim_attr_t *attr = &(attr_table[i]);
+
+        attr->is_auto_rsp = (gatts_attr_db[i].attr_control.auto_rsp == ESP_GATT_AUTO_RSP);
+        attr->len = (desc->length < sizeof(attr->value)) ? desc->length : sizeof(attr->value);
+        if ((desc->value != NULL) && (attr->len != 0)) {
+            memcpy(attr->value, desc->value, attr->len);
+        }
+        attr_handles[i] = SIM_ATTR_HANDLE_BASE + i;
+    }
+    msg = btc_new(btc_gatts_event, ESP_GATTS_CREAT_ATTR_TAB_EVT, NULL, 0);
+    msg->param.gatts.add_attr_tab.status = ESP_GATT_OK;
+    msg->param.gatts.add_attr_tab.svc_inst_id = srvc_inst_id;
+    msg->param.gatts.add_attr_tab.num_handle = attr_num;
+    msg->param.gatts.add_attr_tab.handles = attr_handles;
+    btc_post_locked(msg);
+    pthread_mutex_unlock(&bt_lock);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_start_service(uint16_t service_handle)
+{
+    btc_msg_t *msg = btc_new(btc_gatts_event, ESP_GATTS_START_EVT, NULL, 0);
+
+    msg->param.gatts.start.status = ESP_GATT_OK;
+    msg->param.gatts.start.service_handle = service_handle;
+    btc_post(msg);
+
+    return ESP_OK;
+}
+
+// Queue the notification in L2CAP. As in Bluedroid, the L2CAP queue above
+// its quota reports the congestion before ESP_GATTS_CONF_EVT, which then
+// carries ESP_GATT_CONGESTED.
+static void btc_notify(btc_msg_t *msg)
+{
+    sim_central_t *central;
+    esp_ble_gatts_cb_param_t param = {
+        .conf = {
+            .status = ESP_GATT_OK,
+            .conn_id = msg->conn_id,
+            .handle = msg->param.gatts.conf.handle,
+        },
+    };
+    uint32_t len = msg->len;
+    bool is_congest = false;
+
+    pthread_mutex_lock(&bt_lock);
+    central = find_conn(msg->conn_id);
+    if (central == NULL) {
+        pthread_mutex_unlock(&bt_lock);
+        return;
+    }
+    if (len > (uint32_t)(central->mtu - 3)) {
+        len = central->mtu - 3;
+        central->stats.truncated++;
+    }
+    sdu_push(&(central->down), sdu_new(SIM_ATT_NOTIFY, param.conf.handle, 0, msg->data, len));
+    central->stats.notifications++;
+    if (!central->is_congested && (central->down.count > central->config.l2cap_quota)) {
+        central->is_congested = true;
+        central->stats.congest++;
+        is_congest = true;
+    }
+    if (central->is_congested) {
+        param.conf.status = ESP_GATT_CONGESTED;
+    }
+    pthread_mutex_unlock(&bt_lock);
+
+    if ((gatts_cb != NULL) && is_congest) {
+        esp_ble_gatts_cb_param_t congest = {
+            .congest = {
+                .conn_id = msg->conn_id,
+                .congested = true,
+            },
+        };
+
+        gatts_cb(ESP_GATTS_CONGEST_EVT, SIM_GATTS_IF, &congest);
+    }
+    param.conf.len = len;
+    param.conf.value = msg->data;
+    if (gatts_cb != NULL) {
+        gatts_cb(ESP_GATTS_CONF_EVT, SIM_GATTS_IF, &param);
+    }
+}
+
+// NOTE: Only the notifications are simulated, need_confirm is ignored.
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t gatts_if, uint16_t conn_id,
+                                      uint16_t attr_handle, uint16_t value_len,
+                                      uint8_t *value, bool need_confirm)
+{
+    btc_msg_t *msg;
+
+    if (gatts_if != SIM_GATTS_IF) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    msg = btc_new(btc_notify, ESP_GATTS_CONF_EVT, value, value_len);
+    msg->conn_id = conn_id;
+    msg->param.gatts.conf.handle = attr_handle;
+    btc_post(msg);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_send_response(esp_gatt_if_t gatts_if, uint16_t conn_id,
+                                      uint32_t trans_id, esp_gatt_status_t status,
+                                      esp_gatt_rsp_t *rsp)
+{
+    sim_central_t *central;
+
+    pthread_mutex_lock(&bt_lock);
+    central = find_conn(conn_id);
+    if ((central != NULL) && (central->read_trans_id == trans_id)) {
+        central->read_len = (status == ESP_GATT_OK) ? rsp->attr_value.len : -1;
+        if (central->read_len > 0) {
+            memcpy(central->read_value, rsp->attr_value.value, central->read_len);
+        }
+        central->is_read_done = true;
+        pthread_cond_broadcast(&bt_cond);
+    }
+    pthread_mutex_unlock(&bt_lock);
+
+    return ESP_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// GAP
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t callback)
+{
+    gap_cb = callback;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_device_name(const char *name)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_config_adv_data_raw(uint8_t *raw_data, uint32_t raw_data_len)
+{
+    btc_msg_t *msg;
+
+    if (raw_data_len > 31) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    msg = btc_new(btc_gap_event, ESP_GAP_BLE_ADV_DATA_RAW_SET_COMPLETE_EVT, NULL, 0);
+    msg->param.gap.adv_data_raw_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    btc_post(msg);
+
+    return ESP_OK;
+}
+
+// NOTE: The controller refuses to start the advertising which runs already.
+static void btc_adv_start(btc_msg_t *msg)
+{
+    pthread_mutex_lock(&bt_lock);
+    msg->param.gap.adv_start_cmpl.status = is_advertising ? ESP_BT_STATUS_FAIL :
+                                                            ESP_BT_STATUS_SUCCESS;
+    is_advertising = true;
+    pthread_cond_broadcast(&bt_cond);
+    pthread_mutex_unlock(&bt_lock);
+    btc_gap_event(msg);
+}
+
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t *adv_params)
+{
+    btc_post(btc_new(btc_adv_start, ESP_GAP_BLE_ADV_START_COMPLETE_EVT, NULL, 0));
+    return ESP_OK;
+}
+
+static void btc_adv_stop(btc_msg_t *msg)
+{
+    pthread_mutex_lock(&bt_lock);
+    is_advertising = false;
+    pthread_mutex_unlock(&bt_lock);
+    msg->param.gap.adv_stop_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    btc_gap_event(msg);
+}
+
+esp_err_t esp_ble_gap_stop_advertising(void)
+{
+    btc_post(btc_new(btc_adv_stop, ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT, NULL, 0));
+    return ESP_OK;
+}
+
+// The central takes the shortest interval asked for which it accepts, from
+// the next event on.
+static void btc_update_conn_params(btc_msg_t *msg)
+{
+    struct ble_update_conn_params_evt_param *params = &(msg->param.gap.update_conn_params);
+    sim_central_t *central;
+
+    pthread_mutex_lock(&bt_lock);
+    central = find_conn_by_bda(params->bda);
+    if (central == NULL) {
+        pthread_mutex_unlock(&bt_lock);
+        return;
+    }
+    central->next_interval_us = params->min_int * 1250;
+    if (central->next_interval_us < central->config.interval_min_us) {
+        central->next_interval_us = central->config.interval_min_us;
+    }
+    if (central->next_interval_us > (uint32_t)(params->max_int * 1250)) {
+        central->next_interval_us = params->max_int * 1250;
+    }
+    params->conn_int = central->next_interval_us / 1250;
+    pthread_mutex_unlock(&bt_lock);
+    btc_gap_event(msg);
+}
+
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t *params)
+{
+    btc_msg_t *msg = btc_new(btc_update_conn_params, ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT, NULL, 0);
+
+    memcpy(msg->param.gap.update_conn_params.bda, params->bda, sizeof(esp_bd_addr_t));
+    msg->param.gap.update_conn_params.min_int = params->min_int;
+    msg->param.gap.update_conn_params.max_int = params->max_int;
+    msg->param.gap.update_conn_params.latency = params->latency;
+    msg->param.gap.update_conn_params.timeout = params->timeout;
+    btc_post(msg);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_pkt_data_len(esp_bd_addr_t remote_device, uint16_t tx_data_length)
+{
+    sim_central_t *central;
+
+    if ((tx_data_length < SIM_LL_LEN_MIN) || (tx_data_length > SIM_LL_LEN_MAX)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&bt_lock);
+    central = find_conn_by_bda(remote_device);
+    if ((central != NULL) && central->config.dle) {
+        central->ll_len = tx_data_length;
+    }
+    pthread_mutex_unlock(&bt_lock);
+
+    return ESP_OK;
+}
+
+static void btc_disconnect(btc_msg_t *msg)
+{
+    sim_central_t *central;
+
+    pthread_mutex_lock(&bt_lock);
+    central = find_conn_by_bda(msg->bda);
+    if (central != NULL) {
+        // NOTE: 0x16, the connection terminated by the local host.
+        conn_close_locked(central, 0x16);
+    }
+    pthread_mutex_unlock(&bt_lock);
+}
+
+esp_err_t esp_ble_gap_disconnect(esp_bd_addr_t remote_device)
+{
+    btc_msg_t *msg = btc_new(btc_disconnect, 0, NULL, 0);
+
+    memcpy(msg->bda, remote_device, sizeof(esp_bd_addr_t));
+    btc_post(msg);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_security_param(esp_ble_sm_param_t param_type, void *value,
+                                         uint8_t len)
+{
+    if ((value == NULL) || (len == 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&bt_lock);
+    switch (param_type) {
+    case ESP_BLE_SM_AUTHEN_REQ_MODE:
+        sm_auth_req = *(esp_ble_auth_req_t *)value;
+        break;
+    case ESP_BLE_SM_IOCAP_MODE:
+        sm_iocap = *(esp_ble_io_cap_t *)value;
+        break;
+    case ESP_BLE_SM_SET_STATIC_PASSKEY:
+        memcpy(&sm_passkey, value, sizeof(sm_passkey));
+        has_passkey = true;
+        break;
+    default:
+        break;
+    }
+    pthread_mutex_unlock(&bt_lock);
+
+    return ESP_OK;
+}
+
+// Pair with the central, which accepts if its config says so. A server which
+// asks for MITM and can show a passkey takes the static one, which the central
+// must enter. Otherwise the pairing is Just Works, without MITM.
+static void btc_pair(btc_msg_t *msg)
+{
+    esp_ble_gap_cb_param_t param = {
+        .ble_security.auth_cmpl.success = false,
+    };
+    sim_central_t *central;
+
+    pthread_mutex_lock(&bt_lock);
+    central = find_conn_by_bda(msg->bda);
+    if (central == NULL) {
+        pthread_mutex_unlock(&bt_lock);
+        return;
+    }
+    // NOTE: event is set if the server accepted the pairing of the central.
+    if ((msg->event == 0) || !central->config.pairs) {
+        // NOTE: 0x05, pairing not supported.
+        param.ble_security.auth_cmpl.fail_reason = 0x05;
+    } else if (((sm_auth_req & ESP_LE_AUTH_REQ_MITM) != 0) && (sm_iocap == ESP_IO_CAP_OUT) &&
+               has_passkey) {
+        if (central->config.passkey == sm_passkey) {
+            central->is_encrypted = true;
+            param.ble_security.auth_cmpl.success = true;
+            param.ble_security.auth_cmpl.auth_mode = sm_auth_req;
+        } else {
+            // NOTE: 0x01, passkey entry failed.
+            param.ble_security.auth_cmpl.fail_reason = 0x01;
+        }
+    } else {
+        central->is_encrypted = true;
+        param.ble_security.auth_cmpl.success = true;
+        param.ble_security.auth_cmpl.auth_mode = sm_auth_req & ~ESP_LE_AUTH_REQ_MITM;
+    }
+    memcpy(param.ble_security.auth_cmpl.bd_addr, msg->bda, sizeof(esp_bd_addr_t));
+    post_gap_locked(ESP_GAP_BLE_AUTH_CMPL_EVT, &param);
+    pthread_mutex_unlock(&bt_lock);
+}
+
+esp_err_t esp_ble_gap_security_rsp(esp_bd_addr_t bd_addr, bool accept)
+{
+    btc_msg_t *msg = btc_new(btc_pair, accept, NULL, 0);
+
+    memcpy(msg->bda, bd_addr, sizeof(esp_bd_addr_t));
+    btc_post(msg);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_set_encryption(esp_bd_addr_t bd_addr, esp_ble_sec_act_t sec_act)
+{
+    return esp_ble_gap_security_rsp(bd_addr, true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Central
+sim_central_t *sim_central_connect(const sim_link_config_t *config,
+                                   sim_notify_cb_t cb, void *arg)
+{
+    int64_t deadline = sim_time_us() + SIM_CONNECT_WAIT_US;
+    sim_central_t *central;
+    esp_ble_gatts_cb_param_t param = { 0 };
+    uint32_t slot;
+
+    pthread_mutex_lock(&bt_lock);
+    while (!is_bt_started || !is_registered || !is_advertising) {
+        if (!is_bt_started) {
+            pthread_mutex_unlock(&bt_lock);
+            sim_sleep_us(SIM_TICK_US);
+            pthread_mutex_lock(&bt_lock);
+        } else if (!sim_cond_wait(&bt_cond, &bt_lock, deadline)) {
+            break;
+        }
+        if (sim_time_us() >= deadline) {
+            break;
+        }
+    }
+    for (slot = 0; slot < SIM_CONN_MAX; slot++) {
+        if (conn_table[slot] == NULL) {
+            break;
+        }
+    }
+    if (!is_advertising || (slot == SIM_CONN_MAX)) {
+        pthread_mutex_unlock(&bt_lock);
+        return NULL;
+    }
+    central = calloc(1, sizeof(sim_central_t));
+    central->config = *config;
+    central->cb = cb;
+    central->arg = arg;
+    central->conn_id = next_conn_id++;
+    central->bda[0] = 0x02;
+    central->bda[4] = central->conn_id >> 8;
+    central->bda[5] = central->conn_id;
+    central->mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
+    central->ll_len = SIM_LL_LEN_MIN;
+    central->interval_us = (config->interval_min_us > SIM_CONN_INITIAL_US) ?
+                           config->interval_min_us : SIM_CONN_INITIAL_US;
+    central->is_connected = true;
+    conn_table[slot] = central;
+    // NOTE: The controller stops advertising at the connection.
+    is_advertising = false;
+
+    param.connect.conn_id = central->conn_id;
+    param.connect.conn_params.interval = central->interval_us / 1250;
+    memcpy(param.connect.remote_bda, central->bda, sizeof(esp_bd_addr_t));
+    post_gatts_locked(ESP_GATTS_CONNECT_EVT, &param);
+
+    // The central starts with the MTU exchange.
+    central->mtu = (config->mtu < local_mtu) ? config->mtu : local_mtu;
+    memset(&param, 0, sizeof(param));
+    param.mtu.conn_id = central->conn_id;
+    param.mtu.mtu = central->mtu;
+    post_gatts_locked(ESP_GATTS_MTU_EVT, &param);
+    btc_wait_locked(btc_posted);
+    if (pthread_create(&(central->link_thread), NULL, link_thread, central) != 0) {
+        perror("pthread_create");
+        abort();
+    }
+    pthread_mutex_unlock(&bt_lock);
+
+    return central;
+}
+
+// NOTE: The bytes still queued on the link are lost.
+void sim_central_disconnect(sim_central_t *central)
+{
+    pthread_mutex_lock(&bt_lock);
+    // NOTE: 0x13, the connection terminated by the remote user.
+    conn_close_locked(central, 0x13);
+    btc_wait_locked(btc_posted);
+    pthread_mutex_unlock(&bt_lock);
+
+    pthread_join(central->link_thread, NULL);
+    sdu_clear(&(central->up));
+    sdu_clear(&(central->down));
+    free(central);
+}
+
+bool sim_central_is_connected(sim_central_t *central)
+{
+    bool is_connected;
+
+    pthread_mutex_lock(&bt_lock);
+    is_connected = central->is_connected;
+    pthread_mutex_unlock(&bt_lock);
+
+    return is_connected;
+}
+
+bool sim_central_is_encrypted(sim_central_t *central)
+{
+    bool is_encrypted;
+
+    pthread_mutex_lock(&bt_lock);
+    is_encrypted = central->is_encrypted;
+    pthread_mutex_unlock(&bt_lock);
+
+    return is_encrypted;
+}
+
+uint16_t sim_central_mtu(sim_central_t *central)
+{
+    uint16_t mtu;
+
+    pthread_mutex_lock(&bt_lock);
+    mtu = central->mtu;
+    pthread_mutex_unlock(&bt_lock);
+
+    return mtu;
+}
+
+void sim_central_stats(sim_central_t *central, sim_link_stats_t *stats)
+{
+    pthread_mutex_lock(&bt_lock);
+    *stats = central->stats;
+    stats->interval_us = central->interval_us;
+    stats->mtu = central->mtu;
+    stats->ll_len = central->ll_len;
+    pthread_mutex_unlock(&bt_lock);
+}
+
+// Queue an ATT PDU of the central. A request waits until the server handled it.
+static bool central_send(sim_central_t *central, sim_sdu_t *sdu, bool is_request)
+{
+    uint64_t done_seq = 0;
+
+    sdu->done_seq = is_request ? &done_seq : NULL;
+    pthread_mutex_lock(&bt_lock);
+    while (central->is_connected && (central->up.count >= central->config.write_queue)) {
+        sim_cond_wait(&bt_cond, &bt_lock, SIM_FOREVER);
+    }
+    if (!central->is_connected) {
+        pthread_mutex_unlock(&bt_lock);
+        free(sdu);
+        return false;
+    }
+    sdu_push(&(central->up), sdu);
+    while (is_request && central->is_connected && (done_seq == 0)) {
+        sim_cond_wait(&bt_cond, &bt_lock, SIM_FOREVER);
+    }
+    if (is_request && (done_seq != 0)) {
+        btc_wait_locked(done_seq);
+    }
+    pthread_mutex_unlock(&bt_lock);
+
+    return !is_request || (done_seq != 0);
+}
+
+bool sim_central_write(sim_central_t *central, uint16_t handle,
+                       const uint8_t *value, uint32_t len)
+{
+    if (len > (uint32_t)(sim_central_mtu(central) - 3)) {
+        return false;
+    }
+    return central_send(central, sdu_new(SIM_ATT_WRITE_CMD, handle, 0, value, len), false);
+}
+
+bool sim_central_write_req(sim_central_t *central, uint16_t handle,
+                           const uint8_t *value, uint32_t len)
+{
+    if (len > (uint32_t)(sim_central_mtu(central) - 3)) {
+        return false;
+    }
+    return central_send(central, sdu_new(SIM_ATT_WRITE_REQ, handle, 0, value, len), true);
+}
+
+bool sim_central_write_long(sim_central_t *central, uint16_t handle,
+                            const uint8_t *value, uint32_t len)
+{
+    uint32_t size = sim_central_mtu(central) - 5;
+    uint8_t exec = ESP_GATT_PREP_WRITE_EXEC;
+
+    for (uint32_t offset = 0; offset < len; offset += size) {
+        uint32_t part = ((len - offset) < size) ? (len - offset) : size;
+
+        if (!central_send(central, sdu_new(SIM_ATT_PREP_WRITE, handle, offset,
+                                           value + offset, part), true)) {
+            return false;
+        }
+    }
+    return central_send(central, sdu_new(SIM_ATT_EXEC_WRITE, 0, 0, &exec, 1), true);
+}
+
+int32_t sim_central_read(sim_central_t *central, uint16_t handle, uint16_t offset,
+                         uint8_t *buf, uint32_t size)
+{
+    btc_msg_t *msg;
+    int32_t len;
+
+    pthread_mutex_lock(&bt_lock);
+    if (!central->is_connected || (handle < SIM_ATTR_HANDLE_BASE) ||
+        (handle >= (SIM_ATTR_HANDLE_BASE + attr_num))) {
+        pthread_mutex_unlock(&bt_lock);
+        return -1;
+    }
+    if (attr_table[handle - SIM_ATTR_HANDLE_BASE].is_auto_rsp) {
+        sim_attr_t *attr = &(attr_table[handle - SIM_ATTR_HANDLE_BASE]);
+
+        len = (offset > attr->len) ? -1 : (attr->len - offset);
+        len = (len > (int32_t)(central->mtu - 1)) ? (central->mtu - 1) : len;
+        len = (len > (int32_t)size) ? (int32_t)size : len;
+        if (len > 0) {
+            memcpy(buf, attr->value + offset, len);
+        }
+        pthread_mutex_unlock(&bt_lock);
+        return len;
+    }
+    msg = btc_new(btc_gatts_event, ESP_GATTS_READ_EVT, NULL, 0);
+    msg->param.gatts.read.conn_id = central->conn_id;
+    msg->param.gatts.read.trans_id = next_trans_id++;
+    msg->param.gatts.read.handle = handle;
+    msg->param.gatts.read.offset = offset;
+    msg->param.gatts.read.is_long = (offset != 0);
+    msg->param.gatts.read.need_rsp = true;
+    memcpy(msg->param.gatts.read.bda, central->bda, sizeof(esp_bd_addr_t));
+    central->read_trans_id = msg->param.gatts.read.trans_id;
+    central->is_read_done = false;
+    btc_wait_locked(btc_post_locked(msg));
+    while (central->is_connected && !central->is_read_done) {
+        sim_cond_wait(&bt_cond, &bt_lock, SIM_FOREVER);
+    }
+    len = central->is_read_done ? central->read_len : -1;
+    len = (len > (int32_t)size) ? (int32_t)size : len;
+    if (len > 0) {
+        memcpy(buf, central->read_value, len);
+    }
+    pthread_mutex_unlock(&bt_lock);
+
+    return len;
+}
+
+void sim_central_pair(sim_central_t *central)
+{
+    esp_ble_gap_cb_param_t param = { 0 };
+
+    memcpy(param.ble_security.ble_req.bd_addr, central->bda, sizeof(esp_bd_addr_t));
+    pthread_mutex_lock(&bt_lock);
+    post_gap_locked(ESP_GAP_BLE_SEC_REQ_EVT, &param);
+    btc_wait_locked(btc_posted);
+    pthread_mutex_unlock(&bt_lock);
+}
@@ -0,0 +1,668 @@
+#include "sim_internal.h"
+#include "sim.h"
+
+#include "freertos/task.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_sleep.h"
+#include "esp_pm.h"
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "xtensa/hal.h"
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The rest of the ESP-IDF layer: time, log, NVS, flash, OTA, PM, heap.
+
+// Heap of the ESP32 left to the application with Bluedroid running.
+#define SIM_HEAP_SIZE           (160 * 1024)
+#define SIM_FLASH_SECTOR_SIZE   (4096)
+#define SIM_FLASH_BLOCK_SIZE    (65536)
+#define SIM_NVS_ENTRY_MAX       (32)
+#define SIM_NVS_KEY_MAX_LEN     (16)
+#define SIM_NVS_BLOB_MAX_LEN    (1984)
+
+////////////////////////////////////////////////////////////////////////////////
+// Time and log
+int64_t esp_timer_get_time(void)
+{
+    return sim_time_us();
+}
+
+uint32_t xthal_get_ccount(void)
+{
+    return (uint32_t)(sim_time_us() * SIM_CPU_MHZ);
+}
+
+uint32_t sim_log_time_ms(void)
+{
+    return sim_time_us() / 1000;
+}
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_level = -1;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    // NOTE: The level applies to every tag.
+    pthread_mutex_lock(&log_lock);
+    log_level = level;
+    pthread_mutex_unlock(&log_lock);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    va_list args;
+
+    pthread_mutex_lock(&log_lock);
+    if (log_level < 0) {
+        const char *env = getenv("SIM_LOG_LEVEL");
+
+        log_level = (env != NULL) ? atoi(env) : ESP_LOG_WARN;
+    }
+    if ((int)level <= log_level) {
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+void sim_error_check_failed(esp_err_t err, const char *file, int line, const char *expr)
+{
+    fprintf(stderr, "ESP_ERROR_CHECK failed: esp_err_t 0x%x at %s:%d\nexpression: %s\n",
+            err, file, line, expr);
+    abort();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// NVS
+typedef struct sim_nvs_entry {
+    nvs_handle handle;
+    char key[SIM_NVS_KEY_MAX_LEN];
+    size_t len;
+    uint8_t value[SIM_NVS_BLOB_MAX_LEN];
+} sim_nvs_entry_t;
+
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool is_nvs_init;
+static sim_nvs_entry_t nvs_table[SIM_NVS_ENTRY_MAX];
+static char nvs_namespaces[SIM_NVS_ENTRY_MAX][SIM_NVS_KEY_MAX_LEN];
+
+esp_err_t nvs_flash_init(void)
+{
+    pthread_mutex_lock(&nvs_lock);
+    is_nvs_init = true;
+    pthread_mutex_unlock(&nvs_lock);
+
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    pthread_mutex_lock(&nvs_lock);
+    memset(nvs_table, 0, sizeof(nvs_table));
+    pthread_mutex_unlock(&nvs_lock);
+
+    return ESP_OK;
+}
+
+// The handle is the index of the namespace plus one.
+esp_err_t nvs_open(const char *name, nvs_open_mode open_mode, nvs_handle *out_handle)
+{
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+    if ((name == NULL) || (strlen(name) >= SIM_NVS_KEY_MAX_LEN)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&nvs_lock);
+    if (!is_nvs_init) {
+        err = ESP_ERR_INVALID_STATE;
+    } else {
+        for (uint32_t i = 0; i < SIM_NVS_ENTRY_MAX; i++) {
+            if (strcmp(nvs_namespaces[i], name) == 0) {
+                *out_handle = i + 1;
+                err = ESP_OK;
+                break;
+            }
+            if (nvs_namespaces[i][0] == '\0') {
+                // NOTE: A namespace opened read only is not created.
+                if (open_mode == NVS_READWRITE) {
+                    strcpy(nvs_namespaces[i], name);
+                    *out_handle = i + 1;
+                    err = ESP_OK;
+                }
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&nvs_lock);
+
+    return err;
+}
+
+void nvs_close(nvs_handle handle)
+{
+}
+
+esp_err_t nvs_commit(nvs_handle handle)
+{
+    return ESP_OK;
+}
+
+static sim_nvs_entry_t *nvs_find(nvs_handle handle, const char *key)
+{
+    for (uint32_t i = 0; i < SIM_NVS_ENTRY_MAX; i++) {
+        if ((nvs_table[i].handle == handle) && (strcmp(nvs_table[i].key, key) == 0)) {
+            return &(nvs_table[i]);
+        }
+    }
+    return NULL;
+}
+
+esp_err_t nvs_set_blob(nvs_handle handle, const char *key, const void *value, size_t length)
+{
+    sim_nvs_entry_t *entry;
+
+    if ((key == NULL) || (strlen(key) >= SIM_NVS_KEY_MAX_LEN)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (length > SIM_NVS_BLOB_MAX_LEN) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pthread_mutex_lock(&nvs_lock);
+    entry = nvs_find(handle, key);
+    if (entry == NULL) {
+        entry = nvs_find(0, "");
+    }
+    if (entry == NULL) {
+        pthread_mutex_unlock(&nvs_lock);
+        return ESP_ERR_NVS_NO_FREE_PAGES;
+    }
+    entry->handle = handle;
+    strcpy(entry->key, key);
+    entry->len = length;
+    memcpy(entry->value, value, length);
+    pthread_mutex_unlock(&nvs_lock);
+
+    return ESP_OK;
+}
+
+// NOTE: As in IDF, a NULL out_value asks for the length only.
+esp_err_t nvs_get_blob(nvs_handle handle, const char *key, void *out_value, size_t *length)
+{
+    sim_nvs_entry_t *entry;
+    esp_err_t err = ESP_OK;
+
+    pthread_mutex_lock(&nvs_lock);
+    entry = nvs_find(handle, key);
+    if (entry == NULL) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (out_value == NULL) {
+        *length = entry->len;
+    } else if (*length < entry->len) {
+        *length = entry->len;
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        *length = entry->len;
+        memcpy(out_value, entry->value, entry->len);
+    }
+    pthread_mutex_unlock(&nvs_lock);
+
+    return err;
+}
+
+esp_err_t nvs_erase_key(nvs_handle handle, const char *key)
+{
+    sim_nvs_entry_t *entry;
+
+    pthread_mutex_lock(&nvs_lock);
+    entry = nvs_find(handle, key);
+    if (entry != NULL) {
+        memset(entry, 0, sizeof(sim_nvs_entry_t));
+    }
+    pthread_mutex_unlock(&nvs_lock);
+
+    return (entry != NULL) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Flash
+//
+// The partitions of partitions.csv. As on the chip, a write can only clear
+// bits and an erase sets a sector to 0xff. With sim_flash_file() the flash
+// is also kept in the file, so it outlives the process.
+//
+// The calls take the time of a typical SPI NOR flash: a page program per
+// 256 bytes, a sector erase per 4 KB, and a block erase per aligned 64 KB.
+// Only the calling task waits.
+static const esp_partition_t PARTITION_TABLE[] = {
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, 0x9000, 0x6000, "nvs", false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_PHY, 0xf000, 0x1000, "phy_init", false },
+    { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 0x10000, 0xE0000, "ota_0", false },
+    { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 0xF0000, 0xE0000, "ota_1", false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA, 0x1D0000, 0x2000, "otadata", false },
+    { ESP_PARTITION_TYPE_DATA, 0x40, 0x1D2000, 0x2E000, "spp_log", false },
+};
+
+#define SIM_PARTITION_NUM   (sizeof(PARTITION_TABLE) / sizeof(PARTITION_TABLE[0]))
+#define SIM_FLASH_SIZE      (0x200000)
+#define SIM_FLASH_PAGE_US   (600)
+#define SIM_FLASH_SECTOR_US (45000)
+#define SIM_FLASH_BLOCK_US  (150000)
+
+static pthread_mutex_t flash_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *flash = NULL;
+static int flash_fd = -1;
+static const char *flash_path = NULL;
+static sim_flash_stats_t flash_stats[SIM_PARTITION_NUM];
+
+void sim_flash_file(const char *path)
+{
+    pthread_mutex_lock(&flash_lock);
+    flash_path = path;
+    pthread_mutex_unlock(&flash_lock);
+}
+
+// Called with flash_lock held. A new file starts erased.
+static void flash_init_locked(void)
+{
+    if (flash != NULL) {
+        return;
+    }
+    flash = malloc(SIM_FLASH_SIZE);
+    memset(flash, 0xff, SIM_FLASH_SIZE);
+    if (flash_path == NULL) {
+        return;
+    }
+    flash_fd = open(flash_path, O_RDWR | O_CREAT, 0644);
+    if (flash_fd < 0) {
+        perror(flash_path);
+        abort();
+    }
+    if (pread(flash_fd, flash, SIM_FLASH_SIZE, 0) != SIM_FLASH_SIZE) {
+        memset(flash, 0xff, SIM_FLASH_SIZE);
+        if (pwrite(flash_fd, flash, SIM_FLASH_SIZE, 0) != SIM_FLASH_SIZE) {
+            perror(flash_path);
+            abort();
+        }
+    }
+}
+
+static void flash_sync_locked(uint32_t address, uint32_t size)
+{
+    if ((flash_fd >= 0) && (pwrite(flash_fd, flash + address, size, address) != (ssize_t)size)) {
+        perror(flash_path);
+        abort();
+    }
+}
+
+static int32_t partition_index(const esp_partition_t *partition)
+{
+    if ((partition < PARTITION_TABLE) || (partition >= (PARTITION_TABLE + SIM_PARTITION_NUM))) {
+        return -1;
+    }
+    return partition - PARTITION_TABLE;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+                                                esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+    for (uint32_t i = 0; i < SIM_PARTITION_NUM; i++) {
+        const esp_partition_t *partition = &(PARTITION_TABLE[i]);
+
+        if ((partition->type == type) &&
+            ((subtype == ESP_PARTITION_SUBTYPE_ANY) || (partition->subtype == subtype)) &&
+            ((label == NULL) || (strcmp(partition->label, label) == 0))) {
+            return partition;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset,
+                             void *dst, size_t size)
+{
+    int32_t index = partition_index(partition);
+
+    if ((index < 0) || (dst == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if ((src_offset > partition->size) || (size > (partition->size - src_offset))) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pthread_mutex_lock(&flash_lock);
+    flash_init_locked();
+    memcpy(dst, flash + partition->address + src_offset, size);
+    flash_stats[index].reads++;
+    pthread_mutex_unlock(&flash_lock);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset,
+                              const void *src, size_t size)
+{
+    int32_t index = partition_index(partition);
+    const uint8_t *data = src;
+    uint8_t *dst;
+
+    if ((index < 0) || (src == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if ((dst_offset > partition->size) || (size > (partition->size - dst_offset))) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pthread_mutex_lock(&flash_lock);
+    flash_init_locked();
+    dst = flash + partition->address + dst_offset;
+    for (size_t i = 0; i < size; i++) {
+        dst[i] &= data[i];
+    }
+    flash_sync_locked(partition->address + dst_offset, size);
+    flash_stats[index].writes++;
+    flash_stats[index].write_bytes += size;
+    pthread_mutex_unlock(&flash_lock);
+    sim_sleep_us(((size + 255) / 256) * SIM_FLASH_PAGE_US);
+
+    return ESP_OK;
+}
+
+static int64_t erase_us(uint32_t addr, uint32_t size)
+{
+    int64_t us = 0;
+
+    while (size != 0) {
+        if (((addr % SIM_FLASH_BLOCK_SIZE) == 0) && (size >= SIM_FLASH_BLOCK_SIZE)) {
+            us += SIM_FLASH_BLOCK_US;
+            addr += SIM_FLASH_BLOCK_SIZE;
+            size -= SIM_FLASH_BLOCK_SIZE;
+        } else {
+            us += SIM_FLASH_SECTOR_US;
+            addr += SIM_FLASH_SECTOR_SIZE;
+            size -= SIM_FLASH_SECTOR_SIZE;
+        }
+    }
+    return us;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, uint32_t start_addr,
+                                    uint32_t size)
+{
+    int32_t index = partition_index(partition);
+
+    if (index < 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if ((start_addr > partition->size) || (size > (partition->size - start_addr))) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (((start_addr % SIM_FLASH_SECTOR_SIZE) != 0) || ((size % SIM_FLASH_SECTOR_SIZE) != 0)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pthread_mutex_lock(&flash_lock);
+    flash_init_locked();
+    memset(flash + partition->address + start_addr, 0xff, size);
+    flash_sync_locked(partition->address + start_addr, size);
+    flash_stats[index].erases++;
+    flash_stats[index].erase_bytes += size;
+    pthread_mutex_unlock(&flash_lock);
+    sim_sleep_us(erase_us(partition->address + start_addr, size));
+
+    return ESP_OK;
+}
+
+void sim_flash_stats(const char *label, sim_flash_stats_t *stats)
+{
+    const esp_partition_t *partition;
+
+    memset(stats, 0, sizeof(sim_flash_stats_t));
+    for (partition = PARTITION_TABLE; partition < (PARTITION_TABLE + SIM_PARTITION_NUM);
+         partition++) {
+        if (strcmp(partition->label, label) == 0) {
+            pthread_mutex_lock(&flash_lock);
+            *stats = flash_stats[partition_index(partition)];
+            pthread_mutex_unlock(&flash_lock);
+        }
+    }
+}
+
+const void *sim_flash_data(const char *label)
+{
+    const void *data = NULL;
+
+    for (uint32_t i = 0; i < SIM_PARTITION_NUM; i++) {
+        if (strcmp(PARTITION_TABLE[i].label, label) == 0) {
+            pthread_mutex_lock(&flash_lock);
+            flash_init_locked();
+            data = flash + PARTITION_TABLE[i].address;
+            pthread_mutex_unlock(&flash_lock);
+        }
+    }
+    return data;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// OTA
+//
+// NOTE: The running image is ota_0, the boot partition is kept in RAM.
+#define SIM_IMAGE_MAGIC     (0xE9)
+
+static const esp_partition_t *boot_partition = &(PARTITION_TABLE[2]);
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+    return &(PARTITION_TABLE[2]);
+}
+
+const esp_partition_t *esp_ota_get_boot_partition(void)
+{
+    const esp_partition_t *partition;
+
+    pthread_mutex_lock(&flash_lock);
+    partition = boot_partition;
+    pthread_mutex_unlock(&flash_lock);
+
+    return partition;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+    if (start_from == NULL) {
+        start_from = esp_ota_get_running_partition();
+    }
+    return (start_from == &(PARTITION_TABLE[2])) ? &(PARTITION_TABLE[3]) : &(PARTITION_TABLE[2]);
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    uint8_t magic;
+
+    if ((partition_index(partition) < 0) || (partition->type != ESP_PARTITION_TYPE_APP)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    esp_partition_read(partition, 0, &magic, sizeof(magic));
+    if (magic != SIM_IMAGE_MAGIC) {
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    pthread_mutex_lock(&flash_lock);
+    boot_partition = partition;
+    pthread_mutex_unlock(&flash_lock);
+
+    return ESP_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Power management
+struct sim_pm_lock {
+    esp_pm_lock_type_t type;
+    const char *name;
+    uint32_t count;
+};
+
+esp_err_t esp_pm_configure(const void *config)
+{
+    return (config != NULL) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char *name,
+                             esp_pm_lock_handle_t *handle)
+{
+    esp_pm_lock_handle_t lock = calloc(1, sizeof(struct sim_pm_lock));
+
+    if (lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    lock->type = lock_type;
+    lock->name = name;
+    *handle = lock;
+
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle)
+{
+    if (handle == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    __atomic_add_fetch(&(handle->count), 1, __ATOMIC_RELAXED);
+
+    return ESP_OK;
+}
+
+// NOTE: As in IDF, a release of a lock not held is an error.
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle)
+{
+    uint32_t count;
+
+    if (handle == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    count = __atomic_load_n(&(handle->count), __ATOMIC_RELAXED);
+    do {
+        if (count == 0) {
+            return ESP_ERR_INVALID_STATE;
+        }
+    } while (!__atomic_compare_exchange_n(&(handle->count), &count, count - 1, false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_uart_wakeup(int uart_num)
+{
+    return ((uart_num >= 0) && (uart_num < UART_NUM_MAX)) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// System and heap
+static uint32_t restart_count;
+
+void esp_restart(void)
+{
+    __atomic_add_fetch(&restart_count, 1, __ATOMIC_RELAXED);
+    vTaskDelete(NULL);
+    abort();
+}
+
+uint32_t sim_restart_count(void)
+{
+    return __atomic_load_n(&restart_count, __ATOMIC_RELAXED);
+}
+
+static sim_mem_stats_t mem_stats;
+static int64_t heap_used;
+static int64_t heap_used_max;
+
+void *sim_fw_malloc(size_t size)
+{
+    void *ptr = malloc(size);
+
+    if (ptr != NULL) {
+        int64_t used = __atomic_add_fetch(&heap_used, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+        int64_t max = __atomic_load_n(&heap_used_max, __ATOMIC_RELAXED);
+
+        while ((used > max) &&
+               !__atomic_compare_exchange_n(&heap_used_max, &max, used, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        __atomic_add_fetch(&(mem_stats.mallocs), 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&(mem_stats.alloc_bytes), size, __ATOMIC_RELAXED);
+    }
+    return ptr;
+}
+
+void *sim_fw_calloc(size_t num, size_t size)
+{
+    void *ptr = sim_fw_malloc(num * size);
+
+    if (ptr != NULL) {
+        memset(ptr, 0, num * size);
+    }
+    return ptr;
+}
+
+void sim_fw_free(void *ptr)
+{
+    if (ptr != NULL) {
+        __atomic_sub_fetch(&heap_used, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&(mem_stats.frees), 1, __ATOMIC_RELAXED);
+    }
+    free(ptr);
+}
+
+void *sim_fw_memcpy(void *dst, const void *src, size_t len)
+{
+    __atomic_add_fetch(&(mem_stats.copies), 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(mem_stats.copy_bytes), len, __ATOMIC_RELAXED);
+    return memcpy(dst, src, len);
+}
+
+void sim_mem_stats(sim_mem_stats_t *stats)
+{
+    stats->mallocs = __atomic_load_n(&(mem_stats.mallocs), __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&(mem_stats.frees), __ATOMIC_RELAXED);
+    stats->alloc_bytes = __atomic_load_n(&(mem_stats.alloc_bytes), __ATOMIC_RELAXED);
+    stats->copies = __atomic_load_n(&(mem_stats.copies), __ATOMIC_RELAXED);
+    stats->copy_bytes = __atomic_load_n(&(mem_stats.copy_bytes), __ATOMIC_RELAXED);
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return SIM_HEAP_SIZE - __atomic_load_n(&heap_used, __ATOMIC_RELAXED);
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+    return SIM_HEAP_SIZE - __atomic_load_n(&heap_used_max, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Boot
+extern void app_main(void);
+
+static void main_task(void *arg)
+{
+    app_main();
+    vTaskDelete(NULL);
+}
+
+// NOTE: As in IDF, app_main() runs in the main task, which returns to the
+// caller at once. sim_central_connect() waits for the advertising.
+void sim_boot(void)
+{
+    sim_time_us();
+    sim_timer_service_start();
+    xTaskCreate(main_task, "main", 3584, NULL, 1, NULL);
+}
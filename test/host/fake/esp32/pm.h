@@ -0,0 +1,14 @@
+#include <stdbool.h>
+
+#include "soc/rtc.h"
+
+#ifndef SIM_ESP32_PM_H
+#define SIM_ESP32_PM_H
+
+typedef struct {
+    rtc_cpu_freq_t max_cpu_freq;
+    rtc_cpu_freq_t min_cpu_freq;
+    bool light_sleep_enable;
+} esp_pm_config_esp32_t;
+
+#endif
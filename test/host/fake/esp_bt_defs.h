@@ -0,0 +1,37 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef SIM_ESP_BT_DEFS_H
+#define SIM_ESP_BT_DEFS_H
+
+#define ESP_BD_ADDR_LEN     (6)
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
+
+#define ESP_UUID_LEN_16     (2)
+#define ESP_UUID_LEN_32     (4)
+#define ESP_UUID_LEN_128    (16)
+
+typedef struct {
+    uint16_t len;
+    union {
+        uint16_t uuid16;
+        uint32_t uuid32;
+        uint8_t uuid128[ESP_UUID_LEN_128];
+    } uuid;
+} __attribute__((packed)) esp_bt_uuid_t;
+
+typedef enum {
+    ESP_BT_STATUS_SUCCESS = 0,
+    ESP_BT_STATUS_FAIL,
+    ESP_BT_STATUS_NOT_READY,
+    ESP_BT_STATUS_NOMEM,
+    ESP_BT_STATUS_BUSY,
+    ESP_BT_STATUS_DONE,
+} esp_bt_status_t;
+
+typedef enum {
+    BLE_ADDR_TYPE_PUBLIC = 0x00,
+    BLE_ADDR_TYPE_RANDOM = 0x01,
+} esp_ble_addr_type_t;
+
+#endif
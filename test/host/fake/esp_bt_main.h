@@ -0,0 +1,9 @@
+#include "esp_err.h"
+
+#ifndef SIM_ESP_BT_MAIN_H
+#define SIM_ESP_BT_MAIN_H
+
+esp_err_t esp_bluedroid_init(void);
+esp_err_t esp_bluedroid_enable(void);
+
+#endif
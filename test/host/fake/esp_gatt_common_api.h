@@ -0,0 +1,10 @@
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#ifndef SIM_ESP_GATT_COMMON_API_H
+#define SIM_ESP_GATT_COMMON_API_H
+
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t mtu);
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_bt_defs.h"
+#include "esp_gatt_defs.h"
+
+#ifndef SIM_ESP_GATTS_API_H
+#define SIM_ESP_GATTS_API_H
+
+// The GATT server of Bluedroid over the link of bt.c. Only the events and
+// the fields which main/ uses are filled in.
+typedef enum {
+    ESP_GATTS_REG_EVT = 0,
+    ESP_GATTS_READ_EVT = 1,
+    ESP_GATTS_WRITE_EVT = 2,
+    ESP_GATTS_EXEC_WRITE_EVT = 3,
+    ESP_GATTS_MTU_EVT = 4,
+    ESP_GATTS_CONF_EVT = 5,
+    ESP_GATTS_UNREG_EVT = 6,
+    ESP_GATTS_CREATE_EVT = 7,
+    ESP_GATTS_START_EVT = 12,
+    ESP_GATTS_CONNECT_EVT = 14,
+    ESP_GATTS_DISCONNECT_EVT = 15,
+    ESP_GATTS_CONGEST_EVT = 18,
+    ESP_GATTS_RESPONSE_EVT = 21,
+    ESP_GATTS_CREAT_ATTR_TAB_EVT = 22,
+} esp_gatts_cb_event_t;
+
+typedef union {
+    struct gatts_reg_evt_param {
+        esp_gatt_status_t status;
+        uint16_t app_id;
+    } reg;
+
+    struct gatts_read_evt_param {
+        uint16_t conn_id;
+        uint32_t trans_id;
+        esp_bd_addr_t bda;
+        uint16_t handle;
+        uint16_t offset;
+        bool is_long;
+        bool need_rsp;
+    } read;
+
+    struct gatts_write_evt_param {
+        uint16_t conn_id;
+        uint32_t trans_id;
+        esp_bd_addr_t bda;
+        uint16_t handle;
+        uint16_t offset;
+        bool need_rsp;
+        bool is_prep;
+        uint16_t len;
+        uint8_t *value;
+    } write;
+
+    struct gatts_exec_write_evt_param {
+        uint16_t conn_id;
+        uint32_t trans_id;
+        esp_bd_addr_t bda;
+#define ESP_GATT_PREP_WRITE_CANCEL  0x00
+#define ESP_GATT_PREP_WRITE_EXEC    0x01
+        uint8_t exec_write_flag;
+    } exec_write;
+
+    struct gatts_mtu_evt_param {
+        uint16_t conn_id;
+        uint16_t mtu;
+    } mtu;
+
+    struct gatts_conf_evt_param {
+        esp_gatt_status_t status;
+        uint16_t conn_id;
+        uint16_t handle;
+        uint16_t len;
+        uint8_t *value;
+    } conf;
+
+    struct gatts_start_evt_param {
+        esp_gatt_status_t status;
+        uint16_t service_handle;
+    } start;
+
+    struct gatts_connect_evt_param {
+        uint16_t conn_id;
+        esp_bd_addr_t remote_bda;
+        esp_gatt_conn_params_t conn_params;
+    } connect;
+
+    struct gatts_disconnect_evt_param {
+        uint16_t conn_id;
+        esp_bd_addr_t remote_bda;
+        int reason;
+    } disconnect;
+
+    struct gatts_congest_evt_param {
+        uint16_t conn_id;
+        bool congested;
+    } congest;
+
+    struct gatts_rsp_evt_param {
+        esp_gatt_status_t status;
+        uint16_t handle;
+    } rsp;
+
+    struct gatts_add_attr_tab_evt_param {
+        esp_gatt_status_t status;
+        esp_bt_uuid_t svc_uuid;
+        uint8_t svc_inst_id;
+        uint16_t num_handle;
+        uint16_t *handles;
+    } add_attr_tab;
+} esp_ble_gatts_cb_param_t;
+
+typedef void (*esp_gatts_cb_t)(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
+                               esp_ble_gatts_cb_param_t *param);
+
+esp_err_t esp_ble_gatts_register_callback(esp_gatts_cb_t callback);
+esp_err_t esp_ble_gatts_app_register(uint16_t app_id);
+esp_err_t esp_ble_gatts_create_attr_tab(const esp_gatts_attr_db_t *gatts_attr_db,
+                                        esp_gatt_if_t gatts_if, uint8_t max_nb_attr,
+                                        uint8_t srvc_inst_id);
+esp_err_t esp_ble_gatts_start_service(uint16_t service_handle);
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t gatts_if, uint16_t conn_id,
+                                      uint16_t attr_handle, uint16_t value_len,
+                                      uint8_t *value, bool need_confirm);
+esp_err_t esp_ble_gatts_send_response(esp_gatt_if_t gatts_if, uint16_t conn_id,
+                                      uint32_t trans_id, esp_gatt_status_t status,
+                                      esp_gatt_rsp_t *rsp);
+
+#endif
@@ -0,0 +1,35 @@
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#ifndef SIM_ESP_LOG_H
+#define SIM_ESP_LOG_H
+
+// The log goes to stderr. SIM_LOG_LEVEL in the environment sets the level,
+// 0 none to 5 verbose, 2 warnings by default.
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE,
+} esp_log_level_t;
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+
+#define ESP_LOG_LEVEL_(level, letter, tag, format, ...) \
+    esp_log_write((level), (tag), letter " (%u) %s: " format "\n", \
+                  (unsigned)(sim_log_time_ms()), (tag), ##__VA_ARGS__)
+
+uint32_t sim_log_time_ms(void);
+
+#define ESP_LOGE(tag, format, ...)  ESP_LOG_LEVEL_(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)  ESP_LOG_LEVEL_(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)  ESP_LOG_LEVEL_(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)  ESP_LOG_LEVEL_(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...)  ESP_LOG_LEVEL_(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,14 @@
+#include "esp_err.h"
+#include "esp_partition.h"
+
+#ifndef SIM_ESP_OTA_OPS_H
+#define SIM_ESP_OTA_OPS_H
+
+// NOTE: An image is valid if it starts with the magic byte 0xE9 of the
+// ESP32 image header, the rest is not checked.
+const esp_partition_t *esp_ota_get_running_partition(void);
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from);
+const esp_partition_t *esp_ota_get_boot_partition(void);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition);
+
+#endif
@@ -0,0 +1,8 @@
+#include "esp_err.h"
+
+#ifndef SIM_ESP_SLEEP_H
+#define SIM_ESP_SLEEP_H
+
+esp_err_t esp_sleep_enable_uart_wakeup(int uart_num);
+
+#endif
@@ -0,0 +1,13 @@
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#ifndef SIM_ESP_SYSTEM_H
+#define SIM_ESP_SYSTEM_H
+
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+// NOTE: The host never restarts, the calling task stops, see sim_restart_count().
+void esp_restart(void) __attribute__((noreturn));
+
+#endif
@@ -0,0 +1,8 @@
+#include <stdint.h>
+
+#ifndef SIM_ESP_TIMER_H
+#define SIM_ESP_TIMER_H
+
+int64_t esp_timer_get_time(void);
+
+#endif
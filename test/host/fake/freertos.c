@@ -0,0 +1,572 @@
+#include "sim_internal.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Time
+static int64_t mono_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t boot_us;
+static pthread_once_t boot_once = PTHREAD_ONCE_INIT;
+
+static void time_init(void)
+{
+    boot_us = mono_us();
+}
+
+// NOTE: The time starts at the first call, which sim_boot() makes.
+int64_t sim_time_us(void)
+{
+    pthread_once(&boot_once, time_init);
+    return mono_us() - boot_us;
+}
+
+static struct timespec to_timespec(int64_t time_us)
+{
+    int64_t abs_us = time_us + boot_us;
+    struct timespec ts = {
+        .tv_sec = abs_us / 1000000,
+        .tv_nsec = (abs_us % 1000000) * 1000,
+    };
+
+    return ts;
+}
+
+void sim_sleep_until(int64_t time_us)
+{
+    struct timespec ts;
+
+    sim_time_us();
+    ts = to_timespec(time_us);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+void sim_sleep_us(int64_t us)
+{
+    sim_sleep_until(sim_time_us() + us);
+}
+
+int64_t sim_tick_deadline(TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY) {
+        return SIM_FOREVER;
+    }
+    return ((int64_t)xTaskGetTickCount() + ticks) * SIM_TICK_US;
+}
+
+void sim_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+bool sim_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, int64_t deadline_us)
+{
+    struct timespec ts;
+
+    if (deadline_us == SIM_FOREVER) {
+        pthread_cond_wait(cond, mutex);
+        return true;
+    }
+    if (sim_time_us() >= deadline_us) {
+        return false;
+    }
+    ts = to_timespec(deadline_us);
+    return pthread_cond_timedwait(cond, mutex, &ts) != ETIMEDOUT;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return sim_time_us() / SIM_TICK_US;
+}
+
+void sim_thread_start(void *(*func)(void *), void *arg)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, func, arg) != 0) {
+        perror("pthread_create");
+        abort();
+    }
+    pthread_detach(thread);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Critical section
+void vPortCPUInitializeMutex(portMUX_TYPE *mux)
+{
+    mux->owner = 0;
+}
+
+void vPortEnterCritical(portMUX_TYPE *mux)
+{
+    int unlocked = 0;
+
+    while (!__atomic_compare_exchange_n(&(mux->owner), &unlocked, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        unlocked = 0;
+        sched_yield();
+    }
+}
+
+void vPortExitCritical(portMUX_TYPE *mux)
+{
+    __atomic_store_n(&(mux->owner), 0, __ATOMIC_RELEASE);
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Task
+struct sim_task {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t value;
+    bool is_pending;
+    TaskFunction_t func;
+    void *arg;
+    uint32_t stack_depth;
+    char name[16];
+};
+
+static __thread struct sim_task *current_task = NULL;
+
+static struct sim_task *task_new(const char *name, uint32_t stack_depth)
+{
+    struct sim_task *task = calloc(1, sizeof(struct sim_task));
+
+    pthread_mutex_init(&(task->lock), NULL);
+    sim_cond_init(&(task->cond));
+    task->stack_depth = stack_depth;
+    snprintf(task->name, sizeof(task->name), "%s", name);
+    return task;
+}
+
+// NOTE: A thread which calls the task API without being created as a task,
+// such as main(), gets a task of its own at the first call.
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (current_task == NULL) {
+        current_task = task_new("main", 0);
+    }
+    return current_task;
+}
+
+static void *task_entry(void *arg)
+{
+    struct sim_task *task = arg;
+
+    current_task = task;
+    pthread_setname_np(pthread_self(), task->name);
+    task->func(task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t func, const char *name, uint32_t stack_depth,
+                                   void *arg, UBaseType_t priority, TaskHandle_t *handle,
+                                   BaseType_t core)
+{
+    struct sim_task *task = task_new(name, stack_depth);
+
+    task->func = func;
+    task->arg = arg;
+    // NOTE: The handle is set before the task runs, as with FreeRTOS on the
+    // core of a higher priority task.
+    if (handle != NULL) {
+        *handle = task;
+    }
+    sim_thread_start(task_entry, task);
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t func, const char *name, uint32_t stack_depth,
+                       void *arg, UBaseType_t priority, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(func, name, stack_depth, arg, priority, handle,
+                                   tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if ((task == NULL) || (task == current_task)) {
+        pthread_exit(NULL);
+    }
+    fprintf(stderr, "sim: vTaskDelete of another task is not supported\n");
+    abort();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    sim_sleep_until(sim_tick_deadline(ticks));
+}
+
+// NOTE: The stack of a thread is not measured, the whole depth is reported.
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    return (task != NULL) ? task->stack_depth : 0;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+    BaseType_t ret = pdPASS;
+
+    pthread_mutex_lock(&(task->lock));
+    switch (action) {
+    case eSetBits:
+        task->value |= value;
+        break;
+    case eIncrement:
+        task->value++;
+        break;
+    case eSetValueWithOverwrite:
+        task->value = value;
+        break;
+    case eSetValueWithoutOverwrite:
+        if (task->is_pending) {
+            ret = pdFAIL;
+        } else {
+            task->value = value;
+        }
+        break;
+    default:
+        break;
+    }
+    task->is_pending = true;
+    pthread_cond_signal(&(task->cond));
+    pthread_mutex_unlock(&(task->lock));
+    return ret;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    return xTaskNotify(task, 0, eIncrement);
+}
+
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit,
+                           uint32_t *value, TickType_t ticks)
+{
+    struct sim_task *task = xTaskGetCurrentTaskHandle();
+    int64_t deadline = sim_tick_deadline(ticks);
+    BaseType_t ret = pdTRUE;
+
+    pthread_mutex_lock(&(task->lock));
+    if (!task->is_pending) {
+        task->value &= ~clear_on_entry;
+        while (!task->is_pending) {
+            if ((ticks == 0) || !sim_cond_wait(&(task->cond), &(task->lock), deadline)) {
+                break;
+            }
+        }
+    }
+    if (value != NULL) {
+        *value = task->value;
+    }
+    if (task->is_pending) {
+        task->value &= ~clear_on_exit;
+    } else {
+        ret = pdFALSE;
+    }
+    task->is_pending = false;
+    pthread_mutex_unlock(&(task->lock));
+    return ret;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks)
+{
+    struct sim_task *task = xTaskGetCurrentTaskHandle();
+    int64_t deadline = sim_tick_deadline(ticks);
+    uint32_t value;
+
+    pthread_mutex_lock(&(task->lock));
+    while (task->value == 0) {
+        if ((ticks == 0) || !sim_cond_wait(&(task->cond), &(task->lock), deadline)) {
+            break;
+        }
+    }
+    value = task->value;
+    if (value != 0) {
+        task->value = clear_on_exit ? 0 : (value - 1);
+    }
+    task->is_pending = false;
+    pthread_mutex_unlock(&(task->lock));
+    return value;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Queue
+struct sim_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t length;
+    uint32_t item_size;
+    uint32_t head;
+    uint32_t count;
+    uint8_t *items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct sim_queue *queue = calloc(1, sizeof(struct sim_queue));
+
+    pthread_mutex_init(&(queue->lock), NULL);
+    sim_cond_init(&(queue->cond));
+    queue->length = length;
+    queue->item_size = item_size;
+    queue->items = calloc(length, (item_size != 0) ? item_size : 1);
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    if (queue == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&(queue->lock));
+    pthread_cond_destroy(&(queue->cond));
+    free(queue->items);
+    free(queue);
+}
+
+static BaseType_t queue_send(QueueHandle_t queue, const void *item, TickType_t ticks,
+                             bool is_front)
+{
+    int64_t deadline = sim_tick_deadline(ticks);
+    uint32_t index;
+
+    pthread_mutex_lock(&(queue->lock));
+    while (queue->count == queue->length) {
+        if ((ticks == 0) || !sim_cond_wait(&(queue->cond), &(queue->lock), deadline)) {
+            pthread_mutex_unlock(&(queue->lock));
+            return errQUEUE_FULL;
+        }
+    }
+    if (is_front) {
+        queue->head = (queue->head + queue->length - 1) % queue->length;
+        index = queue->head;
+    } else {
+        index = (queue->head + queue->count) % queue->length;
+    }
+    if (queue->item_size != 0) {
+        memcpy(queue->items + index * queue->item_size, item, queue->item_size);
+    }
+    queue->count++;
+    pthread_cond_broadcast(&(queue->cond));
+    pthread_mutex_unlock(&(queue->lock));
+    return pdPASS;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    return queue_send(queue, item, ticks, false);
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    return queue_send(queue, item, ticks, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    return queue_send(queue, item, ticks, true);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+    int64_t deadline = sim_tick_deadline(ticks);
+
+    pthread_mutex_lock(&(queue->lock));
+    while (queue->count == 0) {
+        if ((ticks == 0) || !sim_cond_wait(&(queue->cond), &(queue->lock), deadline)) {
+            pthread_mutex_unlock(&(queue->lock));
+            return pdFALSE;
+        }
+    }
+    if (queue->item_size != 0) {
+        memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+    }
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&(queue->cond));
+    pthread_mutex_unlock(&(queue->lock));
+    return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&(queue->lock));
+    queue->head = 0;
+    queue->count = 0;
+    pthread_cond_broadcast(&(queue->cond));
+    pthread_mutex_unlock(&(queue->lock));
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    UBaseType_t count;
+
+    pthread_mutex_lock(&(queue->lock));
+    count = queue->count;
+    pthread_mutex_unlock(&(queue->lock));
+    return count;
+}
+
+// NOTE: The mutex does not inherit the priority, and is not recursive.
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t sem = xQueueCreate(1, 0);
+
+    xSemaphoreGive(sem);
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xQueueCreate(1, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Timer
+struct sim_timer {
+    struct sim_timer *next;
+    TimerCallbackFunction_t callback;
+    void *id;
+    TickType_t period;
+    bool auto_reload;
+    bool is_active;
+    TickType_t expiry;
+};
+
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static struct sim_timer *timer_list = NULL;
+
+static void *timer_service(void *arg)
+{
+    pthread_setname_np(pthread_self(), "Tmr Svc");
+    pthread_mutex_lock(&timer_lock);
+    while (1) {
+        struct sim_timer *due = NULL;
+        int64_t deadline = SIM_FOREVER;
+        TickType_t now = xTaskGetTickCount();
+
+        for (struct sim_timer *timer = timer_list; timer != NULL; timer = timer->next) {
+            if (!timer->is_active) {
+                continue;
+            }
+            if ((int32_t)(timer->expiry - now) <= 0) {
+                due = timer;
+                break;
+            }
+            if (((int64_t)timer->expiry * SIM_TICK_US) < deadline) {
+                deadline = (int64_t)timer->expiry * SIM_TICK_US;
+            }
+        }
+        if (due == NULL) {
+            sim_cond_wait(&timer_cond, &timer_lock, deadline);
+            continue;
+        }
+        if (due->auto_reload) {
+            due->expiry += due->period;
+        } else {
+            due->is_active = false;
+        }
+        // NOTE: The callback may call the timer API itself.
+        pthread_mutex_unlock(&timer_lock);
+        due->callback(due);
+        pthread_mutex_lock(&timer_lock);
+    }
+    return NULL;
+}
+
+void sim_timer_service_start(void)
+{
+    sim_cond_init(&timer_cond);
+    sim_thread_start(timer_service, NULL);
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t auto_reload,
+                           void *id, TimerCallbackFunction_t callback)
+{
+    struct sim_timer *timer;
+
+    if (period == 0) {
+        return NULL;
+    }
+    timer = calloc(1, sizeof(struct sim_timer));
+    timer->callback = callback;
+    timer->id = id;
+    timer->period = period;
+    timer->auto_reload = auto_reload;
+    pthread_mutex_lock(&timer_lock);
+    timer->next = timer_list;
+    timer_list = timer;
+    pthread_mutex_unlock(&timer_lock);
+    return timer;
+}
+
+static BaseType_t timer_start(TimerHandle_t timer, TickType_t period)
+{
+    pthread_mutex_lock(&timer_lock);
+    if (period != 0) {
+        timer->period = period;
+    }
+    timer->expiry = xTaskGetTickCount() + timer->period;
+    timer->is_active = true;
+    pthread_cond_signal(&timer_cond);
+    pthread_mutex_unlock(&timer_lock);
+    return pdPASS;
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticks)
+{
+    return timer_start(timer, 0);
+}
+
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t ticks)
+{
+    return timer_start(timer, 0);
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks)
+{
+    return (period != 0) ? timer_start(timer, period) : pdFAIL;
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticks)
+{
+    pthread_mutex_lock(&timer_lock);
+    timer->is_active = false;
+    pthread_mutex_unlock(&timer_lock);
+    return pdPASS;
+}
+
+void *pvTimerGetTimerID(TimerHandle_t timer)
+{
+    return timer->id;
+}
@@ -0,0 +1,49 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sdkconfig.h"
+
+// FreeRTOS of ESP-IDF on POSIX threads, see sim.h.
+// A task is a thread, and the tick counts CLOCK_MONOTONIC at
+// CONFIG_FREERTOS_HZ. The priorities and the core affinity are not modelled,
+// all the tasks share the cores of the host.
+
+#ifndef SIM_FREERTOS_H
+#define SIM_FREERTOS_H
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define configTICK_RATE_HZ      CONFIG_FREERTOS_HZ
+#define portTICK_PERIOD_MS      (1000 / configTICK_RATE_HZ)
+#define portTICK_RATE_MS        portTICK_PERIOD_MS
+#define portMAX_DELAY           ((TickType_t)0xFFFFFFFF)
+
+#define pdFALSE                 (0)
+#define pdTRUE                  (1)
+#define pdPASS                  pdTRUE
+#define pdFAIL                  pdFALSE
+#define errQUEUE_FULL           pdFALSE
+#define pdMS_TO_TICKS(ms)       ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+
+// NOTE: A critical section is a spin lock, as on the dual core ESP32.
+typedef struct {
+    volatile int owner;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED     { .owner = 0 }
+
+void vPortCPUInitializeMutex(portMUX_TYPE *mux);
+void vPortEnterCritical(portMUX_TYPE *mux);
+void vPortExitCritical(portMUX_TYPE *mux);
+
+#define portENTER_CRITICAL(mux)         vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux)          vPortExitCritical(mux)
+#define portENTER_CRITICAL_ISR(mux)     vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_ISR(mux)      vPortExitCritical(mux)
+
+BaseType_t xPortGetCoreID(void);
+
+#endif
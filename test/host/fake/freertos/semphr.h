@@ -0,0 +1,16 @@
+#include "freertos/queue.h"
+
+#ifndef SIM_SEMPHR_H
+#define SIM_SEMPHR_H
+
+// NOTE: As in FreeRTOS, a semaphore is a queue of empty items.
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+
+#define xSemaphoreTake(sem, ticks)  xQueueReceive((sem), NULL, (ticks))
+#define xSemaphoreGive(sem)         xQueueSend((sem), NULL, 0)
+#define vSemaphoreDelete(sem)       vQueueDelete(sem)
+
+#endif
@@ -0,0 +1,18 @@
+#include "freertos/FreeRTOS.h"
+
+#ifndef SIM_TIMERS_H
+#define SIM_TIMERS_H
+
+// The callbacks run in one timer service thread, as in the timer task.
+typedef struct sim_timer *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t timer);
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t auto_reload,
+                           void *id, TimerCallbackFunction_t callback);
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticks);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticks);
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t ticks);
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks);
+void *pvTimerGetTimerID(TimerHandle_t timer);
+
+#endif
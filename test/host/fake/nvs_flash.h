@@ -0,0 +1,9 @@
+#include "esp_err.h"
+
+#ifndef SIM_NVS_FLASH_H
+#define SIM_NVS_FLASH_H
+
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+
+#endif
@@ -0,0 +1,33 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+
+// Shared by the fake layer only.
+
+#ifndef SIM_INTERNAL_H
+#define SIM_INTERNAL_H
+
+#define SIM_TICK_US         (1000000 / configTICK_RATE_HZ)
+#define SIM_FOREVER         INT64_MAX
+
+int64_t sim_time_us(void);
+void sim_sleep_us(int64_t us);
+void sim_sleep_until(int64_t time_us);
+
+// The deadline of a wait of ticks, which ends at a tick boundary as in
+// FreeRTOS. portMAX_DELAY gives SIM_FOREVER.
+int64_t sim_tick_deadline(TickType_t ticks);
+
+// Condition variables on CLOCK_MONOTONIC, which sim_time_us() counts.
+void sim_cond_init(pthread_cond_t *cond);
+// Return false on the timeout.
+bool sim_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, int64_t deadline_us);
+
+// A thread which is not a task, see freertos.c.
+void sim_thread_start(void *(*func)(void *), void *arg);
+
+void sim_timer_service_start(void);
+
+#endif
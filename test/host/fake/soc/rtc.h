@@ -0,0 +1,12 @@
+#ifndef SIM_SOC_RTC_H
+#define SIM_SOC_RTC_H
+
+typedef enum {
+    RTC_CPU_FREQ_XTAL = 0,
+    RTC_CPU_FREQ_80M = 1,
+    RTC_CPU_FREQ_160M = 2,
+    RTC_CPU_FREQ_240M = 3,
+    RTC_CPU_FREQ_2M = 4,
+} rtc_cpu_freq_t;
+
+#endif
@@ -0,0 +1,645 @@
+#include "sim_internal.h"
+#include "sim.h"
+
+#include "driver/uart.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The pseudo-serial line of each port.
+//
+// RX follows the hardware and the ISR of the IDF v3.x driver. The bytes of
+// sim_uart_send() land in the 128 byte FIFO at the baud rate. The ISR moves
+// the FIFO into the ring buffer of the driver when it reaches the full
+// threshold, when the line was idle for the RX timeout, or at the pattern
+// character, and posts UART_DATA or UART_PATTERN_DET. A FIFO which finds the
+// ring buffer full stays in the hardware, the interrupts stop and
+// UART_BUFFER_FULL is posted, until uart_read_bytes() makes room. Meanwhile
+// RTS holds the sender back at rx_flow_ctrl_thresh, or the FIFO overflows.
+//
+// TX drains the ring buffer of uart_write_bytes() at the baud rate into the
+// sink, about a millisecond of bytes at a time.
+// NOTE: A character is 10 bit times, 8N1.
+
+#define SIM_UART_RX_FULL_DEFAULT    (120)
+#define SIM_UART_RX_TOUT_DEFAULT    (10)
+#define SIM_UART_TX_CHUNK_US        (1000)
+#define SIM_UART_TX_CHUNK_MAX       (256)
+
+typedef struct sim_uart {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool is_started;
+
+    uint32_t baud_rate;
+    bool flow_ctrl;
+    uint8_t rts_thresh;
+    uint32_t intr_mask;
+    uint32_t rx_full_thresh;
+    uint32_t rx_tout;
+    int pattern;
+
+    // Driver
+    bool is_installed;
+    uint32_t generation;
+    QueueHandle_t queue;
+    uint8_t *rx_buf;
+    uint32_t rx_size;
+    uint32_t rx_tail;
+    uint32_t rx_used;
+    bool is_rx_full;
+    uint8_t *tx_buf;
+    uint32_t tx_size;
+    uint32_t tx_tail;
+    uint32_t tx_used;
+
+    // Hardware
+    uint8_t fifo[UART_FIFO_LEN];
+    uint32_t fifo_len;
+    int64_t rx_idle_from;
+    int64_t tx_free_at;
+    uint32_t dropped;
+
+    sim_uart_sink_t sink;
+    void *sink_arg;
+} sim_uart_t;
+
+static sim_uart_t sim_uart[UART_NUM_MAX];
+static pthread_once_t uart_once = PTHREAD_ONCE_INIT;
+
+static void uart_init_once(void)
+{
+    for (uint32_t i = 0; i < UART_NUM_MAX; i++) {
+        sim_uart_t *uart = &(sim_uart[i]);
+
+        pthread_mutex_init(&(uart->lock), NULL);
+        sim_cond_init(&(uart->cond));
+        uart->baud_rate = 115200;
+        uart->rts_thresh = 100;
+        uart->intr_mask = UART_RXFIFO_FULL_INT_ENA_M|UART_RXFIFO_TOUT_INT_ENA_M;
+        uart->rx_full_thresh = SIM_UART_RX_FULL_DEFAULT;
+        uart->rx_tout = SIM_UART_RX_TOUT_DEFAULT;
+        uart->pattern = -1;
+    }
+}
+
+static sim_uart_t *get_uart(uart_port_t port)
+{
+    if ((port < 0) || (port >= UART_NUM_MAX)) {
+        return NULL;
+    }
+    pthread_once(&uart_once, uart_init_once);
+    return &(sim_uart[port]);
+}
+
+static int64_t char_us(sim_uart_t *uart, uint32_t count)
+{
+    return ((int64_t)count * 10 * 1000000 + uart->baud_rate - 1) / uart->baud_rate;
+}
+
+static void post_event(sim_uart_t *uart, uart_event_type_t type, size_t size)
+{
+    uart_event_t event = {
+        .type = type,
+        .size = size,
+    };
+
+    if (uart->queue != NULL) {
+        xQueueSend(uart->queue, &event, 0);
+    }
+}
+
+static void rx_push(sim_uart_t *uart, const uint8_t *data, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        uart->rx_buf[(uart->rx_tail + uart->rx_used) % uart->rx_size] = data[i];
+        uart->rx_used++;
+    }
+}
+
+// The ISR. Called with the lock held.
+static void rx_isr(sim_uart_t *uart, uart_event_type_t type)
+{
+    uint32_t len = uart->fifo_len;
+
+    if (!uart->is_installed || uart->is_rx_full || (len == 0)) {
+        return;
+    }
+    if ((uart->rx_size - uart->rx_used) < len) {
+        uart->is_rx_full = true;
+        post_event(uart, UART_BUFFER_FULL, 0);
+        return;
+    }
+    rx_push(uart, uart->fifo, len);
+    uart->fifo_len = 0;
+    post_event(uart, type, len);
+    pthread_cond_broadcast(&(uart->cond));
+}
+
+// Called with the lock held, once the FIFO has room again.
+static void rx_check_full(sim_uart_t *uart)
+{
+    if (uart->is_rx_full && ((uart->rx_size - uart->rx_used) >= uart->fifo_len)) {
+        rx_push(uart, uart->fifo, uart->fifo_len);
+        uart->fifo_len = 0;
+        uart->is_rx_full = false;
+        pthread_cond_broadcast(&(uart->cond));
+    }
+}
+
+static bool is_rts_held(sim_uart_t *uart)
+{
+    return uart->flow_ctrl && uart->is_installed && (uart->fifo_len >= uart->rts_thresh);
+}
+
+// The RX timeout. It fires once the line has been idle for rx_tout
+// characters with bytes left in the FIFO.
+static void *rx_tout_thread(void *arg)
+{
+    sim_uart_t *uart = arg;
+
+    pthread_mutex_lock(&(uart->lock));
+    while (1) {
+        int64_t deadline = SIM_FOREVER;
+
+        if (uart->is_installed && !uart->is_rx_full && (uart->fifo_len != 0) &&
+            ((uart->intr_mask & UART_RXFIFO_TOUT_INT_ENA_M) != 0)) {
+            deadline = uart->rx_idle_from + char_us(uart, uart->rx_tout);
+        }
+        if (!sim_cond_wait(&(uart->cond), &(uart->lock), deadline)) {
+            rx_isr(uart, UART_DATA);
+        }
+    }
+    return NULL;
+}
+
+static void *tx_thread(void *arg)
+{
+    sim_uart_t *uart = arg;
+    uint8_t chunk[SIM_UART_TX_CHUNK_MAX];
+
+    pthread_mutex_lock(&(uart->lock));
+    while (1) {
+        uint32_t len;
+        int64_t start;
+        int64_t end;
+        uint32_t generation;
+        sim_uart_sink_t sink;
+        void *sink_arg;
+
+        if (!uart->is_installed || (uart->tx_used == 0)) {
+            sim_cond_wait(&(uart->cond), &(uart->lock), SIM_FOREVER);
+            continue;
+        }
+        len = uart->baud_rate / 10 * SIM_UART_TX_CHUNK_US / 1000000;
+        len = (len == 0) ? 1 : (len > sizeof(chunk)) ? sizeof(chunk) : len;
+        len = (uart->tx_used < len) ? uart->tx_used : len;
+        for (uint32_t i = 0; i < len; i++) {
+            chunk[i] = uart->tx_buf[(uart->tx_tail + i) % uart->tx_size];
+        }
+        start = sim_time_us();
+        start = (uart->tx_free_at > start) ? uart->tx_free_at : start;
+        end = start + char_us(uart, len);
+        uart->tx_free_at = end;
+        generation = uart->generation;
+        pthread_mutex_unlock(&(uart->lock));
+
+        sim_sleep_until(end);
+
+        pthread_mutex_lock(&(uart->lock));
+        sink = uart->sink;
+        sink_arg = uart->sink_arg;
+        // NOTE: A driver installed again meanwhile starts with an empty buffer.
+        if (uart->is_installed && (uart->generation == generation)) {
+            uart->tx_tail = (uart->tx_tail + len) % uart->tx_size;
+            uart->tx_used -= len;
+        }
+        pthread_cond_broadcast(&(uart->cond));
+        pthread_mutex_unlock(&(uart->lock));
+
+        if (sink != NULL) {
+            sink(uart - sim_uart, chunk, len, end, sink_arg);
+        }
+        pthread_mutex_lock(&(uart->lock));
+    }
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Driver
+esp_err_t uart_driver_install(uart_port_t uart_num, int rx_buffer_size, int tx_buffer_size,
+                              int queue_size, QueueHandle_t *uart_queue, int intr_alloc_flags)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+
+    if ((uart == NULL) || (rx_buffer_size <= UART_FIFO_LEN) ||
+        ((tx_buffer_size != 0) && (tx_buffer_size <= UART_FIFO_LEN))) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    if (uart->is_installed) {
+        pthread_mutex_unlock(&(uart->lock));
+        return ESP_FAIL;
+    }
+    uart->rx_buf = malloc(rx_buffer_size);
+    uart->rx_size = rx_buffer_size;
+    uart->rx_tail = 0;
+    uart->rx_used = 0;
+    uart->is_rx_full = false;
+    // NOTE: Without a TX buffer, uart_write_bytes() waits for the FIFO.
+    uart->tx_size = (tx_buffer_size != 0) ? tx_buffer_size : UART_FIFO_LEN;
+    uart->tx_buf = malloc(uart->tx_size);
+    uart->tx_tail = 0;
+    uart->tx_used = 0;
+    uart->fifo_len = 0;
+    uart->queue = NULL;
+    if ((uart_queue != NULL) && (queue_size > 0)) {
+        uart->queue = xQueueCreate(queue_size, sizeof(uart_event_t));
+        *uart_queue = uart->queue;
+    }
+    uart->is_installed = true;
+    uart->generation++;
+    if (!uart->is_started) {
+        uart->is_started = true;
+        sim_thread_start(rx_tout_thread, uart);
+        sim_thread_start(tx_thread, uart);
+    }
+    pthread_cond_broadcast(&(uart->cond));
+    pthread_mutex_unlock(&(uart->lock));
+
+    return ESP_OK;
+}
+
+// NOTE: The bytes still in the TX buffer are lost, as on the target.
+esp_err_t uart_driver_delete(uart_port_t uart_num)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+
+    if (uart == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    if (!uart->is_installed) {
+        pthread_mutex_unlock(&(uart->lock));
+        return ESP_OK;
+    }
+    uart->is_installed = false;
+    if (uart->queue != NULL) {
+        vQueueDelete(uart->queue);
+        uart->queue = NULL;
+    }
+    free(uart->rx_buf);
+    free(uart->tx_buf);
+    uart->rx_buf = NULL;
+    uart->tx_buf = NULL;
+    uart->fifo_len = 0;
+    pthread_cond_broadcast(&(uart->cond));
+    pthread_mutex_unlock(&(uart->lock));
+
+    return ESP_OK;
+}
+
+esp_err_t uart_param_config(uart_port_t uart_num, const uart_config_t *uart_config)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+
+    if ((uart == NULL) || (uart_config->baud_rate <= 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    uart->baud_rate = uart_config->baud_rate;
+    uart->flow_ctrl = (uart_config->flow_ctrl & UART_HW_FLOWCTRL_RTS) != 0;
+    uart->rts_thresh = uart_config->rx_flow_ctrl_thresh;
+    pthread_cond_broadcast(&(uart->cond));
+    pthread_mutex_unlock(&(uart->lock));
+
+    return ESP_OK;
+}
+
+esp_err_t uart_intr_config(uart_port_t uart_num, const uart_intr_config_t *intr_conf)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+
+    if ((uart == NULL) || (intr_conf->rxfifo_full_thresh >= UART_FIFO_LEN) ||
+        (intr_conf->rx_timeout_thresh > 126)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    uart->intr_mask = intr_conf->intr_enable_mask;
+    uart->rx_full_thresh = (intr_conf->rxfifo_full_thresh != 0) ? intr_conf->rxfifo_full_thresh : 1;
+    uart->rx_tout = (intr_conf->rx_timeout_thresh != 0) ? intr_conf->rx_timeout_thresh : 1;
+    pthread_cond_broadcast(&(uart->cond));
+    pthread_mutex_unlock(&(uart->lock));
+
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num,
+                       int rts_io_num, int cts_io_num)
+{
+    return (get_uart(uart_num) != NULL) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t uart_num, uint32_t baudrate)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+
+    if ((uart == NULL) || (baudrate == 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    uart->baud_rate = baudrate;
+    pthread_cond_broadcast(&(uart->cond));
+    pthread_mutex_unlock(&(uart->lock));
+
+    return ESP_OK;
+}
+
+esp_err_t uart_get_baudrate(uart_port_t uart_num, uint32_t *baudrate)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+
+    if (uart == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    *baudrate = uart->baud_rate;
+    pthread_mutex_unlock(&(uart->lock));
+
+    return ESP_OK;
+}
+
+esp_err_t uart_set_hw_flow_ctrl(uart_port_t uart_num, uart_hw_flowcontrol_t flow_ctrl,
+                                uint8_t rx_thresh)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+
+    if ((uart == NULL) || (rx_thresh >= UART_FIFO_LEN)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    uart->flow_ctrl = (flow_ctrl & UART_HW_FLOWCTRL_RTS) != 0;
+    uart->rts_thresh = rx_thresh;
+    pthread_cond_broadcast(&(uart->cond));
+    pthread_mutex_unlock(&(uart->lock));
+
+    return ESP_OK;
+}
+
+esp_err_t uart_set_wakeup_threshold(uart_port_t uart_num, int wakeup_threshold)
+{
+    return (get_uart(uart_num) != NULL) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_enable_pattern_det_intr(uart_port_t uart_num, char pattern_chr, uint8_t chr_num,
+                                       int chr_tout, int post_idle, int pre_idle)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+
+    // NOTE: Only a single pattern character is simulated.
+    if ((uart == NULL) || (chr_num != 1)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    uart->pattern = (uint8_t)pattern_chr;
+    pthread_mutex_unlock(&(uart->lock));
+
+    return ESP_OK;
+}
+
+esp_err_t uart_disable_pattern_det_intr(uart_port_t uart_num)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+
+    if (uart == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    uart->pattern = -1;
+    pthread_mutex_unlock(&(uart->lock));
+
+    return ESP_OK;
+}
+
+int uart_write_bytes(uart_port_t uart_num, const char *src, size_t size)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+    size_t written = 0;
+
+    if (uart == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    while (uart->is_installed && (written < size)) {
+        if (uart->tx_used == uart->tx_size) {
+            sim_cond_wait(&(uart->cond), &(uart->lock), SIM_FOREVER);
+            continue;
+        }
+        while ((written < size) && (uart->tx_used < uart->tx_size)) {
+            uart->tx_buf[(uart->tx_tail + uart->tx_used) % uart->tx_size] = src[written++];
+            uart->tx_used++;
+        }
+        pthread_cond_broadcast(&(uart->cond));
+    }
+    pthread_mutex_unlock(&(uart->lock));
+
+    return uart->is_installed ? (int)written : -1;
+}
+
+int uart_read_bytes(uart_port_t uart_num, uint8_t *buf, uint32_t length, TickType_t ticks_to_wait)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+    int64_t deadline = sim_tick_deadline(ticks_to_wait);
+    uint32_t len = 0;
+
+    if (uart == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    while (uart->is_installed && (uart->rx_used == 0) && (ticks_to_wait != 0)) {
+        if (!sim_cond_wait(&(uart->cond), &(uart->lock), deadline)) {
+            break;
+        }
+    }
+    if (!uart->is_installed) {
+        pthread_mutex_unlock(&(uart->lock));
+        return -1;
+    }
+    while ((len < length) && (uart->rx_used != 0)) {
+        buf[len++] = uart->rx_buf[uart->rx_tail];
+        uart->rx_tail = (uart->rx_tail + 1) % uart->rx_size;
+        uart->rx_used--;
+    }
+    rx_check_full(uart);
+    pthread_mutex_unlock(&(uart->lock));
+
+    return len;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t uart_num, size_t *size)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+
+    if ((uart == NULL) || !uart->is_installed) {
+        return ESP_FAIL;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    *size = uart->rx_used;
+    pthread_mutex_unlock(&(uart->lock));
+
+    return ESP_OK;
+}
+
+esp_err_t uart_flush_input(uart_port_t uart_num)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+
+    if ((uart == NULL) || !uart->is_installed) {
+        return ESP_FAIL;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    uart->dropped += uart->rx_used + uart->fifo_len;
+    uart->rx_tail = 0;
+    uart->rx_used = 0;
+    uart->fifo_len = 0;
+    uart->is_rx_full = false;
+    pthread_cond_broadcast(&(uart->cond));
+    pthread_mutex_unlock(&(uart->lock));
+
+    return ESP_OK;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t uart_num, TickType_t ticks_to_wait)
+{
+    sim_uart_t *uart = get_uart(uart_num);
+    int64_t deadline = sim_tick_deadline(ticks_to_wait);
+    esp_err_t err = ESP_OK;
+
+    if (uart == NULL) {
+        return ESP_FAIL;
+    }
+    pthread_mutex_lock(&(uart->lock));
+    while (uart->is_installed && (uart->tx_used != 0)) {
+        if (!sim_cond_wait(&(uart->cond), &(uart->lock), deadline)) {
+            err = ESP_ERR_TIMEOUT;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(uart->lock));
+
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Serial device
+// Bytes up to the next point where the ISR or RTS acts.
+static uint32_t rx_span(sim_uart_t *uart, const uint8_t *data, uint32_t len)
+{
+    uint32_t span = UART_FIFO_LEN - uart->fifo_len;
+
+    if (!uart->is_rx_full && ((uart->intr_mask & UART_RXFIFO_FULL_INT_ENA_M) != 0) &&
+        (uart->fifo_len < uart->rx_full_thresh)) {
+        span = uart->rx_full_thresh - uart->fifo_len;
+    }
+    if (uart->flow_ctrl && (uart->fifo_len < uart->rts_thresh) &&
+        ((uint32_t)(uart->rts_thresh - uart->fifo_len) < span)) {
+        span = uart->rts_thresh - uart->fifo_len;
+    }
+    if ((uart->pattern >= 0) && !uart->is_rx_full) {
+        const uint8_t *end = memchr(data, uart->pattern, (len < span) ? len : span);
+
+        if (end != NULL) {
+            span = end - data + 1;
+        }
+    }
+    return (span == 0) ? 1 : (len < span) ? len : span;
+}
+
+void sim_uart_send(uart_port_t port, const uint8_t *data, uint32_t len)
+{
+    sim_uart_t *uart = get_uart(port);
+    int64_t start = sim_time_us();
+
+    pthread_mutex_lock(&(uart->lock));
+    while (len != 0) {
+        uint32_t span;
+        int64_t end;
+
+        if (is_rts_held(uart)) {
+            sim_cond_wait(&(uart->cond), &(uart->lock), SIM_FOREVER);
+            start = sim_time_us();
+            continue;
+        }
+        span = rx_span(uart, data, len);
+        end = start + char_us(uart, span);
+        // NOTE: The line is busy until the last byte, so the RX timeout
+        // counts from there.
+        uart->rx_idle_from = end;
+        pthread_mutex_unlock(&(uart->lock));
+
+        sim_sleep_until(end);
+
+        pthread_mutex_lock(&(uart->lock));
+        if (!uart->is_installed) {
+            uart->dropped += span;
+        } else {
+            uint32_t room = UART_FIFO_LEN - uart->fifo_len;
+            uint32_t fit = (span < room) ? span : room;
+
+            memcpy(uart->fifo + uart->fifo_len, data, fit);
+            uart->fifo_len += fit;
+            if (fit < span) {
+                // NOTE: The ISR resets the FIFO which overflowed.
+                uart->dropped += (span - fit) + uart->fifo_len;
+                uart->fifo_len = 0;
+                post_event(uart, UART_FIFO_OVF, 0);
+            } else if ((uart->pattern >= 0) && (data[span - 1] == uart->pattern)) {
+                rx_isr(uart, UART_PATTERN_DET);
+            } else if (((uart->intr_mask & UART_RXFIFO_FULL_INT_ENA_M) != 0) &&
+                       (uart->fifo_len >= uart->rx_full_thresh)) {
+                rx_isr(uart, UART_DATA);
+            }
+        }
+        uart->rx_idle_from = end;
+        pthread_cond_broadcast(&(uart->cond));
+        data += span;
+        len -= span;
+        start = end;
+    }
+    pthread_mutex_unlock(&(uart->lock));
+}
+
+void sim_uart_set_sink(uart_port_t port, sim_uart_sink_t sink, void *arg)
+{
+    sim_uart_t *uart = get_uart(port);
+
+    pthread_mutex_lock(&(uart->lock));
+    uart->sink = sink;
+    uart->sink_arg = arg;
+    pthread_mutex_unlock(&(uart->lock));
+}
+
+uint32_t sim_uart_dropped(uart_port_t port)
+{
+    sim_uart_t *uart = get_uart(port);
+    uint32_t dropped;
+
+    pthread_mutex_lock(&(uart->lock));
+    dropped = uart->dropped;
+    pthread_mutex_unlock(&(uart->lock));
+
+    return dropped;
+}
+
+uint32_t sim_uart_baud(uart_port_t port)
+{
+    sim_uart_t *uart = get_uart(port);
+    uint32_t baud_rate;
+
+    pthread_mutex_lock(&(uart->lock));
+    baud_rate = uart->baud_rate;
+    pthread_mutex_unlock(&(uart->lock));
+
+    return baud_rate;
+}
@@ -0,0 +1,11 @@
+#include <stdint.h>
+
+#ifndef SIM_XTENSA_HAL_H
+#define SIM_XTENSA_HAL_H
+
+// The cycle counter runs at SIM_CPU_MHZ of the host time.
+#define SIM_CPU_MHZ     (160)
+
+uint32_t xthal_get_ccount(void);
+
+#endif
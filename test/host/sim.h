@@ -0,0 +1,139 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "driver/uart.h"
+
+// Host simulation of the ESP-IDF layer under main/.
+//
+// fake/ holds the headers of the IDF APIs which main/ calls, and their
+// implementation on POSIX threads:
+//   freertos.c   tasks, queues, semaphores, task notifications, timers
+//   uart.c       UART driver with a paced pseudo-serial line per port
+//   bt.c         Bluedroid GATTS/GAP with a simulated link layer
+//   esp.c        esp_timer, NVS in RAM, partitions, OTA, PM, system
+//   sha256.c     mbedtls_sha256_* for spp_ota.c
+//
+// Everything runs in real time. sim_boot() starts the firmware through
+// app_main(), then the test plays the central and the serial device.
+//
+// The link runs one connection event per connection interval. In each event
+// the central and the server exchange LL PDUs of up to the data length, as
+// long as the airtime of LE 1M PHY fits the interval. A notification or a
+// write is delivered once its last PDU went over the air. As in Bluedroid,
+// ESP_GATTS_CONF_EVT of a notification follows once it is queued in L2CAP,
+// and ESP_GATTS_CONGEST_EVT reports the L2CAP queue above its quota.
+//
+// NOTE: The CPU of the host is much faster than the ESP32, so the numbers
+// show the protocol and the link, not the CPU load of the firmware.
+
+#ifndef SIM_H
+#define SIM_H
+
+typedef struct sim_central sim_central_t;
+
+// Called in the link thread for each notification received. time_us is the
+// end of the PDU which completed it.
+typedef void (*sim_notify_cb_t)(sim_central_t *central, uint16_t handle,
+                                const uint8_t *value, uint32_t len,
+                                int64_t time_us, void *arg);
+
+typedef struct sim_link_config {
+    uint16_t mtu;               // MTU the central asks for in the exchange
+    uint32_t interval_min_us;   // shortest connection interval it accepts
+    bool dle;                   // accepts the LE data length extension
+    bool pairs;                 // completes a pairing the server asks for
+    uint32_t passkey;           // enters it when the pairing asks for one
+    uint32_t write_queue;       // writes without response it may queue
+    uint32_t l2cap_quota;       // L2CAP SDUs queued before the congestion
+    uint32_t event_pdus;        // PDUs per direction and event, 0 by airtime
+} sim_link_config_t;
+
+#define SIM_LINK_CONFIG_DEFAULT {   \
+    .mtu            = 517,          \
+    .interval_min_us = 15000,       \
+    .dle            = true,         \
+    .pairs          = true,         \
+    .write_queue    = 16,           \
+    .l2cap_quota    = 10,           \
+    .event_pdus     = 0,            \
+}
+
+typedef struct sim_link_stats {
+    uint32_t events;
+    uint32_t up_pdus;
+    uint32_t down_pdus;
+    uint32_t notifications;
+    uint32_t truncated;         // notifications cut to the MTU
+    uint32_t congest;
+    uint32_t interval_us;
+    uint16_t mtu;
+    uint16_t ll_len;
+} sim_link_stats_t;
+
+// Firmware
+void sim_boot(void);
+int64_t sim_time_us(void);
+void sim_sleep_us(int64_t us);
+uint32_t sim_restart_count(void);
+
+// Central
+sim_central_t *sim_central_connect(const sim_link_config_t *config,
+                                   sim_notify_cb_t cb, void *arg);
+void sim_central_disconnect(sim_central_t *central);
+bool sim_central_is_connected(sim_central_t *central);
+bool sim_central_is_encrypted(sim_central_t *central);
+uint16_t sim_central_mtu(sim_central_t *central);
+void sim_central_stats(sim_central_t *central, sim_link_stats_t *stats);
+// Write without response. Blocks while the write queue is full.
+bool sim_central_write(sim_central_t *central, uint16_t handle,
+                       const uint8_t *value, uint32_t len);
+// Write request, returns once the server handled it.
+bool sim_central_write_req(sim_central_t *central, uint16_t handle,
+                           const uint8_t *value, uint32_t len);
+// Long write by prepared writes, executed at the end.
+bool sim_central_write_long(sim_central_t *central, uint16_t handle,
+                            const uint8_t *value, uint32_t len);
+// Read by the application response, returns the length read or -1.
+int32_t sim_central_read(sim_central_t *central, uint16_t handle, uint16_t offset,
+                         uint8_t *buf, uint32_t size);
+// Start a pairing from the central side.
+void sim_central_pair(sim_central_t *central);
+
+// Serial device on the other end of a UART port. sim_uart_send() paces the
+// bytes at the baud rate and returns once the last one is on the line. With
+// the hardware flow control it waits while RTS holds it back, otherwise the
+// bytes which find the driver buffer full are lost.
+typedef void (*sim_uart_sink_t)(uart_port_t port, const uint8_t *data, uint32_t len,
+                                int64_t time_us, void *arg);
+
+void sim_uart_send(uart_port_t port, const uint8_t *data, uint32_t len);
+void sim_uart_set_sink(uart_port_t port, sim_uart_sink_t sink, void *arg);
+uint32_t sim_uart_dropped(uart_port_t port);
+uint32_t sim_uart_baud(uart_port_t port);
+
+// Flash of the partitions, in RAM unless a file is given before sim_boot().
+typedef struct sim_flash_stats {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t erases;
+    uint32_t erase_bytes;
+    uint32_t write_bytes;
+} sim_flash_stats_t;
+
+void sim_flash_file(const char *path);
+void sim_flash_stats(const char *label, sim_flash_stats_t *stats);
+const void *sim_flash_data(const char *label);
+
+// Heap and copy calls of the firmware. The Makefile points malloc, calloc,
+// free and memcpy of the main/ objects here, the rest of the host keeps them.
+typedef struct sim_mem_stats {
+    uint64_t mallocs;
+    uint64_t frees;
+    uint64_t alloc_bytes;
+    uint64_t copies;
+    uint64_t copy_bytes;
+} sim_mem_stats_t;
+
+void sim_mem_stats(sim_mem_stats_t *stats);
+
+#endif
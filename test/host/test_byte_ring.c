@@ -0,0 +1,142 @@
+#include "client.h"
+#include "byte_ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+// byte_ring.c with a producer and a consumer thread, through both the copy
+// and the in-place calls. The counters start just below the wrap of uint32_t.
+
+#define RING_BYTES          (16 * 1024 * 1024)
+#define RING_START          (0xFFFFF000u)
+
+static uint8_t ring_buf[1024];
+static byte_ring_t ring = BYTE_RING_INITIALIZER(ring_buf);
+static bool is_in_place;
+
+static uint8_t stream_byte(uint32_t pos)
+{
+    return (uint8_t)(pos ^ (pos >> 8) ^ (pos >> 16));
+}
+
+static void *producer(void *arg)
+{
+    uint8_t buf[200];
+    uint32_t len = 1;
+
+    for (uint32_t pos = 0; pos < RING_BYTES; ) {
+        uint32_t n = (len < (RING_BYTES - pos)) ? len : (RING_BYTES - pos);
+
+        if (is_in_place) {
+            uint8_t *str;
+            uint32_t space = byte_ring_reserve(&ring, &str);
+
+            n = (space < n) ? space : n;
+            for (uint32_t i = 0; i < n; i++) {
+                str[i] = stream_byte(pos + i);
+            }
+            byte_ring_commit(&ring, n);
+        } else {
+            n = (byte_ring_free(&ring) < n) ? byte_ring_free(&ring) : n;
+            for (uint32_t i = 0; i < n; i++) {
+                buf[i] = stream_byte(pos + i);
+            }
+            n = byte_ring_write(&ring, buf, n);
+        }
+        // NOTE: The host may run both threads on one CPU.
+        if (n == 0) {
+            sched_yield();
+        }
+        pos += n;
+        len = (len % sizeof(buf)) + 1;
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    uint32_t *errors = arg;
+    uint8_t buf[150];
+    uint32_t len = 1;
+
+    for (uint32_t pos = 0; pos < RING_BYTES; ) {
+        uint8_t *str = buf;
+        uint32_t n;
+
+        if (is_in_place) {
+            n = byte_ring_peek(&ring, &str);
+        } else {
+            n = byte_ring_read(&ring, buf, len);
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            if (str[i] != stream_byte(pos + i)) {
+                (*errors)++;
+            }
+        }
+        if (is_in_place) {
+            byte_ring_consume(&ring, n);
+        }
+        if (n == 0) {
+            sched_yield();
+        }
+        pos += n;
+        len = (len % sizeof(buf)) + 1;
+    }
+    return NULL;
+}
+
+static void test_stress(bool in_place)
+{
+    pthread_t threads[2];
+    uint32_t errors = 0;
+
+    ring.head = RING_START;
+    ring.tail = RING_START;
+    ring.high_water = 0;
+    ring.overflow = 0;
+    is_in_place = in_place;
+
+    pthread_create(&threads[0], NULL, producer, NULL);
+    pthread_create(&threads[1], NULL, consumer, &errors);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    CHECK(errors == 0, "%u bytes differ, in place %d", errors, in_place);
+    CHECK(byte_ring_used(&ring) == 0, "%u bytes left", byte_ring_used(&ring));
+    CHECK(ring.high_water <= ring.size, "high water %u", ring.high_water);
+    CHECK(ring.overflow == 0, "overflow %u", ring.overflow);
+    printf("stress in place %d: %u bytes, high water %u of %u\n",
+           in_place, RING_BYTES, ring.high_water, ring.size);
+}
+
+// A write beyond the free space stores what fits and counts the rest.
+static void test_overflow(void)
+{
+    static uint8_t data[1100];
+
+    ring.head = RING_START;
+    ring.tail = RING_START;
+    ring.high_water = 0;
+    ring.overflow = 0;
+
+    CHECK(byte_ring_write(&ring, data, 1000) == 1000, "first write");
+    CHECK(byte_ring_write(&ring, data, 100) == 24, "second write");
+    CHECK(ring.overflow == 76, "overflow %u", ring.overflow);
+    CHECK(ring.high_water == 1024, "high water %u", ring.high_water);
+    CHECK(byte_ring_free(&ring) == 0, "free %u", byte_ring_free(&ring));
+    byte_ring_discard(&ring);
+    CHECK(byte_ring_used(&ring) == 0, "used %u", byte_ring_used(&ring));
+    CHECK(byte_ring_write(&ring, data, 1100) == 1024, "write after discard");
+    CHECK(ring.overflow == 152, "overflow %u", ring.overflow);
+}
+
+int main(void)
+{
+    test_stress(false);
+    test_stress(true);
+    test_overflow();
+
+    printf("%s\n", (check_failures == 0) ? "PASS" : "FAIL");
+    return (check_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+#include "client.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// The UART to BLE coalescing of SPP_CMD_TX_MODE on synthetic bursts. The
+// throughput mode sends a burst in full notifications, the latency mode as
+// the UART events come. Both send the end of a burst once the line is idle,
+// within the bound below.
+
+#define COALESCE_BAUD_RATE  (921600)
+#define COALESCE_MTU        (247)
+#define COALESCE_BURST      (600)
+#define COALESCE_PERIOD_US  (100000)
+#define COALESCE_BURSTS     (20)
+// The idle line, a tick of ble_tx_task, a connection interval and the airtime.
+#define COALESCE_BOUND_US   (1000 + 10000 + 15000 + 5000)
+
+typedef struct coalesce_run {
+    uint32_t notifications;
+    uint64_t received;
+    int64_t burst_end_us[COALESCE_BURSTS];
+    int64_t latency_us[COALESCE_BURSTS];
+    uint32_t burst_done;
+} coalesce_run_t;
+
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static coalesce_run_t run;
+
+static void handle_data(client_t *client, uint32_t chan, const uint8_t *value, uint32_t len,
+                        int64_t time_us, void *arg)
+{
+    pthread_mutex_lock(&run_lock);
+    run.notifications++;
+    run.received += len;
+    while ((run.burst_done < COALESCE_BURSTS) &&
+           (run.received >= ((uint64_t)(run.burst_done + 1) * COALESCE_BURST))) {
+        run.latency_us[run.burst_done] = time_us - run.burst_end_us[run.burst_done];
+        run.burst_done++;
+    }
+    pthread_mutex_unlock(&run_lock);
+}
+
+static void measure(client_t *client, spp_tx_mode_t mode, const char *name)
+{
+    uint8_t arg[2] = { mode, 0 };
+    uint8_t buf[COALESCE_BURST];
+    uint32_t byte_us = 10 * 1000000 / sim_uart_baud(CLIENT_CHAN0_UART);
+    int64_t next = sim_time_us();
+    int64_t latency_max = 0;
+
+    CHECK(client_command(client, SPP_CMD_TX_MODE, arg, sizeof(arg)) == SPP_CMD_OK, "mode");
+    memset(buf, 'a', sizeof(buf));
+    pthread_mutex_lock(&run_lock);
+    memset(&run, 0, sizeof(run));
+    pthread_mutex_unlock(&run_lock);
+
+    for (uint32_t i = 0; i < COALESCE_BURSTS; i++) {
+        sim_sleep_us(next - sim_time_us());
+        next += COALESCE_PERIOD_US;
+        pthread_mutex_lock(&run_lock);
+        run.burst_end_us[i] = sim_time_us() + sizeof(buf) * byte_us;
+        pthread_mutex_unlock(&run_lock);
+        sim_uart_send(CLIENT_CHAN0_UART, buf, sizeof(buf));
+    }
+    sim_sleep_us(COALESCE_PERIOD_US);
+
+    pthread_mutex_lock(&run_lock);
+    for (uint32_t i = 0; i < run.burst_done; i++) {
+        latency_max = (run.latency_us[i] > latency_max) ? run.latency_us[i] : latency_max;
+    }
+    printf("%-10s %3u notifications for %u bursts of %u bytes, end of burst %.2f ms max\n",
+           name, run.notifications, COALESCE_BURSTS, COALESCE_BURST, latency_max / 1000.0);
+    CHECK(run.burst_done == COALESCE_BURSTS, "%s: %u bursts received", name, run.burst_done);
+    CHECK(latency_max <= COALESCE_BOUND_US, "%s: %lld us", name, (long long)latency_max);
+    pthread_mutex_unlock(&run_lock);
+}
+
+int main(void)
+{
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    // NOTE: The idle timeout counts in ticks, so it may end within a burst
+    // and send one partial notification more.
+    uint32_t full = (COALESCE_BURST + COALESCE_MTU - 4) / (COALESCE_MTU - 3) + 1;
+    uint32_t latency_count;
+    uint8_t arg[4];
+    client_t client;
+
+    sim_boot();
+    config.mtu = COALESCE_MTU;
+    if (!client_connect(&client, &config, handle_data, NULL)) {
+        printf("FAIL: no connection\n");
+        return 1;
+    }
+    // NOTE: A burst must take less than the idle timeout of the throughput
+    // mode, one tick, or each FIFO chunk goes out on its own.
+    put_le32(arg, COALESCE_BAUD_RATE);
+    CHECK(client_command(&client, SPP_CMD_UART_BAUD, arg, 4) == SPP_CMD_OK, "baud rate");
+    measure(&client, SPP_TX_MODE_LATENCY, "latency");
+    latency_count = run.notifications;
+    measure(&client, SPP_TX_MODE_THROUGHPUT, "throughput");
+    CHECK(run.notifications <= (COALESCE_BURSTS * full), "%u notifications, %u per burst",
+          run.notifications, full);
+    CHECK(run.notifications < latency_count, "%u in the throughput mode, %u in the latency mode",
+          run.notifications, latency_count);
+    client_disconnect(&client);
+
+    printf("%s\n", (check_failures == 0) ? "PASS" : "FAIL");
+    return (check_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+#include "client.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// The command engine: the round trip of a command to its response on the
+// status characteristic, and the writes it must answer or ignore.
+
+#define COMMAND_ROUNDS      (100)
+// The time of the firmware beyond the two connection events, the write and
+// the response. The 50 ms sleep of the old command task alone took longer.
+#define COMMAND_EXCESS_US   (10000)
+#define COMMAND_PERIOD_MS   (256)
+#define COMMAND_PERIOD_US   (1100000)
+
+static bool has_telemetry(client_t *client, void *arg)
+{
+    return client->telemetry_count != *(uint32_t *)arg;
+}
+
+// NOTE: The idle link moves to the long interval, see tune_conn() in
+// ble_spp_service.c, so the round trip is checked against the interval.
+static void test_latency(client_t *client)
+{
+    static int64_t samples[COMMAND_ROUNDS];
+    static int64_t excess[COMMAND_ROUNDS];
+    uint8_t arg[2] = { 0, 0 };
+    int64_t start = sim_time_us();
+    uint32_t interval_min = UINT32_MAX;
+    uint32_t interval_max = 0;
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < COMMAND_ROUNDS; i++) {
+        int64_t sent = sim_time_us();
+        sim_link_stats_t stats;
+
+        if (client_command(client, SPP_CMD_STATUS_PERIOD, arg, sizeof(arg)) != SPP_CMD_OK) {
+            continue;
+        }
+        sim_central_stats(client->central, &stats);
+        interval_min = (stats.interval_us < interval_min) ? stats.interval_us : interval_min;
+        interval_max = (stats.interval_us > interval_max) ? stats.interval_us : interval_max;
+        pthread_mutex_lock(&(client->lock));
+        samples[count] = client->response_us - sent;
+        pthread_mutex_unlock(&(client->lock));
+        excess[count] = samples[count] - 2 * stats.interval_us;
+        count++;
+    }
+    sort_samples(samples, count);
+    sort_samples(excess, count);
+
+    printf("%u commands, %.1f per second, round trip p50 %.2f ms, p99 %.2f ms, "
+           "interval %u to %u ms\n", count, count * 1000000.0 / (sim_time_us() - start),
+           percentile(samples, count, 50) / 1000.0, percentile(samples, count, 99) / 1000.0,
+           interval_min / 1000, interval_max / 1000);
+    CHECK(count == COMMAND_ROUNDS, "%u of %u responses", count, COMMAND_ROUNDS);
+    CHECK(percentile(excess, count, 99) < COMMAND_EXCESS_US, "p99 %lld us beyond the interval",
+          (long long)percentile(excess, count, 99));
+}
+
+static void test_malformed(client_t *client)
+{
+    uint8_t arg[SPP_CMD_MAX_LEN] = { 0 };
+    uint32_t count;
+
+    // NOTE: An empty write is ignored, the next command still works.
+    CHECK(sim_central_write_req(client->central, CLIENT_HANDLE(SPP_IDX_SPP_COMMAND_VAL),
+                                arg, 0), "empty write");
+    CHECK(client_command(client, SPP_CMD_STATUS_PERIOD, arg, 2) == SPP_CMD_OK,
+          "command after the empty write");
+    CHECK(client_command(client, 0x7F, NULL, 0) == SPP_CMD_ERR_UNKNOWN, "unknown command");
+    CHECK(client_command(client, SPP_CMD_UART_BAUD, arg, 3) == SPP_CMD_ERR_LEN, "short argument");
+    CHECK(client_command(client, SPP_CMD_STATUS_PERIOD, arg, SPP_CMD_MAX_LEN - 1) == SPP_CMD_OK,
+          "longest command");
+
+    // The last byte of the argument counts, the period is above 255 ms.
+    put_le16(arg, COMMAND_PERIOD_MS);
+    CHECK(client_command(client, SPP_CMD_STATUS_PERIOD, arg, 2) == SPP_CMD_OK, "period");
+    pthread_mutex_lock(&(client->lock));
+    count = client->telemetry_count;
+    pthread_mutex_unlock(&(client->lock));
+    CHECK(client_wait(client, has_telemetry, &count, COMMAND_PERIOD_US), "no telemetry");
+    sim_sleep_us(COMMAND_PERIOD_US);
+    pthread_mutex_lock(&(client->lock));
+    count = client->telemetry_count - count;
+    pthread_mutex_unlock(&(client->lock));
+    CHECK((count >= 3) && (count <= 6), "%u telemetry records in %u ms", count,
+          COMMAND_PERIOD_US / 1000);
+    put_le16(arg, 0);
+    CHECK(client_command(client, SPP_CMD_STATUS_PERIOD, arg, 2) == SPP_CMD_OK, "stop");
+}
+
+int main(void)
+{
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    client_t client;
+
+    sim_boot();
+    if (!client_connect(&client, &config, NULL, NULL)) {
+        printf("FAIL: no connection\n");
+        return 1;
+    }
+    test_latency(&client);
+    test_malformed(&client);
+    client_disconnect(&client);
+
+    printf("%s\n", (check_failures == 0) ? "PASS" : "FAIL");
+    return (check_failures == 0) ? 0 : 1;
+}
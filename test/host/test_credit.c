@@ -0,0 +1,182 @@
+#include "client.h"
+#include "spp_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// The credits of SPP_STATUS_CREDIT on the uplink, at 115200 baud. A client
+// which keeps to its credits writes far faster than the UART drains, yet
+// loses nothing. A client which ignores them loses whole writes. So does a
+// long write beyond SPP_DATA_MAX_LEN, of which no part reaches the UART.
+
+#define CREDIT_MTU          (247)
+#define CREDIT_BYTES        (32 * 1024)
+#define CREDIT_RAW_BYTES    (16 * 1024)
+#define CREDIT_DRAIN_US     (5000000)
+#define CREDIT_LONG_BYTES   (SPP_DATA_MAX_LEN + 88)
+
+static pthread_mutex_t sink_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t delivered;
+static uint64_t corrupt;
+
+static uint8_t stream_byte(uint64_t offset)
+{
+    return (uint8_t)(offset ^ (offset >> 8) ^ (offset >> 16));
+}
+
+static void handle_uart(uart_port_t port, const uint8_t *data, uint32_t len,
+                        int64_t time_us, void *arg)
+{
+    pthread_mutex_lock(&sink_lock);
+    for (uint32_t i = 0; i < len; i++) {
+        if (data[i] != stream_byte(delivered + i)) {
+            corrupt++;
+        }
+    }
+    delivered += len;
+    pthread_mutex_unlock(&sink_lock);
+}
+
+static uint64_t sink_delivered(void)
+{
+    uint64_t bytes;
+
+    pthread_mutex_lock(&sink_lock);
+    bytes = delivered;
+    pthread_mutex_unlock(&sink_lock);
+    return bytes;
+}
+
+static void sink_reset(void)
+{
+    pthread_mutex_lock(&sink_lock);
+    delivered = 0;
+    corrupt = 0;
+    pthread_mutex_unlock(&sink_lock);
+}
+
+// Wait until the UART sent bytes, or stopped sending.
+static void sink_drain(uint64_t bytes)
+{
+    int64_t deadline = sim_time_us() + CREDIT_DRAIN_US;
+    uint64_t last = UINT64_MAX;
+
+    while ((sink_delivered() < bytes) && (sink_delivered() != last) &&
+           (sim_time_us() < deadline)) {
+        last = sink_delivered();
+        sim_sleep_us(200000);
+    }
+}
+
+static void test_credits(client_t *client)
+{
+    uint8_t buf[CREDIT_MTU - 3];
+    uint32_t drop = spp_stats.rx_drop;
+    uint64_t in_flight_max = 0;
+    int64_t start = sim_time_us();
+    int64_t sent_us;
+    int64_t uart_us = CREDIT_BYTES * 10LL * 1000000 / sim_uart_baud(CLIENT_CHAN0_UART);
+
+    sink_reset();
+    for (uint32_t sent = 0; sent < CREDIT_BYTES; sent += sizeof(buf)) {
+        uint32_t len = ((CREDIT_BYTES - sent) < sizeof(buf)) ? (CREDIT_BYTES - sent) : sizeof(buf);
+        uint64_t in_flight;
+
+        for (uint32_t i = 0; i < len; i++) {
+            buf[i] = stream_byte(sent + i);
+        }
+        if (!client_send(client, 0, buf, len)) {
+            CHECK(false, "no credits after %u bytes", sent);
+            break;
+        }
+        in_flight = sent + len - sink_delivered();
+        in_flight_max = (in_flight > in_flight_max) ? in_flight : in_flight_max;
+    }
+    sent_us = sim_time_us() - start;
+    sink_drain(CREDIT_BYTES);
+
+    printf("credits  %u bytes in %.0f ms, %llu delivered, %llu in flight max, %u dropped\n",
+           CREDIT_BYTES, sent_us / 1000.0, (unsigned long long)sink_delivered(),
+           (unsigned long long)in_flight_max, spp_stats.rx_drop - drop);
+    CHECK(sink_delivered() == CREDIT_BYTES, "%llu of %u bytes",
+          (unsigned long long)sink_delivered(), CREDIT_BYTES);
+    CHECK(corrupt == 0, "%llu bytes differ", (unsigned long long)corrupt);
+    CHECK(spp_stats.rx_drop == drop, "%u bytes dropped", spp_stats.rx_drop - drop);
+    // NOTE: The writes are held back to the pace of the UART.
+    CHECK(sent_us > (uart_us / 2), "%lld us to send, the UART takes %lld us",
+          (long long)sent_us, (long long)uart_us);
+}
+
+static void test_no_credits(client_t *client)
+{
+    uint8_t buf[CREDIT_MTU - 3];
+    uint32_t drop = spp_stats.rx_drop;
+    uint32_t sent = 0;
+
+    sink_reset();
+    memset(buf, 'r', sizeof(buf));
+    while (sent < CREDIT_RAW_BYTES) {
+        sim_central_write(client->central, CLIENT_HANDLE(SPP_IDX_SPP_DATA_RECV_VAL),
+                          buf, sizeof(buf));
+        sent += sizeof(buf);
+    }
+    sink_drain(sent);
+
+    printf("ignored  %u bytes, %llu delivered, %u dropped\n", sent,
+           (unsigned long long)sink_delivered(), spp_stats.rx_drop - drop);
+    CHECK(spp_stats.rx_drop != drop, "nothing dropped");
+    // NOTE: A write is stored or dropped whole.
+    CHECK((sink_delivered() + (spp_stats.rx_drop - drop)) == sent,
+          "%llu delivered, %u dropped", (unsigned long long)sink_delivered(),
+          spp_stats.rx_drop - drop);
+}
+
+static void test_long_write(client_t *client)
+{
+    static uint8_t buf[CREDIT_LONG_BYTES];
+    uint32_t drop;
+
+    for (uint32_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = stream_byte(i);
+    }
+    sink_reset();
+    CHECK(sim_central_write_long(client->central, CLIENT_HANDLE(SPP_IDX_SPP_DATA_RECV_VAL),
+                                 buf, SPP_DATA_MAX_LEN), "long write");
+    sink_drain(SPP_DATA_MAX_LEN);
+    CHECK(sink_delivered() == SPP_DATA_MAX_LEN, "%llu of %u bytes",
+          (unsigned long long)sink_delivered(), SPP_DATA_MAX_LEN);
+    CHECK(corrupt == 0, "%llu bytes differ", (unsigned long long)corrupt);
+
+    sink_reset();
+    drop = spp_stats.rx_drop;
+    CHECK(sim_central_write_long(client->central, CLIENT_HANDLE(SPP_IDX_SPP_DATA_RECV_VAL),
+                                 buf, sizeof(buf)), "long write");
+    sink_drain(sizeof(buf));
+    printf("long     %u bytes, %llu delivered, %u dropped\n", CREDIT_LONG_BYTES,
+           (unsigned long long)sink_delivered(), spp_stats.rx_drop - drop);
+    CHECK(sink_delivered() == 0, "%llu bytes of the overflow delivered",
+          (unsigned long long)sink_delivered());
+    CHECK((spp_stats.rx_drop - drop) == sizeof(buf), "%u of %u bytes dropped",
+          spp_stats.rx_drop - drop, CREDIT_LONG_BYTES);
+}
+
+int main(void)
+{
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    client_t client;
+
+    sim_boot();
+    sim_uart_set_sink(CLIENT_CHAN0_UART, handle_uart, NULL);
+    config.mtu = CREDIT_MTU;
+    if (!client_connect(&client, &config, NULL, NULL)) {
+        printf("FAIL: no connection\n");
+        return 1;
+    }
+    test_credits(&client);
+    test_no_credits(&client);
+    test_long_write(&client);
+    client_disconnect(&client);
+
+    printf("%s\n", (check_failures == 0) ? "PASS" : "FAIL");
+    return (check_failures == 0) ? 0 : 1;
+}
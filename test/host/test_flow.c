@@ -0,0 +1,91 @@
+#include "client.h"
+
+#include <stdio.h>
+
+// The notification pipeline of spp_flow.c keeps the link busy, so the
+// downlink throughput follows the PDUs the controller takes per connection
+// event, rather than a fixed pacing. The congestion of the L2CAP queue holds
+// the sender back.
+
+#define FLOW_BAUD_RATE      (921600)
+#define FLOW_MTU            (247)
+#define FLOW_WARMUP_US      (300000)
+#define FLOW_RUN_US         (1500000)
+
+static uint64_t received;
+
+static void handle_data(client_t *client, uint32_t chan, const uint8_t *value, uint32_t len,
+                        int64_t time_us, void *arg)
+{
+    __atomic_add_fetch(&received, len, __ATOMIC_RELAXED);
+}
+
+// The bytes per second the central receives while the UART sends at full rate.
+static double measure(uint32_t event_pdus, sim_link_stats_t *stats)
+{
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    uint8_t buf[256] = { 0 };
+    client_t client;
+    int64_t start;
+    int64_t warm = 0;
+    uint64_t warm_bytes = 0;
+    double rate;
+
+    config.mtu = FLOW_MTU;
+    config.event_pdus = event_pdus;
+    if (!client_connect(&client, &config, handle_data, NULL)) {
+        CHECK(false, "no connection");
+        return 0;
+    }
+    start = sim_time_us();
+    while (sim_time_us() < (start + FLOW_RUN_US)) {
+        sim_uart_send(CLIENT_CHAN0_UART, buf, sizeof(buf));
+        if ((warm == 0) && (sim_time_us() >= (start + FLOW_WARMUP_US))) {
+            warm = sim_time_us();
+            warm_bytes = __atomic_load_n(&received, __ATOMIC_RELAXED);
+        }
+    }
+    rate = (__atomic_load_n(&received, __ATOMIC_RELAXED) - warm_bytes) * 1000000.0 /
+           (sim_time_us() - warm);
+    sim_central_stats(client.central, stats);
+    client_disconnect(&client);
+    // NOTE: Let the firmware drop what is left, before the next run.
+    sim_sleep_us(FLOW_WARMUP_US);
+
+    return rate;
+}
+
+int main(void)
+{
+    static const uint32_t PDUS[] = { 1, 2, 4 };
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    double rate[sizeof(PDUS) / sizeof(PDUS[0])];
+    uint8_t arg[4];
+    client_t client;
+
+    sim_boot();
+    if (!client_connect(&client, &config, NULL, NULL)) {
+        printf("FAIL: no connection\n");
+        return 1;
+    }
+    put_le32(arg, FLOW_BAUD_RATE);
+    CHECK(client_command(&client, SPP_CMD_UART_BAUD, arg, 4) == SPP_CMD_OK, "baud rate");
+    client_disconnect(&client);
+
+    for (uint32_t i = 0; i < (sizeof(PDUS) / sizeof(PDUS[0])); i++) {
+        sim_link_stats_t stats;
+
+        rate[i] = measure(PDUS[i], &stats);
+        printf("%u PDUs per event: %.0f bytes/s, interval %u us, %u congestion\n",
+               PDUS[i], rate[i], stats.interval_us, stats.congest);
+        CHECK(stats.truncated == 0, "%u notifications above the MTU", stats.truncated);
+        CHECK(stats.congest != 0, "no congestion at %u PDUs", PDUS[i]);
+    }
+    CHECK(rate[1] > (1.6 * rate[0]), "%.0f at 2 PDUs, %.0f at 1", rate[1], rate[0]);
+    CHECK(rate[2] > (1.6 * rate[1]), "%.0f at 4 PDUs, %.0f at 2", rate[2], rate[1]);
+    // A sleep of 20 ms after each notification allowed MTU - 3 bytes per 20 ms.
+    CHECK(rate[2] > (2 * (FLOW_MTU - 3) * 1000000.0 / 20000), "%.0f at 4 PDUs", rate[2]);
+
+    printf("%s\n", (check_failures == 0) ? "PASS" : "FAIL");
+    return (check_failures == 0) ? 0 : 1;
+}
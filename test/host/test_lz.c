@@ -0,0 +1,370 @@
+#include "client.h"
+#include "spp_lz.h"
+
+#include "xtensa/hal.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// The codec of the compressed transport on serial traffic, cut into
+// notifications the way compress_data() in esp32_spp_server.c does. Reports
+// the ratio and the encoder cycles per byte, host time counted at 160 MHz
+// by xthal_get_ccount(). Then the throughput of NMEA over a link of one PDU
+// per connection event, with the compression off and on.
+
+#define LZ_MTU              (247)
+#define LZ_CORPUS_SIZE      (64 * 1024)
+#define LZ_CYCLE_ROUNDS     (20)
+#define LZ_BAUD_RATE        (921600)
+#define LZ_WARMUP_US        (300000)
+#define LZ_RUN_US           (1500000)
+#define LZ_DRAIN_US         (100000)
+
+typedef struct lz_corpus {
+    const char *name;
+    uint32_t (*fill)(uint8_t *buf, uint32_t size, uint32_t *seed);
+    double ratio_min;
+} lz_corpus_t;
+
+static uint32_t next_rand(uint32_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static uint32_t append(uint8_t *buf, uint32_t size, uint32_t len, const char *line)
+{
+    uint32_t n = strlen(line);
+
+    n = (n < (size - len)) ? n : (size - len);
+    memcpy(buf + len, line, n);
+    return len + n;
+}
+
+static uint32_t fill_nmea(uint8_t *buf, uint32_t size, uint32_t *seed)
+{
+    char line[128];
+    uint32_t len = 0;
+
+    for (uint32_t t = 0; len < size; t++) {
+        uint32_t r = next_rand(seed);
+
+        snprintf(line, sizeof(line),
+                 "$GPGGA,%02u%02u%02u.00,4807.%03u,N,01131.%03u,E,1,08,0.9,545.%u,M,46.9,M,,*%02X\r\n",
+                 (t / 3600) % 24, (t / 60) % 60, t % 60, 38 + (r % 4), (r >> 4) % 8,
+                 (r >> 8) % 10, (r >> 12) & 0xFF);
+        len = append(buf, size, len, line);
+        snprintf(line, sizeof(line),
+                 "$GPRMC,%02u%02u%02u.00,A,4807.%03u,N,01131.%03u,E,022.4,084.4,230394,003.1,W*%02X\r\n",
+                 (t / 3600) % 24, (t / 60) % 60, t % 60, 38 + (r % 4), (r >> 4) % 8,
+                 (r >> 16) & 0xFF);
+        len = append(buf, size, len, line);
+    }
+    return len;
+}
+
+static uint32_t fill_csv(uint8_t *buf, uint32_t size, uint32_t *seed)
+{
+    char line[128];
+    uint32_t len = 0;
+
+    for (uint32_t t = 0; len < size; t++) {
+        uint32_t r = next_rand(seed);
+
+        snprintf(line, sizeof(line), "%u,%d.%u,%u.%u,3.%03u,%u\n", 1000000 + t * 100,
+                 21 + (int)(r % 3), (r >> 2) % 10, 40 + (r >> 4) % 5, (r >> 8) % 10,
+                 280 + (r >> 12) % 20, (r >> 20) % 2);
+        len = append(buf, size, len, line);
+    }
+    return len;
+}
+
+static uint32_t fill_log(uint8_t *buf, uint32_t size, uint32_t *seed)
+{
+    static const char *FORMAT[] = {
+        "I (%u) spp: Connected, conn_id %u, mtu %u\n",
+        "W (%u) spp: UART%u RX overflow.\n",
+        "I (%u) spp: Status period %u ms, channel %u\n",
+        "D (%u) sensor: sample %u ready, %u bytes queued\n",
+    };
+    char line[128];
+    uint32_t len = 0;
+
+    for (uint32_t t = 0; len < size; t++) {
+        uint32_t r = next_rand(seed);
+
+        snprintf(line, sizeof(line), FORMAT[r % 4], 10000 + t * 37, (r >> 4) % 3,
+                 (r >> 8) % 512);
+        len = append(buf, size, len, line);
+    }
+    return len;
+}
+
+static uint32_t fill_random(uint8_t *buf, uint32_t size, uint32_t *seed)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        buf[i] = next_rand(seed);
+    }
+    return size;
+}
+
+static const lz_corpus_t LZ_CORPUS[] = {
+    { "nmea",   fill_nmea,      2.0 },
+    { "csv",    fill_csv,       1.3 },
+    { "log",    fill_log,       1.5 },
+    // NOTE: The bytes which do not compress cost the header byte only.
+    { "random", fill_random,    0.99 },
+};
+
+// Encode the bytes at src into a payload, as compress_data() does.
+static uint32_t encode_payload(spp_lz_t *lz, const uint8_t *src, uint32_t src_len,
+                               uint8_t *buf, uint32_t max_data_size, uint32_t *consumed)
+{
+    uint32_t len = (src_len < SPP_LZ_BLOCK_MAX) ? src_len : SPP_LZ_BLOCK_MAX;
+    uint32_t data_size = spp_lz_encode(lz, src, len, buf + 1, max_data_size - 1, consumed);
+
+    if (data_size >= *consumed) {
+        *consumed = (len < (max_data_size - 1)) ? len : (max_data_size - 1);
+        memcpy(buf + 1, src, *consumed);
+        buf[0] = SPP_LZ_HDR_RAW;
+        data_size = *consumed;
+    } else {
+        buf[0] = SPP_LZ_HDR_LZ;
+    }
+    return data_size + 1;
+}
+
+// The bytes of the payload, or -1 if it does not decode.
+static int32_t decode_payload(const uint8_t *buf, uint32_t len, uint8_t *dst, uint32_t dst_size)
+{
+    if ((len == 0) || ((buf[0] == SPP_LZ_HDR_RAW) && ((len - 1) > dst_size))) {
+        return -1;
+    }
+    if (buf[0] == SPP_LZ_HDR_RAW) {
+        memcpy(dst, buf + 1, len - 1);
+        return len - 1;
+    }
+    if (buf[0] == SPP_LZ_HDR_LZ) {
+        return spp_lz_decode(buf + 1, len - 1, dst, dst_size);
+    }
+    return -1;
+}
+
+static void test_corpus(const lz_corpus_t *corpus)
+{
+    static uint8_t src[LZ_CORPUS_SIZE];
+    static spp_lz_t lz;
+    uint8_t buf[LZ_MTU - 3];
+    uint8_t dec[SPP_LZ_BLOCK_MAX];
+    uint32_t seed = 0x2545F491;
+    uint32_t size = corpus->fill(src, sizeof(src), &seed);
+    uint64_t out = 0;
+    uint32_t payloads = 0;
+    uint32_t errors = 0;
+    uint32_t start;
+    uint32_t cycles;
+    double ratio;
+
+    for (uint32_t pos = 0; pos < size; payloads++) {
+        uint32_t consumed;
+        uint32_t len = encode_payload(&lz, src + pos, size - pos, buf, sizeof(buf), &consumed);
+        int32_t n = decode_payload(buf, len, dec, sizeof(dec));
+
+        if ((n != (int32_t)consumed) || (memcmp(dec, src + pos, consumed) != 0)) {
+            errors++;
+        }
+        if ((len > sizeof(buf)) || (consumed == 0)) {
+            CHECK(false, "%s: payload of %u bytes for %u", corpus->name, len, consumed);
+            break;
+        }
+        out += len;
+        pos += consumed;
+    }
+
+    start = xthal_get_ccount();
+    for (uint32_t round = 0; round < LZ_CYCLE_ROUNDS; round++) {
+        for (uint32_t pos = 0; pos < size; ) {
+            uint32_t consumed;
+
+            encode_payload(&lz, src + pos, size - pos, buf, sizeof(buf), &consumed);
+            pos += consumed;
+        }
+    }
+    cycles = xthal_get_ccount() - start;
+
+    ratio = (double)size / out;
+    printf("%-8s %6u bytes in %4u payloads, ratio %5.2f, %6.1f cycles per byte\n",
+           corpus->name, size, payloads, ratio, (double)cycles / size / LZ_CYCLE_ROUNDS);
+    CHECK(errors == 0, "%s: %u payloads differ", corpus->name, errors);
+    CHECK(ratio >= corpus->ratio_min, "%s: ratio %.2f", corpus->name, ratio);
+}
+
+// The decoder of the clients must hold up to any payload.
+static void test_garbage(void)
+{
+    uint8_t src[64];
+    uint8_t dst[SPP_LZ_BLOCK_MAX];
+    uint32_t seed = 1;
+    uint32_t bad = 0;
+
+    for (uint32_t i = 0; i < 100000; i++) {
+        uint32_t len = next_rand(&seed) % sizeof(src);
+        uint32_t size = next_rand(&seed) % sizeof(dst);
+        int32_t n;
+
+        for (uint32_t j = 0; j < len; j++) {
+            src[j] = next_rand(&seed);
+        }
+        n = spp_lz_decode(src, len, dst, size);
+        if (n > (int32_t)size) {
+            bad++;
+        }
+    }
+    CHECK(bad == 0, "%u decodes beyond the buffer", bad);
+}
+
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t stream[LZ_CORPUS_SIZE];
+static uint32_t stream_size;
+static uint64_t received;
+static uint64_t corrupt;
+static uint32_t undecoded;
+
+static void handle_data(client_t *client, uint32_t chan, const uint8_t *value, uint32_t len,
+                        int64_t time_us, void *arg)
+{
+    bool is_compressed = *(bool *)arg;
+    uint8_t dec[SPP_LZ_BLOCK_MAX];
+    int32_t n = len;
+
+    if (is_compressed) {
+        n = decode_payload(value, len, dec, sizeof(dec));
+        value = dec;
+    }
+    pthread_mutex_lock(&stream_lock);
+    if (n < 0) {
+        undecoded++;
+        n = 0;
+    }
+    for (int32_t i = 0; i < n; i++) {
+        if (value[i] != stream[(received + i) % stream_size]) {
+            corrupt++;
+        }
+    }
+    received += n;
+    pthread_mutex_unlock(&stream_lock);
+}
+
+static uint64_t stream_received(void)
+{
+    uint64_t bytes;
+
+    pthread_mutex_lock(&stream_lock);
+    bytes = received;
+    pthread_mutex_unlock(&stream_lock);
+    return bytes;
+}
+
+static void stream_reset(void)
+{
+    pthread_mutex_lock(&stream_lock);
+    received = 0;
+    corrupt = 0;
+    undecoded = 0;
+    pthread_mutex_unlock(&stream_lock);
+}
+
+// Wait until the central stopped receiving.
+static void stream_drain(void)
+{
+    uint64_t last;
+
+    do {
+        last = stream_received();
+        sim_sleep_us(LZ_DRAIN_US);
+    } while (stream_received() != last);
+}
+
+// The bytes per second of NMEA the central receives while the UART sends
+// at full rate, held back by RTS. The stream arrives whole and in order.
+static double measure(bool is_compressed)
+{
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    uint8_t arg = is_compressed;
+    client_t client;
+    int64_t start;
+    int64_t warm = 0;
+    uint64_t warm_bytes = 0;
+    uint64_t sent = 0;
+    uint32_t pos = 0;
+    double rate;
+
+    config.mtu = LZ_MTU;
+    config.event_pdus = 1;
+    if (!client_connect(&client, &config, handle_data, &is_compressed)) {
+        CHECK(false, "no connection");
+        return 0;
+    }
+    CHECK(client_command(&client, SPP_CMD_COMPRESS, &arg, 1) == SPP_CMD_OK, "compress");
+
+    stream_reset();
+    start = sim_time_us();
+    while (sim_time_us() < (start + LZ_RUN_US)) {
+        uint32_t len = ((stream_size - pos) < 256) ? (stream_size - pos) : 256;
+
+        sim_uart_send(CLIENT_CHAN0_UART, stream + pos, len);
+        sent += len;
+        pos = (pos + len) % stream_size;
+        if ((warm == 0) && (sim_time_us() >= (start + LZ_WARMUP_US))) {
+            warm = sim_time_us();
+            warm_bytes = stream_received();
+        }
+    }
+    rate = (stream_received() - warm_bytes) * 1000000.0 / (sim_time_us() - warm);
+    stream_drain();
+    CHECK(undecoded == 0, "%u payloads do not decode, compressed %d", undecoded, is_compressed);
+    CHECK(stream_received() == sent, "%llu of %llu bytes, compressed %d",
+          (unsigned long long)stream_received(), (unsigned long long)sent, is_compressed);
+    CHECK(corrupt == 0, "%llu bytes differ, compressed %d", (unsigned long long)corrupt,
+          is_compressed);
+    client_disconnect(&client);
+
+    printf("%-8s %10.0f bytes/s of NMEA at 1 PDU per event\n", is_compressed ? "lz" : "raw", rate);
+    return rate;
+}
+
+int main(void)
+{
+    uint32_t seed = 0x2545F491;
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    uint8_t arg[4];
+    client_t client;
+    double raw;
+    double lz;
+
+    for (uint32_t i = 0; i < (sizeof(LZ_CORPUS) / sizeof(LZ_CORPUS[0])); i++) {
+        test_corpus(&(LZ_CORPUS[i]));
+    }
+    test_garbage();
+
+    stream_size = fill_nmea(stream, sizeof(stream), &seed);
+    sim_boot();
+    if (!client_connect(&client, &config, NULL, NULL)) {
+        printf("FAIL: no connection\n");
+        return 1;
+    }
+    put_le32(arg, LZ_BAUD_RATE);
+    CHECK(client_command(&client, SPP_CMD_UART_BAUD, arg, 4) == SPP_CMD_OK, "baud rate");
+    arg[0] = 1;
+    CHECK(client_command(&client, SPP_CMD_UART_FLOW, arg, 1) == SPP_CMD_OK, "flow control");
+    client_disconnect(&client);
+
+    raw = measure(false);
+    lz = measure(true);
+    CHECK(lz > (1.5 * raw), "%.0f bytes/s compressed, %.0f raw", lz, raw);
+
+    printf("%s\n", (check_failures == 0) ? "PASS" : "FAIL");
+    return (check_failures == 0) ? 0 : 1;
+}
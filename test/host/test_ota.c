@@ -0,0 +1,222 @@
+#include "client.h"
+
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "mbedtls/sha256.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// An OTA image over the data channel into the emulated flash, see
+// fake/esp.c. The link pairs with the passkey first, a central with the
+// wrong one is refused. The image stops at a disconnect and resumes from
+// the offset the firmware kept. SPP_CMD_OTA_END then selects the partition
+// and restarts.
+//
+// The flash calls take the time of the chip, so the sender only keeps up
+// with the writes of the link, measured first on the UART channel, if the
+// flash writes overlap the receive. stall counts the time the sender waited
+// for a grant.
+
+#define OTA_MTU             (247)
+#define OTA_IMAGE_SIZE      (300 * 1024 + 123)
+#define OTA_STOP_AT         (120 * 1024)
+#define OTA_WAIT_US         (3000000)
+#define OTA_LINK_BYTES      (64 * 1024)
+#define OTA_PAIR_US         (200000)
+
+static uint8_t image[OTA_IMAGE_SIZE];
+static int64_t stall_us;
+
+typedef struct grant_wait {
+    uint32_t pos;
+} grant_wait_t;
+
+static bool has_grant(client_t *client, void *arg)
+{
+    grant_wait_t *wait = arg;
+
+    return (client->ota.state != SPP_OTA_STATE_RECEIVING) || (client->ota.granted > wait->pos);
+}
+
+static bool has_written(client_t *client, void *arg)
+{
+    return client->ota.offset == OTA_IMAGE_SIZE;
+}
+
+static bool is_encrypted(client_t *client, void *arg)
+{
+    return sim_central_is_encrypted(client->central);
+}
+
+// The first SPP_CMD_OTA_BEGIN asks for the pairing. Return the offset to
+// send from, or -1.
+static int32_t ota_begin(client_t *client, const uint8_t *id)
+{
+    uint8_t arg[4 + SPP_OTA_ID_LEN];
+    int32_t result;
+
+    put_le32(arg, OTA_IMAGE_SIZE);
+    memcpy(arg + 4, id, SPP_OTA_ID_LEN);
+    result = client_command(client, SPP_CMD_OTA_BEGIN, arg, sizeof(arg));
+    CHECK(result == SPP_CMD_ERR_AUTH, "begin on a plain link: %d", result);
+    CHECK(client_wait(client, is_encrypted, NULL, OTA_WAIT_US), "no encryption");
+    result = client_command(client, SPP_CMD_OTA_BEGIN, arg, sizeof(arg));
+    CHECK(result == SPP_CMD_OK, "begin: %d", result);
+    if (result != SPP_CMD_OK) {
+        return -1;
+    }
+    pthread_mutex_lock(&(client->lock));
+    result = client->ota.offset;
+    pthread_mutex_unlock(&(client->lock));
+    return result;
+}
+
+// A central which pairs without the passkey never gets to write.
+static void test_wrong_passkey(const uint8_t *id)
+{
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    uint8_t arg[4 + SPP_OTA_ID_LEN];
+    client_t client;
+    int32_t result;
+
+    config.passkey = CONFIG_SPP_BLE_PASSKEY + 1;
+    if (!client_connect(&client, &config, NULL, NULL)) {
+        CHECK(false, "no connection");
+        return;
+    }
+    put_le32(arg, OTA_IMAGE_SIZE);
+    memcpy(arg + 4, id, SPP_OTA_ID_LEN);
+    result = client_command(&client, SPP_CMD_OTA_BEGIN, arg, sizeof(arg));
+    CHECK(result == SPP_CMD_ERR_AUTH, "begin on a plain link: %d", result);
+    sim_sleep_us(OTA_PAIR_US);
+    CHECK(!sim_central_is_encrypted(client.central), "paired with the wrong passkey");
+    result = client_command(&client, SPP_CMD_OTA_BEGIN, arg, sizeof(arg));
+    CHECK(result == SPP_CMD_ERR_AUTH, "begin with the wrong passkey: %d", result);
+    client_disconnect(&client);
+}
+
+// Write the image from pos to end, each write within the grant.
+static bool ota_send(client_t *client, uint32_t pos, uint32_t end)
+{
+    uint32_t size = sim_central_mtu(client->central) - 3;
+
+    while (pos < end) {
+        grant_wait_t wait = {
+            .pos = pos,
+        };
+        int64_t start = sim_time_us();
+        uint32_t granted;
+        uint32_t len;
+
+        if (!client_wait(client, has_grant, &wait, OTA_WAIT_US)) {
+            return false;
+        }
+        stall_us += sim_time_us() - start;
+        pthread_mutex_lock(&(client->lock));
+        granted = client->ota.granted;
+        if (client->ota.state != SPP_OTA_STATE_RECEIVING) {
+            pthread_mutex_unlock(&(client->lock));
+            return false;
+        }
+        pthread_mutex_unlock(&(client->lock));
+
+        len = (size < (end - pos)) ? size : (end - pos);
+        len = (len < (granted - pos)) ? len : (granted - pos);
+        if (!sim_central_write(client->central, CLIENT_HANDLE(SPP_IDX_SPP_DATA_RECV_VAL),
+                               image + pos, len)) {
+            return false;
+        }
+        pos += len;
+    }
+    return true;
+}
+
+// The bytes per second of the writes without response, which the UART
+// channel drops beyond its credits.
+static double link_rate(client_t *client)
+{
+    uint32_t size = sim_central_mtu(client->central) - 3;
+    int64_t start = sim_time_us();
+
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    for (uint32_t pos = 0; pos < OTA_LINK_BYTES; pos += size) {
+        sim_central_write(client->central, CLIENT_HANDLE(SPP_IDX_SPP_DATA_RECV_VAL), image, size);
+    }
+    esp_log_level_set("*", ESP_LOG_WARN);
+    return OTA_LINK_BYTES * 1000000.0 / (sim_time_us() - start);
+}
+
+int main(void)
+{
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    uint8_t digest[32];
+    uint8_t arg = 1;
+    sim_flash_stats_t stats;
+    client_t client;
+    int64_t start;
+    int64_t send_us;
+    double link;
+    double rate;
+    int32_t offset;
+    int32_t result;
+
+    for (uint32_t i = 0; i < sizeof(image); i++) {
+        image[i] = (uint8_t)((i * 7) ^ (i >> 9));
+    }
+    image[0] = 0xE9;
+    mbedtls_sha256_ret(image, sizeof(image), digest, 0);
+
+    sim_boot();
+    test_wrong_passkey(digest);
+    config.mtu = OTA_MTU;
+    config.passkey = CONFIG_SPP_BLE_PASSKEY;
+
+    // The first connection stops within the image.
+    if (!client_connect(&client, &config, NULL, NULL)) {
+        printf("FAIL: no connection\n");
+        return 1;
+    }
+    link = link_rate(&client);
+    offset = ota_begin(&client, digest);
+    CHECK(offset == 0, "new image at %d", offset);
+    start = sim_time_us();
+    CHECK(ota_send(&client, 0, OTA_STOP_AT), "first part");
+    send_us = sim_time_us() - start;
+    client_disconnect(&client);
+
+    // The second one resumes.
+    if (!client_connect(&client, &config, NULL, NULL)) {
+        printf("FAIL: no connection\n");
+        return 1;
+    }
+    offset = ota_begin(&client, digest);
+    CHECK((offset > 0) && (offset <= OTA_STOP_AT), "resumed at %d of %u", offset, OTA_STOP_AT);
+    offset = (offset < 0) ? 0 : offset;
+    start = sim_time_us();
+    CHECK(ota_send(&client, offset, OTA_IMAGE_SIZE), "second part");
+    CHECK(client_wait(&client, has_written, NULL, OTA_WAIT_US), "image not written");
+    send_us += sim_time_us() - start;
+
+    result = client_command(&client, SPP_CMD_OTA_END, &arg, 1);
+    CHECK(result == SPP_CMD_OK, "end: %d", result);
+    start = sim_time_us();
+    while ((sim_restart_count() == 0) && (sim_time_us() < (start + OTA_WAIT_US))) {
+        sim_sleep_us(10000);
+    }
+    sim_flash_stats("ota_1", &stats);
+
+    rate = (OTA_IMAGE_SIZE + OTA_STOP_AT - offset) * 1000000.0 / send_us;
+    printf("%u bytes resumed at %d, %.0f bytes/s, link %.0f bytes/s, stall %.0f ms of %.0f ms, "
+           "%u KB erased, %u KB written\n", OTA_IMAGE_SIZE, offset, rate, link,
+           stall_us / 1000.0, send_us / 1000.0, stats.erase_bytes / 1024, stats.write_bytes / 1024);
+    CHECK(sim_restart_count() == 1, "%u restarts", sim_restart_count());
+    CHECK(strcmp(esp_ota_get_boot_partition()->label, "ota_1") == 0, "boot from %s",
+          esp_ota_get_boot_partition()->label);
+    CHECK(memcmp(sim_flash_data("ota_1"), image, sizeof(image)) == 0, "image differs");
+    // NOTE: The erase of a 64 KB block outlasts the two receive blocks.
+    CHECK(rate > (0.6 * link), "%.0f bytes/s, link %.0f bytes/s", rate, link);
+
+    printf("%s\n", (check_failures == 0) ? "PASS" : "FAIL");
+    return (check_failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+#include "client.h"
+#include "spp_log.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Store and forward on a flash kept in a file.
+//
+// spp_log.c on a file of its own: the stream read back, the oldest sectors
+// dropped when full, the laps carried on over a reboot and the erases
+// spread evenly. Then the firmware with sim_flash_file(): the UART data of
+// no central goes into the log, its depth shows on the status
+// characteristic, and the central which subscribes gets all of it in order,
+// followed by the data which came in during the replay.
+
+#define STORE_SECTORS       (8)
+#define STORE_ROUNDS        (4000)
+#define STORE_START         (0xFFFF0000u)
+#define STORE_UART_BYTES    (24 * 1024)
+#define STORE_LIVE_BYTES    (4 * 1024)
+#define STORE_DRAIN_US      (3000000)
+
+typedef struct store_flash {
+    int fd;
+    uint32_t erases[STORE_SECTORS];
+    uint32_t bad_writes;
+} store_flash_t;
+
+static bool flash_read(void *ctx, uint32_t addr, void *buf, uint32_t len)
+{
+    store_flash_t *flash = ctx;
+
+    return pread(flash->fd, buf, len, addr) == (ssize_t)len;
+}
+
+// NOTE: NOR flash only clears bits, a write over unerased bytes is counted.
+static bool flash_write(void *ctx, uint32_t addr, const void *buf, uint32_t len)
+{
+    store_flash_t *flash = ctx;
+    uint8_t old[SPP_LOG_SECTOR_SIZE];
+    const uint8_t *src = buf;
+
+    if ((len > sizeof(old)) || (pread(flash->fd, old, len, addr) != (ssize_t)len)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        if (old[i] != 0xff) {
+            flash->bad_writes++;
+        }
+        old[i] &= src[i];
+    }
+    return pwrite(flash->fd, old, len, addr) == (ssize_t)len;
+}
+
+static bool flash_erase(void *ctx, uint32_t addr)
+{
+    store_flash_t *flash = ctx;
+    uint8_t sector[SPP_LOG_SECTOR_SIZE];
+
+    if (((addr % SPP_LOG_SECTOR_SIZE) != 0) || ((addr / SPP_LOG_SECTOR_SIZE) >= STORE_SECTORS)) {
+        return false;
+    }
+    memset(sector, 0xff, sizeof(sector));
+    flash->erases[addr / SPP_LOG_SECTOR_SIZE]++;
+    return pwrite(flash->fd, sector, sizeof(sector), addr) == (ssize_t)sizeof(sector);
+}
+
+static const spp_log_flash_t STORE_FLASH = {
+    .read = flash_read,
+    .write = flash_write,
+    .erase = flash_erase,
+};
+
+static uint8_t stream_byte(uint32_t pos)
+{
+    return (uint8_t)(pos ^ (pos >> 8) ^ (pos >> 16));
+}
+
+static int temp_file(char *path)
+{
+    int fd = mkstemp(path);
+
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+static void test_log(void)
+{
+    char path[] = "/tmp/spp_log_XXXXXX";
+    store_flash_t flash = {
+        .fd = temp_file(path),
+    };
+    uint8_t buf[1500];
+    uint32_t pos = STORE_START;
+    uint32_t read_pos = STORE_START;
+    uint32_t errors = 0;
+    uint32_t skipped = 0;
+    uint32_t erase_min = UINT32_MAX;
+    uint32_t erase_max = 0;
+    uint32_t seq;
+    spp_log_t log;
+
+    memset(buf, 0xff, sizeof(buf));
+    for (uint32_t i = 0; i < (STORE_SECTORS * SPP_LOG_SECTOR_SIZE); i += sizeof(buf)) {
+        CHECK(pwrite(flash.fd, buf, sizeof(buf), i) == sizeof(buf), "%s", path);
+    }
+    CHECK(spp_log_init(&log, &STORE_FLASH, &flash, 0, STORE_SECTORS * SPP_LOG_SECTOR_SIZE),
+          "init");
+    srand(1);
+    for (uint32_t round = 0; round < STORE_ROUNDS; round++) {
+        uint32_t len = 1 + (rand() % 1024);
+        uint32_t n;
+
+        for (uint32_t i = 0; i < len; i++) {
+            buf[i] = stream_byte(pos + i);
+        }
+        n = spp_log_append(&log, pos, buf, len);
+        CHECK(n == len, "%u of %u bytes stored", n, len);
+        pos += n;
+        // NOTE: The reader lags at times, and loses the dropped sectors.
+        if ((int32_t)(read_pos - log.tail) < 0) {
+            skipped += log.tail - read_pos;
+            read_pos = log.tail;
+        }
+        if ((rand() % 4) != 0) {
+            continue;
+        }
+        n = spp_log_read_at(&log, read_pos, buf, 1 + (rand() % sizeof(buf)));
+        for (uint32_t i = 0; i < n; i++) {
+            if (buf[i] != stream_byte(read_pos + i)) {
+                errors++;
+            }
+        }
+        read_pos += n;
+        spp_log_release(&log, read_pos);
+        CHECK(spp_log_used(&log) <= (STORE_SECTORS * SPP_LOG_SECTOR_SIZE), "%u bytes used",
+              spp_log_used(&log));
+    }
+    CHECK(errors == 0, "%u bytes differ", errors);
+    CHECK(flash.bad_writes == 0, "%u bytes written unerased", flash.bad_writes);
+    CHECK(skipped == log.dropped, "%u bytes skipped, %u dropped", skipped, log.dropped);
+
+    // The reboot starts empty after the newest sector.
+    seq = log.seq;
+    CHECK(spp_log_init(&log, &STORE_FLASH, &flash, 0, STORE_SECTORS * SPP_LOG_SECTOR_SIZE),
+          "init after the reboot");
+    CHECK(log.seq == seq, "seq %u, %u before the reboot", log.seq, seq);
+    CHECK(spp_log_used(&log) == 0, "%u bytes used after the reboot", spp_log_used(&log));
+    for (uint32_t i = 0; i < (STORE_SECTORS * SPP_LOG_DATA_SIZE); i += sizeof(buf)) {
+        CHECK(spp_log_append(&log, pos, buf, sizeof(buf)) == sizeof(buf), "append after the reboot");
+        pos += sizeof(buf);
+    }
+    for (uint32_t i = 0; i < STORE_SECTORS; i++) {
+        erase_min = (flash.erases[i] < erase_min) ? flash.erases[i] : erase_min;
+        erase_max = (flash.erases[i] > erase_max) ? flash.erases[i] : erase_max;
+    }
+    printf("log      %u sectors, %u laps, %u bytes dropped, erases %u to %u per sector\n",
+           STORE_SECTORS, log.seq / STORE_SECTORS, log.dropped, erase_min, erase_max);
+    CHECK((erase_max - erase_min) <= 1, "erases %u to %u", erase_min, erase_max);
+
+    close(flash.fd);
+    unlink(path);
+}
+
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t received;
+static uint32_t corrupt;
+
+static void handle_data(client_t *client, uint32_t chan, const uint8_t *value, uint32_t len,
+                        int64_t time_us, void *arg)
+{
+    pthread_mutex_lock(&stream_lock);
+    for (uint32_t i = 0; i < len; i++) {
+        if (value[i] != stream_byte(received + i)) {
+            corrupt++;
+        }
+    }
+    received += len;
+    pthread_mutex_unlock(&stream_lock);
+}
+
+static uint32_t stream_received(void)
+{
+    uint32_t bytes;
+
+    pthread_mutex_lock(&stream_lock);
+    bytes = received;
+    pthread_mutex_unlock(&stream_lock);
+    return bytes;
+}
+
+static void send_stream(uint32_t pos, uint32_t len)
+{
+    uint8_t buf[256];
+
+    for (uint32_t end = pos + len; pos < end; pos += sizeof(buf)) {
+        for (uint32_t i = 0; i < sizeof(buf); i++) {
+            buf[i] = stream_byte(pos + i);
+        }
+        sim_uart_send(CLIENT_CHAN0_UART, buf, sizeof(buf));
+    }
+}
+
+static void test_forward(void)
+{
+    char path[] = "/tmp/spp_flash_XXXXXX";
+    int fd = temp_file(path);
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    spp_telemetry_t telemetry;
+    sim_flash_stats_t stats;
+    sim_central_t *central;
+    client_t client;
+    int64_t start;
+    int64_t deadline;
+    int32_t len;
+
+    close(fd);
+    sim_flash_file(path);
+    sim_boot();
+
+    // Nobody is connected yet.
+    send_stream(0, STORE_UART_BYTES);
+    sim_sleep_us(100000);
+    sim_flash_stats("spp_log", &stats);
+    CHECK(stats.write_bytes != 0, "nothing written to the log");
+
+    central = sim_central_connect(&config, NULL, NULL);
+    CHECK(central != NULL, "no connection");
+    len = sim_central_read(central, CLIENT_HANDLE(SPP_IDX_SPP_STATUS_VAL), 0,
+                           (uint8_t *)&telemetry, sizeof(telemetry));
+    CHECK(len == sizeof(telemetry), "status read of %d bytes", len);
+    CHECK(telemetry.store_bytes == STORE_UART_BYTES, "%u bytes stored", telemetry.store_bytes);
+    sim_central_disconnect(central);
+
+    if (!client_connect(&client, &config, handle_data, NULL)) {
+        CHECK(false, "no connection");
+        return;
+    }
+    start = sim_time_us();
+    send_stream(STORE_UART_BYTES, STORE_LIVE_BYTES);
+    deadline = start + STORE_DRAIN_US;
+    while ((stream_received() < (STORE_UART_BYTES + STORE_LIVE_BYTES)) &&
+           (sim_time_us() < deadline)) {
+        sim_sleep_us(10000);
+    }
+    printf("forward  %u bytes stored, %u in the log, %u erases, %u received in %.0f ms\n",
+           telemetry.store_bytes, stats.write_bytes, stats.erases, stream_received(),
+           (sim_time_us() - start) / 1000.0);
+    CHECK(stream_received() == (STORE_UART_BYTES + STORE_LIVE_BYTES), "%u of %u bytes",
+          stream_received(), STORE_UART_BYTES + STORE_LIVE_BYTES);
+    CHECK(corrupt == 0, "%u bytes differ", corrupt);
+    client_disconnect(&client);
+
+    unlink(path);
+}
+
+int main(void)
+{
+    test_log();
+    test_forward();
+
+    printf("%s\n", (check_failures == 0) ? "PASS" : "FAIL");
+    return (check_failures == 0) ? 0 : 1;
+}
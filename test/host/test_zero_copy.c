@@ -0,0 +1,106 @@
+#include "client.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// The heap and memcpy calls of the firmware per MB forwarded, in each
+// direction. The forwarding itself must not touch the heap. The UART reads
+// into the ring in place and the notifications go out of it, so the downlink
+// only copies into the bounce buffer at the wrap. The uplink copies each
+// write into the RX ring once.
+
+#define COPY_BAUD_RATE      (460800)
+#define COPY_MTU            (247)
+#define COPY_BYTES          (256 * 1024)
+#define COPY_CHUNK          (256)
+#define COPY_DRAIN_US       (2000000)
+#define MB                  (1024.0 * 1024.0)
+
+static uint64_t received;
+
+static void handle_data(client_t *client, uint32_t chan, const uint8_t *value, uint32_t len,
+                        int64_t time_us, void *arg)
+{
+    __atomic_add_fetch(&received, len, __ATOMIC_RELAXED);
+}
+
+static void handle_uart(uart_port_t port, const uint8_t *data, uint32_t len,
+                        int64_t time_us, void *arg)
+{
+    __atomic_add_fetch(&received, len, __ATOMIC_RELAXED);
+}
+
+static void wait_received(uint64_t bytes)
+{
+    int64_t deadline = sim_time_us() + COPY_DRAIN_US;
+
+    while ((__atomic_load_n(&received, __ATOMIC_RELAXED) < bytes) &&
+           (sim_time_us() < deadline)) {
+        sim_sleep_us(10000);
+    }
+}
+
+static void report(const char *dir, const sim_mem_stats_t *before, const sim_mem_stats_t *after,
+                   uint64_t copy_max)
+{
+    uint64_t bytes = __atomic_load_n(&received, __ATOMIC_RELAXED);
+    double scale = MB / bytes;
+
+    printf("%-8s %8llu bytes: %6.1f malloc, %6.1f free, %8.1f memcpy, %10.0f bytes copied per MB\n",
+           dir, (unsigned long long)bytes,
+           (after->mallocs - before->mallocs) * scale,
+           (after->frees - before->frees) * scale,
+           (after->copies - before->copies) * scale,
+           (after->copy_bytes - before->copy_bytes) * scale);
+    CHECK(bytes == COPY_BYTES, "%s: %llu of %u bytes", dir, (unsigned long long)bytes,
+          COPY_BYTES);
+    CHECK(after->mallocs == before->mallocs, "%s: %llu malloc", dir,
+          (unsigned long long)(after->mallocs - before->mallocs));
+    CHECK((after->copy_bytes - before->copy_bytes) <= copy_max,
+          "%s: %llu bytes copied", dir,
+          (unsigned long long)(after->copy_bytes - before->copy_bytes));
+}
+
+int main(void)
+{
+    sim_link_config_t config = SIM_LINK_CONFIG_DEFAULT;
+    sim_mem_stats_t before;
+    sim_mem_stats_t after;
+    uint8_t buf[COPY_CHUNK];
+    uint8_t arg[4];
+    client_t client;
+
+    sim_boot();
+    sim_uart_set_sink(CLIENT_CHAN0_UART, handle_uart, NULL);
+    config.mtu = COPY_MTU;
+    if (!client_connect(&client, &config, handle_data, NULL)) {
+        printf("FAIL: no connection\n");
+        return 1;
+    }
+    put_le32(arg, COPY_BAUD_RATE);
+    CHECK(client_command(&client, SPP_CMD_UART_BAUD, arg, 4) == SPP_CMD_OK, "baud rate");
+    memset(buf, 'x', sizeof(buf));
+
+    received = 0;
+    sim_mem_stats(&before);
+    for (uint32_t sent = 0; sent < COPY_BYTES; sent += sizeof(buf)) {
+        sim_uart_send(CLIENT_CHAN0_UART, buf, sizeof(buf));
+    }
+    wait_received(COPY_BYTES);
+    sim_mem_stats(&after);
+    report("downlink", &before, &after, COPY_BYTES / 16);
+
+    received = 0;
+    sim_mem_stats(&before);
+    for (uint32_t sent = 0; sent < COPY_BYTES; sent += sizeof(buf)) {
+        CHECK(client_send(&client, 0, buf, sizeof(buf)), "no credits");
+    }
+    wait_received(COPY_BYTES);
+    sim_mem_stats(&after);
+    report("uplink", &before, &after, COPY_BYTES);
+
+    client_disconnect(&client);
+
+    printf("%s\n", (check_failures == 0) ? "PASS" : "FAIL");
+    return (check_failures == 0) ? 0 : 1;
+}
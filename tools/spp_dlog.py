@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""Decode the deferred log of the SPP server.
+
+The entries carry the address of the format string, which is looked up in
+the firmware ELF (build/esp32_spp_server.elf). The input is either a raw
+capture of the log UART with the binary sink, or the SPP_STATUS_LOG records
+of the status characteristic, one record per line in hex.
+
+Needs pyelftools.
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+from elftools.elf.elffile import ELFFile
+
+ENTRY = struct.Struct("<II3IHBB")
+RECORD = struct.Struct("<BB")
+SYNC = b"\x55\xaa"
+STATUS_LOG = 0x05
+LEVELS = "NEWIDV"
+TICK_MS = 10
+TAG = "ESP32_BLE_SPP"
+
+CONVERSION = re.compile(r"%[-+ #0]*\d*(?:\.\d+)?(?:hh|h|ll|l|z)?([diouxXcsp%])")
+
+
+class Firmware:
+    def __init__(self, path):
+        self.segments = []
+        with open(path, "rb") as f:
+            elf = ELFFile(f)
+            for segment in elf.iter_segments():
+                if segment["p_type"] == "PT_LOAD" and segment["p_filesz"] != 0:
+                    self.segments.append((segment["p_vaddr"], segment.data()))
+
+    def string(self, addr):
+        for base, data in self.segments:
+            if base <= addr < base + len(data):
+                end = data.find(b"\0", addr - base)
+                return data[addr - base:end].decode("utf-8", "replace")
+        return "<0x%08x>" % addr
+
+
+def format_entry(firmware, entry):
+    ticks, fmt, arg0, arg1, arg2, suppressed, level, core = entry
+    args = iter((arg0, arg1, arg2))
+
+    def convert(match):
+        kind = match.group(1)
+        if kind == "%":
+            return "%"
+        value = next(args, 0)
+        if kind == "s":
+            return firmware.string(value)
+        if kind in "di" and value >= 1 << 31:
+            value -= 1 << 32
+        spec = re.sub(r"(hh|h|ll|l|z)", "", match.group(0))
+        return spec.replace("u", "d").replace("p", "x") % value
+
+    text = CONVERSION.sub(convert, firmware.string(fmt))
+    line = "%s (%d) %s: %s" % (LEVELS[level % len(LEVELS)], ticks * TICK_MS, TAG, text)
+    if suppressed:
+        line += " (%d muted)" % suppressed
+    return line
+
+
+def read_uart(data):
+    pos = data.find(SYNC)
+    while pos >= 0 and pos + len(SYNC) + ENTRY.size <= len(data):
+        yield ENTRY.unpack_from(data, pos + len(SYNC))
+        pos = data.find(SYNC, pos + len(SYNC) + ENTRY.size)
+
+
+def read_records(lines):
+    for line in lines:
+        if re.match(r"^\s*[0-9a-fA-F][0-9a-fA-F\s:-]*$", line) is None:
+            continue
+        data = bytes.fromhex(re.sub(r"[^0-9a-fA-F]", "", line))
+        if len(data) < RECORD.size or data[0] != STATUS_LOG:
+            continue
+        _, count = RECORD.unpack_from(data)
+        for i in range(count):
+            offset = RECORD.size + i * ENTRY.size
+            if offset + ENTRY.size > len(data):
+                break
+            yield ENTRY.unpack_from(data, offset)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("elf", help="firmware ELF")
+    parser.add_argument("input", help="log UART capture, or status records in hex")
+    parser.add_argument("--uart", action="store_true", help="input is a raw UART capture")
+    args = parser.parse_args()
+
+    firmware = Firmware(args.elf)
+    if args.uart:
+        with open(args.input, "rb") as f:
+            entries = read_uart(f.read())
+    else:
+        with open(args.input, "r") as f:
+            entries = list(read_records(f))
+    for entry in entries:
+        print(format_entry(firmware, entry))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""Decode the latency trace of the SPP server.
+
+The input is the SPP_STATUS_TRACE records of the status characteristic,
+one record per line in hex. Prints a latency histogram per stage and channel, and writes a
+Chrome trace (chrome://tracing, Perfetto) with --chrome.
+"""
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+STAGES = {
+    0x01: "uart_read",
+    0x02: "tx_data",
+    0x03: "tx_indicate",
+    0x04: "congest",
+    0x05: "gatts_write",
+    0x06: "rx_exec",
+}
+
+FLAG_END = 0x80
+FLAG_CORE1 = 0x40
+FLAG_CHAN_MASK = 0x0F
+
+STATUS_TRACE = 0x04
+EVENT = struct.Struct("<IHBB")
+DUMP = struct.Struct("<BHB")
+
+HEX_LINE = re.compile(r"^\s*[0-9a-fA-F][0-9a-fA-F\s:-]*$")
+
+
+def parse_record(line):
+    if HEX_LINE.match(line) is None:
+        return None
+    try:
+        data = bytes.fromhex(re.sub(r"[^0-9a-fA-F]", "", line))
+    except ValueError:
+        return None
+    if len(data) < DUMP.size or data[0] != STATUS_TRACE:
+        return None
+    _, _, count = DUMP.unpack_from(data)
+    events = []
+    for i in range(count):
+        offset = DUMP.size + i * EVENT.size
+        if offset + EVENT.size > len(data):
+            break
+        ccount, arg, stage, flags = EVENT.unpack_from(data, offset)
+        events.append((ccount, stage, flags, arg))
+    return events
+
+
+def read_events(stream):
+    events = []
+    for line in stream:
+        parsed = parse_record(line)
+        if parsed is not None:
+            events.extend(parsed)
+    return events
+
+
+def unwrap(events, mhz):
+    """Turn the 32-bit cycle counts into microseconds, per core."""
+    last = {}
+    base = {}
+    out = []
+    for ccount, stage, flags, arg in events:
+        core = 1 if flags & FLAG_CORE1 else 0
+        if core in last and ccount < last[core]:
+            base[core] = base.get(core, 0) + (1 << 32)
+        last[core] = ccount
+        ts = (base.get(core, 0) + ccount) / mhz
+        out.append((ts, core, stage, flags, arg))
+    return out
+
+
+def pair(events):
+    """Match the begin and end of each stage, nested per core and channel."""
+    open_spans = {}
+    spans = []
+    for ts, core, stage, flags, arg in events:
+        key = (core, stage, flags & FLAG_CHAN_MASK)
+        if flags & FLAG_END:
+            stack = open_spans.get(key)
+            if stack:
+                spans.append((key, stack.pop(), ts, arg))
+        else:
+            open_spans.setdefault(key, []).append(ts)
+    return spans
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def print_histograms(spans, out):
+    by_stage = {}
+    for (core, stage, chan), begin, end, _ in spans:
+        by_stage.setdefault((stage, chan), []).append(end - begin)
+
+    for (stage, chan) in sorted(by_stage):
+        values = sorted(by_stage[(stage, chan)])
+        out.write("%s chan %d: n=%d min=%.1f p50=%.1f p90=%.1f p99=%.1f max=%.1f us\n" % (
+            STAGES.get(stage, "stage%d" % stage), chan, len(values), values[0],
+            percentile(values, 50), percentile(values, 90), percentile(values, 99),
+            values[-1]))
+        buckets = {}
+        for value in values:
+            bucket = 0
+            while (1 << bucket) <= value:
+                bucket += 1
+            buckets[bucket] = buckets.get(bucket, 0) + 1
+        peak = max(buckets.values())
+        for bucket in sorted(buckets):
+            low = 0 if bucket == 0 else 1 << (bucket - 1)
+            out.write("  %7d - %7d us %6d %s\n" % (
+                low, 1 << bucket, buckets[bucket], "#" * (40 * buckets[bucket] // peak)))
+
+
+def chrome_trace(spans):
+    trace = []
+    for (core, stage, chan), begin, end, arg in spans:
+        trace.append({
+            "name": STAGES.get(stage, "stage%d" % stage),
+            "ph": "X",
+            "ts": begin,
+            "dur": end - begin,
+            "pid": core,
+            "tid": chan,
+            "args": {"arg": arg},
+        })
+    return {"traceEvents": trace}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", nargs="?", type=argparse.FileType("r"), default=sys.stdin)
+    parser.add_argument("--mhz", type=float, default=160.0,
+                        help="CPU frequency, CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ")
+    parser.add_argument("--chrome", metavar="FILE", help="write a Chrome trace JSON")
+    args = parser.parse_args()
+
+    spans = pair(unwrap(read_events(args.input), args.mhz))
+    if not spans:
+        sys.exit("No trace events found.")
+    print_histograms(spans, sys.stdout)
+    if args.chrome:
+        with open(args.chrome, "w") as f:
+            json.dump(chrome_trace(spans), f)
+
+
+if __name__ == "__main__":
+    main()